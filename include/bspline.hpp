@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <math.h>
 #include <vector>
+#include <algorithm>
 #pragma once
 
 /* 
@@ -18,10 +19,20 @@ class ControlBasis{
         double *tcenter;                  // vector of basis function center positions
         double width;                     // support of each basis function (m*dtknot)
         std::vector<double> carrier_freq; // Frequencies of the carrier waves
+        double tphase;                    // Time point of the cached carrier phases
+        std::vector<double> cos_omt;      // Cached cos(carrier_freq[f] * tphase) of each carrier wave
+        std::vector<double> sin_omt;      // Cached sin(carrier_freq[f] * tphase) of each carrier wave
 
         /* Evaluate the bspline basis functions B_l(tau_l(t)) */
         double basisfunction(int id, double t);
 
+        /* Return the first of the (at most three) basis functions that are nonzero at time t, 
+         * i.e. l = k, k+1, k+2 for t in the knot interval [k*dtknot, (k+1)*dtknot) */
+        int firstActive(double t);
+
+        /* Compute cos and sin of each carrier wave at time t, unless they are cached for t */
+        void setCarrierPhases(double t);
+
     public:
         ControlBasis(int NBasis, double T, std::vector<double> carrier_freq_);
         ~ControlBasis();
@@ -33,6 +44,13 @@ class ControlBasis{
         /* Evaluate the spline at time t using the coefficients coeff. */
         double evaluate(const double t, const std::vector<double>& coeff, const double ground_freq, const ControlType controltype);
 
-        /* Evaluates the derivative at time t, multiplied with fbar. */
-        void derivative(const double t, double* coeff_diff, const double fbar, const ControlType controltype);
+        /* Evaluate the rotating frame controls Re = p(t) and Im = q(t) together, sharing the basis functions and carrier phases */
+        void evaluate(const double t, const std::vector<double>& coeff, double* Re, double* Im);
+
+        /* Return the range [first, first+n) of coefficients of the basis functions that are nonzero at time t */
+        void getActiveCoeffs(const double t, int* first, int* n);
+
+        /* Add the derivatives of p(t) and q(t) wrt the coefficients, multiplied with Rebar and Imbar, to dRedp and dImdp. 
+         * Only the coefficients of the basis functions that are nonzero at t are touched. */
+        void derivative(const double t, double* dRedp, double* dImdp, const double Rebar, const double Imbar);
 };
\ No newline at end of file
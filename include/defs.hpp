@@ -22,7 +22,22 @@ enum class ControlType {RE, IM, LAB};
 /* Linear solver */
 enum class LinearSolverType{
   GMRES,   // uses Petsc's GMRES solver
-  NEUMANN   // uses Neuman power iterations 
+  NEUMANN,  // uses Neuman power iterations 
+  CHEBYSHEV,       // uses Chebyshev semi-iterations, stopping on the residual norm (implicit midpoint rule only)
+  CHEBYSHEV_FIXED  // uses a fixed number of Chebyshev semi-iterations without any norms or inner products (implicit midpoint rule only)
+};
+
+/* Preconditioner for the linear solver */
+enum class PreconditionerType {
+  NONE,      // no preconditioning
+  DIAGONAL   // inverts the time-independent diagonal part of the system (drift Hamiltonian and diagonal Lindblad terms)
+};
+
+/* Compression of the primal states that are stored for the adjoint */
+enum class StoreCompression {
+  NONE,     // Store states in double precision
+  SINGLE,   // Store states in single precision
+  DELTA     // Store differences to the previous state, quantized to a given absolute error bound (32bit integers)
 };
 
 /* Solver run type */
@@ -24,9 +24,17 @@ class Gate {
     std::vector<double> gate_rot_freq; /* Frequencies of gate rotation (rad/time). Often same as rotational frequencies. */
 
   private:
-    Mat VxV_re, VxV_im;     /* Real and imaginary part of vectorized Gate G=\bar V \kron V */
+    Mat VxV_re, VxV_im;     /* Real and imaginary part of vectorized Gate G=\bar V \kron V, assembled on first use */
     Vec x;                  /* auxiliary */
     IS isu, isv;            /* Vector strides for accessing real and imaginary part of the state */
+    Mat Vf_re, Vf_im;       /* Real and imaginary part of the full-dimension gate V (Schroedinger mode), assembled on first use */
+    Vec xf;                 /* auxiliary */
+    IS isuf, isvf;          /* Vector strides for accessing real and imaginary part of a state vector */
+
+    /* Assemble the vectorized gate VxV_re, VxV_im */
+    void assembleVxV();
+    /* Assemble the full-dimension gate Vf_re, Vf_im */
+    void assembleVfull();
 
   public:
     Gate();
@@ -35,11 +43,14 @@ class Gate {
 
     int getDimRho() { return dim_rho; };
 
-    /* Assemble VxV_re = Re(\bar V \kron V) and VxV_im = Im(\bar V \kron V) */
+    /* Rotate the essential-level gate V = V_re + i V_im to the rotational frame */
     void assembleGate();
 
     /* apply the gate transformation  VrhoV =  V \rho V^\dagger. The output vector VrhoV must be allocated! */
     void applyGate(const Vec state, Vec VrhoV);
+
+    /* apply the gate to a state vector Vpsi = V psi (Schroedinger mode). The output vector Vpsi must be allocated! */
+    void applyGateVector(const Vec psi, Vec Vpsi);
 };
 
 /* X Gate, spanning one qubit. 
@@ -3,6 +3,8 @@
 #include "util.hpp"
 #include <petscts.h>
 #include <vector>
+#include <algorithm>
+#include <map>
 #include <assert.h>
 #include <iostream> 
 #include "gate.hpp"
@@ -26,9 +28,29 @@ typedef struct {
   Mat** Bd_vec;
   Vec *aux;
   double time;
+  VecScatter *scat_halo;   // Scatter of x into a local buffer including halo (distributed matrix-free solver), or NULL
+  Vec *xhalo;              // Local buffer holding x[halo_low..halo_upp) 
+  int halo_low;            // First (complex) index of x held in xhalo
+  int it_low, it_upp;      // Locally owned (complex) index range of the output vector
+  Vec *diag;               // Time-independent diagonal of the RHS (drift Hamiltonian, dephasing, decay), same layout as x
+  std::vector<double> sqrtn; // Ladder factors sqrt(0), sqrt(1), ..., sqrt(nmax)
+  bool schroedinger;       // x holds state vectors psi instead of vectorized density matrices
+  int nbatch;              // Number of states interleaved in x: x[nbatch*getIndexReal(it) + b] = Re(x_b(it)). 1 if not batched.
+  int (*mult)(Mat, Vec, Vec);   // Kernel applying the RHS, called by myMatMult_logged
+  int (*multT)(Mat, Vec, Vec);  // Kernel applying the RHS^T, called by myMatMultTranspose_logged
+  bool fused_shift;        // The kernels apply the scale and shift below themselves (generic and vectorized matrix-free kernels)
+  double alpha, beta;      // Scale and shift applied by those kernels: y = alpha x + beta RHS x. 0 and 1 for the RHS itself.
 } MatShellCtx;
 
 
+/* Controls of all oscillators at one time point, and the nonzero derivatives of the controls wrt the parameters */
+typedef struct {
+  std::vector<double> p, q;         // Rotating frame controls p(t), q(t) of each oscillator
+  std::vector<int> dfirst;          // Per oscillator: first parameter with nonzero derivative, -1 if the derivatives are not evaluated yet
+  std::vector<std::vector<double> > dRedp, dImdp;  // Per oscillator: derivatives of p and q wrt the parameters dfirst, dfirst+1, ...
+} ControlSample;
+
+
 /* Define the Matrix-Vector products for the RHS MatShell */
 int myMatMult_matfree_2Osc(Mat RHS, Vec x, Vec y);              // Matrix free solver for 2 oscillators 
 int myMatMultTranspose_matfree_2Osc(Mat RHS, Vec x, Vec y);
@@ -38,8 +60,23 @@ int myMatMult_matfree_4Osc(Mat RHS, Vec x, Vec y);              // Matrix free s
 int myMatMultTranspose_matfree_4Osc(Mat RHS, Vec x, Vec y);
 int myMatMult_matfree_5Osc(Mat RHS, Vec x, Vec y);              // Matrix free solver for 5 oscillators 
 int myMatMultTranspose_matfree_5Osc(Mat RHS, Vec x, Vec y);
+int myMatMult_matfree_generic(Mat RHS, Vec x, Vec y);           // Matrix free solver for any number of oscillators and levels
+int myMatMultTranspose_matfree_generic(Mat RHS, Vec x, Vec y);
+int myMatMult_matfree_vectorized(Mat RHS, Vec x, Vec y);        // Matrix free solver with SIMD-friendly inner loops, any number of oscillators and levels
+int myMatMultTranspose_matfree_vectorized(Mat RHS, Vec x, Vec y);
+int myMatMult_schroedinger(Mat RHS, Vec x, Vec y);              // Matrix free solver for state vectors (Schroedinger mode), any number of oscillators and levels
+int myMatMultTranspose_schroedinger(Mat RHS, Vec x, Vec y);
+int myMatMult_batch(Mat RHS, Vec x, Vec y);                     // Matrix free solver for a batch of interleaved states, any number of oscillators and levels
+int myMatMultTranspose_batch(Mat RHS, Vec x, Vec y);
 int myMatMult_sparsemat(Mat RHS, Vec x, Vec y);                 // Sparse matrix solver
 int myMatMultTranspose_sparsemat(Mat RHS, Vec x, Vec y);
+int myMatMult_logged(Mat RHS, Vec x, Vec y);                    // MatShell operations: Call the kernel of the context inside the RHS log event
+int myMatMultTranspose_logged(Mat RHS, Vec x, Vec y);
+void myMatMultShifted(Mat RHS, Vec x, Vec y, double alpha, double beta, bool transpose);  // y = alpha x + beta RHS x (or RHS^T), fused into the kernel if it supports it
+
+/* Access to x including the halo needed by the (distributed) matrix-free kernels */
+void matfree_getArrayHalo(MatShellCtx* shellctx, Vec x, const double** xptr);
+void matfree_restoreArrayHalo(MatShellCtx* shellctx, Vec x, const double** xptr);
 
 
 /* 
@@ -48,13 +85,13 @@ int myMatMultTranspose_sparsemat(Mat RHS, Vec x, Vec y);
 class MasterEq{
 
   protected:
-    int dim;                   // Dimension of full vectorized system = N^2
+    int dim;                   // Dimension of full vectorized system = N^2, or N in Schroedinger mode
     int dim_rho;               // Dimension of full system = N
     int dim_ess;               // Dimension of system of essential levels = N_e
     int noscillators;          // Number of oscillators
     Oscillator** oscil_vec;    // Vector storing pointers to the oscillators
 
-    Mat RHS;                // Realvalued, vectorized systemmatrix (2N^2 x 2N^2)
+    Mat RHS;                // Realvalued, vectorized systemmatrix (2N^2 x 2N^2, or 2N x 2N in Schroedinger mode)
     MatShellCtx RHSctx;     // MatShell context that contains data needed to apply the RHS
 
     Mat* Ac_vec;  // Vector of constant mats for time-varying control term (real)
@@ -70,24 +107,44 @@ class MasterEq{
 
     /* Auxiliary stuff */
     int mpirank_petsc;   // Rank of Petsc's communicator
+    int mpisize_petsc;   // Size of Petsc's communicator
     int mpirank_world;   // Rank of global communicator
     int nparams_max;     // Maximum number of design parameters per oscilator 
     IS isu, isv;         // Vector strides for accessing u=Re(x), v=Im(x) 
+    VecScatter scat_halo;  // Scatter from x into xhalo for the distributed matrix-free solver
+    Vec xhalo;             // Local part of x plus the halo needed by the matrix-free stencils
+    Vec diag;              // Precomputed time-independent diagonal for the matrix-free solver
+    int nbatch;                  // Number of states propagated together by the batched RHS (1: no batched RHS)
+    Mat RHS_batch;               // Batched RHS, applies RHS to nbatch interleaved states at once
+    MatShellCtx RHSctx_batch;    // MatShell context of the batched RHS
+    VecScatter scat_halo_batch;  // Halo scatter for the batched RHS (distributed matrix-free solver)
+    Vec xhalo_batch;             // Halo buffer for the batched RHS
 
     double *dRedp;
     double *dImdp;
     Vec aux;              // auxiliary vector 
-    PetscInt* cols;           // holding columns when evaluating dRHSdp
-    PetscScalar* vals;   // holding values when evaluating dRHSdp
+
+    /* Table of control samples at the time points visited by the time-stepper. Filled on first use, such that all 
+     * forward and adjoint propagations (of all initial conditions) look up the controls. Cleared by setControlAmplitudes. 
+     * Ordered by time, such that the samples of discarded adaptive steps can be removed (eraseControlSamples). */
+    std::map<double, ControlSample> control_samples;
+
+    /* Add alpha * (coeff_p * dp/dparams + coeff_q * dq/dparams) to the gradient array, only for the parameters of the splines that are nonzero at t */
+    void addControlGradient(const double t, double* coeff_p, double* coeff_q, const double alpha, double* grad);
+
+    /* Return the control sample at time t from the table. Evaluates the controls, and if derivatives is true their derivatives, if not stored yet. */
+    const ControlSample& getControlSample(const double t, const bool derivatives);
  
   public:
     std::vector<int> nlevels;  // Number of levels per oscillator
     std::vector<int> nessential; // Number of essential levels per oscillator
     bool usematfree;  // Flag for using matrix free solver
+    bool matfree_vectorized;  // Flag for using the vectorized matrix free kernel
+    bool schroedinger;  // Flag for evolving state vectors psi under -iH(t) instead of the density matrix (closed systems only)
 
   public:
     MasterEq();
-    MasterEq(std::vector<int> nlevels, std::vector<int> nessential, Oscillator** oscil_vec_, const std::vector<double> crosskerr_, const std::vector<double> Jkl_, const std::vector<double> eta_, LindbladType lindbladtype_, bool usematfree_);
+    MasterEq(std::vector<int> nlevels, std::vector<int> nessential, Oscillator** oscil_vec_, const std::vector<double> crosskerr_, const std::vector<double> Jkl_, const std::vector<double> eta_, LindbladType lindbladtype_, bool usematfree_, bool matfree_vectorized_, bool schroedinger_);
     ~MasterEq();
 
     /* initialize matrices needed for applying sparse-mat solver */
@@ -99,7 +156,7 @@ class MasterEq{
     /* Return number of oscillators */
     int getNOscillators();
 
-    /* Return dimension of vectorized system N^2 */
+    /* Return dimension of vectorized system N^2, or of the state vector N in Schroedinger mode */
     int getDim();
 
     /* Return dimension of essential level system: N_e */
@@ -114,14 +171,42 @@ class MasterEq{
      */
     int assemble_RHS(const double t);
 
+    /* Assemble the linear combination (c1 RHS(t1) + c2 RHS(t2)) / (c1 + c2), e.g. for commutator-free Magnus integrators.
+     * The controls are combined, and the time-dependent Jkl coupling is passed as amplitude and phase. Overwritten by assemble_RHS(t). */
+    int assemble_RHS_combined(const double t1, const double c1, const double t2, const double c2);
+
     /* Access the right-hand-side matrix */
     Mat getRHS();
 
+    /* Set up the batched right-hand-side matrix that applies the RHS to nbatch states at once. States are interleaved, 
+     * such that element b of each block of nbatch consecutive entries belongs to state b (Petsc block size nbatch). */
+    void initBatch(const int nbatch_);
+
+    /* Access the batched right-hand-side matrix */
+    Mat getRHSBatch();
+
+    /* Copy the time-independent diagonal of the RHS (drift Hamiltonian and diagonal Lindblad terms) into d. 
+     * Its complex entries are stored in the layout of x, such that y = diag * x is the complex product. */
+    void getConstantDiagonal(Vec d);
+
     /* 
      * Compute gradient of RHS wrt control parameters:
      * grad += alpha * RHS(x)^T * x_bar  
+     * grad is a dense array over all parameters. Only this processor's part of the state is summed, the 
+     * contributions of petsc's processors must be summed up afterwards.
      */
-    void computedRHSdp(const double t,const Vec x,const Vec x_bar, const double alpha, Vec grad);
+    void computedRHSdp(const double t,const Vec x,const Vec x_bar, const double alpha, double* grad);
+
+    /* Same as computedRHSdp for batched states x and x_bar, summing the gradient over the batch */
+    void computedRHSdp_batch(const double t,const Vec x,const Vec x_bar, const double alpha, double* grad);
+
+    /* Fused adjoint kernel: y += RHS^T x_bar, and grad += alpha * RHS(x)^T * x_bar as in computedRHSdp (or computedRHSdp_batch 
+     * if nbatch > 1), both computed in one sweep over the lines of x_bar. The RHS must be assembled at time t. 
+     * Only available if hasFusedAdjoint(). */
+    void computedRHSdp_fused(const double t, const Vec x, const Vec x_bar, const double alpha, double* grad, Vec y);
+
+    /* Return true if the fused adjoint kernel is available: matrix-free solver on a single processor */
+    bool hasFusedAdjoint() { return usematfree && mpisize_petsc == 1; };
 
     // /* Compute reduced density operator for a sub-system defined by IDs in the oscilIDs vector */
     // void createReducedDensity(const Vec rho, Vec *reduced, const std::vector<int>& oscilIDs);
@@ -131,7 +216,11 @@ class MasterEq{
     /* Set the oscillators control function parameters from global design vector x */
     void setControlAmplitudes(const Vec x);
 
-    /* Set initial conditions 
+    /* Remove the tabulated control samples at time points in the open interval (t0, t1). Called by adaptive time stepping 
+     * for the steps that are not replayed, such that the table holds the samples of the accepted steps only. */
+    void eraseControlSamples(const double t0, const double t1);
+
+    /* Set initial conditions (density matrix, or state vector psi in Schroedinger mode)
      * In:   iinit -- index in processors range [rank * ninit_local .. (rank+1) * ninit_local - 1]
      *       ninit -- number of initial conditions 
      *       initcond_type -- type of initial condition (pure, fromfile, diagona, basis)
@@ -145,108 +234,30 @@ class MasterEq{
 
 
 // Mat-free solver inlines for 2 oscillator
-inline double H_detune(const double detuning0, const double detuning1, const int a, const int b) {
-  return detuning0*a + detuning1*b;
-};
-inline double H_selfkerr(const double xi0, const double xi1, const int a, const int b) {
-  return - xi0 / 2.0 * a * (a-1) - xi1 / 2.0 * b * (b-1);
-};
-inline double H_crosskerr(const double xi01, const int a, const int b) {
-  return - xi01 * a * b;
-};
-inline double L2(const double dephase0, const double dephase1, const int i0, const int i1, const int i0p, const int i1p){
-  return dephase0 * ( i0*i0p - 1./2. * (i0*i0 + i0p*i0p) ) + dephase1 * ( i1*i1p - 1./2. * (i1*i1 + i1p*i1p) );
-};
-inline double L1diag(const double decay0, const double decay1, const int i0, const int i1, const int i0p, const int i1p){
-  return - decay0 / 2.0 * ( i0 + i0p ) - decay1 / 2.0 * ( i1 + i1p );
-};
 inline int TensorGetIndex(const int nlevels0, const int nlevels1,const  int i0, const int i1, const int i0p, const int i1p){
   return i0*nlevels1 + i1 + (nlevels0 * nlevels1) * ( i0p * nlevels1 + i1p);
 };
 
 
 // Matfree solver inlines for 3 oscillator
-inline double H_detune(const double detuning0, const double detuning1, const double detuning2, const int i0, const int i1, const int i2) {
-  return detuning0*i0 + detuning1*i1 + detuning2*i2;
-};
-inline double H_selfkerr(const double xi0, const double xi1, const double xi2, const int i0, const int i1, const int i2) {
-  return - xi0 / 2.0 * i0 * (i0-1) - xi1 / 2.0 * i1 * (i1-1) - xi2 / 2.0 * i2 * (i2-1);
-};
-inline double H_crosskerr(const double xi01, const double xi02, const double xi12, const int i0, const int i1, const int i2) {
-  return - xi01 * i0 * i1 - xi02 * i0 * i2 - xi12 * i1 * i2;
-};
-inline double L2(const double dephase0, const double dephase1, const double dephase2, const int i0, const int i1, const int i2, const int i0p, const int i1p, const int i2p){
-  return dephase0 * ( i0*i0p - 1./2. * (i0*i0 + i0p*i0p) ) 
-       + dephase1 * ( i1*i1p - 1./2. * (i1*i1 + i1p*i1p) )
-       + dephase2 * ( i2*i2p - 1./2. * (i2*i2 + i2p*i2p) );
-};
-inline double L1diag(const double decay0, const double decay1, const double decay2, const int i0, const int i1, const int i2, const int i0p, const int i1p, const int i2p){
-  return - decay0 / 2.0 * ( i0 + i0p ) 
-         - decay1 / 2.0 * ( i1 + i1p )
-         - decay2 / 2.0 * ( i2 + i2p );
-};
 inline int TensorGetIndex(const int nlevels0, const int nlevels1, const int nlevels2, const  int i0, const int i1, const int i2, const int i0p, const int i1p, const int i2p){
   return i0*nlevels1*nlevels2 + i1*nlevels2 + i2 + (nlevels0 * nlevels1 * nlevels2) * ( i0p * nlevels1*nlevels2 + i1p*nlevels2 + i2p);
 };
 
 
 // Matfree solver inlines for 4 oscillators
-inline double H_detune(const double detuning0, const double detuning1, const double detuning2, const double detuning3, const int i0, const int i1, const int i2, const int i3) {
-  return detuning0*i0 + detuning1*i1 + detuning2*i2 + detuning3*i3;
-};
-inline double H_selfkerr(const double xi0, const double xi1, const double xi2, const double xi3, const int i0, const int i1, const int i2, const int i3) {
-  return - xi0 / 2.0 * i0 * (i0-1) - xi1 / 2.0 * i1 * (i1-1) - xi2 / 2.0 * i2 * (i2-1) - xi3/2.0 * i3 * (i3-1);
-};
-inline double H_crosskerr(const double xi01, const double xi02, const double xi03, const double xi12, const double xi13, const double xi23, const int i0, const int i1, const int i2, const int i3) {
-  return - xi01 * i0 * i1 - xi02 * i0 * i2  - xi03*i0*i3 - xi12 * i1 * i2 - xi13*i1*i3 - xi23*i2*i3;
-};
-inline double L2(const double dephase0, const double dephase1, const double dephase2, const double dephase3, const int i0, const int i1, const int i2, const int i3, const int i0p, const int i1p, const int i2p, const int i3p){
-  return dephase0 * ( i0*i0p - 1./2. * (i0*i0 + i0p*i0p) ) 
-       + dephase1 * ( i1*i1p - 1./2. * (i1*i1 + i1p*i1p) )
-       + dephase2 * ( i2*i2p - 1./2. * (i2*i2 + i2p*i2p) )
-       + dephase3 * ( i3*i3p - 1./2. * (i3*i3 + i3p*i3p) );
-};
-inline double L1diag(const double decay0, const double decay1, const double decay2, const double decay3, const int i0, const int i1, const int i2, const int i3, const int i0p, const int i1p, const int i2p, const int i3p){
-  return - decay0 / 2.0 * ( i0 + i0p ) 
-         - decay1 / 2.0 * ( i1 + i1p )
-         - decay2 / 2.0 * ( i2 + i2p )
-         - decay3 / 2.0 * ( i3 + i3p );
-};
 inline int TensorGetIndex(const int nlevels0, const int nlevels1, const int nlevels2, const int nlevels3, const  int i0, const int i1, const int i2, const int i3, const int i0p, const int i1p, const int i2p, const int i3p){
   return i0*nlevels1*nlevels2*nlevels3 + i1*nlevels2*nlevels3 + i2*nlevels3 + i3 + (nlevels0 * nlevels1 * nlevels2 * nlevels3) * ( i0p * nlevels1*nlevels2*nlevels3 + i1p*nlevels2*nlevels3 + i2p*nlevels3 + i3p);
 }
 
 // Matfree solver inlines for 5 oscillators
-inline double H_detune(const double detuning0, const double detuning1, const double detuning2, const double detuning3, const double detuning4, const int i0, const int i1, const int i2, const int i3, const int i4) {
-  return detuning0*i0 + detuning1*i1 + detuning2*i2 + detuning3*i3 + detuning4*i4;
-};
-inline double H_selfkerr(const double xi0, const double xi1, const double xi2, const double xi3, const double xi4, const int i0, const int i1, const int i2, const int i3, const int i4) {
-  return - xi0 / 2.0 * i0 * (i0-1) - xi1 / 2.0 * i1 * (i1-1) - xi2 / 2.0 * i2 * (i2-1) - xi3/2.0 * i3 * (i3-1) - xi4/2.0 * i4 * (i4-1);
-};
-inline double H_crosskerr(const double xi01, const double xi02, const double xi03, const double xi04, const double xi12, const double xi13, const double xi14, const double xi23, const double xi24, const double xi34, const int i0, const int i1, const int i2, const int i3, const int i4) {
-  return - xi01 * i0 * i1 - xi02 * i0 * i2  - xi03*i0*i3 - xi04*i0*i4 - xi12 * i1 * i2 - xi13*i1*i3 - xi14*i1*i4 - xi23*i2*i3 - xi24*i2*i4 - xi34*i3*i4;
-};
-inline double L2(const double dephase0, const double dephase1, const double dephase2, const double dephase3, const double dephase4, const int i0, const int i1, const int i2, const int i3, const int i4, const int i0p, const int i1p, const int i2p, const int i3p, const int i4p){
-  return dephase0 * ( i0*i0p - 1./2. * (i0*i0 + i0p*i0p) ) 
-       + dephase1 * ( i1*i1p - 1./2. * (i1*i1 + i1p*i1p) )
-       + dephase2 * ( i2*i2p - 1./2. * (i2*i2 + i2p*i2p) )
-       + dephase3 * ( i3*i3p - 1./2. * (i3*i3 + i3p*i3p) )
-       + dephase4 * ( i3*i3p - 1./2. * (i4*i4 + i4p*i4p) );
-};
-inline double L1diag(const double decay0, const double decay1, const double decay2, const double decay3, const double decay4, const int i0, const int i1, const int i2, const int i3, const int i4, const int i0p, const int i1p, const int i2p, const int i3p, const int i4p){
-  return - decay0 / 2.0 * ( i0 + i0p ) 
-         - decay1 / 2.0 * ( i1 + i1p )
-         - decay2 / 2.0 * ( i2 + i2p )
-         - decay3 / 2.0 * ( i3 + i3p )
-         - decay4 / 2.0 * ( i4 + i4p );
-};
 inline int TensorGetIndex(const int nlevels0, const int nlevels1, const int nlevels2, const int nlevels3, const int nlevels4, const  int i0, const int i1, const int i2, const int i3, const int i4, const int i0p, const int i1p, const int i2p, const int i3p, const int i4p){
   return i0*nlevels1*nlevels2*nlevels3*nlevels4 + i1*nlevels2*nlevels3*nlevels4 + i2*nlevels3*nlevels4 + i3*nlevels4 + i4 + (nlevels0 * nlevels1 * nlevels2 * nlevels3*nlevels4) * ( i0p * nlevels1*nlevels2*nlevels3*nlevels4 + i1p*nlevels2*nlevels3*nlevels4 + i2p*nlevels3*nlevels4+ i3p*nlevels4 + i4p);
 }
 
 
 // Mat-free solver inline for gradient updates for oscillator i
-inline void dRHSdp_getcoeffs(const int it, const int n, const int i, const int ip, const int stridei, const int strideip, const double* xptr, double* res_p_re, double* res_p_im, double* res_q_re, double* res_q_im) {
+inline void dRHSdp_getcoeffs(const int it, const int n, const int i, const int ip, const int stridei, const int strideip, const double* xptr, const double* sqrtn, double* res_p_re, double* res_p_im, double* res_q_re, double* res_q_im) {
 
   *res_p_re = 0.0;
   *res_p_im = 0.0;
@@ -256,9 +267,9 @@ inline void dRHSdp_getcoeffs(const int it, const int n, const int i, const int i
   /* ik+1..,ik'.. term */
   if (i < n-1) {
     int itx = it + stridei;
-    double xre = xptr[2 * itx];
-    double xim = xptr[2 * itx + 1];
-    double sq = sqrt(i + 1);
+    double xre = xptr[getIndexReal(itx)];
+    double xim = xptr[getIndexImag(itx)];
+    double sq = sqrtn[i + 1];
     *res_p_re +=   sq * xim;
     *res_p_im += - sq * xre;
     *res_q_re +=   sq * xre;
@@ -267,9 +278,9 @@ inline void dRHSdp_getcoeffs(const int it, const int n, const int i, const int i
   /* \rho(ik..,ik'+1..) */
   if (ip < n-1) {
     int itx = it + strideip;
-    double xre = xptr[2 * itx];
-    double xim = xptr[2 * itx + 1];
-    double sq = sqrt(ip + 1);
+    double xre = xptr[getIndexReal(itx)];
+    double xim = xptr[getIndexImag(itx)];
+    double sq = sqrtn[ip + 1];
     *res_p_re += - sq * xim;
     *res_p_im += + sq * xre;
     *res_q_re +=   sq * xre;
@@ -278,9 +289,9 @@ inline void dRHSdp_getcoeffs(const int it, const int n, const int i, const int i
   /* \rho(ik-1..,ik'..) */
   if (i > 0) {
     int itx = it - stridei;
-    double xre = xptr[2 * itx];
-    double xim = xptr[2 * itx + 1];
-    double sq = sqrt(i);
+    double xre = xptr[getIndexReal(itx)];
+    double xim = xptr[getIndexImag(itx)];
+    double sq = sqrtn[i];
     *res_p_re += + sq * xim;
     *res_p_im += - sq * xre;
     *res_q_re += - sq * xre;
@@ -289,9 +300,9 @@ inline void dRHSdp_getcoeffs(const int it, const int n, const int i, const int i
   /* \rho(ik..,ik'-1..) */
   if (ip > 0) {
     int itx = it - strideip;
-    double xre = xptr[2 * itx];
-    double xim = xptr[2 * itx + 1];
-    double sq = sqrt(ip);
+    double xre = xptr[getIndexReal(itx)];
+    double xim = xptr[getIndexImag(itx)];
+    double sq = sqrtn[ip];
     *res_p_re += - sq * xim;
     *res_p_im += + sq * xre;
     *res_q_re += - sq * xre;
@@ -300,14 +311,14 @@ inline void dRHSdp_getcoeffs(const int it, const int n, const int i, const int i
 }
 
 // Mat-free solver inline for Jkl coupling between oscillator i and oscillator j
-inline void Jkl_coupling(const int it, const int ni, const int nj, const int i, const int ip, const int j, const int jp, const int stridei, const int strideip, const int stridej, const int stridejp, const double* xptr, const double Jij, const double cosij, const double sinij, double* yre, double* yim) {
+inline void Jkl_coupling(const int it, const int ni, const int nj, const int i, const int ip, const int j, const int jp, const int stridei, const int strideip, const int stridej, const int stridejp, const double* xptr, const double* sqrtn, const double Jij, const double cosij, const double sinij, double* yre, double* yim) {
   if (fabs(Jij)>1e-10) {
     //  1) J_kl (-icos + sin) * ρ_{E−k+l i, i′}
     if (i > 0 && j < nj-1) {
       int itx = it - stridei + stridej;
-      double xre = xptr[2 * itx];
-      double xim = xptr[2 * itx + 1];
-      double sq = sqrt(i * (j + 1));
+      double xre = xptr[getIndexReal(itx)];
+      double xim = xptr[getIndexImag(itx)];
+      double sq = sqrtn[i] * sqrtn[j + 1];
       // sin u + cos v + i ( -cos u + sin v)
       *yre += Jij * sq * (   cosij * xim + sinij * xre);
       *yim += Jij * sq * ( - cosij * xre + sinij * xim);
@@ -315,9 +326,9 @@ inline void Jkl_coupling(const int it, const int ni, const int nj, const int i,
     // 2) J_kl (−icos − sin)sqrt(il*(ik +1)) ρ_{E+k−li,i′}
     if (i < ni-1 && j > 0) {
       int itx = it + stridei - stridej;  // E+k-l i, i'
-      double xre = xptr[2 * itx];
-      double xim = xptr[2 * itx + 1];
-      double sq = sqrt(j * (i + 1)); // sqrt( il*(ik+1))
+      double xre = xptr[getIndexReal(itx)];
+      double xim = xptr[getIndexImag(itx)];
+      double sq = sqrtn[j] * sqrtn[i + 1]; // sqrt( il*(ik+1))
       // -sin u + cos v + i (-cos u - sin v)
       *yre += Jij * sq * (   cosij * xim - sinij * xre);
       *yim += Jij * sq * ( - cosij * xre - sinij * xim);
@@ -325,9 +336,9 @@ inline void Jkl_coupling(const int it, const int ni, const int nj, const int i,
     // 3) J_kl ( icos + sin)sqrt(ik'*(il' +1)) ρ_{i,E-k+li'}
     if (ip > 0 && jp < nj-1) {
       int itx = it - strideip + stridejp;  // i, E-k+l i'
-      double xre = xptr[2 * itx];
-      double xim = xptr[2 * itx + 1];
-      double sq = sqrt(ip * (jp + 1)); // sqrt( ik'*(il'+1))
+      double xre = xptr[getIndexReal(itx)];
+      double xim = xptr[getIndexImag(itx)];
+      double sq = sqrtn[ip] * sqrtn[jp + 1]; // sqrt( ik'*(il'+1))
       //  sin u - cos v + i ( cos u + sin v)
       *yre += Jij * sq * ( - cosij * xim + sinij * xre);
       *yim += Jij * sq * (   cosij * xre + sinij * xim);
@@ -335,9 +346,9 @@ inline void Jkl_coupling(const int it, const int ni, const int nj, const int i,
     // 4) J_kl ( icos - sin)sqrt(il'*(ik' +1)) ρ_{i,E+k-li'}
     if (ip < ni-1 && jp > 0) {
       int itx = it + strideip - stridejp;  // i, E+k-l i'
-      double xre = xptr[2 * itx];
-      double xim = xptr[2 * itx + 1];
-      double sq = sqrt(jp * (ip + 1)); // sqrt( il'*(ik'+1))
+      double xre = xptr[getIndexReal(itx)];
+      double xim = xptr[getIndexImag(itx)];
+      double sq = sqrtn[jp] * sqrtn[ip + 1]; // sqrt( il'*(ik'+1))
       // - sin u - cos v + i ( cos u - sin v)
       *yre += Jij * sq * ( - cosij * xim - sinij * xre);
       *yim += Jij * sq * (   cosij * xre - sinij * xim);
@@ -346,41 +357,41 @@ inline void Jkl_coupling(const int it, const int ni, const int nj, const int i,
 }
 
 // transpose of Jkl coupling
-inline void Jkl_coupling_T(const int it, const int ni, const int nj, const int i, const int ip, const int j, const int jp, const int stridei, const int strideip, const int stridej, const int stridejp, const double* xptr, const double Jij, const double cosij, const double sinij, double* yre, double* yim) {
+inline void Jkl_coupling_T(const int it, const int ni, const int nj, const int i, const int ip, const int j, const int jp, const int stridei, const int strideip, const int stridej, const int stridejp, const double* xptr, const double* sqrtn, const double Jij, const double cosij, const double sinij, double* yre, double* yim) {
   if (fabs(Jij)>1e-10) {
     //  1) [...] * \bar y_{E+k-l i, i′}
     if (i < ni-1 && j > 0) {
       int itx = it + stridei - stridej;
-      double xre = xptr[2 * itx];
-      double xim = xptr[2 * itx + 1];
-      double sq = sqrt(j * (i + 1));
+      double xre = xptr[getIndexReal(itx)];
+      double xim = xptr[getIndexImag(itx)];
+      double sq = sqrtn[j] * sqrtn[i + 1];
       *yre += Jij * sq * ( - cosij * xim + sinij * xre);
       *yim += Jij * sq * ( + cosij * xre + sinij * xim);
     }
     // 2) J_kl (−icos − sin)sqrt(ik*(il +1)) \bar y_{E-k+li,i′}
     if (i > 0 && j < nj-1) {
       int itx = it - stridei + stridej;  // E-k+l i, i'
-      double xre = xptr[2 * itx];
-      double xim = xptr[2 * itx + 1];
-      double sq = sqrt(i * (j + 1)); // sqrt( ik*(il+1))
+      double xre = xptr[getIndexReal(itx)];
+      double xim = xptr[getIndexImag(itx)];
+      double sq = sqrtn[i] * sqrtn[j + 1]; // sqrt( ik*(il+1))
       *yre += Jij * sq * ( - cosij * xim - sinij * xre);
       *yim += Jij * sq * ( + cosij * xre - sinij * xim);
     }
     // 3) J_kl ( icos + sin)sqrt(il'*(ik' +1)) \bar y_{i,E+k-li'}
     if (ip < ni-1 && jp > 0) {
       int itx = it + strideip - stridejp;  // i, E+k-l i'
-      double xre = xptr[2 * itx];
-      double xim = xptr[2 * itx + 1];
-      double sq = sqrt(jp * (ip + 1)); // sqrt( il'*(ik'+1))
+      double xre = xptr[getIndexReal(itx)];
+      double xim = xptr[getIndexImag(itx)];
+      double sq = sqrtn[jp] * sqrtn[ip + 1]; // sqrt( il'*(ik'+1))
       *yre += Jij * sq * (   cosij * xim + sinij * xre);
       *yim += Jij * sq * ( - cosij * xre + sinij * xim);
     }
     // 4) J_kl ( icos - sin)sqrt(ik'*(il' +1)) \bar y_{i,E-k+li'}
     if (ip > 0 && jp < nj-1) {
       int itx = it - strideip + stridejp;  // i, E-k+l i'
-      double xre = xptr[2 * itx];
-      double xim = xptr[2 * itx + 1];
-      double sq = sqrt(ip * (jp + 1)); // sqrt( ik'*(il'+1))
+      double xre = xptr[getIndexReal(itx)];
+      double xim = xptr[getIndexImag(itx)];
+      double sq = sqrtn[ip] * sqrtn[jp + 1]; // sqrt( ik'*(il'+1))
       *yre += Jij * sq * (   cosij * xim - sinij * xre);
       *yim += Jij * sq * ( - cosij * xre - sinij * xim);
     }
@@ -389,13 +400,13 @@ inline void Jkl_coupling_T(const int it, const int ni, const int nj, const int i
 }
 
 // Mat-free solver inline for off-diagonal L1decay term
-inline void L1decay(const int it, const int n, const int i, const int ip, const int stridei, const int strideip, const double* xptr, const double decayi, double* yre, double* yim){
+inline void L1decay(const int it, const int n, const int i, const int ip, const int stridei, const int strideip, const double* xptr, const double* sqrtn, const double decayi, double* yre, double* yim){
   if  (fabs(decayi) > 1e-12) {
     if (i < n-1 && ip < n-1) {
-      double l1off = decayi * sqrt((i+1)*(ip+1));
+      double l1off = decayi * sqrtn[i+1] * sqrtn[ip+1];
       int itx = it + stridei + strideip;
-      double xre = xptr[2 * itx];
-      double xim = xptr[2 * itx + 1];
+      double xre = xptr[getIndexReal(itx)];
+      double xim = xptr[getIndexImag(itx)];
       *yre += l1off * xre;
       *yim += l1off * xim;
     }
@@ -404,13 +415,13 @@ inline void L1decay(const int it, const int n, const int i, const int ip, const
 
 
 // Transpose of offdiagonal L1decay
-inline void L1decay_T(const int it, const int n, const int i, const int ip, const int stridei, const int strideip, const double* xptr, const double decayi, double* yre, double* yim){
+inline void L1decay_T(const int it, const int n, const int i, const int ip, const int stridei, const int strideip, const double* xptr, const double* sqrtn, const double decayi, double* yre, double* yim){
   if (fabs(decayi) > 1e-12) {
       if (i > 0 && ip > 0) {
-        double l1off = decayi * sqrt(i*ip);
+        double l1off = decayi * sqrtn[i] * sqrtn[ip];
         int itx = it - stridei - strideip;
-        double xre = xptr[2 * itx];
-        double xim = xptr[2 * itx + 1];
+        double xre = xptr[getIndexReal(itx)];
+        double xim = xptr[getIndexImag(itx)];
         *yre += l1off * xre;
         *yim += l1off * xim;
       }
@@ -418,40 +429,40 @@ inline void L1decay_T(const int it, const int n, const int i, const int ip, cons
 }
 
 // Matfree solver inline for Control terms
-inline void control(const int it, const int n, const int i, const int ip, const int stridei, const int strideip, const double* xptr, const double pt, const double qt, double* yre, double* yim){
+inline void control(const int it, const int n, const int i, const int ip, const int stridei, const int strideip, const double* xptr, const double* sqrtn, const double pt, const double qt, double* yre, double* yim){
   /* \rho(ik+1..,ik'..) term */
   if (i < n-1) {
       int itx = it + stridei;
-      double xre = xptr[2 * itx];
-      double xim = xptr[2 * itx + 1];
-      double sq = sqrt(i + 1);
+      double xre = xptr[getIndexReal(itx)];
+      double xim = xptr[getIndexImag(itx)];
+      double sq = sqrtn[i + 1];
       *yre += sq * (   pt * xim + qt * xre);
       *yim += sq * ( - pt * xre + qt * xim);
     }
     /* \rho(ik..,ik'+1..) */
     if (ip < n-1) {
       int itx = it + strideip;
-      double xre = xptr[2 * itx];
-      double xim = xptr[2 * itx + 1];
-      double sq = sqrt(ip + 1);
+      double xre = xptr[getIndexReal(itx)];
+      double xim = xptr[getIndexImag(itx)];
+      double sq = sqrtn[ip + 1];
       *yre += sq * ( -pt * xim + qt * xre);
       *yim += sq * (  pt * xre + qt * xim);
     }
     /* \rho(ik-1..,ik'..) */
     if (i > 0) {
       int itx = it - stridei;
-      double xre = xptr[2 * itx];
-      double xim = xptr[2 * itx + 1];
-      double sq = sqrt(i);
+      double xre = xptr[getIndexReal(itx)];
+      double xim = xptr[getIndexImag(itx)];
+      double sq = sqrtn[i];
       *yre += sq * (  pt * xim - qt * xre);
       *yim += sq * (- pt * xre - qt * xim);
     }
     /* \rho(ik..,ik'-1..) */
     if (ip > 0) {
       int itx = it - strideip;
-      double xre = xptr[2 * itx];
-      double xim = xptr[2 * itx + 1];
-      double sq = sqrt(ip);
+      double xre = xptr[getIndexReal(itx)];
+      double xim = xptr[getIndexImag(itx)];
+      double sq = sqrtn[ip];
       *yre += sq * (- pt * xim - qt * xre);
       *yim += sq * (  pt * xre - qt * xim);
     }
@@ -459,41 +470,120 @@ inline void control(const int it, const int n, const int i, const int ip, const
 
 
 // Transpose of control terms
-inline void control_T(const int it, const int n, const int i, const int ip, const int stridei, const int strideip, const double* xptr, const double pt, const double qt, double* yre, double* yim){
+inline void control_T(const int it, const int n, const int i, const int ip, const int stridei, const int strideip, const double* xptr, const double* sqrtn, const double pt, const double qt, double* yre, double* yim){
   /* \rho(ik+1..,ik'..) term */
   if (i > 0) {
     int itx = it - stridei;
-    double xre = xptr[2 * itx];
-    double xim = xptr[2 * itx + 1];
-    double sq = sqrt(i);
+    double xre = xptr[getIndexReal(itx)];
+    double xim = xptr[getIndexImag(itx)];
+    double sq = sqrtn[i];
     *yre += sq * ( - pt * xim + qt * xre);
     *yim += sq * (   pt * xre + qt * xim);
   }
   /* \rho(ik..,ik'+1..) */
   if (ip > 0) {
     int itx = it - strideip;
-    double xre = xptr[2 * itx];
-    double xim = xptr[2 * itx + 1];
-    double sq = sqrt(ip);
+    double xre = xptr[getIndexReal(itx)];
+    double xim = xptr[getIndexImag(itx)];
+    double sq = sqrtn[ip];
     *yre += sq * (  pt * xim + qt * xre);
     *yim += sq * ( -pt * xre + qt * xim);
   }
   /* \rho(ik-1..,ik'..) */
   if (i < n-1) {
     int itx = it + stridei;
-    double xre = xptr[2 * itx];
-    double xim = xptr[2 * itx + 1];
-    double sq = sqrt(i+1);
+    double xre = xptr[getIndexReal(itx)];
+    double xim = xptr[getIndexImag(itx)];
+    double sq = sqrtn[i+1];
     *yre += sq * (- pt * xim - qt * xre);
     *yim += sq * (  pt * xre - qt * xim);
   }
   /* \rho(ik..,ik'-1..) */
   if (ip < n-1) {
     int itx = it + strideip;
-    double xre = xptr[2 * itx];
-    double xim = xptr[2 * itx + 1];
-    double sq = sqrt(ip+1);
+    double xre = xptr[getIndexReal(itx)];
+    double xim = xptr[getIndexImag(itx)];
+    double sq = sqrtn[ip+1];
     *yre += sq * (+ pt * xim - qt * xre);
     *yim += sq * (- pt * xre - qt * xim);
   }
-}
\ No newline at end of file
+}
+
+
+// Schroedinger mode: Control terms -i(p(a+a^d) + iq(a-a^d)) psi, acting on the row index only
+inline void control_schroedinger(const int it, const int n, const int i, const int stridei, const double* xptr, const double* sqrtn, const double pt, const double qt, double* yre, double* yim){
+  /* psi(ik+1..) term */
+  if (i < n-1) {
+    int itx = it + stridei;
+    double xre = xptr[getIndexReal(itx)];
+    double xim = xptr[getIndexImag(itx)];
+    double sq = sqrtn[i + 1];
+    *yre += sq * (   pt * xim + qt * xre);
+    *yim += sq * ( - pt * xre + qt * xim);
+  }
+  /* psi(ik-1..) term */
+  if (i > 0) {
+    int itx = it - stridei;
+    double xre = xptr[getIndexReal(itx)];
+    double xim = xptr[getIndexImag(itx)];
+    double sq = sqrtn[i];
+    *yre += sq * (  pt * xim - qt * xre);
+    *yim += sq * (- pt * xre - qt * xim);
+  }
+}
+
+// Schroedinger mode: Jkl coupling between oscillator i and oscillator j, acting on the row index only
+inline void Jkl_coupling_schroedinger(const int it, const int ni, const int nj, const int i, const int j, const int stridei, const int stridej, const double* xptr, const double* sqrtn, const double Jij, const double cosij, const double sinij, double* yre, double* yim) {
+  if (fabs(Jij)>1e-10) {
+    //  1) J_kl (-icos + sin) * psi_{E−k+l i}
+    if (i > 0 && j < nj-1) {
+      int itx = it - stridei + stridej;
+      double xre = xptr[getIndexReal(itx)];
+      double xim = xptr[getIndexImag(itx)];
+      double sq = sqrtn[i] * sqrtn[j + 1];
+      *yre += Jij * sq * (   cosij * xim + sinij * xre);
+      *yim += Jij * sq * ( - cosij * xre + sinij * xim);
+    }
+    // 2) J_kl (−icos − sin)sqrt(il*(ik +1)) psi_{E+k−l i}
+    if (i < ni-1 && j > 0) {
+      int itx = it + stridei - stridej;
+      double xre = xptr[getIndexReal(itx)];
+      double xim = xptr[getIndexImag(itx)];
+      double sq = sqrtn[j] * sqrtn[i + 1];
+      *yre += Jij * sq * (   cosij * xim - sinij * xre);
+      *yim += Jij * sq * ( - cosij * xre - sinij * xim);
+    }
+  }
+}
+
+// Schroedinger mode: gradient coefficients d/dp (-iH psi) = -i(a+a^d) psi and d/dq (-iH psi) = (a-a^d) psi for oscillator i
+inline void dRHSdp_getcoeffs_schroedinger(const int it, const int n, const int i, const int stridei, const double* xptr, const double* sqrtn, double* res_p_re, double* res_p_im, double* res_q_re, double* res_q_im) {
+
+  *res_p_re = 0.0;
+  *res_p_im = 0.0;
+  *res_q_re = 0.0;
+  *res_q_im = 0.0;
+
+  /* psi(ik+1..) term */
+  if (i < n-1) {
+    int itx = it + stridei;
+    double xre = xptr[getIndexReal(itx)];
+    double xim = xptr[getIndexImag(itx)];
+    double sq = sqrtn[i + 1];
+    *res_p_re +=   sq * xim;
+    *res_p_im += - sq * xre;
+    *res_q_re +=   sq * xre;
+    *res_q_im +=   sq * xim;
+  }
+  /* psi(ik-1..) term */
+  if (i > 0) {
+    int itx = it - stridei;
+    double xre = xptr[getIndexReal(itx)];
+    double xim = xptr[getIndexImag(itx)];
+    double sq = sqrtn[i];
+    *res_p_re += + sq * xim;
+    *res_p_im += - sq * xre;
+    *res_q_re += - sq * xre;
+    *res_q_im += - sq * xim;
+  }
+}
@@ -22,6 +22,9 @@ class OptimProblem {
   int ninit_local;                      /* Local number of initial conditions on this processor */
   Vec rho_t0;                            /* Storage for initial condition of the ODE */
   Vec rho_t0_bar;                        /* Adjoint of ODE initial condition */
+  Vec rho_t0_batch;                      /* Batch of initial conditions that are propagated simultaneously. Same as rho_t0 if nbatch = 1. */
+  Vec rho_t0_bar_batch;                  /* Batch of adjoint initial conditions. Same as rho_t0_bar if nbatch = 1. */
+  Vec finalstate_col;                    /* Buffer for a single final state of a batch. Only allocated if nbatch > 1. */
   InitialConditionType initcond_type;    /* Type of initial conditions */
   std::vector<int> initcond_IDs;         /* Integer list for pure-state initialization */
 
@@ -13,20 +13,32 @@ class OptimTarget{
     Vec targetstate;   	           /* Holds the target state (unless its a pure one in which case this is NULL). 
                                       If target is a gate, this holds the transformed state VrhoV^\dagger.
                                       If target is read from file, this holds the target density matrix from that file. */
+    Vec targetstate_single;        /* Storage of the target state if one initial condition is propagated at a time. 'targetstate' points to it, or into targetstate_batch. */
+    std::vector<Vec> targetstate_batch; /* Gate optimization with a batch of initial conditions: The prepared target of each batch column */
 
     Vec aux;      /* auxiliary vector needed when computing the objective for gate optimization */
+    bool schroedinger;  /* Flag for state vectors psi instead of vectorized density matrices (targetstate then holds psi_target) */
+
+    /* Complex overlap <targetstate, psi> of two state vectors (Schroedinger mode), summed over all petsc processors */
+    void stateOverlap(const Vec state, double* re, double* im);
 
   public:
 
-    OptimTarget(int dim, int purestateID_, TargetType target_type_, ObjectiveType objective_type_, Gate* targetgate_, std::string target_filename_);
+    OptimTarget(int dim, int purestateID_, TargetType target_type_, ObjectiveType objective_type_, Gate* targetgate_, std::string target_filename_, bool schroedinger_);
     ~OptimTarget();
 
     /* Get information on the type of optimization target */
     TargetType getType(){ return target_type; };
 
-    /* If gate optimization, this routine prepares the rotated target state VrhoV for a given initial state rho */
+    /* If gate optimization, this routine prepares the rotated target state VrhoV for a given initial state rho (or Vpsi in Schroedinger mode) */
     void prepare(const Vec rho);
 
+    /* Same for the initial state of batch column ibatch, if several initial conditions are propagated at once. The target is stored per column, such that it is prepared once per batch. */
+    void prepare(const Vec rho, int ibatch);
+
+    /* Make the target of batch column ibatch, prepared above, the current target for evaluating J and its derivative. */
+    void selectBatch(int ibatch);
+
     /* Evaluate the objective J */
     /* Note that J depends on the target state which itself can depend on the initial state. Therefor, the targetstate should be computed within 'prepare' routine! */
     double evalJ(const Vec state);
@@ -41,8 +53,12 @@ class OptimTarget{
     double FrobeniusDistance(const Vec state);
     void FrobeniusDistance_diff(const Vec state, Vec statebar, const double Jbar);
 
-    /* Hilber-Schmidt overlap Tr(targetstate^\dagger * state), potentially scaled by purity of targetstate */
+    /* Hilber-Schmidt overlap Tr(targetstate^\dagger * state), potentially scaled by purity of targetstate. In Schroedinger mode, this is |<psi_target, psi>|^2. */
     double HilbertSchmidtOverlap(const Vec state, bool scalebypurity);
     void HilbertSchmidtOverlap_diff(const Vec state, Vec statebar, const double Jbar, bool scalebypurity);
+
+    /* Population of the i-th basis state rho_ii, or |psi_i|^2 in Schroedinger mode. Returns this processor's contribution (zero if not owned). */
+    double population(const Vec state, const int i, const int dim);
+    void population_diff(const Vec state, Vec statebar, const int i, const int dim, const double popbar);
 };
 
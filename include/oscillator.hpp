@@ -62,6 +62,8 @@ class Oscillator {
     int evalControl(const double t, double* Re_ptr, double* Im_ptr);
     /* Compute derivatives of the p(t) and q(t) control function wrt the parameters */
     int evalControl_diff(const double t, double* dRedp, double* dImdp);
+    /* Return the range [first, first+n) of parameters with nonzero derivative at time t */
+    void getActiveParams(const double t, int* first, int* n) { basisfunctions->getActiveCoeffs(t, first, n); };
 
     /* Evaluates Lab-frame control function f(t) */
     int evalControl_Labframe(const double t, double* f_ptr);
@@ -71,7 +73,7 @@ class Oscillator {
     /* Derivative of expected alrue computation */
     void expectedEnergy_diff(const Vec x, Vec x_bar, const double obj_bar);
 
-    /* Compute population (=diagonal elements) for this oscillators reduced system */
+    /* Compute population (=diagonal elements) for this oscillators reduced system. x is the vectorized rho, or psi in Schroedinger mode. */
     void population(const Vec x, std::vector<double> &pop); 
 };
 
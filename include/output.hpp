@@ -13,16 +13,21 @@ class Output{
   int mpisize_petsc;  /* Size of communicator for parallelizing Petsc */
   int mpirank_init;   /* Rank of processor for parallelizing initial conditions */
   int mpirank_braid;  /* Rank of processor for parallelizing XBraid, or -1 if compiling without XBraid */
+  int mpisize_world;  /* Size of MPI_COMM_WORLD */
+  MPI_Comm comm_init; /* Communicator for parallelizing initial conditions */
   
   FILE* optimfile;      /* Output file to log optimization progress */
   int output_frequency;   /* Output frequency in time domain: write output at every <num> time step. */
   std::vector<std::vector<std::string> > outputstr; // List of outputs for each oscillator
 
   bool writefullstate;  /* Flag to determin if full state vector should be written to file */
-  FILE *ufile;          /* File for writing real part of solution vector */
-  FILE *vfile;          /* File for writing imaginary part of solution vector */
-  std::vector<FILE *>expectedfile;    /* Files for writing expected energy levels over time */
-  std::vector<FILE *>populationfile;  /* Files for writing population over time */
+  /* Data files are held in slots, one per state that is propagated simultaneously (batched propagation) */
+  std::vector<FILE *>ufile;          /* Files for writing real part of solution vector */
+  std::vector<FILE *>vfile;          /* Files for writing imaginary part of solution vector */
+  std::vector<std::vector<FILE *> >expectedfile;    /* Files for writing expected energy levels over time, per oscillator */
+  std::vector<std::vector<FILE *> >populationfile;  /* Files for writing population over time, per oscillator */
+  std::vector<bool> slot_active;     /* Flag per slot: true if any data is written for the currently open files. Same on all petsc processors. */
+  bool perf_report;     /* Flag to determine if a performance report is written at the end of the run */
 
   // VecScatter scat;    /* Petsc's scatter context to communicate a state across petsc's cores */
   // Vec xseq;           /* A sequential vector for IO. */
@@ -47,9 +52,17 @@ class Output{
     /* Write gradient for adjoint mode */
     void writeGradient(Vec grad);
 
-    /* Open, write and close files for fullstate and expected energy levels over time */
-    void openDataFiles(std::string prefix, int initid);
-    void writeDataFiles(int timestep, double time, const Vec state, MasterEq* mastereq);
+    /* Open, write and close files for fullstate and expected energy levels over time. 
+     * slot distinguishes the states of a batch that are propagated simultaneously. */
+    void openDataFiles(std::string prefix, int initid, int slot = 0);
+    void writeDataFiles(int timestep, double time, const Vec state, MasterEq* mastereq, int slot = 0);
     void closeDataFiles();
 
+    /* Return true if data of this slot will be written at this time step. Same result on all petsc processors. */
+    bool writesDataFiles(int timestep, int slot = 0);
+
+    /* Write the performance report <datadir>/performance.json: Timings of the log events per stage, and the histogram of 
+     * linear solver iterations (iter_histogram[i]: number of solves that took i iterations). Collective on MPI_COMM_WORLD. */
+    void writePerformanceReport(double runtime, double memory, const std::vector<int>& iter_histogram);
+
 };
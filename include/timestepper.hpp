@@ -4,25 +4,120 @@
 #include "mastereq.hpp"
 #include <assert.h> 
 #include <iostream> 
+#include <map>
 #include "defs.hpp"
 #include "output.hpp"
 #include "optimtarget.hpp"
 #pragma once
 
 
+/* Options for storing the forward trajectory that is needed by the adjoint */
+struct StorageOptions {
+  bool storeFWD = false;                                  /* Store the primal states during the forward solve (gradient and optimization runs) */
+  bool hermitian = false;                                 /* Store the states Hermitian-packed (upper triangle of rho only) */
+  int ncheckpoints = 0;                                   /* Number of states kept for binomial checkpointing. 0 stores all time steps. */
+  std::string scratchdir = "";                            /* Directory of a memory-mapped scratch file holding the states. Empty keeps them in memory. */
+  StoreCompression compression = StoreCompression::NONE;  /* Compression of the stored states */
+  double compression_tol = 1e-10;                         /* Absolute error bound for DELTA compression */
+  bool stages = false;                                    /* Gauss-Legendre only: Store the stages of each step as well */
+};
+
 /* Base class for time steppers */
 class TimeStepper{
   protected:
     int dim;             /* State vector dimension */
     Vec x;               // auxiliary vector needed for time stepping
     bool storeFWD;       /* Flag that determines if primal states should be stored during forward evaluation */
+    bool storeHermitian; /* Flag that determines if primal states are stored Hermitian-packed (upper triangle of rho only) */
     std::vector<Vec> store_states; /* Storage for primal states */
+    VecScatter scat_pack, scat_unpack;  /* Scatters from the full state into the Hermitian-packed storage, and back */
+    std::vector<int> unpack_conj;       /* Local indices of Im(rho(i,j)), i>j, that are negated after unpacking */
+    Vec state_unpacked;                 /* Buffer holding the unpacked state returned by getState() */
+    Vec xcol, xcol_adj;                 /* Buffers for single states of a batch. Only allocated if nbatch > 1. */
+    int ncheckpoints;                   /* Number of states kept for binomial checkpointing of the adjoint. 0 if all time steps are stored. */
+    std::vector<int> checkpoint_tindex; /* Time index of the state held by each checkpoint, -1 if unused */
+    Vec x_recompute;                    /* Auxiliary state for recomputing forward steps from a checkpoint */
+    double* store_map;                  /* Memory-mapped scratch file holding the stored states. NULL if they are stored in memory. */
+    size_t store_mapsize;               /* Size of the mapping in bytes */
+    size_t store_stride;                /* Distance between two stored states in the mapping (page aligned) */
+    int store_readahead;                /* Number of stored states that are prefetched during the backward sweep */
+    int store_fd;                       /* File descriptor of the scratch file */
+    StoreCompression store_compression; /* Compression of the stored states */
+    double store_tol;                   /* Absolute error bound for DELTA compression */
+    std::vector<bool> store_iskey;                /* Compression: Flag per time index, true if the state is stored uncompressed in store_states */
+    std::vector<std::vector<float> > store_single;  /* SINGLE compression: Local part of each state in single precision */
+    std::vector<std::vector<int> > store_delta;     /* DELTA compression: Quantized difference of each state to the previous one */
+    Vec store_buffer;                   /* Compression: State in storage layout before encoding */
+    Vec store_recon;                    /* DELTA compression: Encoded state of the previous time step, as seen by the decoder */
+    Vec store_decoded;                  /* Compression: Decoded state */
+    int store_recon_tindex;             /* Time index held by store_recon, -1 if none */
+    int store_decoded_tindex;           /* Time index held by store_decoded, -1 if none */
+    bool adaptive;                      /* Flag for adaptive time stepping, controlled by the embedded error estimate of the stepper */
+    double adapt_tol;                   /* Adaptive: Tolerance for the estimated local error per time step */
+    double adapt_h;                     /* Adaptive: Proposed size of the next time step */
+    std::vector<double> tgrid;          /* Adaptive: Time points of the steps of the last forward solve */
+    std::map<int, std::vector<double> > adapt_grids;  /* Adaptive: Time grid chosen for each batch, keyed by the id of its first initial condition. Replayed by later forward solves, see adaptiveStep. */
+    Vec x_prev;                         /* Adaptive: State before the current step, restored if the step is rejected */
+    double errest;                      /* Estimate of the local error of the last forward step. Only set by evolveFWD if adaptive. */
+    int errest_order;                   /* Order q of the embedded method behind errest, which is O(h^(q+1)). 0 if the stepper provides no estimate. */
+    bool adjoint_sweep;                 /* True while solveAdjointODE calls evolveBWD for consecutive steps backwards in time, such that a step may reuse the primal state passed to the previous call */
+
+    /* Store the state x at time index tindex. With checkpointing, only states at checkpoint_tindex are stored. */
+    void storeState(int tindex, const Vec x);
+
+    /* Store x in / return the state held by storage slot islot */
+    void storeSlot(int islot, const Vec x);
+    Vec getSlot(int islot);
+
+    /* Create the nstore stored states in a memory-mapped file in scratchdir */
+    void mapStorage(const std::string& scratchdir, int nstore, PetscInt dim_local, PetscInt dim_store);
+    /* Map the scratch file, sized for nstore states, and create the stored states of local size nlocal on it */
+    void mapSlots(int nstore, PetscInt nlocal, PetscInt dim_store);
+    /* Enlarge the storage to hold at least nstore states, keeping the stored ones. Used if adaptive steps exceed ntime. */
+    void growStorage(int nstore);
+    /* Give advice (MADV_WILLNEED, MADV_DONTNEED) on the mapped pages of nslots stored states, starting at slot ifirst */
+    void adviseSlots(int ifirst, int nslots, int advice);
+
+    /* Compressed storage: Encode the state x at time index tindex / Return the decoded state at tindex (in storage layout). */
+    void encodeState(int tindex, const Vec x);
+    Vec decodeState(int tindex);
+
+    /* Binomial checkpointing: Time index at which the segment [a,b] is split if s free checkpoints are available */
+    int checkpointSplit(int a, int b, int s);
+    /* Binomial checkpointing: Run the adjoint backwards from time index b to a, given the state at a in slot islot_a and s free checkpoints */
+    void reverseSegment(int a, int b, int s, int islot_a, const std::vector<int>& initids, double Jbar);
+
+    /* Adaptive: Take step n from tstart, retaking it with a smaller step while the error estimate exceeds the tolerance. 
+     * Steps of the grid in tgrid are replayed, unless their error estimate exceeds twice the tolerance. Then the rest of 
+     * the grid is chosen anew, starting from a step of at most adapt_h. Returns the time reached. */
+    double adaptiveStep(int n, double tstart, Vec x);
+
+    /* Add derivative of penalty integral at time index tindex to the adjoint x, for all states of the batch */
+    void penaltyIntegral_diff_batch(int tindex, const Vec state, const std::vector<int>& initids, double Jbar);
+
+    /* Return the system matrix that acts on the (batched) state */
+    Mat getRHS();
+
+    /* Add derivative of x_bar^T RHS(t) x wrt control parameters to grad, for the (batched) states. 
+     * Adds this processor's contribution to its local copy of grad. See reduceGradient(). */
+    void computedRHSdp(const double t, const Vec x, const Vec x_bar, const double alpha, Vec grad);
+
+    /* x_adj += RHS^T x_bar and the gradient update of computedRHSdp, in one sweep over the state if the matrix-free 
+     * solver provides the fused kernel. The RHS must be assembled at time t. */
+    void computeAdjointRHS(const double t, const Vec x, const Vec x_bar, const double alpha, Vec x_adj, Vec grad);
+
+    /* Count a linear solve (or Arnoldi process) that took iters iterations in the histogram */
+    void recordIterations(int iters);
 
   public:
     MasterEq* mastereq;  // Lindblad master equation
-    int ntime;           // number of time steps
+    int ntime;           // number of time steps. Initial number of time steps (for storage and output) if adaptive.
+    int nsteps;          // number of time steps taken by the last forward solve. Equals ntime, unless adaptive.
+    int nrejected;       // number of rejected time steps in the last forward solve, if adaptive
     double total_time;   // final time
     double dt;           // time step size
+    int nbatch;          // number of initial conditions that are propagated simultaneously
+    std::vector<int> iter_histogram; // number of linear solves (Arnoldi processes for EXP) per number of iterations taken
 
     Vec redgrad;                   /* Reduced gradient */
 
@@ -38,21 +133,45 @@ class TimeStepper{
 
   public: 
     TimeStepper(); 
-    TimeStepper(MasterEq* mastereq_, int ntime_, double total_time_, Output* output_, bool storeFWD_); 
+    TimeStepper(MasterEq* mastereq_, int ntime_, double total_time_, Output* output_, const StorageOptions& storage, int nbatch_ = 1); 
     virtual ~TimeStepper(); 
 
-    /* Return the state at a certain time index */
+    /* Switch compression of the stored states. Takes effect for the next forward solve. */
+    void setStoreCompression(StoreCompression compression);
+    StoreCompression getStoreCompression() { return store_compression; };
+
+    /* Switch on adaptive time stepping with tolerance tol for the local error estimate per time step. The initial step 
+     * size is dt. Each batch of initial conditions keeps the grid of its first forward solve while the grid passes the 
+     * error test, such that the objective is differentiable in the parameters. The adjoint replays the steps of the last forward solve. */
+    void setAdaptive(double tol);
+
+    /* Return the time at a certain time index */
+    double getTime(int tindex);
+
+    /* Return the state at a certain time index. For Hermitian-packed or compressed storage, the returned vector is overwritten by the next call. 
+     * With checkpointing, only states at a checkpoint are available. */
     Vec getState(int tindex);
 
-    /* Solve the ODE forward in time with initial condition rho_t0. Return state at final time step */
+    /* Return state b of the batch xbatch. If nbatch > 1, it is copied into xcol, otherwise xbatch itself is returned. */
+    Vec getColumn(const Vec xbatch, int b, Vec xcol);
+    /* Insert xcol as state b into the batch xbatch. Does nothing if xcol is xbatch itself. */
+    void setColumn(Vec xbatch, int b, const Vec xcol);
+
+    /* Solve the ODE forward in time with initial condition rho_t0. Return state at final time step.
+     * If nbatch > 1, rho_t0 holds a batch of initial conditions, one for each id in initids, and remaining states are zero. */
     Vec solveODE(int initid, Vec rho_t0);
+    Vec solveODE(const std::vector<int>& initids, Vec rho_t0);
 
-    /* Solve the adjoint ODE backwards in time with terminal condition rho_t0_bar */
+    /* Sum the local gradient contributions of petsc's processors in redgrad. Called at the end of an adjoint solve. */
+    void reduceGradient();
+
+    /* Solve the adjoint ODE backwards in time with terminal condition rho_t0_bar (a batch if nbatch > 1) */
     void solveAdjointODE(int initid, Vec rho_t0_bar, double Jbar);
+    void solveAdjointODE(const std::vector<int>& initids, Vec rho_t0_bar, double Jbar);
 
-    /* evaluate the penalty integral term */
-    double penaltyIntegral(double time, const Vec x);
-    void penaltyIntegral_diff(double time, const Vec x, Vec xbar, double Jbar);
+    /* evaluate the penalty integral term at time, with quadrature weight h (the time step size) */
+    double penaltyIntegral(double time, double h, const Vec x);
+    void penaltyIntegral_diff(double time, double h, const Vec x, Vec xbar, double Jbar);
 
     /* Evolve state forward from tstart to tstop */
     virtual void evolveFWD(const double tstart, const double tstop, Vec x) = 0;
@@ -63,7 +182,7 @@ class TimeStepper{
 class ExplEuler : public TimeStepper {
   Vec stage;
   public:
-    ExplEuler(MasterEq* mastereq_, int ntime_, double total_time_, Output* output_, bool storeFWD_);
+    ExplEuler(MasterEq* mastereq_, int ntime_, double total_time_, Output* output_, const StorageOptions& storage, int nbatch_ = 1);
     ~ExplEuler();
 
     /* Evolve state forward from tstart to tstop */
@@ -85,6 +204,8 @@ class ImplMidpoint : public TimeStepper {
   Vec rhs, rhs_adj;      /* right hand side */
   KSP ksp;               /* Petsc's linear solver context for running GMRES */
   PC  preconditioner;    /* Preconditioner for linear solver */
+  Mat implmat;           /* I - dt/2 A for GMRES, matrix-free */
+  double impl_dt;        /* Step size dt of implmat */
   LinearSolverType linsolve_type;  // Either GMRES or NEUMANN
   int linsolve_maxiter;            // Maximum number of linear solver iterations
   double linsolve_abstol;          // Absolute stopping criteria for linear solver
@@ -93,9 +214,28 @@ class ImplMidpoint : public TimeStepper {
   double linsolve_error_avg;       // Computing the average error of linear solver 
   int linsolve_counter;            // Counting how often a linear solve is performed is called
   Vec tmp, err;                    /* Auxiliary vector for applying the neuman iterations */
+  Vec cheb_dir;                    /* Update direction of the Chebyshev iterations */
+  double cheb_normA;               /* Estimate of |A|_2, bounding the spectral radius of A for the Chebyshev iterations. Negative if not yet estimated. */
+  double cheb_decay;               /* Largest decay rate -Re(lambda) of A, from the Lindblad terms */
+  int cheb_fallbacks;              /* Number of Chebyshev solves that diverged and were solved with GMRES */
+  PreconditionerType precond_type; // Preconditioner for GMRES
+  Vec precond_constdiag;           /* Time-independent diagonal D of the RHS (complex entries in the layout of a single state) */
+  Vec precond_diag;                /* Inverse of the diagonal of I - dt/2 D */
+  double precond_dt;               /* Step size for which precond_diag is set up */
+  bool linsolve_warmstart;         // Start GMRES from the stages extrapolated from the previous steps
+  Vec stage_prev, stage_adj_prev;  /* Stages of the previous step, for the initial guess */
+  Vec state_next;                  /* Adjoint sweep: Primal state passed to the last evolveBWD, i.e. the state at the end of the next step backwards */
+  double state_next_time;          /* Time of state_next, negative if not set */
+
+  /* Set up the preconditioner for step size dt, if it changed */
+  void setupPreconditioner(double dt);
+
+  /* Initial guess k = 2 k - kprev by linear extrapolation from the last two stages, i.e. the unscaled solutions of the 
+   * linear systems. kprev then holds the last stage. */
+  void extrapolateGuess(Vec* k, Vec* kprev);
 
   public:
-    ImplMidpoint(MasterEq* mastereq_, int ntime_, double total_time_, LinearSolverType linsolve_type_, int linsolve_maxiter_, Output* output_, bool storeFWD_);
+    ImplMidpoint(MasterEq* mastereq_, int ntime_, double total_time_, LinearSolverType linsolve_type_, int linsolve_maxiter_, PreconditionerType precond_type_, bool linsolve_warmstart_, Output* output_, const StorageOptions& storage, int nbatch_ = 1);
     ~ImplMidpoint();
 
 
@@ -108,8 +248,159 @@ class ImplMidpoint : public TimeStepper {
     // bool transpose=true solves the transposed system (I-alpha A^T)x = b
     // Return residual norm ||y-yprev||
     int NeumannSolve(Mat A, Vec b, Vec x, double alpha, bool transpose);
+
+    /* Solve (I-alpha*A) * x = b using Chebyshev semi-iterations for the spectrum of alpha*A in [-delta, 0] x [-i rho, i rho],
+     * with rho = alpha*|A|_2 and delta = alpha*(largest decay rate), estimated once per run. Returns the number of iterations. 
+     * If the residual grows, |A|_2 was underestimated: It is doubled for the following solves, and this system is solved with GMRES. */
+    int ChebyshevSolve(Mat A, Vec b, Vec x, double alpha, bool transpose);
+
+    /* Estimate |A|_2 by power iterations on A^T A, times a safety factor, and the largest decay rate from the constant diagonal */
+    void estimateSpectrum(Mat A);
+
+    /* Apply the implicit system matrix (or its transpose) y = (I - dt/2 A) x of the current step */
+    void applyImplicitMatrix(Vec x, Vec y, bool transpose);
+
+    /* Apply the diagonal preconditioner (or its transpose) y = (I - dt/2 D)^{-1} x, for single or batched states */
+    void applyPreconditioner(Vec x, Vec y, bool transpose);
 };
 
+/* Matrix-free application of the implicit midpoint system matrix */
+int myMatMult_implmidpoint(Mat M, Vec x, Vec y);
+int myMatMultTranspose_implmidpoint(Mat M, Vec x, Vec y);
+
+/* Shell preconditioner for GMRES in the implicit midpoint rule */
+int myPCApply_diagonal(PC pc, Vec x, Vec y);
+int myPCApplyTranspose_diagonal(PC pc, Vec x, Vec y);
+
+
+
+/* Implements s-stage Gauss-Legendre Runge-Kutta methods (s = 2: 4th order, s = 3: 6th order). Symplectic. 
+ * Stages K_i = A(t_n + c_i h) (x_n + h sum_j a_ij K_j) are solved for simultaneously, 
+ * the update is x_n+1 = x_n + h sum_i b_i K_i. */
+class GaussLegendre : public TimeStepper {
+
+  int nstages;                      /* Number of stages s */
+  std::vector<double> a, b, c;      /* Butcher tableau. a is stored row-wise. */
+  std::vector<double> e;            /* Weights of the embedded error estimate dt |sum_i e_i (K_i - A(t_i) x_n)|, e_i = l_i(0) with the Lagrange polynomials l_i at the nodes c */
+  PetscInt nlocal;                  /* Local size of one stage */
+  Mat stagemat;                     /* Stage system matrix I - h (a_ij A(t_n + c_i h)), matrix-free */
+  double stage_tstart;              /* Start time of the current step */
+  double stage_dt;                  /* Step size of the current step */
+  Vec stages, stages_adj;           /* All stage variables, stacked */
+  Vec rhs, work;                    /* Stacked right hand side and auxiliary vector */
+  Vec view_in, view_out;            /* Views on a single stage of a stacked vector */
+  Vec u, w;                         /* Auxiliary vectors of state size */
+  KSP ksp;                          /* Petsc's linear solver context for running GMRES */
+  PC  preconditioner;               /* Preconditioner for linear solver */
+  LinearSolverType linsolve_type;   // Either GMRES or NEUMANN
+  int linsolve_maxiter;             // Maximum number of linear solver iterations
+  double linsolve_abstol;           // Absolute stopping criteria for linear solver
+  double linsolve_reltol;           // Relative stopping criteria for linear solver
+  Vec tmp, err;                     /* Auxiliary vectors for the neuman iterations */
+  bool storeStages;                 /* Flag that determines if the stages of each forward step are stored for the adjoint */
+  std::vector<Vec> kstore;          /* Stored stages (stacked) of the forward steps. Allocated when first needed, reused by later forward solves. */
+  std::vector<double> kstore_time;  /* Start time of the step of each stored stage vector, ascending */
+  int kstore_count;                 /* Number of steps stored by the last forward solve */
+
+  /* Place view on stage i of the stacked array ptr / reset it */
+  void placeStage(Vec view, const double* ptr, int i);
+
+  /* Store the stages of the forward step starting at tstart / Return the stored stages of that step, or NULL if there are none */
+  void storeStageVec(double tstart, const Vec k);
+  Vec getStageVec(double tstart);
+
+  public:
+    GaussLegendre(MasterEq* mastereq_, int ntime_, double total_time_, int nstages_, LinearSolverType linsolve_type_, int linsolve_maxiter_, Output* output_, const StorageOptions& storage, int nbatch_ = 1);
+    ~GaussLegendre();
+
+    /* Evolve state forward from tstart to tstop */
+    void evolveFWD(const double tstart, const double tstop, Vec x);
+    /* Evolve adjoint backward from tstop to tstart and update reduced gradient */
+    void evolveBWD(const double tstart, const double tstop, const Vec x_stop, Vec x_adj, Vec grad, bool compute_gradient);
+
+    /* Apply the stage system matrix (or its transpose) of the current step to stacked stages x */
+    void applyStageMatrix(Vec x, Vec y, bool transpose);
+
+    /* Solve the stage system (or its transpose) with the configured linear solver */
+    void solveStages(Vec b, Vec y, bool transpose);
+};
+
+/* Matrix-free application of the Gauss-Legendre stage system matrix */
+int myMatMult_stages(Mat M, Vec x, Vec y);
+int myMatMultTranspose_stages(Mat M, Vec x, Vec y);
+
+
+/* Implements the exponential integrator x_n+1 = exp(h A(t_n + h/2)) x_n. 2nd order, like the midpoint rule, but stable for any step size.
+ * exp(h A) x is approximated in the Krylov space of A and x (Arnoldi), whose dimension is chosen from an a posteriori error estimate. 
+ * If the maximum dimension doesn't suffice, the step is split into substeps. 
+ * The adjoint applies exp(h A^T) in the Krylov space of A^T. The gradient integrates (exp((1-s) h A^T) x_adj)^T dA/dp exp(s h A) x_n over s with Gauss-Legendre quadrature. */
+class KrylovExp : public TimeStepper {
+  protected:
+
+  int krylov_maxdim;                /* Maximum dimension of the Krylov space */
+  double krylov_tol;                /* Relative tolerance for the error estimate of exp(h A) x */
+  Vec* basis;                       /* Arnoldi basis V_1..V_m+1 */
+  Vec* basis_adj;                   /* Arnoldi basis of the adjoint */
+  std::vector<double> hess;         /* Upper Hessenberg matrix H, (m+1) x maxdim, row-wise */
+  std::vector<double> hess_adj;     /* Upper Hessenberg matrix of the adjoint */
+  std::vector<Vec> substates;       /* States at the start of each substep, recomputed for the gradient */
+  Vec u, w, x0;                     /* Auxiliary vectors of state size */
+
+  /* Substeps of the forward sweep, kept for the adjoint if all time steps are stored. For the step starting at the key time: 
+   * the number of substeps of each of its exponentials, and the states at the start of all its substeps except the first one (the stored state). */
+  std::map<double, std::vector<int> > fwd_nsub;
+  std::map<double, std::vector<Vec> > fwd_substates;
+  double fwd_tstart;                /* Start time of the forward step that is being kept, negative if none */
+  int fwd_count;                    /* Number of states kept for that step */
+
+  /* Build the Krylov space of A (or A^T) and v. Returns its dimension m. Sets beta = |v|, and converged = false if the error estimate for exp(tau*A) v failed for m = krylov_maxdim. */
+  int arnoldi(Mat A, Vec v, double tau, bool transpose, Vec* V, std::vector<double>& H, double* beta, bool* converged);
+  /* Relative error estimate of exp(tau*A) v in the Krylov space of dimension m: tau h_m+1,m |e_m^T exp(tau*H_m) e_1| */
+  double krylovError(const std::vector<double>& H, int m, double tau);
+  /* Evaluate y = beta V_m exp(tau*H_m) e_1 */
+  void krylovExp(Vec* V, const std::vector<double>& H, int m, double beta, double tau, Vec y);
+  /* Apply x = exp(dt*A) x (or exp(dt*A^T) x) in substeps. Returns the number of substeps. If keep_substates, stores the start of each substep. 
+   * Within a forward step started by beginForwardStep, the start of each substep is kept for the adjoint. */
+  int expmv(Mat A, double dt, Vec x, bool transpose, bool keep_substates);
+  /* Keep the substeps of the forward step starting at tstart, if all time steps are stored */
+  void beginForwardStep(double tstart);
+  /* States at the start of the substeps of the iexp-th exponential of the forward step starting at tstart from state x. Empty if they were not kept. */
+  void getSubstates(double tstart, int iexp, const Vec x, std::vector<Vec>& xs);
+  /* Adjoint of x = exp(dt*A) x, with A assembled as a combination of RHS(times[j]) with weights coeffs[j]: Update x_adj = exp(dt*A^T) x_adj. 
+   * If compute_gradient, add the derivative of x_adj^T exp(dt*A) x wrt the control parameters to grad, given the state x before the step 
+   * and the states xs at the start of its substeps (recomputed from x if empty). 
+   * This is the quadrature of the derivative of the exact exponential, not the derivative of the Krylov approximation: 
+   * It matches finite differences of the objective only up to krylov_tol. */
+  void expmvAdjoint(Mat A, double dt, const Vec x, const std::vector<Vec>& xs, Vec x_adj, const std::vector<double>& times, const std::vector<double>& coeffs, Vec grad, bool compute_gradient);
+
+  public:
+    KrylovExp(MasterEq* mastereq_, int ntime_, double total_time_, int krylov_maxdim_, double krylov_tol_, Output* output_, const StorageOptions& storage, int nbatch_ = 1);
+    ~KrylovExp();
+
+    /* Evolve state forward from tstart to tstop */
+    void evolveFWD(const double tstart, const double tstop, Vec x);
+    /* Evolve adjoint backward from tstop to tstart and update reduced gradient */
+    void evolveBWD(const double tstart, const double tstop, const Vec x_stop, Vec x_adj, Vec grad, bool compute_gradient);
+};
+
+
+/* 4th-order commutator-free Magnus integrator (Blanes & Moan, 2006):
+ *   x_n+1 = exp(h(a1 A(t1) + a2 A(t2))) exp(h(a2 A(t1) + a1 A(t2))) x_n, 
+ * with Gauss nodes t1,2 = t_n + (1/2 -+ sqrt(3)/6) h and weights a1,2 = 1/4 -+ sqrt(3)/6. 
+ * The two exponentials are applied with the Krylov machinery of KrylovExp. Stable for any dt, no linear solver. */
+class CFMagnus4 : public KrylovExp {
+
+  Vec x_stage;                      /* State after the first exponential, recomputed for the gradient if not kept */
+
+  public:
+    CFMagnus4(MasterEq* mastereq_, int ntime_, double total_time_, int krylov_maxdim_, double krylov_tol_, Output* output_, const StorageOptions& storage, int nbatch_ = 1);
+    ~CFMagnus4();
+
+    /* Evolve state forward from tstart to tstop */
+    void evolveFWD(const double tstart, const double tstop, Vec x);
+    /* Evolve adjoint backward from tstop to tstart and update reduced gradient */
+    void evolveBWD(const double tstart, const double tstop, const Vec x_stop, Vec x_adj, Vec grad, bool compute_gradient);
+};
 
 
 /*
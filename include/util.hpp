@@ -6,8 +6,43 @@
 
 #pragma once
 
-int getIndexReal(const int i); // Return storage index of Re(x[i]) (colocated: x[2*i], blocked: x[i])
-int getIndexImag(const int i); // Return storage index of Im(x[i]) (colocated: x[2*i+1], blocked: x[i+dim])
+/* Storage of the real-valued state x of the vectorized system with dim=N^2 complex entries:
+ * colocated x = [Re(x_0), Im(x_0), Re(x_1), Im(x_1), ...] (default), or 
+ * blocked   x = [Re(x); Im(x)] (compile with -DBLOCKED_STORAGE). */
+extern int storage_dim;  // Complex dimension dim of the state, locates Im(x) in blocked storage. Set once by the MasterEq.
+void setStorageDim(const int dim);
+
+inline int getIndexReal(const int i) { // Return storage index of Re(x[i]) (colocated: x[2*i], blocked: x[i])
+#ifdef BLOCKED_STORAGE
+  return i;
+#else
+  return 2*i;
+#endif
+}
+inline int getIndexImag(const int i) { // Return storage index of Im(x[i]) (colocated: x[2*i+1], blocked: x[i+dim])
+#ifdef BLOCKED_STORAGE
+  return i + storage_dim;
+#else
+  return 2*i + 1;
+#endif
+}
+
+/* PETSc log stages and events for the performance report. Registered by registerLogEvents() after PetscInitialize. */
+extern PetscLogStage STAGE_FORWARD, STAGE_ADJOINT;  // Forward and adjoint time integration
+extern PetscLogEvent EVENT_RHS;         // Application of the RHS (MatShell products)
+extern PetscLogEvent EVENT_LINSOLVE;    // Linear solves of the implicit time-steppers
+extern PetscLogEvent EVENT_CONTROL;     // Evaluation of the controls and their derivatives
+extern PetscLogEvent EVENT_GRADIENT;    // Accumulation of the gradient
+extern PetscLogEvent EVENT_OUTPUT;      // Writing output files
+extern PetscLogEvent EVENT_REDUCTION;   // MPI reductions of objective and gradient
+void registerLogEvents();
+
+/* Create index sets u=Re(x[i]), v=Im(x[i]) for the complex indices i = ilow, ..., ilow+n-1 of the state x. 
+ * For blocked storage, these are contiguous and VecGetSubVector does not copy. */
+void createReImIndexSets(const int n, const int ilow, IS* isu, IS* isv);
+
+/* Return the dot product of the local parts of x and y (no reduction over processors) */
+double localDot(const Vec x, const Vec y);
 
 /* Return the index of vectorized matrix element (row,col) with matrix dimension dim x dim */
 int getVecID(const int row, const int col, const int dim);
@@ -81,4 +116,16 @@ int getEigvals(const Mat A, const int neigvals, std::vector<double>& eigvals, st
 /* 
  * Test if A+iB is unitary (A and B should be real-valued!)
  */
-bool isUnitary(const Mat A, const Mat B);
\ No newline at end of file
+bool isUnitary(const Mat A, const Mat B);
+
+/* 
+ * Apply the exponential of a small dense matrix to a vector: v = exp(tau*H) v. 
+ * H is m x m, stored row-wise with leading dimension ldh. Taylor series on substeps with |tau*H| <= 1/2.
+ */
+void expmvDense(const int m, const double* H, const int ldh, const double tau, std::vector<double>& v);
+
+
+/* 
+ * Nodes and weights of the q-point Gauss-Legendre quadrature on [0,1]
+ */
+void getGaussLegendre(const int q, std::vector<double>& nodes, std::vector<double>& weights);
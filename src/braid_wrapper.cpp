@@ -174,7 +174,7 @@ braid_Int myBraidApp::Step(braid_Vector u_, braid_Vector ustop_, braid_Vector fs
 #ifdef SANITY_CHECK
     // printf("Performing check Hermitian, Trace... \n");
     /* Sanity check. Be careful: This is costly! */
-    if (tstop == total_time) 
+    if (tstop == total_time && !mastereq->schroedinger) 
     {
       printf("Trace check %f ...\n", tstop);
       PetscBool check;
@@ -203,7 +203,7 @@ braid_Int myBraidApp::Step(braid_Vector u_, braid_Vector ustop_, braid_Vector fs
     /* Add penalty term */
     if (_braid_CoreElt(core->GetCore(), max_levels) == 1 && timestepper->gamma_penalty > 1e-13) {
 
-      timestepper->penalty_integral += timestepper->penaltyIntegral(tstart, u->x);
+      timestepper->penalty_integral += timestepper->penaltyIntegral(tstart, timestepper->dt, u->x);
       // printf("%f %.8f %.8f\n", tstart, weight, penalty_integral); 
     }
 
@@ -515,7 +515,7 @@ braid_Int myAdjointBraidApp::Step(braid_Vector u_, braid_Vector ustop_, braid_Ve
 
   /* Derivative of penalty objective */
   if (_braid_CoreElt(core->GetCore(), max_levels) == 1 && timestepper->gamma_penalty > 1e-13) {
-    timestepper->penaltyIntegral_diff(tstop_orig, uprimal_tstop->x, u->x, Jbar);
+    timestepper->penaltyIntegral_diff(tstop_orig, timestepper->dt, uprimal_tstop->x, u->x, Jbar);
   }
 
 
@@ -571,6 +571,9 @@ Vec myAdjointBraidApp::PostProcess() {
     _braid_FCRelax(core->GetCore(), 0);
   }
 
+  /* Sum the gradient contributions of petsc's processors */
+  timestepper->reduceGradient();
+
   /* Close output files */
   output->closeDataFiles();
 
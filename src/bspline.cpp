@@ -16,6 +16,10 @@ ControlBasis::ControlBasis(int NBasis, double T, std::vector<double> carrier_fre
         tcenter[i] = dtknot * ( (i+1) - 1.5 );
     }
 
+    /* No carrier phases cached yet */
+    tphase = -1.0;
+    cos_omt.resize(carrier_freq.size(), 0.0);
+    sin_omt.resize(carrier_freq.size(), 0.0);
 }
 
 ControlBasis::~ControlBasis(){
@@ -27,13 +31,15 @@ ControlBasis::~ControlBasis(){
 double ControlBasis::evaluate(const double t, const std::vector<double>& coeff, const double ground_freq, const ControlType controltype){
 
     double sum = 0.0;
-    /* Sum over basis function */
-    for (int l=0; l<nbasis; l++) {
+    int nfreq = carrier_freq.size();
+    /* Sum over the basis functions that are nonzero at t */
+    int lstart = firstActive(t);
+    for (int l=lstart; l<std::min(lstart+3, nbasis); l++) {
         double Blt = basisfunction(l,t);
         /* Sum over carrier wave frequencies */
-        for (int f=0; f < carrier_freq.size(); f++) {
-            double alpha1 = coeff[l*carrier_freq.size()*2 + f*2];
-            double alpha2 = coeff[l*carrier_freq.size()*2 + f*2 + 1];
+        for (int f=0; f < nfreq; f++) {
+            double alpha1 = coeff[l*nfreq*2 + f*2];
+            double alpha2 = coeff[l*nfreq*2 + f*2 + 1];
             double cos_omt = cos(carrier_freq[f]*t);
             double sin_omt = sin(carrier_freq[f]*t);
             switch (controltype) {
@@ -57,26 +63,75 @@ double ControlBasis::evaluate(const double t, const std::vector<double>& coeff,
     return sum;
 }
 
-void ControlBasis::derivative(const double t, double* coeff_diff, const double valbar, const ControlType controltype) {
+void ControlBasis::evaluate(const double t, const std::vector<double>& coeff, double* Re, double* Im){
+
+    int nfreq = carrier_freq.size();
+    setCarrierPhases(t);
+
+    /* Sum over the carrier waves of the splines that are nonzero at t: p + iq = sum_f (sum_l B_l (alpha1 + i alpha2)) e^{i omega_f t} */
+    double sumRe = 0.0;
+    double sumIm = 0.0;
+    int lstart = firstActive(t);
+    int lstop = std::min(lstart+3, nbasis);
+    for (int f=0; f < nfreq; f++) {
+        double a1 = 0.0;
+        double a2 = 0.0;
+        for (int l=lstart; l<lstop; l++) {
+            double Blt = basisfunction(l,t);
+            a1 += coeff[l*nfreq*2 + f*2]     * Blt;
+            a2 += coeff[l*nfreq*2 + f*2 + 1] * Blt;
+        }
+        sumRe += a1 * cos_omt[f] - a2 * sin_omt[f];
+        sumIm += a1 * sin_omt[f] + a2 * cos_omt[f];
+    }
+
+    *Re = sumRe;
+    *Im = sumIm;
+}
 
-    /* Iterate over basis function */
-    for (int l=0; l<nbasis; l++) {
+void ControlBasis::derivative(const double t, double* dRedp, double* dImdp, const double Rebar, const double Imbar) {
+
+    int nfreq = carrier_freq.size();
+    setCarrierPhases(t);
+
+    /* Iterate over the basis functions that are nonzero at t */
+    int lstart = firstActive(t);
+    for (int l=lstart; l<std::min(lstart+3, nbasis); l++) {
         double basis = basisfunction(l, t); 
         /* Iterate over carrier frequencies */
-        for (int f=0; f < carrier_freq.size(); f++) {
-            double freq = carrier_freq[f] * t;
-            int coeff_id = l * carrier_freq.size() * 2 + f * 2;
-            if (controltype == ControlType::RE) {
-                coeff_diff[coeff_id]     +=   basis * cos(freq) * valbar;
-                coeff_diff[coeff_id + 1] += - basis * sin(freq) * valbar;
-            } else {
-                coeff_diff[coeff_id]     += basis * sin(freq) * valbar;
-                coeff_diff[coeff_id + 1] += basis * cos(freq) * valbar;
-            }
+        for (int f=0; f < nfreq; f++) {
+            int coeff_id = l * nfreq * 2 + f * 2;
+            dRedp[coeff_id]     +=   basis * cos_omt[f] * Rebar;
+            dRedp[coeff_id + 1] += - basis * sin_omt[f] * Rebar;
+            dImdp[coeff_id]     +=   basis * sin_omt[f] * Imbar;
+            dImdp[coeff_id + 1] +=   basis * cos_omt[f] * Imbar;
         }
     }
 }
 
+void ControlBasis::getActiveCoeffs(const double t, int* first, int* n){
+    int nfreq = carrier_freq.size();
+    int lstart = firstActive(t);
+    int lstop = std::min(lstart+3, nbasis);
+    *first = lstart * nfreq * 2;
+    *n = std::max(lstop - lstart, 0) * nfreq * 2;
+}
+
+int ControlBasis::firstActive(double t){
+    /* Splines l with support [(l-2)*dtknot, (l+1)*dtknot) */
+    int k = (int) floor(t / dtknot);
+    return std::max(k, 0);
+}
+
+void ControlBasis::setCarrierPhases(double t){
+    if (t == tphase) return;
+    for (int f=0; f < carrier_freq.size(); f++) {
+        cos_omt[f] = cos(carrier_freq[f]*t);
+        sin_omt[f] = sin(carrier_freq[f]*t);
+    }
+    tphase = t;
+}
+
 double ControlBasis::basisfunction(int id, double t){
 
     /* compute scaled time tau = (t-tcenter[k])  */
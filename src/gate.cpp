@@ -39,41 +39,37 @@ Gate::Gate(std::vector<int> nlevels_, std::vector<int> nessential_, double time_
   MatAssemblyEnd(V_re, MAT_FINAL_ASSEMBLY);
   MatAssemblyEnd(V_im, MAT_FINAL_ASSEMBLY);
 
-  /* Allocate vectorized Gate in full dimensions G = VxV, where V is the full-dimension gate (inserting zero rows and colums for all non-essential levels) */ 
-  // parallel matrix, essential levels dimension TODO: Preallocate!
-  MatCreate(PETSC_COMM_WORLD, &VxV_re);
-  MatCreate(PETSC_COMM_WORLD, &VxV_im);
-  MatSetSizes(VxV_re, PETSC_DECIDE, PETSC_DECIDE, dim_rho*dim_rho, dim_rho*dim_rho);
-  MatSetSizes(VxV_im, PETSC_DECIDE, PETSC_DECIDE, dim_rho*dim_rho, dim_rho*dim_rho);
-  MatSetUp(VxV_re);
-  MatSetUp(VxV_im);
-  MatAssemblyBegin(VxV_re, MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd(VxV_re, MAT_FINAL_ASSEMBLY);
-  MatAssemblyBegin(VxV_im, MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd(VxV_im, MAT_FINAL_ASSEMBLY);
-
-  /* Allocate auxiliare vectors */
-  MatCreateVecs(VxV_re, &x, NULL);
-
-
-  /* Create vector strides for accessing real and imaginary part of co-located state */
-  PetscInt ilow, iupp;
-  MatGetOwnershipRange(VxV_re, &ilow, &iupp);
-  PetscInt dimis = iupp - ilow;
-  ISCreateStride(PETSC_COMM_WORLD, dimis, 2*ilow, 2, &isu);
-  ISCreateStride(PETSC_COMM_WORLD, dimis, 2*ilow+1, 2, &isv);
- 
+  /* The vectorized gate (Lindblad solver) and the full-dimension gate (Schroedinger mode) are assembled on first use */
+  VxV_re = NULL;
+  VxV_im = NULL;
+  x = NULL;
+  isu = NULL;
+  isv = NULL;
+  Vf_re = NULL;
+  Vf_im = NULL;
+  xf = NULL;
+  isuf = NULL;
+  isvf = NULL;
 }
 
 Gate::~Gate(){
   if (dim_rho == 0) return;
-  MatDestroy(&VxV_re);
-  MatDestroy(&VxV_im);
   MatDestroy(&V_re);
   MatDestroy(&V_im);
-  VecDestroy(&x);
-  ISDestroy(&isu);
-  ISDestroy(&isv);
+  if (VxV_re != NULL) {
+    MatDestroy(&VxV_re);
+    MatDestroy(&VxV_im);
+    VecDestroy(&x);
+    ISDestroy(&isu);
+    ISDestroy(&isv);
+  }
+  if (Vf_re != NULL) {
+    MatDestroy(&Vf_re);
+    MatDestroy(&Vf_im);
+    VecDestroy(&xf);
+    ISDestroy(&isuf);
+    ISDestroy(&isvf);
+  }
 }
 
 void Gate::assembleGate(){
@@ -134,12 +130,36 @@ void Gate::assembleGate(){
   } 
   else printf("Rotated Gate is unitary.\n");
 #endif
+}
 
 
-  /* Assemble vectorized gate G=V\kron V where V = PV_eP^T for essential dimension gate V_e (user input) and projection P lifting V_e to the full dimension by inserting identity blocks for non-essential levels. */
-  // Each element in V\kron V is a product V(i,j)*V(r,c), for rows and columns i,j,r,c!
+void Gate::assembleVxV(){
+
+  /* Allocate vectorized Gate in full dimensions G = VxV, where V is the full-dimension gate (inserting zero rows and colums for all non-essential levels) */ 
+  // parallel matrix, essential levels dimension TODO: Preallocate!
+  MatCreate(PETSC_COMM_WORLD, &VxV_re);
+  MatCreate(PETSC_COMM_WORLD, &VxV_im);
+  MatSetSizes(VxV_re, PETSC_DECIDE, PETSC_DECIDE, dim_rho*dim_rho, dim_rho*dim_rho);
+  MatSetSizes(VxV_im, PETSC_DECIDE, PETSC_DECIDE, dim_rho*dim_rho, dim_rho*dim_rho);
+  MatSetUp(VxV_re);
+  MatSetUp(VxV_im);
+  MatAssemblyBegin(VxV_re, MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(VxV_re, MAT_FINAL_ASSEMBLY);
+  MatAssemblyBegin(VxV_im, MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(VxV_im, MAT_FINAL_ASSEMBLY);
+
+  /* Allocate auxiliare vectors */
+  MatCreateVecs(VxV_re, &x, NULL);
+
+
+  /* Create vector strides for accessing real and imaginary part of the state */
   PetscInt ilow, iupp;
   MatGetOwnershipRange(VxV_re, &ilow, &iupp);
+  PetscInt dimis = iupp - ilow;
+  createReImIndexSets(dimis, ilow, &isu, &isv);
+
+  /* Assemble vectorized gate G=V\kron V where V = PV_eP^T for essential dimension gate V_e (user input) and projection P lifting V_e to the full dimension by inserting identity blocks for non-essential levels. */
+  // Each element in V\kron V is a product V(i,j)*V(r,c), for rows and columns i,j,r,c!
   double val;
   double vre_ij, vim_ij;
   double vre_rc, vim_rc;
@@ -216,7 +236,43 @@ void Gate::assembleGate(){
   MatAssemblyEnd(VxV_re, MAT_FINAL_ASSEMBLY);
   MatAssemblyBegin(VxV_im, MAT_FINAL_ASSEMBLY);
   MatAssemblyEnd(VxV_im, MAT_FINAL_ASSEMBLY);
+}
+
+
+void Gate::assembleVfull(){
+
+  /* Allocate full-dimension gate V = PV_eP^T, parallel matrix with the same distribution as the state vector */
+  MatCreate(PETSC_COMM_WORLD, &Vf_re);
+  MatCreate(PETSC_COMM_WORLD, &Vf_im);
+  MatSetSizes(Vf_re, PETSC_DECIDE, PETSC_DECIDE, dim_rho, dim_rho);
+  MatSetSizes(Vf_im, PETSC_DECIDE, PETSC_DECIDE, dim_rho, dim_rho);
+  MatSetUp(Vf_re);
+  MatSetUp(Vf_im);
+  MatCreateVecs(Vf_re, &xf, NULL);
+  PetscInt ilow, iupp;
+  MatGetOwnershipRange(Vf_re, &ilow, &iupp);
+  createReImIndexSets(iupp - ilow, ilow, &isuf, &isvf);
 
+  /* Lift V_e to the full dimension, inserting identity for the non-essential levels */
+  for (PetscInt row_f = ilow; row_f < iupp; row_f++) {
+    if (isEssential(row_f, nlevels, nessential)) {
+      PetscInt row_e = mapFullToEss(row_f, nlevels, nessential);
+      for (PetscInt col_e = 0; col_e < dim_ess; col_e++) {
+        PetscInt col_f = mapEssToFull(col_e, nlevels, nessential);
+        double vre = 0.0, vim = 0.0;
+        MatGetValues(V_re, 1, &row_e, 1, &col_e, &vre);
+        MatGetValues(V_im, 1, &row_e, 1, &col_e, &vim);
+        if (fabs(vre) > 1e-14) MatSetValue(Vf_re, row_f, col_f, vre, INSERT_VALUES);
+        if (fabs(vim) > 1e-14) MatSetValue(Vf_im, row_f, col_f, vim, INSERT_VALUES);
+      }
+    } else {
+      MatSetValue(Vf_re, row_f, row_f, 1.0, INSERT_VALUES);
+    }
+  }
+  MatAssemblyBegin(Vf_re, MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(Vf_re, MAT_FINAL_ASSEMBLY);
+  MatAssemblyBegin(Vf_im, MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(Vf_im, MAT_FINAL_ASSEMBLY);
 }
 
 
@@ -224,6 +280,7 @@ void Gate::assembleGate(){
 void Gate::applyGate(const Vec state, Vec VrhoV){
   /* Exit, if this is a dummy gate */
   if (dim_rho == 0) return;
+  if (VxV_re == NULL) assembleVxV();
 
   /* Get real and imag part of the state q = u + iv */
   Vec u, v;
@@ -247,6 +304,33 @@ void Gate::applyGate(const Vec state, Vec VrhoV){
 }
 
 
+void Gate::applyGateVector(const Vec psi, Vec Vpsi){
+  /* Exit, if this is a dummy gate */
+  if (dim_rho == 0) return;
+  if (Vf_re == NULL) assembleVfull();
+
+  /* Get real and imag part of the state psi = u + iv */
+  Vec u, v;
+  VecGetSubVector(psi, isuf, &u);
+  VecGetSubVector(psi, isvf, &v);
+
+  /* (a) Real part Re(V psi) = V_re u - V_im v */
+  MatMult(Vf_im, v, xf);
+  VecScale(xf, -1.0);
+  MatMultAdd(Vf_re, u, xf, xf);
+  VecISCopy(Vpsi, isuf, SCATTER_FORWARD, xf);
+
+  /* (b) Imaginary part Im(V psi) = V_re v + V_im u */
+  MatMult(Vf_re, v, xf);
+  MatMultAdd(Vf_im, u, xf, xf);
+  VecISCopy(Vpsi, isvf, SCATTER_FORWARD, xf);
+
+  /* Restore psi from index set */
+  VecRestoreSubVector(psi, isuf, &u);
+  VecRestoreSubVector(psi, isvf, &v);
+}
+
+
 XGate::XGate(std::vector<int> nlevels, std::vector<int> nessential, double time, std::vector<double> gate_rot_freq) : Gate(nlevels, nessential, time, gate_rot_freq) {
 
   assert(dim_ess == 2);
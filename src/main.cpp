@@ -13,6 +13,9 @@
 #ifdef WITH_SLEPC
 #include <slepceps.h>
 #endif
+#ifdef WITH_OPENMP
+#include <omp.h>
+#endif
 
 
 #define TEST_FD_GRAD 0    // Run Finite Differences gradient test
@@ -169,6 +172,14 @@ int main(int argc,char **argv)
 #endif
   std::cout<< std::endl;
 
+#ifdef BLOCKED_STORAGE
+  /* Blocked storage locates Im(x) by the global dimension, which doesn't fit Petsc's parallel distribution */
+  if (mpisize_petsc > 1) {
+    if (mpirank_world == 0) printf("\n ERROR: Blocked storage of the state [Re(x); Im(x)] is not available with Petsc's parallel distribution (np_petsc=%d).\n", mpisize_petsc);
+    exit(1);
+  }
+#endif
+
   /* Initialize Petsc using petsc's communicator */
   PETSC_COMM_WORLD = comm_petsc;
 #ifdef WITH_SLEPC
@@ -177,6 +188,7 @@ int main(int argc,char **argv)
   ierr = PetscInitialize(&argc,&argv,(char*)0,NULL);if (ierr) return ierr;
 #endif
   PetscViewerPushFormat(PETSC_VIEWER_STDOUT_WORLD, 	PETSC_VIEWER_ASCII_MATLAB );
+  registerLogEvents();
 
 
 
@@ -269,15 +281,8 @@ int main(int argc,char **argv)
   for (int i = Jkl.size(); i < (noscillators-1) * noscillators / 2; i++) Jkl.push_back(0.0);
   // Sanity check for matrix free solver
   bool usematfree = config.GetBoolParam("usematfree", false);
-  if ( (usematfree && nlevels.size() < 2) ||   
-       (usematfree && nlevels.size() > 5)   ){
-        printf("Warning: Matrix free solver is only implemented for systems with 2, 3, 4, or 5 oscillators. Switching to sparse-matrix solver now.\n");
-        usematfree = false;
-  }
-  if (usematfree && mpisize_petsc > 1) {
-    printf("ERROR: No Petsc-parallel version for the matrix free solver available!");
-    exit(1);
-  }
+  bool matfree_vectorized = config.GetBoolParam("matfree_vectorized", false);
+  bool schroedinger = config.GetBoolParam("schroedinger", false);
   // Compute coupling rotation frequencies eta_ij = w^r_i - w^r_j
   std::vector<double> eta(nlevels.size()*(nlevels.size()-1)/2.);
   int idx = 0;
@@ -287,7 +292,7 @@ int main(int argc,char **argv)
       idx++;
     }
   }
-  MasterEq* mastereq = new MasterEq(nlevels, nessential, oscil_vec, crosskerr, Jkl, eta, lindbladtype, usematfree);
+  MasterEq* mastereq = new MasterEq(nlevels, nessential, oscil_vec, crosskerr, Jkl, eta, lindbladtype, usematfree, matfree_vectorized, schroedinger);
 
 
   /* Output */
@@ -312,6 +317,9 @@ int main(int argc,char **argv)
       if (i < nlevels.size()-1) std::cout<< "x";
     }
     std::cout << std::endl;
+#ifdef WITH_OPENMP
+    if (usematfree) std::cout << "Matrix-free solver using " << omp_get_max_threads() << " OpenMP threads" << std::endl;
+#endif
   }
 
   /* --- Initialize the time-stepper --- */
@@ -320,21 +328,105 @@ int main(int argc,char **argv)
   int linsolve_maxiter = config.GetIntParam("linearsolver_maxiter", 10);
   if      (linsolvestr.compare("gmres")   == 0) linsolvetype = LinearSolverType::GMRES;
   else if (linsolvestr.compare("neumann") == 0) linsolvetype = LinearSolverType::NEUMANN;
+  else if (linsolvestr.compare("chebyshev") == 0) linsolvetype = LinearSolverType::CHEBYSHEV;
+  else if (linsolvestr.compare("chebyshev_fixed") == 0) linsolvetype = LinearSolverType::CHEBYSHEV_FIXED;
   else {
     printf("\n\n ERROR: Unknown linear solver type: %s.\n\n", linsolvestr.c_str());
     exit(1);
   }
+  bool linsolve_warmstart = config.GetBoolParam("linearsolver_warmstart", false);
+  PreconditionerType precondtype;
+  std::string precondstr = config.GetStrParam("linearsolver_preconditioner", "none");
+  if      (precondstr.compare("none")     == 0) precondtype = PreconditionerType::NONE;
+  else if (precondstr.compare("diagonal") == 0) precondtype = PreconditionerType::DIAGONAL;
+  else {
+    printf("\n\n ERROR: Unknown preconditioner: %s.\n\n", precondstr.c_str());
+    exit(1);
+  }
   /* My time stepper */
-  bool storeFWD = false;
-  if (runtype == RunType::GRADIENT || runtype == RunType::OPTIMIZATION) storeFWD = true;
+  StorageOptions storage;
+  if (runtype == RunType::GRADIENT || runtype == RunType::OPTIMIZATION) storage.storeFWD = true;
 #if TEST_FD_GRAD
-  storeFWD = true;
+  storage.storeFWD = true;
 #endif
 #if TEST_FD_HESS
-  storeFWD = true;
+  storage.storeFWD = true;
+#endif
+  storage.hermitian = config.GetBoolParam("store_hermitian", false);
+  if (storage.hermitian && initcondstr[0].compare("file") == 0) {
+    printf("ERROR: Hermitian-packed storage (store_hermitian = true) requires Hermitian initial conditions, which are not guaranteed for initialcondition = file.\n");
+    exit(1);
+  }
+  /* Number of initial conditions that are propagated simultaneously, at most the local number of initial conditions */
+  int nbatch = config.GetIntParam("nbatch", 1);
+  nbatch = max(1, min(nbatch, ninit / np_init));
+#ifdef WITH_BRAID
+  if (nbatch > 1) {
+    printf("ERROR: Batched propagation of initial conditions (nbatch > 1) is not available with XBraid.\n");
+    exit(1);
+  }
 #endif
-  TimeStepper *mytimestepper = new ImplMidpoint(mastereq, ntime, total_time, linsolvetype, linsolve_maxiter, output, storeFWD);
-  // TimeStepper *mytimestepper = new ExplEuler(mastereq, ntime, total_time, output, storeFWD);
+  if (nbatch > 1) mastereq->initBatch(nbatch);
+  /* Number of states stored for the adjoint (binomial checkpointing). 0 stores all time steps. */
+  storage.ncheckpoints = config.GetIntParam("checkpoints", 0);
+  /* Directory for a memory-mapped file holding the stored states. Empty if they are kept in memory. */
+  storage.scratchdir = config.GetStrParam("store_scratchdir", "none");
+  if (storage.scratchdir.compare("none") == 0) storage.scratchdir = "";
+  /* Compression of the stored states */
+  std::string storecompressionstr = config.GetStrParam("store_compression", "none");
+  storage.compression_tol = config.GetDoubleParam("store_compression_tol", 1e-10);
+  if      (storecompressionstr.compare("none")   == 0) storage.compression = StoreCompression::NONE;
+  else if (storecompressionstr.compare("single") == 0) storage.compression = StoreCompression::SINGLE;
+  else if (storecompressionstr.compare("delta")  == 0) storage.compression = StoreCompression::DELTA;
+  else {
+    printf("\n\n ERROR: Unknown compression of stored states: %s.\n\n", storecompressionstr.c_str());
+    exit(1);
+  }
+  std::string timestepperstr = config.GetStrParam("timestepper", "IMR");
+  /* Store the stages of the Gauss-Legendre steps for the adjoint */
+  storage.stages = config.GetBoolParam("store_stages", false);
+  if (storage.stages) {
+#ifdef WITH_BRAID
+    printf("ERROR: Storing the time-stepper stages (store_stages = true) is not available with XBraid.\n");
+    exit(1);
+#endif
+    if (timestepperstr.compare("GL2") != 0 && timestepperstr.compare("GL3") != 0) {
+      printf("ERROR: Storing the time-stepper stages (store_stages = true) is only available for the Gauss-Legendre time-steppers. IMR obtains its stage from the stored states.\n");
+      exit(1);
+    }
+  }
+  TimeStepper *mytimestepper;
+  if      (timestepperstr.compare("IMR") == 0) mytimestepper = new ImplMidpoint(mastereq, ntime, total_time, linsolvetype, linsolve_maxiter, precondtype, linsolve_warmstart, output, storage, nbatch);
+  else if (timestepperstr.compare("GL2") == 0) mytimestepper = new GaussLegendre(mastereq, ntime, total_time, 2, linsolvetype, linsolve_maxiter, output, storage, nbatch);
+  else if (timestepperstr.compare("GL3") == 0) mytimestepper = new GaussLegendre(mastereq, ntime, total_time, 3, linsolvetype, linsolve_maxiter, output, storage, nbatch);
+  else if (timestepperstr.compare("EE")  == 0) mytimestepper = new ExplEuler(mastereq, ntime, total_time, output, storage, nbatch);
+  else if (timestepperstr.compare("EXP") == 0) {
+    int krylov_maxdim = config.GetIntParam("krylov_maxdim", 30);
+    double krylov_tol = config.GetDoubleParam("krylov_tol", 1e-10);
+    mytimestepper = new KrylovExp(mastereq, ntime, total_time, krylov_maxdim, krylov_tol, output, storage, nbatch);
+  }
+  else if (timestepperstr.compare("CFM4") == 0) {
+    int krylov_maxdim = config.GetIntParam("krylov_maxdim", 30);
+    double krylov_tol = config.GetDoubleParam("krylov_tol", 1e-10);
+    mytimestepper = new CFMagnus4(mastereq, ntime, total_time, krylov_maxdim, krylov_tol, output, storage, nbatch);
+  }
+  else {
+    printf("\n\n ERROR: Unknown time-stepper: %s.\n\n", timestepperstr.c_str());
+    exit(1);
+  }
+  /* Adaptive time stepping: dt is the initial step size */
+  double adaptive_tol = config.GetDoubleParam("timestepper_adaptive_tol", 0.0);
+  if (adaptive_tol > 0.0) {
+#ifdef WITH_BRAID
+    printf("ERROR: Adaptive time stepping is not available with XBraid.\n");
+    exit(1);
+#endif
+    if (timestepperstr.compare("EE") == 0 || timestepperstr.compare("EXP") == 0 || timestepperstr.compare("CFM4") == 0) {
+      printf("ERROR: Adaptive time stepping is not available for the %s time-stepper.\n", timestepperstr.c_str());
+      exit(1);
+    }
+    mytimestepper->setAdaptive(adaptive_tol);
+  }
 
   // /* Petsc's Time-stepper */
   // Vec x;
@@ -426,6 +518,22 @@ int main(int argc,char **argv)
       printf("\nGradient norm: %1.14e\n", gnorm);
     }
     optimctx->output->writeGradient(grad);
+
+    /* Compressed storage of the states: Report the gradient error against a run that stores them uncompressed */
+    if (mytimestepper->getStoreCompression() != StoreCompression::NONE) {
+      Vec grad_ref;
+      VecDuplicate(grad, &grad_ref);
+      StoreCompression compression = mytimestepper->getStoreCompression();
+      mytimestepper->setStoreCompression(StoreCompression::NONE);
+      optimctx->evalGradF(xinit, grad_ref);
+      mytimestepper->setStoreCompression(compression);
+      double gnorm_ref, gerr;
+      VecNorm(grad_ref, NORM_2, &gnorm_ref);
+      VecAXPY(grad_ref, -1.0, grad);
+      VecNorm(grad_ref, NORM_2, &gerr);
+      if (mpirank_world == 0) printf("Gradient error of compressed storage: ||g - g_uncompressed|| = %1.4e, relative %1.4e\n", gerr, gerr / gnorm_ref);
+      VecDestroy(&grad_ref);
+    }
   }
 
   /* --- Solve the optimization  --- */
@@ -458,6 +566,7 @@ int main(int argc,char **argv)
     printf(" Used Time:        %.2f seconds\n", UsedTime);
     printf(" Global Memory:    %.2f MB\n", globalMB);
     printf(" Processors used:  %d\n", mpisize_world);
+    if (adaptive_tol > 0.0) printf(" Time steps:       %d (%d rejected)\n", mytimestepper->nsteps, mytimestepper->nrejected);
     printf("\n");
   }
   // printf("Rank %d: %.2fMB\n", mpirank_world, myMB );
@@ -470,6 +579,9 @@ int main(int argc,char **argv)
     fclose(timefile);
   }
 
+  /* Write performance report */
+  output->writePerformanceReport(UsedTime, globalMB, mytimestepper->iter_histogram);
+
 
 #if TEST_FD_GRAD
   if (mpirank_world == 0)  {
@@ -14,10 +14,13 @@ MasterEq::MasterEq(){
   dRedp = NULL;
   dImdp = NULL;
   usematfree = false;
+  matfree_vectorized = false;
+  schroedinger = false;
+  nbatch = 1;
 }
 
 
-MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Oscillator** oscil_vec_, const std::vector<double> crosskerr_, const std::vector<double> Jkl_, const std::vector<double> eta_, LindbladType lindbladtype, bool usematfree_) {
+MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Oscillator** oscil_vec_, const std::vector<double> crosskerr_, const std::vector<double> Jkl_, const std::vector<double> eta_, LindbladType lindbladtype, bool usematfree_, bool matfree_vectorized_, bool schroedinger_) {
   int ierr;
 
   nlevels = nlevels_;
@@ -28,6 +31,9 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
   Jkl = Jkl_;
   eta = eta_;
   usematfree = usematfree_;
+  matfree_vectorized = matfree_vectorized_;
+  schroedinger = schroedinger_;
+  nbatch = 1;
 
   for (int i=0; i<crosskerr.size(); i++){
     crosskerr[i] *= 2.*M_PI;
@@ -39,7 +45,6 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
     eta[i] *= 2.*M_PI;
   }
 
-  int mpisize_petsc;
   MPI_Comm_size(PETSC_COMM_WORLD, &mpisize_petsc);
   MPI_Comm_rank(PETSC_COMM_WORLD, &mpirank_petsc);
   MPI_Comm_rank(MPI_COMM_WORLD, &mpirank_world);
@@ -51,12 +56,27 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
     dim_rho *= oscil_vec[iosc]->getNLevels();
     dim_ess *= nessential[iosc];
   }
-  dim = dim_rho*dim_rho; // density matrix: N \times N -> vectorized: N^2
-  if (mpirank_world == 0) printf("System dimension (complex) N^2 = %d\n",dim);
+  if (schroedinger) {
+    dim = dim_rho; // state vector psi: N
+    if (mpirank_world == 0) printf("System dimension (complex) N = %d (Schroedinger mode)\n",dim);
+  } else {
+    dim = dim_rho*dim_rho; // density matrix: N \times N -> vectorized: N^2
+    if (mpirank_world == 0) printf("System dimension (complex) N^2 = %d\n",dim);
+  }
+  setStorageDim(dim);
 
   /* Sanity check for parallel petsc */
   if (dim % mpisize_petsc != 0) {
-    printf("\n ERROR in parallel distribution: Petsc's communicator size (%d) must be integer multiple of system dimension N^2=%d\n", mpisize_petsc, dim);
+    printf("\n ERROR in parallel distribution: Petsc's communicator size (%d) must be integer multiple of system dimension %d\n", mpisize_petsc, dim);
+    exit(1);
+  }
+  /* Sanity check for Schroedinger mode: closed systems only, matrix-free solver only */
+  if (schroedinger && lindbladtype != LindbladType::NONE) {
+    printf("\n ERROR: Schroedinger mode evolves state vectors and requires collapse_type = none.\n");
+    exit(1);
+  }
+  if (schroedinger && !usematfree) {
+    printf("\n ERROR: Schroedinger mode is only available with the matrix-free solver (usematfree = true).\n");
     exit(1);
   }
 
@@ -70,6 +90,8 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
   /* Check Lindblad collapse operator configuration */
   switch (lindbladtype)  {
     case LindbladType::NONE:
+      addT1 = false;
+      addT2 = false;
       break;
     case LindbladType::DECAY: 
       addT1 = true;
@@ -86,7 +108,7 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
     default:
       printf("ERROR! Wrong lindblad type: %d\n", lindbladtype);
       exit(1);
-  } 
+  }
 
   if (!usematfree) {
     initSparseMatSolver();
@@ -96,8 +118,83 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
   PetscInt ilow, iupp;
   MatGetOwnershipRange(RHS, &ilow, &iupp);
   int dimis = (iupp - ilow)/2;
-  ISCreateStride(PETSC_COMM_WORLD, dimis, ilow, 2, &isu);
-  ISCreateStride(PETSC_COMM_WORLD, dimis, ilow+1, 2, &isv);
+  createReImIndexSets(dimis, ilow/2, &isu, &isv);
+
+  /* For the distributed matrix-free solver: Create a scatter that gathers the locally owned part of x 
+   * together with the halo of the stencils. The furthest access is i0p+1,i0+1 (L1 decay on oscillator 0), 
+   * hence the halo is one slab of the outermost tensor index i0p plus one i0-stride on either side. In Schroedinger 
+   * mode, the furthest access is i0+1, hence the halo is one i0-stride. */
+  RHSctx.it_low = ilow/2;
+  RHSctx.it_upp = iupp/2;
+  RHSctx.halo_low = 0;
+  RHSctx.scat_halo = NULL;
+  RHSctx.xhalo = NULL;
+  if (usematfree && mpisize_petsc > 1) {
+    int halo = dim_rho * oscil_vec[0]->dim_postOsc + oscil_vec[0]->dim_postOsc;
+    if (schroedinger) halo = oscil_vec[0]->dim_postOsc;
+    int halo_low = std::max(ilow/2 - halo, 0);
+    int halo_upp = std::min(iupp/2 + halo, dim);
+    Vec xtmp;
+    IS ishalo;
+    MatCreateVecs(RHS, &xtmp, NULL);
+    VecCreateSeq(PETSC_COMM_SELF, 2*(halo_upp - halo_low), &xhalo);
+    ISCreateStride(PETSC_COMM_SELF, 2*(halo_upp - halo_low), 2*halo_low, 1, &ishalo);
+    VecScatterCreate(xtmp, ishalo, xhalo, NULL, &scat_halo);
+    ISDestroy(&ishalo);
+    VecDestroy(&xtmp);
+    RHSctx.halo_low = halo_low;
+    RHSctx.scat_halo = &scat_halo;
+    RHSctx.xhalo = &xhalo;
+  }
+
+  /* For the matrix-free solver: Precompute the time-independent diagonal of the RHS on the local range,
+   * diag(it) = (l2 + l1diag)(ik,ik') - i (hd(ik) - hd(ik')), as well as the ladder factors sqrt(0..nmax). 
+   * In Schroedinger mode, diag(it) = -i hd(ik). */
+  RHSctx.diag = NULL;
+  if (usematfree) {
+    MatCreateVecs(RHS, &diag, NULL);
+    std::vector<double> hd(dim_rho, 0.0);
+    std::vector<int> i(noscillators);
+    for (int row = 0; row < dim_rho; row++) {
+      for (int k = 0; k < noscillators; k++) i[k] = (row / oscil_vec[k]->dim_postOsc) % nlevels[k];
+      int kl = 0;
+      for (int k = 0; k < noscillators; k++) {
+        hd[row] += oscil_vec[k]->getDetuning() * i[k] - oscil_vec[k]->getSelfkerr() / 2.0 * i[k] * (i[k]-1);
+        for (int l = k+1; l < noscillators; l++) {
+          hd[row] -= crosskerr[kl] * i[k] * i[l];
+          kl++;
+        }
+      }
+    }
+    double* diagptr;
+    VecGetArray(diag, &diagptr);
+    for (int it = ilow/2; it < iupp/2; it++) {
+      if (schroedinger) {
+        diagptr[getIndexReal(it - ilow/2)] = 0.0;
+        diagptr[getIndexImag(it - ilow/2)] = -hd[it];
+        continue;
+      }
+      int row = it % dim_rho;
+      int col = it / dim_rho;
+      double l2l1diag = 0.0;
+      for (int k = 0; k < noscillators; k++) {
+        int ik  = (row / oscil_vec[k]->dim_postOsc) % nlevels[k];
+        int ikp = (col / oscil_vec[k]->dim_postOsc) % nlevels[k];
+        if (addT2 && oscil_vec[k]->getDephaseTime() > 1e-14) 
+          l2l1diag += 1./oscil_vec[k]->getDephaseTime() * ( ik*ikp - 1./2. * (ik*ik + ikp*ikp) );
+        if (addT1 && oscil_vec[k]->getDecayTime() > 1e-14) 
+          l2l1diag -= 1./oscil_vec[k]->getDecayTime() / 2.0 * ( ik + ikp );
+      }
+      diagptr[getIndexReal(it - ilow/2)]   = l2l1diag;
+      diagptr[getIndexImag(it - ilow/2)] = -(hd[row] - hd[col]);
+    }
+    VecRestoreArray(diag, &diagptr);
+    RHSctx.diag = &diag;
+
+    int nmax = *std::max_element(nlevels.begin(), nlevels.end());
+    RHSctx.sqrtn.resize(nmax+1);
+    for (int l = 0; l <= nmax; l++) RHSctx.sqrtn[l] = sqrt(l);
+  }
 
   /* Compute maximum number of design parameters over all oscillators */
   nparams_max = 0;
@@ -109,8 +206,6 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
   /* Allocate some auxiliary vectors */
   dRedp = new double[nparams_max];
   dImdp = new double[nparams_max];
-  cols = new PetscInt[nparams_max];
-  vals = new PetscScalar[nparams_max];
 
   /* Allocate MatShell context for applying RHS */
   RHSctx.isu = &isu;
@@ -131,36 +226,52 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
   }
   RHSctx.nlevels = nlevels;
   RHSctx.oscil_vec = oscil_vec;
+  RHSctx.schroedinger = schroedinger;
+  RHSctx.nbatch = 1;
   RHSctx.time = 0.0;
   for (int iosc = 0; iosc < noscillators; iosc++) {
     RHSctx.control_Re.push_back(0.0);
     RHSctx.control_Im.push_back(0.0);
   }
 
-  /* Set the MatMult routine for applying the RHS to a vector x */
+  /* Set the MatMult kernels for applying the RHS to a vector x */
   if (usematfree) { // matrix-free solver
-    if (noscillators == 2) {
-      MatShellSetOperation(RHS, MATOP_MULT, (void(*)(void)) myMatMult_matfree_2Osc);
-      MatShellSetOperation(RHS, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_matfree_2Osc);
+    if (schroedinger) {
+      RHSctx.mult  = myMatMult_schroedinger;
+      RHSctx.multT = myMatMultTranspose_schroedinger;
+    } else if (matfree_vectorized) {
+      RHSctx.mult  = myMatMult_matfree_vectorized;
+      RHSctx.multT = myMatMultTranspose_matfree_vectorized;
+    } else if (mpisize_petsc > 1) { // distributed: only the generic kernel iterates over a sub-range
+      RHSctx.mult  = myMatMult_matfree_generic;
+      RHSctx.multT = myMatMultTranspose_matfree_generic;
+    } else if (noscillators == 2) {
+      RHSctx.mult  = myMatMult_matfree_2Osc;
+      RHSctx.multT = myMatMultTranspose_matfree_2Osc;
     } else if (noscillators == 3) {
-      MatShellSetOperation(RHS, MATOP_MULT, (void(*)(void)) myMatMult_matfree_3Osc);
-      MatShellSetOperation(RHS, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_matfree_3Osc);
+      RHSctx.mult  = myMatMult_matfree_3Osc;
+      RHSctx.multT = myMatMultTranspose_matfree_3Osc;
     } else if (noscillators == 4) {
-      MatShellSetOperation(RHS, MATOP_MULT, (void(*)(void)) myMatMult_matfree_4Osc);
-      MatShellSetOperation(RHS, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_matfree_4Osc);
+      RHSctx.mult  = myMatMult_matfree_4Osc;
+      RHSctx.multT = myMatMultTranspose_matfree_4Osc;
     } else if (noscillators == 5) {
-      MatShellSetOperation(RHS, MATOP_MULT, (void(*)(void)) myMatMult_matfree_5Osc);
-      MatShellSetOperation(RHS, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_matfree_5Osc);
+      RHSctx.mult  = myMatMult_matfree_5Osc;
+      RHSctx.multT = myMatMultTranspose_matfree_5Osc;
     } else {
-      printf("ERROR. Matfree solver only for 2, 3 or 4 oscillators. This should never happen!\n");
-      exit(1);
+      RHSctx.mult  = myMatMult_matfree_generic;
+      RHSctx.multT = myMatMultTranspose_matfree_generic;
     }
   }
   else { // sparse-matrix solver
-    MatShellSetOperation(RHS, MATOP_MULT, (void(*)(void)) myMatMult_sparsemat);
-    MatShellSetOperation(RHS, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_sparsemat);
+    RHSctx.mult  = myMatMult_sparsemat;
+    RHSctx.multT = myMatMultTranspose_sparsemat;
   }
+  RHSctx.fused_shift = RHSctx.mult == myMatMult_matfree_generic || RHSctx.mult == myMatMult_matfree_vectorized;
+  RHSctx.alpha = 0.0;
+  RHSctx.beta = 1.0;
 
+  MatShellSetOperation(RHS, MATOP_MULT, (void(*)(void)) myMatMult_logged);
+  MatShellSetOperation(RHS, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_logged);
 }
 
 
@@ -188,11 +299,21 @@ MasterEq::~MasterEq(){
     }
     delete [] dRedp;
     delete [] dImdp;
-    delete [] vals;
-    delete [] cols;
 
     ISDestroy(&isu);
     ISDestroy(&isv);
+    if (RHSctx.scat_halo != NULL) {
+      VecScatterDestroy(&scat_halo);
+      VecDestroy(&xhalo);
+    }
+    if (RHSctx.diag != NULL) VecDestroy(&diag);
+    if (nbatch > 1) {
+      MatDestroy(&RHS_batch);
+      if (RHSctx_batch.scat_halo != NULL) {
+        VecScatterDestroy(&scat_halo_batch);
+        VecDestroy(&xhalo_batch);
+      }
+    }
   }
 }
 
@@ -549,12 +670,55 @@ int MasterEq::assemble_RHS(const double t){
 
   /* Prepare the matrix shell to perform the action of RHS on a vector */
   RHSctx.time = t;
+  RHSctx.Jkl = Jkl;
+  RHSctx.eta = eta;
 
+  const ControlSample& sample = getControlSample(t, false);
   for (int iosc = 0; iosc < noscillators; iosc++) {
-    double p, q;
-    oscil_vec[iosc]->evalControl(t, &p, &q);
-    RHSctx.control_Re[iosc] = p;
-    RHSctx.control_Im[iosc] = q;
+    RHSctx.control_Re[iosc] = sample.p[iosc];
+    RHSctx.control_Im[iosc] = sample.q[iosc];
+  }
+
+  /* The batched RHS applies the same operator */
+  if (nbatch > 1) {
+    RHSctx_batch.time = t;
+    RHSctx_batch.Jkl = RHSctx.Jkl;
+    RHSctx_batch.eta = RHSctx.eta;
+    RHSctx_batch.control_Re = RHSctx.control_Re;
+    RHSctx_batch.control_Im = RHSctx.control_Im;
+  }
+
+  return 0;
+}
+
+int MasterEq::assemble_RHS_combined(const double t1, const double c1, const double t2, const double c2){
+
+  /* The controls enter the RHS linearly */
+  double w1 = c1 / (c1 + c2);
+  double w2 = c2 / (c1 + c2);
+  const ControlSample& sample1 = getControlSample(t1, false);
+  const ControlSample& sample2 = getControlSample(t2, false);
+  for (int iosc = 0; iosc < noscillators; iosc++) {
+    RHSctx.control_Re[iosc] = w1 * sample1.p[iosc] + w2 * sample2.p[iosc];
+    RHSctx.control_Im[iosc] = w1 * sample1.q[iosc] + w2 * sample2.q[iosc];
+  }
+
+  /* The kernels evaluate the coupling as Jkl*cos(eta_kl*time), Jkl*sin(eta_kl*time). Pass the combination 
+   * w1 (cos,sin)(eta_kl*t1) + w2 (cos,sin)(eta_kl*t2) = r (cos,sin)(phi) as Jkl*r and phase phi at time 1. */
+  RHSctx.time = 1.0;
+  for (int kl = 0; kl < Jkl.size(); kl++) {
+    double cosJ = w1 * cos(eta[kl] * t1) + w2 * cos(eta[kl] * t2);
+    double sinJ = w1 * sin(eta[kl] * t1) + w2 * sin(eta[kl] * t2);
+    RHSctx.Jkl[kl] = Jkl[kl] * sqrt(cosJ*cosJ + sinJ*sinJ);
+    RHSctx.eta[kl] = atan2(sinJ, cosJ);
+  }
+
+  if (nbatch > 1) {
+    RHSctx_batch.time = RHSctx.time;
+    RHSctx_batch.Jkl = RHSctx.Jkl;
+    RHSctx_batch.eta = RHSctx.eta;
+    RHSctx_batch.control_Re = RHSctx.control_Re;
+    RHSctx_batch.control_Im = RHSctx.control_Im;
   }
 
   return 0;
@@ -565,6 +729,70 @@ int MasterEq::assemble_RHS(const double t){
 Mat MasterEq::getRHS() { return RHS; }
 
 
+void MasterEq::initBatch(const int nbatch_){
+  nbatch = nbatch_;
+  if (nbatch <= 1) return;
+
+  if (!usematfree) {
+    printf("\n ERROR: Batched propagation of initial conditions (nbatch = %d) requires the matrix-free solver (usematfree = true).\n", nbatch);
+    exit(1);
+  }
+
+  /* Create the batched matrix shell. Each processor owns nbatch times its local rows of RHS, hence column b 
+   * of the batch has the same parallel layout as a single state. */
+  PetscInt mlocal, nlocal;
+  MatGetLocalSize(RHS, &mlocal, &nlocal);
+  RHSctx_batch = RHSctx;
+  RHSctx_batch.nbatch = nbatch;
+  MatCreateShell(PETSC_COMM_WORLD, nbatch*mlocal, nbatch*nlocal, nbatch*2*dim, nbatch*2*dim, (void**) &RHSctx_batch, &RHS_batch);
+  MatSetBlockSizes(RHS_batch, nbatch, nbatch);
+  MatSetUp(RHS_batch);
+  MatAssemblyBegin(RHS_batch,MAT_FINAL_ASSEMBLY); MatAssemblyEnd(RHS_batch,MAT_FINAL_ASSEMBLY);
+
+  /* Distributed: gather the same halo as for a single state, for all states of the batch */
+  if (RHSctx.scat_halo != NULL) {
+    PetscInt nhalo;
+    VecGetSize(xhalo, &nhalo);
+    Vec xtmp;
+    IS ishalo;
+    MatCreateVecs(RHS_batch, &xtmp, NULL);
+    VecCreateSeq(PETSC_COMM_SELF, nbatch*nhalo, &xhalo_batch);
+    ISCreateStride(PETSC_COMM_SELF, nbatch*nhalo, nbatch*2*RHSctx.halo_low, 1, &ishalo);
+    VecScatterCreate(xtmp, ishalo, xhalo_batch, NULL, &scat_halo_batch);
+    ISDestroy(&ishalo);
+    VecDestroy(&xtmp);
+    RHSctx_batch.scat_halo = &scat_halo_batch;
+    RHSctx_batch.xhalo = &xhalo_batch;
+  }
+
+  RHSctx_batch.mult  = myMatMult_batch;
+  RHSctx_batch.multT = myMatMultTranspose_batch;
+  RHSctx_batch.fused_shift = false;
+  MatShellSetOperation(RHS_batch, MATOP_MULT, (void(*)(void)) myMatMult_logged);
+  MatShellSetOperation(RHS_batch, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_logged);
+}
+
+
+Mat MasterEq::getRHSBatch() { return RHS_batch; }
+
+
+void MasterEq::getConstantDiagonal(Vec d){
+  if (usematfree) {
+    VecCopy(diag, d);
+    return;
+  }
+
+  /* Sparse matrix solver: The constant part is Ad + i Bd */
+  Vec u, v;
+  VecGetSubVector(d, isu, &u);
+  VecGetSubVector(d, isv, &v);
+  MatGetDiagonal(Ad, u);
+  MatGetDiagonal(Bd, v);
+  VecRestoreSubVector(d, isu, &u);
+  VecRestoreSubVector(d, isv, &v);
+}
+
+
 // void MasterEq::createReducedDensity(const Vec rho, Vec *reduced, const std::vector<int>& oscilIDs) {
 
 //   Vec red;
@@ -709,16 +937,17 @@ Mat MasterEq::getRHS() { return RHS; }
 
 // }
 
-/* grad += alpha * RHS(x)^T * xbar  */
-void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const double alpha, Vec grad) {
+/* grad += alpha * RHS(x)^T * xbar, local contribution of this processor  */
+void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const double alpha, double* grad) {
 
 
   if (usematfree) {  // Matrix-free solver
     double res_p_re,  res_p_im, res_q_re, res_q_im;
 
     const double* xptr, *xbarptr;
-    VecGetArrayRead(x, &xptr);
+    matfree_getArrayHalo(&RHSctx, x, &xptr);
     VecGetArrayRead(xbar, &xbarptr);
+    const double* sqrtn = RHSctx.sqrtn.data();
 
     double* coeff_p = new double [noscillators];
     double* coeff_q = new double [noscillators];
@@ -727,7 +956,41 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
       coeff_q[i] = 0.0;
     }
 
-    if (noscillators == 2) {
+    if (schroedinger) {
+      /* compute strides for accessing psi from the oscillators' subsystem dimensions */
+      std::vector<int> stridei(noscillators), i(noscillators);
+      for (int k = 0; k < noscillators; k++) stridei[k] = oscil_vec[k]->dim_postOsc;
+      int stride0 = stridei[0];
+
+      /* --- Collect coefficients for gradient --- */
+      // Iterate over the local indices of xbar, one block of fixed i0 at a time
+      int it_low = RHSctx.it_low;
+      int it_upp = RHSctx.it_upp;
+#pragma omp parallel for firstprivate(i) private(res_p_re, res_p_im, res_q_re, res_q_im) reduction(+:coeff_p[:noscillators], coeff_q[:noscillators])
+      for (int blk = it_low / stride0; blk <= (it_upp-1) / stride0; blk++) {
+        int it_first = std::max(it_low, blk * stride0);
+        int it_last  = std::min(it_upp, (blk+1) * stride0);
+        for (int k = 0; k < noscillators; k++) i[k] = (it_first / stridei[k]) % nlevels[k];
+        for (int it = it_first; it < it_last; it++) {
+          /* Get xbar */
+          double xbarre = xbarptr[getIndexReal(it - it_low)];
+          double xbarim = xbarptr[getIndexImag(it - it_low)];
+
+          /* --- Oscillator k --- */
+          for (int k = 0; k < noscillators; k++) {
+            dRHSdp_getcoeffs_schroedinger(it, nlevels[k], i[k], stridei[k], xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+            coeff_p[k] += res_p_re * xbarre + res_p_im * xbarim;
+            coeff_q[k] += res_q_re * xbarre + res_q_im * xbarim;
+          }
+
+          /* Advance indices i0,i1,... */
+          for (int k = noscillators-1; k >= 0; k--) {
+            if (++i[k] < nlevels[k]) break;
+            i[k] = 0;
+          }
+        }
+      }
+    } else if (mpisize_petsc == 1 && noscillators == 2) {
     /* compute strides for accessing x at i0+1, i0-1, i0p+1, i0p-1, i1+1, i1-1, i1p+1, i1p-1: */
       int n0 = nlevels[0];
       int n1 = nlevels[1];
@@ -737,22 +1000,23 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
       int stridei1p = TensorGetIndex(n0,n1, 0,0,0,1);
 
       /* --- Collect coefficients for gradient --- */
-      int it = 0;
       // Iterate over indices of xbar
+#pragma omp parallel for collapse(2) private(res_p_re, res_p_im, res_q_re, res_q_im) reduction(+:coeff_p[:noscillators], coeff_q[:noscillators])
       for (int i0p = 0; i0p < n0; i0p++)  {
         for (int i1p = 0; i1p < n1; i1p++)  {
+          int it = i0p * stridei0p + i1p * stridei1p;  // first index of this (i0p,i1p) block
           for (int i0 = 0; i0 < n0; i0++)  {
             for (int i1 = 0; i1 < n1; i1++)  {
               /* Get xbar */
-              double xbarre = xbarptr[2*it];
-              double xbarim = xbarptr[2*it+1];
+              double xbarre = xbarptr[getIndexReal(it)];
+              double xbarim = xbarptr[getIndexImag(it)];
 
               /* --- Oscillator 0 --- */
-              dRHSdp_getcoeffs(it, n0, i0, i0p, stridei0, stridei0p, xptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+              dRHSdp_getcoeffs(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
               coeff_p[0] += res_p_re * xbarre + res_p_im * xbarim;
               coeff_q[0] += res_q_re * xbarre + res_q_im * xbarim;
               /* --- Oscillator 1 --- */
-              dRHSdp_getcoeffs(it, n1, i1, i1p, stridei1, stridei1p, xptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+              dRHSdp_getcoeffs(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
               coeff_p[1] += res_p_re * xbarre + res_p_im * xbarim;
               coeff_q[1] += res_q_re * xbarre + res_q_im * xbarim;
 
@@ -761,7 +1025,7 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
           }
         }
       }
-    } else if (noscillators == 3) {
+    } else if (mpisize_petsc == 1 && noscillators == 3) {
       /* compute strides for accessing x */
       int n0 = nlevels[0];
       int n1 = nlevels[1];
@@ -774,28 +1038,29 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
       int stridei2p = TensorGetIndex(n0,n1,n2, 0,0,0,0,0,1);
 
       /* --- Collect coefficients for gradient --- */
-      int it = 0;
       // Iterate over indices of xbar
+#pragma omp parallel for collapse(2) private(res_p_re, res_p_im, res_q_re, res_q_im) reduction(+:coeff_p[:noscillators], coeff_q[:noscillators])
       for (int i0p = 0; i0p < n0; i0p++)  {
         for (int i1p = 0; i1p < n1; i1p++)  {
+          int it = i0p * stridei0p + i1p * stridei1p;  // first index of this (i0p,i1p) block
           for (int i2p = 0; i2p < n2; i2p++)  {
             for (int i0 = 0; i0 < n0; i0++)  {
               for (int i1 = 0; i1 < n1; i1++)  {
                 for (int i2 = 0; i2 < n2; i2++)  {
                   /* Get xbar */
-                  double xbarre = xbarptr[2*it];
-                  double xbarim = xbarptr[2*it+1];
+                  double xbarre = xbarptr[getIndexReal(it)];
+                  double xbarim = xbarptr[getIndexImag(it)];
 
                   /* --- Oscillator 0 --- */
-                  dRHSdp_getcoeffs(it, n0, i0, i0p, stridei0, stridei0p, xptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                  dRHSdp_getcoeffs(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
                   coeff_p[0] += res_p_re * xbarre + res_p_im * xbarim;
                   coeff_q[0] += res_q_re * xbarre + res_q_im * xbarim;
                   /* --- Oscillator 1 --- */
-                  dRHSdp_getcoeffs(it, n1, i1, i1p, stridei1, stridei1p, xptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                  dRHSdp_getcoeffs(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
                   coeff_p[1] += res_p_re * xbarre + res_p_im * xbarim;
                   coeff_q[1] += res_q_re * xbarre + res_q_im * xbarim;
                   /* --- Oscillator 2 --- */
-                  dRHSdp_getcoeffs(it, n2, i2, i2p, stridei2, stridei2p, xptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                  dRHSdp_getcoeffs(it, n2, i2, i2p, stridei2, stridei2p, xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
                   coeff_p[2] += res_p_re * xbarre + res_p_im * xbarim;
                   coeff_q[2] += res_q_re * xbarre + res_q_im * xbarim;
 
@@ -806,7 +1071,7 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
           }
         }
       }
-    } else if (noscillators == 4) {
+    } else if (mpisize_petsc == 1 && noscillators == 4) {
       /* compute strides for accessing x */
       int n0 = nlevels[0];
       int n1 = nlevels[1];
@@ -822,10 +1087,11 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
       int stridei3p = TensorGetIndex(n0,n1,n2,n3, 0,0,0,0,0,0,0,1);
 
       /* --- Collect coefficients for gradient --- */
-      int it = 0;
       // Iterate over indices of xbar
+#pragma omp parallel for collapse(2) private(res_p_re, res_p_im, res_q_re, res_q_im) reduction(+:coeff_p[:noscillators], coeff_q[:noscillators])
       for (int i0p = 0; i0p < n0; i0p++)  {
         for (int i1p = 0; i1p < n1; i1p++)  {
+          int it = i0p * stridei0p + i1p * stridei1p;  // first index of this (i0p,i1p) block
           for (int i2p = 0; i2p < n2; i2p++)  {
             for (int i3p = 0; i3p < n3; i3p++)  {
               for (int i0 = 0; i0 < n0; i0++)  {
@@ -833,23 +1099,23 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
                   for (int i2 = 0; i2 < n2; i2++)  {
                     for (int i3 = 0; i3 < n3; i3++)  {
                       /* Get xbar */
-                      double xbarre = xbarptr[2*it];
-                      double xbarim = xbarptr[2*it+1];
+                      double xbarre = xbarptr[getIndexReal(it)];
+                      double xbarim = xbarptr[getIndexImag(it)];
 
                       /* --- Oscillator 0 --- */
-                      dRHSdp_getcoeffs(it, n0, i0, i0p, stridei0, stridei0p, xptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                      dRHSdp_getcoeffs(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
                       coeff_p[0] += res_p_re * xbarre + res_p_im * xbarim;
                       coeff_q[0] += res_q_re * xbarre + res_q_im * xbarim;
                       /* --- Oscillator 1 --- */
-                      dRHSdp_getcoeffs(it, n1, i1, i1p, stridei1, stridei1p, xptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                      dRHSdp_getcoeffs(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
                       coeff_p[1] += res_p_re * xbarre + res_p_im * xbarim;
                       coeff_q[1] += res_q_re * xbarre + res_q_im * xbarim;
                       /* --- Oscillator 2 --- */
-                      dRHSdp_getcoeffs(it, n2, i2, i2p, stridei2, stridei2p, xptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                      dRHSdp_getcoeffs(it, n2, i2, i2p, stridei2, stridei2p, xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
                       coeff_p[2] += res_p_re * xbarre + res_p_im * xbarim;
                       coeff_q[2] += res_q_re * xbarre + res_q_im * xbarim;
                       /* --- Oscillator 3 --- */
-                      dRHSdp_getcoeffs(it, n3, i3, i3p, stridei3, stridei3p, xptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                      dRHSdp_getcoeffs(it, n3, i3, i3p, stridei3, stridei3p, xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
                       coeff_p[3] += res_p_re * xbarre + res_p_im * xbarim;
                       coeff_q[3] += res_q_re * xbarre + res_q_im * xbarim;
 
@@ -862,7 +1128,7 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
           }
         }
       }
-    } else if (noscillators == 5) {
+    } else if (mpisize_petsc == 1 && noscillators == 5) {
       /* compute strides for accessing x */
       int n0 = nlevels[0];
       int n1 = nlevels[1];
@@ -881,10 +1147,11 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
       int stridei4p = TensorGetIndex(n0,n1,n2,n3,n4, 0,0,0,0,0,0,0,0,0,1);
 
       /* --- Collect coefficients for gradient --- */
-      int it = 0;
       // Iterate over indices of xbar
+#pragma omp parallel for collapse(2) private(res_p_re, res_p_im, res_q_re, res_q_im) reduction(+:coeff_p[:noscillators], coeff_q[:noscillators])
       for (int i0p = 0; i0p < n0; i0p++)  {
         for (int i1p = 0; i1p < n1; i1p++)  {
+          int it = i0p * stridei0p + i1p * stridei1p;  // first index of this (i0p,i1p) block
           for (int i2p = 0; i2p < n2; i2p++)  {
             for (int i3p = 0; i3p < n3; i3p++)  {
               for (int i4p = 0; i4p < n4; i4p++)  {
@@ -894,27 +1161,27 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
                       for (int i3 = 0; i3 < n3; i3++)  {
                         for (int i4 = 0; i4 < n4; i4++)  {
                           /* Get xbar */
-                          double xbarre = xbarptr[2*it];
-                          double xbarim = xbarptr[2*it+1];
+                          double xbarre = xbarptr[getIndexReal(it)];
+                          double xbarim = xbarptr[getIndexImag(it)];
 
                           /* --- Oscillator 0 --- */
-                          dRHSdp_getcoeffs(it, n0, i0, i0p, stridei0, stridei0p, xptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                          dRHSdp_getcoeffs(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
                           coeff_p[0] += res_p_re * xbarre + res_p_im * xbarim;
                           coeff_q[0] += res_q_re * xbarre + res_q_im * xbarim;
                           /* --- Oscillator 1 --- */
-                          dRHSdp_getcoeffs(it, n1, i1, i1p, stridei1, stridei1p, xptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                          dRHSdp_getcoeffs(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
                           coeff_p[1] += res_p_re * xbarre + res_p_im * xbarim;
                           coeff_q[1] += res_q_re * xbarre + res_q_im * xbarim;
                           /* --- Oscillator 2 --- */
-                          dRHSdp_getcoeffs(it, n2, i2, i2p, stridei2, stridei2p, xptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                          dRHSdp_getcoeffs(it, n2, i2, i2p, stridei2, stridei2p, xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
                           coeff_p[2] += res_p_re * xbarre + res_p_im * xbarim;
                           coeff_q[2] += res_q_re * xbarre + res_q_im * xbarim;
                           /* --- Oscillator 3 --- */
-                          dRHSdp_getcoeffs(it, n3, i3, i3p, stridei3, stridei3p, xptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                          dRHSdp_getcoeffs(it, n3, i3, i3p, stridei3, stridei3p, xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
                           coeff_p[3] += res_p_re * xbarre + res_p_im * xbarim;
                           coeff_q[3] += res_q_re * xbarre + res_q_im * xbarim;
                           /* --- Oscillator 4 --- */
-                          dRHSdp_getcoeffs(it, n4, i4, i4p, stridei4, stridei4p, xptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+                          dRHSdp_getcoeffs(it, n4, i4, i4p, stridei4, stridei4p, xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
                           coeff_p[4] += res_p_re * xbarre + res_p_im * xbarim;
                           coeff_q[4] += res_q_re * xbarre + res_q_im * xbarim;
 
@@ -929,35 +1196,54 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
           }
         }
       }
-    } else { 
-      printf("This should never happen!\n"); 
-      exit(1);
-    }
-    VecRestoreArrayRead(x, &xptr);
-    VecRestoreArrayRead(xbar, &xbarptr);
-
-    /* Set the gradient values */
-    int shift = 0;
-    for (int iosc = 0; iosc < noscillators; iosc++){
-      // eval control parameters derivatives
-      for (int i=0; i<nparams_max; i++){
-        dRedp[i] = 0.0;
-        dImdp[i] = 0.0;
+    } else {
+      /* compute strides for accessing x from the oscillators' subsystem dimensions */
+      std::vector<int> stridei(noscillators), strideip(noscillators);
+      std::vector<int> i(noscillators), ip(noscillators);
+      for (int k = 0; k < noscillators; k++) {
+        stridei[k]  = oscil_vec[k]->dim_postOsc;
+        strideip[k] = dim_rho * oscil_vec[k]->dim_postOsc;
       }
-      oscil_vec[iosc]->evalControl_diff(t, dRedp, dImdp);
 
-      PetscInt nparam = getOscillator(iosc)->getNParams();
-      for (int iparam=0; iparam < nparam; iparam++) {
-        vals[iparam] = alpha * (coeff_p[iosc] * dRedp[iparam] + coeff_q[iosc] * dImdp[iparam]);
-        cols[iparam] = iparam + shift;
+      /* --- Collect coefficients for gradient --- */
+      // Iterate over the local indices of xbar, one column of rho at a time
+      int it_low = RHSctx.it_low;
+      int it_upp = RHSctx.it_upp;
+#pragma omp parallel for firstprivate(i, ip) private(res_p_re, res_p_im, res_q_re, res_q_im) reduction(+:coeff_p[:noscillators], coeff_q[:noscillators])
+      for (int col = it_low / dim_rho; col <= (it_upp-1) / dim_rho; col++) {
+        int row_first = std::max(it_low - col * dim_rho, 0);
+        int row_last  = std::min(it_upp - col * dim_rho, dim_rho);
+        int it = col * dim_rho + row_first;  // first local index in this column
+        for (int k = 0; k < noscillators; k++) {
+          i[k]  = (row_first / stridei[k]) % nlevels[k];
+          ip[k] = (col / stridei[k]) % nlevels[k];
+        }
+        for (int row = row_first; row < row_last; row++) {
+          /* Get xbar */
+          double xbarre = xbarptr[getIndexReal(it - it_low)];
+          double xbarim = xbarptr[getIndexImag(it - it_low)];
+
+          /* --- Oscillator k --- */
+          for (int k = 0; k < noscillators; k++) {
+            dRHSdp_getcoeffs(it, nlevels[k], i[k], ip[k], stridei[k], strideip[k], xptr, sqrtn, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+            coeff_p[k] += res_p_re * xbarre + res_p_im * xbarim;
+            coeff_q[k] += res_q_re * xbarre + res_q_im * xbarim;
+          }
+          it++;
+
+          /* Advance row indices i0,i1,... */
+          for (int k = noscillators-1; k >= 0; k--) {
+            if (++i[k] < nlevels[k]) break;
+            i[k] = 0;
+          }
+        }
       }
-      VecSetValues(grad, nparam, cols, vals, ADD_VALUES);
-      shift += nparam;
     }
+    matfree_restoreArrayHalo(&RHSctx, x, &xptr);
+    VecRestoreArrayRead(xbar, &xbarptr);
 
-    //Assemble gradient
-    VecAssemblyBegin(grad);
-    VecAssemblyEnd(grad);
+    /* Set the gradient values */
+    addControlGradient(t, coeff_p, coeff_q, alpha, grad);
 
     delete [] coeff_p;
     delete [] coeff_q;
@@ -970,41 +1256,28 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
   VecGetSubVector(xbar, isu, &ubar);
   VecGetSubVector(xbar, isv, &vbar);
 
-  /* Loop over oscillators */
-  int col_shift = 0;
+  /* Collect the coefficients of dp and dq for each oscillator: Local parts of the terms in RHS(x)^T xbar */
+  double* coeff_p = new double [noscillators];
+  double* coeff_q = new double [noscillators];
   for (int iosc= 0; iosc < noscillators; iosc++){
-
-    /* Evaluate the derivative of the control functions wrt control parameters */
-    for (int i=0; i<nparams_max; i++){
-      dRedp[i] = 0.0;
-      dImdp[i] = 0.0;
-    }
-    oscil_vec[iosc]->evalControl_diff(t, dRedp, dImdp);
-
-    /* Compute terms in RHS(x)^T xbar */
     double uAubar, vAvbar, vBubar, uBvbar;
     MatMult(Ac_vec[iosc], u, aux);
-    VecDot(aux, ubar, &uAubar);
+    uAubar = localDot(aux, ubar);
     MatMult(Ac_vec[iosc], v, aux);
-    VecDot(aux, vbar, &vAvbar);
+    vAvbar = localDot(aux, vbar);
     MatMult(Bc_vec[iosc], u, aux);
-    VecDot(aux, vbar, &uBvbar);
+    uBvbar = localDot(aux, vbar);
     MatMult(Bc_vec[iosc], v, aux);
-    VecDot(aux, ubar, &vBubar);
+    vBubar = localDot(aux, ubar);
+    coeff_p[iosc] = -vBubar + uBvbar;
+    coeff_q[iosc] = uAubar + vAvbar;
+  }
 
-    /* Number of parameters for this oscillator */
-    int nparams_iosc = getOscillator(iosc)->getNParams();
+  /* Set the gradient values */
+  addControlGradient(t, coeff_p, coeff_q, alpha, grad);
 
-    /* Set gradient terms for each control parameter */
-    for (int iparam=0; iparam < nparams_iosc; iparam++) {
-      vals[iparam] = alpha * ((uAubar + vAvbar) * dImdp[iparam] + ( -vBubar + uBvbar) * dRedp[iparam]);
-      cols[iparam] = col_shift + iparam;
-    }
-    VecSetValues(grad, nparams_iosc, cols, vals, ADD_VALUES);
-    col_shift += nparams_iosc;
-  }
-  VecAssemblyBegin(grad);
-  VecAssemblyEnd(grad);
+  delete [] coeff_p;
+  delete [] coeff_q;
 
   /* Restore x */
   VecRestoreSubVector(x, isu, &u);
@@ -1015,6 +1288,20 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
 
 }
 
+void MasterEq::addControlGradient(const double t, double* coeff_p, double* coeff_q, const double alpha, double* grad) {
+
+  /* Add to the parameters of the splines that are nonzero at t */
+  const ControlSample& sample = getControlSample(t, true);
+  int shift = 0;
+  for (int iosc = 0; iosc < noscillators; iosc++){
+    double* grad_active = grad + shift + sample.dfirst[iosc];
+    for (int i = 0; i < sample.dRedp[iosc].size(); i++) {
+      grad_active[i] += alpha * (coeff_p[iosc] * sample.dRedp[iosc][i] + coeff_q[iosc] * sample.dImdp[iosc][i]);
+    }
+    shift += getOscillator(iosc)->getNParams();
+  }
+}
+
 void MasterEq::setControlAmplitudes(const Vec x) {
 
   const PetscScalar* ptr;
@@ -1028,6 +1315,52 @@ void MasterEq::setControlAmplitudes(const Vec x) {
     shift += getOscillator(ioscil)->getNParams();
   }
   VecRestoreArrayRead(x, &ptr);
+
+  /* The tabulated controls belong to the previous parameters */
+  control_samples.clear();
+}
+
+
+void MasterEq::eraseControlSamples(const double t0, const double t1) {
+  control_samples.erase(control_samples.upper_bound(t0), control_samples.lower_bound(t1));
+}
+
+
+const ControlSample& MasterEq::getControlSample(const double t, const bool derivatives) {
+
+  /* Evaluate the controls when visiting t for the first time */
+  std::map<double, ControlSample>::iterator it = control_samples.find(t);
+  if (it == control_samples.end()) {
+    ControlSample sample;
+    sample.p.resize(noscillators);
+    sample.q.resize(noscillators);
+    sample.dfirst.assign(noscillators, -1);
+    sample.dRedp.resize(noscillators);
+    sample.dImdp.resize(noscillators);
+    for (int iosc = 0; iosc < noscillators; iosc++) {
+      oscil_vec[iosc]->evalControl(t, &sample.p[iosc], &sample.q[iosc]);
+    }
+    it = control_samples.insert(std::make_pair(t, sample)).first;
+  }
+  ControlSample& sample = it->second;
+
+  /* Evaluate the nonzero derivatives when they are needed for the first time */
+  if (derivatives && noscillators > 0 && sample.dfirst[0] < 0) {
+    for (int iosc = 0; iosc < noscillators; iosc++) {
+      int first, n;
+      oscil_vec[iosc]->getActiveParams(t, &first, &n);
+      for (int i = first; i < first + n; i++) {
+        dRedp[i] = 0.0;
+        dImdp[i] = 0.0;
+      }
+      oscil_vec[iosc]->evalControl_diff(t, dRedp, dImdp);
+      sample.dfirst[iosc] = first;
+      sample.dRedp[iosc].assign(dRedp + first, dRedp + first + n);
+      sample.dImdp[iosc].assign(dImdp + first, dImdp + first + n);
+    }
+  }
+
+  return sample;
 }
 
 
@@ -1038,7 +1371,6 @@ int MasterEq::getRhoT0(const int iinit, const int ninit, const InitialConditionT
   double val;
   int dim_post;
   int initID = 1;    // Output: ID for this initial condition */
-  int dim_rho = (int) sqrt(dim); // N
 
   /* Switch over type of initial condition */
   switch (initcond_type) {
@@ -1153,8 +1485,9 @@ int MasterEq::getRhoT0(const int iinit, const int ninit, const InitialConditionT
       diagelem = iinit * dim_post;
       if (dim_ess < dim_rho)  diagelem = mapEssToFull(diagelem, nlevels, nessential);
 
-      /* Set B_{mm} */
-      elemID = getIndexReal(getVecID(diagelem, diagelem, dim_rho)); // real part in vectorized system
+      /* Set B_{mm}, or psi = e_m in Schroedinger mode */
+      if (schroedinger) elemID = getIndexReal(diagelem);
+      else              elemID = getIndexReal(getVecID(diagelem, diagelem, dim_rho)); // real part in vectorized system
       val = 1.0;
       VecGetOwnershipRange(rho0, &ilow, &iupp);
       if (ilow <= elemID && elemID < iupp) VecSetValues(rho0, 1, &elemID, &val, INSERT_VALUES);
@@ -1195,7 +1528,20 @@ int MasterEq::getRhoT0(const int iinit, const int ninit, const InitialConditionT
         j = mapEssToFull(j, nlevels, nessential);
       }
 
-      if (k == j) {
+      if (schroedinger) {
+        /* B_{kj} = psi psi^\dagger is a pure state: psi = e_k (k=j), 1/sqrt(2)(e_k + e_j) (k<j), or 1/sqrt(2)(e_k + i e_j) (k>j) */
+        if (k == j) {
+          elemID = getIndexReal(k);
+          val = 1.0;
+          if (ilow <= elemID && elemID < iupp) VecSetValues(rho0, 1, &elemID, &val, INSERT_VALUES);
+        } else {
+          val = 1./sqrt(2.);
+          elemID = getIndexReal(k);
+          if (ilow <= elemID && elemID < iupp) VecSetValues(rho0, 1, &elemID, &val, INSERT_VALUES);
+          elemID = k < j ? getIndexReal(j) : getIndexImag(j);
+          if (ilow <= elemID && elemID < iupp) VecSetValues(rho0, 1, &elemID, &val, INSERT_VALUES);
+        }
+      } else if (k == j) {
         /* B_{kk} = E_{kk} -> set only one element at (k,k) */
         elemID = getIndexReal(getVecID(k, k, dim_rho)); // real part in vectorized system
         double val = 1.0;
@@ -1251,6 +1597,29 @@ int MasterEq::getRhoT0(const int iinit, const int ninit, const InitialConditionT
 }
 
 
+/* Get read access to x for the matrix-free kernels. In the distributed case, x is first gathered into the local 
+ * halo buffer, and the returned pointer is shifted such that it can be indexed by global (complex) position. */
+void matfree_getArrayHalo(MatShellCtx* shellctx, Vec x, const double** xptr){
+  if (shellctx->scat_halo == NULL) {
+    VecGetArrayRead(x, xptr);
+  } else {
+    VecScatterBegin(*shellctx->scat_halo, x, *shellctx->xhalo, INSERT_VALUES, SCATTER_FORWARD);
+    VecScatterEnd(*shellctx->scat_halo, x, *shellctx->xhalo, INSERT_VALUES, SCATTER_FORWARD);
+    VecGetArrayRead(*shellctx->xhalo, xptr);
+    *xptr -= shellctx->nbatch * getIndexReal(shellctx->halo_low);
+  }
+}
+
+void matfree_restoreArrayHalo(MatShellCtx* shellctx, Vec x, const double** xptr){
+  if (shellctx->scat_halo == NULL) {
+    VecRestoreArrayRead(x, xptr);
+  } else {
+    *xptr += shellctx->nbatch * getIndexReal(shellctx->halo_low);
+    VecRestoreArrayRead(*shellctx->xhalo, xptr);
+  }
+}
+
+
 /* Sparse matrix solver: Define the action of RHS on a vector x */
 int myMatMult_sparsemat(Mat RHS, Vec x, Vec y){
 
@@ -1442,28 +1811,20 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   double* yptr;
   VecGetArrayRead(x, &xptr);
   VecGetArray(y, &yptr);
+  const double* diagptr;
+  VecGetArrayRead(*shellctx->diag, &diagptr);
+  const double* sqrtn = shellctx->sqrtn.data();
 
 
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling
   double J01  = shellctx->Jkl[0];  // Jaynes-Cummings coupling
   double eta01 = shellctx->eta[0];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)
     decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2)
-    dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)
     decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2)
-    dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -1478,53 +1839,43 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   int stridei1p = TensorGetIndex(n0,n1, 0,0,0,1);
 
   /* Iterate over indices of output vector y */
-  int it = 0;
+#pragma omp parallel for collapse(2)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
+      int it = i0p * stridei0p + i1p * stridei1p;  // first index of this (i0p,i1p) block
       for (int i0 = 0; i0 < n0; i0++)  {
         for (int i1 = 0; i1 < n1; i1++)  {
 
           /* --- Diagonal part ---*/
           //Get input x values
-          double xre = xptr[2 * it];
-          double xim = xptr[2 * it + 1];
-          // drift Hamiltonian: uout = ( hd(ik) - hd(ik'))*vin
-          //                    vout = (-hd(ik) + hd(ik'))*uin
-          double hd  = H_detune(detuning_freq0, detuning_freq1, i0, i1)
-                     + H_selfkerr(xi0, xi1, i0, i1)
-                     + H_crosskerr(xi01, i0, i1);
-          double hdp = H_detune(detuning_freq0, detuning_freq1, i0p, i1p)
-                     + H_selfkerr(xi0, xi1, i0p, i1p)
-                     + H_crosskerr(xi01, i0p, i1p);
-          double yre = ( hd - hdp ) * xim;
-          double yim = (-hd + hdp ) * xre;
-          // Decay l1, diagonal part: xout += l1diag xin
-          // Dephasing l2: xout += l2(ik, ikp) xin
-          double l1diag = L1diag(decay0, decay1, i0, i1, i0p, i1p);
-          double l2 = L2(dephase0, dephase1, i0, i1, i0p, i1p);
-          yre += (l2 + l1diag) * xre;
-          yim += (l2 + l1diag) * xim;
+          double xre = xptr[getIndexReal(it)];
+          double xim = xptr[getIndexImag(it)];
+          // drift Hamiltonian and diagonal Lindblad terms, precomputed: diag = (l2 + l1diag) - i (hd(ik) - hd(ik'))
+          double diagre = diagptr[getIndexReal(it)];
+          double diagim = diagptr[getIndexImag(it)];
+          double yre = diagre * xre - diagim * xim;
+          double yim = diagre * xim + diagim * xre;
 
 
           /* --- Offdiagonal: Jkl coupling term --- */
           // oscillator 0<->1 
-          Jkl_coupling(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, J01, cos01, sin01, &yre, &yim);
+          Jkl_coupling(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, sqrtn, J01, cos01, sin01, &yre, &yim);
 
           /* --- Offdiagonal part of decay L1 */
           // Oscillators 0
-          L1decay(it, n0, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
+          L1decay(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, decay0, &yre, &yim);
           // Oscillator 1
-          L1decay(it, n1, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
+          L1decay(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, decay1, &yre, &yim);
 
           /* --- Control hamiltonian --- */
           // Oscillator 0 
-          control(it, n0, i0, i0p, stridei0, stridei0p, xptr, pt0, qt0, &yre, &yim);
+          control(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, pt0, qt0, &yre, &yim);
           // Oscillator 1
-          control(it, n1, i1, i1p, stridei1, stridei1p, xptr, pt1, qt1, &yre, &yim);
+          control(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, pt1, qt1, &yre, &yim);
 
           /* Update */
-          yptr[2*it]   = yre;
-          yptr[2*it+1] = yim;
+          yptr[getIndexReal(it)]   = yre;
+          yptr[getIndexImag(it)] = yim;
           it++;
         }
       }
@@ -1534,6 +1885,7 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   /* Restore x and y */
   VecRestoreArrayRead(x, &xptr);
   VecRestoreArray(y, &yptr);
+  VecRestoreArrayRead(*shellctx->diag, &diagptr);
 
 
   return 0;
@@ -1553,27 +1905,19 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   double* yptr;
   VecGetArrayRead(x, &xptr);
   VecGetArray(y, &yptr);
+  const double* diagptr;
+  VecGetArrayRead(*shellctx->diag, &diagptr);
+  const double* sqrtn = shellctx->sqrtn.data();
 
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling 
   double J01 = shellctx->Jkl[0];   // Jaynes-Cummings coupling
   double eta01 = shellctx->eta[0];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)
     decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2)
-    dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)
     decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2)
-    dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -1589,53 +1933,43 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
 
 
   /* Iterate over indices of output vector y */
-  int it = 0;
+#pragma omp parallel for collapse(2)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
+      int it = i0p * stridei0p + i1p * stridei1p;  // first index of this (i0p,i1p) block
       for (int i0 = 0; i0 < n0; i0++)  {
         for (int i1 = 0; i1 < n1; i1++)  {
 
           /* --- Diagonal part ---*/
           //Get input x values
-          double xre = xptr[2 * it];
-          double xim = xptr[2 * it + 1];
-          // drift Hamiltonian Hd^T: uout = ( hd(ik) - hd(ik'))*vin
-          //                         vout = (-hd(ik) + hd(ik'))*uin
-          double hd  = H_detune(detuning_freq0, detuning_freq1, i0, i1)
-                     + H_selfkerr(xi0, xi1, i0, i1)
-                     + H_crosskerr(xi01, i0, i1);
-          double hdp = H_detune(detuning_freq0, detuning_freq1, i0p, i1p)
-                     + H_selfkerr(xi0, xi1, i0p, i1p)
-                     + H_crosskerr(xi01, i0p, i1p);
-          double yre = (-hd + hdp ) * xim;
-          double yim = ( hd - hdp ) * xre;
-          // Decay l1^T, diagonal part: xout += l1diag xin
-          // Dephasing l2^T: xout += l2(ik, ikp) xin
-          double l1diag = L1diag(decay0, decay1, i0, i1, i0p, i1p);
-          double l2 = L2(dephase0, dephase1, i0, i1, i0p, i1p);
-          yre += (l2 + l1diag) * xre;
-          yim += (l2 + l1diag) * xim;
+          double xre = xptr[getIndexReal(it)];
+          double xim = xptr[getIndexImag(it)];
+          // transpose of the precomputed diagonal part: conj(diag)
+          double diagre = diagptr[getIndexReal(it)];
+          double diagim = diagptr[getIndexImag(it)];
+          double yre = diagre * xre + diagim * xim;
+          double yim = diagre * xim - diagim * xre;
 
           /* --- Offdiagonal coupling term J_kl --- */
           // oscillator 0<->1
-          Jkl_coupling_T(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, J01, cos01, sin01, &yre, &yim);
+          Jkl_coupling_T(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, sqrtn, J01, cos01, sin01, &yre, &yim);
  
           /* --- Offdiagonal part of decay L1^T */
           // Oscillators 0
-          L1decay_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
+          L1decay_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, decay0, &yre, &yim);
           // Oscillator 1
-          L1decay_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
+          L1decay_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, decay1, &yre, &yim);
 
           /* --- Control hamiltonian  --- */
           // Oscillator 0
-          control_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, pt0, qt0, &yre, &yim);
+          control_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, pt0, qt0, &yre, &yim);
           // Oscillator 1
-          control_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, pt1, qt1, &yre, &yim);
+          control_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, pt1, qt1, &yre, &yim);
 
 
           /* Update */
-          yptr[2*it]   = yre;
-          yptr[2*it+1] = yim;
+          yptr[getIndexReal(it)]   = yre;
+          yptr[getIndexImag(it)] = yim;
           it++;
         }
       }
@@ -1647,6 +1981,7 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   /* Restore x and y */
   VecRestoreArrayRead(x, &xptr);
   VecRestoreArray(y, &yptr);
+  VecRestoreArrayRead(*shellctx->diag, &diagptr);
 
   return 0;
 }
@@ -1665,34 +2000,22 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   double* yptr;
   VecGetArrayRead(x, &xptr);
   VecGetArray(y, &yptr); 
+  const double* diagptr;
+  VecGetArrayRead(*shellctx->diag, &diagptr);
+  const double* sqrtn = shellctx->sqrtn.data();
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
-  double xi2  = shellctx->oscil_vec[2]->getSelfkerr();   
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling
-  double xi02 = shellctx->crosskerr[1];  // zz-coupling
-  double xi12 = shellctx->crosskerr[2];  // zz-coupling
   double J01  = shellctx->Jkl[0];  // Jaynes-Cummings coupling
   double J02  = shellctx->Jkl[1];  // Jaynes-Cummings coupling
   double J12  = shellctx->Jkl[2];  // Jaynes-Cummings coupling
   double eta01 = shellctx->eta[0];
   double eta02 = shellctx->eta[1];
   double eta12 = shellctx->eta[2];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
-  double detuning_freq2 = shellctx->oscil_vec[2]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
   double decay2 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
-  double dephase2= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)   decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)   decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   if (shellctx->oscil_vec[2]->getDecayTime() > 1e-14 && shellctx->addT1)   decay2= 1./shellctx->oscil_vec[2]->getDecayTime();
-  if (shellctx->oscil_vec[2]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase2 = 1./shellctx->oscil_vec[2]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -1715,9 +2038,10 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   int stridei2p = TensorGetIndex(n0,n1,n2, 0,0,0,0,0,1);
 
    /* Iterate over indices of output vector y */
-  int it = 0;
+#pragma omp parallel for collapse(2)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
+      int it = i0p * stridei0p + i1p * stridei1p;  // first index of this (i0p,i1p) block
       for (int i2p = 0; i2p < n2; i2p++)  {
         for (int i0 = 0; i0 < n0; i0++)  {
           for (int i1 = 0; i1 < n1; i1++)  {
@@ -1725,54 +2049,43 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
 
               /* --- Diagonal part ---*/
               //Get input x values
-              double xre = xptr[2 * it];
-              double xim = xptr[2 * it + 1];
-              // drift Hamiltonian: uout = ( hd(ik) - hd(ik'))*vin
-              //                    vout = (-hd(ik) + hd(ik'))*uin
-              double hd  = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, i0, i1, i2)
-                         + H_selfkerr(xi0, xi1, xi2, i0, i1, i2)
-                         + H_crosskerr(xi01, xi02, xi12, i0, i1, i2);
-              double hdp = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, i0p, i1p, i2p)
-                         + H_selfkerr(xi0, xi1, xi2, i0p, i1p, i2p)
-                         + H_crosskerr(xi01, xi02, xi12, i0p, i1p, i2p);
-              double yre = ( hd - hdp ) * xim;
-              double yim = (-hd + hdp ) * xre;
-              // Decay l1, diagonal part: xout += l1diag xin
-              // Dephasing l2: xout += l2(ik, ikp) xin
-              double l1diag = L1diag(decay0, decay1, decay2, i0, i1, i2, i0p, i1p, i2p);
-              double l2 = L2(dephase0, dephase1, dephase2, i0, i1, i2, i0p, i1p, i2p);
-              yre += (l2 + l1diag) * xre;
-              yim += (l2 + l1diag) * xim;
+              double xre = xptr[getIndexReal(it)];
+              double xim = xptr[getIndexImag(it)];
+              // drift Hamiltonian and diagonal Lindblad terms, precomputed: diag = (l2 + l1diag) - i (hd(ik) - hd(ik'))
+              double diagre = diagptr[getIndexReal(it)];
+              double diagim = diagptr[getIndexImag(it)];
+              double yre = diagre * xre - diagim * xim;
+              double yim = diagre * xim + diagim * xre;
 
 
               /* --- Offdiagonal: Jkl coupling  --- */
               // oscillator 0<->1 
-              Jkl_coupling(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, J01, cos01, sin01, &yre, &yim);
+              Jkl_coupling(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, sqrtn, J01, cos01, sin01, &yre, &yim);
               // oscillator 0<->2
-              Jkl_coupling(it, n0, n2, i0, i0p, i2, i2p, stridei0, stridei0p, stridei2, stridei2p, xptr, J02, cos02, sin02, &yre, &yim);
+              Jkl_coupling(it, n0, n2, i0, i0p, i2, i2p, stridei0, stridei0p, stridei2, stridei2p, xptr, sqrtn, J02, cos02, sin02, &yre, &yim);
               // oscillator 1<->2
-              Jkl_coupling(it, n1, n2, i1, i1p, i2, i2p, stridei1, stridei1p, stridei2, stridei2p, xptr, J12, cos12, sin12, &yre, &yim);
+              Jkl_coupling(it, n1, n2, i1, i1p, i2, i2p, stridei1, stridei1p, stridei2, stridei2p, xptr, sqrtn, J12, cos12, sin12, &yre, &yim);
 
               /* --- Offdiagonal part of decay L1 */
               // Oscillators 0
-              L1decay(it, n0, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
+              L1decay(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, decay0, &yre, &yim);
               // Oscillator 1
-              L1decay(it, n1, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
+              L1decay(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, decay1, &yre, &yim);
               // Oscillator 2
-              L1decay(it, n2, i2, i2p, stridei2, stridei2p, xptr, decay2, &yre, &yim);
+              L1decay(it, n2, i2, i2p, stridei2, stridei2p, xptr, sqrtn, decay2, &yre, &yim);
               
 
               /* --- Control hamiltonian ---  */
               // Oscillator 0 
-              control(it, n0, i0, i0p, stridei0, stridei0p, xptr, pt0, qt0, &yre, &yim);
+              control(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, pt0, qt0, &yre, &yim);
               // Oscillator 1
-              control(it, n1, i1, i1p, stridei1, stridei1p, xptr, pt1, qt1, &yre, &yim);
+              control(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, pt1, qt1, &yre, &yim);
               // Oscillator 1
-              control(it, n2, i2, i2p, stridei2, stridei2p, xptr, pt2, qt2, &yre, &yim);
+              control(it, n2, i2, i2p, stridei2, stridei2p, xptr, sqrtn, pt2, qt2, &yre, &yim);
               
               /* --- Update --- */
-              yptr[2*it]   = yre;
-              yptr[2*it+1] = yim;
+              yptr[getIndexReal(it)]   = yre;
+              yptr[getIndexImag(it)] = yim;
               it++;
             }
           }
@@ -1784,6 +2097,7 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   /* Restore x and y */
   VecRestoreArrayRead(x, &xptr);
   VecRestoreArray(y, &yptr);
+  VecRestoreArrayRead(*shellctx->diag, &diagptr);
 
   return 0;
 }
@@ -1801,36 +2115,24 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   double* yptr;
   VecGetArrayRead(x, &xptr);
   VecGetArray(y, &yptr);
+  const double* diagptr;
+  VecGetArrayRead(*shellctx->diag, &diagptr);
+  const double* sqrtn = shellctx->sqrtn.data();
 
 
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
-  double xi2  = shellctx->oscil_vec[2]->getSelfkerr();   
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling
-  double xi02 = shellctx->crosskerr[1];  // zz-coupling
-  double xi12 = shellctx->crosskerr[2];  // zz-coupling
   double J01  = shellctx->Jkl[0];  // Jaynes-Cummings coupling
   double J02  = shellctx->Jkl[1];  // Jaynes-Cummings coupling
   double J12  = shellctx->Jkl[2];  // Jaynes-Cummings coupling
   double eta01 = shellctx->eta[0];
   double eta02 = shellctx->eta[1];
   double eta12 = shellctx->eta[2];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
-  double detuning_freq2 = shellctx->oscil_vec[2]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
   double decay2 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
-  double dephase2= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)   decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)   decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   if (shellctx->oscil_vec[2]->getDecayTime() > 1e-14 && shellctx->addT1)   decay2= 1./shellctx->oscil_vec[2]->getDecayTime();
-  if (shellctx->oscil_vec[2]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase2 = 1./shellctx->oscil_vec[2]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -1853,9 +2155,10 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   int stridei2p = TensorGetIndex(n0,n1,n2, 0,0,0,0,0,1);
 
    /* Iterate over indices of output vector y */
-  int it = 0;
+#pragma omp parallel for collapse(2)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
+      int it = i0p * stridei0p + i1p * stridei1p;  // first index of this (i0p,i1p) block
       for (int i2p = 0; i2p < n2; i2p++)  {
         for (int i0 = 0; i0 < n0; i0++)  {
           for (int i1 = 0; i1 < n1; i1++)  {
@@ -1863,53 +2166,42 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
 
               /* --- Diagonal part ---*/
               //Get input x values
-              double xre = xptr[2 * it];
-              double xim = xptr[2 * it + 1];
-              // drift Hamiltonian Hd^T: uout = ( hd(ik) - hd(ik'))*vin
-              //                         vout = (-hd(ik) + hd(ik'))*uin
-              double hd  = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, i0, i1, i2)
-                         + H_selfkerr(xi0, xi1, xi2, i0, i1, i2)
-                         + H_crosskerr(xi01, xi02, xi12, i0, i1, i2);
-              double hdp = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, i0p, i1p, i2p)
-                         + H_selfkerr(xi0, xi1, xi2, i0p, i1p, i2p)
-                         + H_crosskerr(xi01, xi02, xi12, i0p, i1p, i2p);
-              double yre = (-hd + hdp ) * xim;
-              double yim = ( hd - hdp ) * xre;
-              // Decay l1^T, diagonal part: xout += l1diag xin
-              // Dephasing l2^T: xout += l2(ik, ikp) xin
-              double l1diag = L1diag(decay0, decay1, decay2, i0, i1, i2, i0p, i1p, i2p);
-              double l2 = L2(dephase0, dephase1, dephase2, i0, i1, i2, i0p, i1p, i2p);
-              yre += (l2 + l1diag) * xre;
-              yim += (l2 + l1diag) * xim;
+              double xre = xptr[getIndexReal(it)];
+              double xim = xptr[getIndexImag(it)];
+              // transpose of the precomputed diagonal part: conj(diag)
+              double diagre = diagptr[getIndexReal(it)];
+              double diagim = diagptr[getIndexImag(it)];
+              double yre = diagre * xre + diagim * xim;
+              double yim = diagre * xim - diagim * xre;
 
               /* --- Offdiagonal coupling term J_kl --- */
               // oscillator 0<->1
-              Jkl_coupling_T(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, J01, cos01, sin01, &yre, &yim);
+              Jkl_coupling_T(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, sqrtn, J01, cos01, sin01, &yre, &yim);
               // oscillator 0<->2
-              Jkl_coupling_T(it, n0, n2, i0, i0p, i2, i2p, stridei0, stridei0p, stridei2, stridei2p, xptr, J02, cos02, sin02, &yre, &yim);
+              Jkl_coupling_T(it, n0, n2, i0, i0p, i2, i2p, stridei0, stridei0p, stridei2, stridei2p, xptr, sqrtn, J02, cos02, sin02, &yre, &yim);
               // oscillator 1<->2
-              Jkl_coupling_T(it, n1, n2, i1, i1p, i2, i2p, stridei1, stridei1p, stridei2, stridei2p, xptr, J12, cos12, sin12, &yre, &yim);
+              Jkl_coupling_T(it, n1, n2, i1, i1p, i2, i2p, stridei1, stridei1p, stridei2, stridei2p, xptr, sqrtn, J12, cos12, sin12, &yre, &yim);
               
 
               /* --- Offdiagonal part of decay L1^T */
               // Oscillators 0
-              L1decay_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
+              L1decay_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, decay0, &yre, &yim);
               // Oscillator 1
-              L1decay_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
+              L1decay_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, decay1, &yre, &yim);
              // Oscillator 2
-              L1decay_T(it, n2, i2, i2p, stridei2, stridei2p, xptr, decay2, &yre, &yim);
+              L1decay_T(it, n2, i2, i2p, stridei2, stridei2p, xptr, sqrtn, decay2, &yre, &yim);
 
               /* --- Control hamiltonian  --- */
               // Oscillator 0
-              control_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, pt0, qt0, &yre, &yim);
+              control_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, pt0, qt0, &yre, &yim);
               // Oscillator 1
-              control_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, pt1, qt1, &yre, &yim);
+              control_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, pt1, qt1, &yre, &yim);
               // Oscillator 2
-              control_T(it, n2, i2, i2p, stridei2, stridei2p, xptr, pt2, qt2, &yre, &yim);
+              control_T(it, n2, i2, i2p, stridei2, stridei2p, xptr, sqrtn, pt2, qt2, &yre, &yim);
 
               /* Update */
-              yptr[2*it]   = yre;
-              yptr[2*it+1] = yim;
+              yptr[getIndexReal(it)]   = yre;
+              yptr[getIndexImag(it)] = yim;
               it++;
             }
           }
@@ -1921,6 +2213,7 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   /* Restore x and y */
   VecRestoreArrayRead(x, &xptr);
   VecRestoreArray(y, &yptr);
+  VecRestoreArrayRead(*shellctx->diag, &diagptr);
 
   return 0;
 }
@@ -1940,18 +2233,11 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   double* yptr;
   VecGetArrayRead(x, &xptr);
   VecGetArray(y, &yptr); 
+  const double* diagptr;
+  VecGetArrayRead(*shellctx->diag, &diagptr);
+  const double* sqrtn = shellctx->sqrtn.data();
 
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
-  double xi2  = shellctx->oscil_vec[2]->getSelfkerr();   
-  double xi3  = shellctx->oscil_vec[3]->getSelfkerr();   
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling
-  double xi02 = shellctx->crosskerr[1];  // zz-coupling
-  double xi03 = shellctx->crosskerr[2];  // zz-coupling
-  double xi12 = shellctx->crosskerr[3];  // zz-coupling
-  double xi13 = shellctx->crosskerr[4];  // zz-coupling
-  double xi23 = shellctx->crosskerr[5];  // zz-coupling
   double J01  = shellctx->Jkl[0];  // Jaynes-Cummings coupling
   double J02  = shellctx->Jkl[1];  // Jaynes-Cummings coupling
   double J03  = shellctx->Jkl[2];  // Jaynes-Cummings coupling
@@ -1964,26 +2250,14 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   double eta12 = shellctx->eta[3];
   double eta13 = shellctx->eta[4];
   double eta23 = shellctx->eta[5];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
-  double detuning_freq2 = shellctx->oscil_vec[2]->getDetuning();
-  double detuning_freq3 = shellctx->oscil_vec[3]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
   double decay2 = 0.0;
   double decay3 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
-  double dephase2= 0.0;
-  double dephase3= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)   decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)   decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   if (shellctx->oscil_vec[2]->getDecayTime() > 1e-14 && shellctx->addT1)   decay2= 1./shellctx->oscil_vec[2]->getDecayTime();
-  if (shellctx->oscil_vec[2]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase2 = 1./shellctx->oscil_vec[2]->getDephaseTime();
   if (shellctx->oscil_vec[3]->getDecayTime() > 1e-14 && shellctx->addT1)   decay3= 1./shellctx->oscil_vec[3]->getDecayTime();
-  if (shellctx->oscil_vec[3]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase3 = 1./shellctx->oscil_vec[3]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -2016,9 +2290,10 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   int stridei3p = TensorGetIndex(n0,n1,n2,n3, 0,0,0,0,0,0,0,1);
 
    /* Iterate over indices of output vector y */
-  int it = 0;
+#pragma omp parallel for collapse(2)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
+      int it = i0p * stridei0p + i1p * stridei1p;  // first index of this (i0p,i1p) block
       for (int i2p = 0; i2p < n2; i2p++)  {
         for (int i3p = 0; i3p < n3; i3p++)  {
           for (int i0 = 0; i0 < n0; i0++)  {
@@ -2027,64 +2302,53 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
                 for (int i3 = 0; i3 < n3; i3++)  {
 
                   /* --- Diagonal part ---*/
-                  double xre = xptr[2 * it];
-                  double xim = xptr[2 * it + 1];
-                  // drift Hamiltonian: uout = ( hd(ik) - hd(ik'))*vin
-                  //                    vout = (-hd(ik) + hd(ik'))*uin
-                  double hd  = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, i0, i1, i2, i3)
-                             + H_selfkerr(xi0, xi1, xi2, xi3, i0, i1, i2, i3)
-                             + H_crosskerr(xi01, xi02, xi03, xi12, xi13, xi23, i0, i1, i2, i3);
-                  double hdp = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, i0p, i1p, i2p, i3p)
-                             + H_selfkerr(xi0, xi1, xi2, xi3, i0p, i1p, i2p, i3p)
-                             + H_crosskerr(xi01, xi02, xi03, xi12, xi13, xi23, i0p, i1p, i2p, i3p);
-                  double yre = ( hd - hdp ) * xim;
-                  double yim = (-hd + hdp ) * xre;
-                  // Decay l1, diagonal part: xout += l1diag xin
-                  // Dephasing l2: xout += l2(ik, ikp) xin
-                  double l1diag = L1diag(decay0, decay1, decay2, decay3, i0, i1, i2, i3, i0p, i1p, i2p, i3p);
-                  double l2 = L2(dephase0, dephase1, dephase2, dephase3, i0, i1, i2, i3, i0p, i1p, i2p, i3p);
-                  yre += (l2 + l1diag) * xre;
-                  yim += (l2 + l1diag) * xim;
+                  double xre = xptr[getIndexReal(it)];
+                  double xim = xptr[getIndexImag(it)];
+                  // drift Hamiltonian and diagonal Lindblad terms, precomputed: diag = (l2 + l1diag) - i (hd(ik) - hd(ik'))
+                  double diagre = diagptr[getIndexReal(it)];
+                  double diagim = diagptr[getIndexImag(it)];
+                  double yre = diagre * xre - diagim * xim;
+                  double yim = diagre * xim + diagim * xre;
 
 
                   /* --- Offdiagonal: Jkl coupling  --- */
                   // oscillator 0<->1 
-                  Jkl_coupling(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, J01, cos01, sin01, &yre, &yim);
+                  Jkl_coupling(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, sqrtn, J01, cos01, sin01, &yre, &yim);
                   // oscillator 0<->2
-                  Jkl_coupling(it, n0, n2, i0, i0p, i2, i2p, stridei0, stridei0p, stridei2, stridei2p, xptr, J02, cos02, sin02, &yre, &yim);
+                  Jkl_coupling(it, n0, n2, i0, i0p, i2, i2p, stridei0, stridei0p, stridei2, stridei2p, xptr, sqrtn, J02, cos02, sin02, &yre, &yim);
                   // oscillator 0<->3
-                  Jkl_coupling(it, n0, n3, i0, i0p, i3, i3p, stridei0, stridei0p, stridei3, stridei3p, xptr, J03, cos03, sin03, &yre, &yim);
+                  Jkl_coupling(it, n0, n3, i0, i0p, i3, i3p, stridei0, stridei0p, stridei3, stridei3p, xptr, sqrtn, J03, cos03, sin03, &yre, &yim);
                   // oscillator 1<->2
-                  Jkl_coupling(it, n1, n2, i1, i1p, i2, i2p, stridei1, stridei1p, stridei2, stridei2p, xptr, J12, cos12, sin12, &yre, &yim);
+                  Jkl_coupling(it, n1, n2, i1, i1p, i2, i2p, stridei1, stridei1p, stridei2, stridei2p, xptr, sqrtn, J12, cos12, sin12, &yre, &yim);
                   // oscillator 1<->3
-                  Jkl_coupling(it, n1, n3, i1, i1p, i3, i3p, stridei1, stridei1p, stridei3, stridei3p, xptr, J13, cos13, sin13, &yre, &yim);
+                  Jkl_coupling(it, n1, n3, i1, i1p, i3, i3p, stridei1, stridei1p, stridei3, stridei3p, xptr, sqrtn, J13, cos13, sin13, &yre, &yim);
                   // oscillator 2<->3
-                  Jkl_coupling(it, n2, n3, i2, i2p, i3, i3p, stridei2, stridei2p, stridei3, stridei3p, xptr, J23, cos23, sin23, &yre, &yim);
+                  Jkl_coupling(it, n2, n3, i2, i2p, i3, i3p, stridei2, stridei2p, stridei3, stridei3p, xptr, sqrtn, J23, cos23, sin23, &yre, &yim);
 
                   /* --- Offdiagonal part of decay L1 */
                   // Oscillators 0
-                  L1decay(it, n0, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
+                  L1decay(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, decay0, &yre, &yim);
                   // Oscillator 1
-                  L1decay(it, n1, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
+                  L1decay(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, decay1, &yre, &yim);
                   // Oscillator 2
-                  L1decay(it, n2, i2, i2p, stridei2, stridei2p, xptr, decay2, &yre, &yim);
+                  L1decay(it, n2, i2, i2p, stridei2, stridei2p, xptr, sqrtn, decay2, &yre, &yim);
                   // Oscillator 3
-                  L1decay(it, n3, i3, i3p, stridei3, stridei3p, xptr, decay3, &yre, &yim);
+                  L1decay(it, n3, i3, i3p, stridei3, stridei3p, xptr, sqrtn, decay3, &yre, &yim);
               
 
                   /* --- Control hamiltonian ---  */
                   // Oscillator 0 
-                  control(it, n0, i0, i0p, stridei0, stridei0p, xptr, pt0, qt0, &yre, &yim);
+                  control(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, pt0, qt0, &yre, &yim);
                   // Oscillator 1
-                  control(it, n1, i1, i1p, stridei1, stridei1p, xptr, pt1, qt1, &yre, &yim);
+                  control(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, pt1, qt1, &yre, &yim);
                   // Oscillator 2
-                  control(it, n2, i2, i2p, stridei2, stridei2p, xptr, pt2, qt2, &yre, &yim);
+                  control(it, n2, i2, i2p, stridei2, stridei2p, xptr, sqrtn, pt2, qt2, &yre, &yim);
                   // Oscillator 2
-                  control(it, n3, i3, i3p, stridei3, stridei3p, xptr, pt3, qt3, &yre, &yim);
+                  control(it, n3, i3, i3p, stridei3, stridei3p, xptr, sqrtn, pt3, qt3, &yre, &yim);
               
                   /* --- Update --- */
-                  yptr[2*it]   = yre;
-                  yptr[2*it+1] = yim;
+                  yptr[getIndexReal(it)]   = yre;
+                  yptr[getIndexImag(it)] = yim;
                   it++;
                 }
               }
@@ -2098,6 +2362,7 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   /* Restore x and y */
   VecRestoreArrayRead(x, &xptr);
   VecRestoreArray(y, &yptr);
+  VecRestoreArrayRead(*shellctx->diag, &diagptr);
 
   return 0;
 }
@@ -2116,18 +2381,11 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   double* yptr;
   VecGetArrayRead(x, &xptr);
   VecGetArray(y, &yptr);
+  const double* diagptr;
+  VecGetArrayRead(*shellctx->diag, &diagptr);
+  const double* sqrtn = shellctx->sqrtn.data();
 
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
-  double xi2  = shellctx->oscil_vec[2]->getSelfkerr();   
-  double xi3  = shellctx->oscil_vec[3]->getSelfkerr();   
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling
-  double xi02 = shellctx->crosskerr[1];  // zz-coupling
-  double xi03 = shellctx->crosskerr[2];  // zz-coupling
-  double xi12 = shellctx->crosskerr[3];  // zz-coupling
-  double xi13 = shellctx->crosskerr[4];  // zz-coupling
-  double xi23 = shellctx->crosskerr[5];  // zz-coupling
   double J01  = shellctx->Jkl[0];  // Jaynes-Cummings coupling
   double J02  = shellctx->Jkl[1];  // Jaynes-Cummings coupling
   double J03  = shellctx->Jkl[2];  // Jaynes-Cummings coupling
@@ -2140,26 +2398,14 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   double eta12 = shellctx->eta[3];
   double eta13 = shellctx->eta[4];
   double eta23 = shellctx->eta[5];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
-  double detuning_freq2 = shellctx->oscil_vec[2]->getDetuning();
-  double detuning_freq3 = shellctx->oscil_vec[3]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
   double decay2 = 0.0;
   double decay3 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
-  double dephase2= 0.0;
-  double dephase3= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)   decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)   decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   if (shellctx->oscil_vec[2]->getDecayTime() > 1e-14 && shellctx->addT1)   decay2= 1./shellctx->oscil_vec[2]->getDecayTime();
-  if (shellctx->oscil_vec[2]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase2 = 1./shellctx->oscil_vec[2]->getDephaseTime();
   if (shellctx->oscil_vec[3]->getDecayTime() > 1e-14 && shellctx->addT1)   decay3= 1./shellctx->oscil_vec[3]->getDecayTime();
-  if (shellctx->oscil_vec[3]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase3 = 1./shellctx->oscil_vec[3]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -2193,74 +2439,64 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
 
 
    /* Iterate over indices of output vector y */
-  int it = 0;
+#pragma omp parallel for collapse(2)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
+      int it = i0p * stridei0p + i1p * stridei1p;  // first index of this (i0p,i1p) block
       for (int i2p = 0; i2p < n2; i2p++)  {
         for (int i3p = 0; i3p < n3; i3p++)  {
           for (int i0 = 0; i0 < n0; i0++)  {
             for (int i1 = 0; i1 < n1; i1++)  {
               for (int i2 = 0; i2 < n2; i2++)  {
                 for (int i3 = 0; i3 < n3; i3++)  {
-                  double xre = xptr[2 * it];
-                  double xim = xptr[2 * it + 1];
+                  double xre = xptr[getIndexReal(it)];
+                  double xim = xptr[getIndexImag(it)];
 
                   /* --- Diagonal part ---*/
-                  // drift Hamiltonian Hd^T: uout = ( hd(ik) - hd(ik'))*vin
-                  //                         vout = (-hd(ik) + hd(ik'))*uin
-                  double hd  = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, i0, i1, i2, i3)
-                             + H_selfkerr(xi0, xi1, xi2, xi3, i0, i1, i2, i3)
-                             + H_crosskerr(xi01, xi02, xi03, xi12, xi13, xi23, i0, i1, i2, i3);
-                  double hdp = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, i0p, i1p, i2p, i3p)
-                             + H_selfkerr(xi0, xi1, xi2, xi3, i0p, i1p, i2p, i3p)
-                             + H_crosskerr(xi01, xi02, xi03, xi12, xi13, xi23, i0p, i1p, i2p, i3p);
-                  double yre = (-hd + hdp ) * xim;
-                  double yim = ( hd - hdp ) * xre;
-                  // Decay l1^T, diagonal part: xout += l1diag xin
-                  // Dephasing l2^T: xout += l2(ik, ikp) xin
-                  double l1diag = L1diag(decay0, decay1, decay2, decay3, i0, i1, i2, i3, i0p, i1p, i2p, i3p);
-                  double l2 = L2(dephase0, dephase1, dephase2, dephase3, i0, i1, i2, i3, i0p, i1p, i2p, i3p);
-                  yre += (l2 + l1diag) * xre;
-                  yim += (l2 + l1diag) * xim;
+                  // transpose of the precomputed diagonal part: conj(diag)
+                  double diagre = diagptr[getIndexReal(it)];
+                  double diagim = diagptr[getIndexImag(it)];
+                  double yre = diagre * xre + diagim * xim;
+                  double yim = diagre * xim - diagim * xre;
 
                   /* --- Offdiagonal coupling term J_kl --- */
                   // oscillator 0<->1
-                  Jkl_coupling_T(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, J01, cos01, sin01, &yre, &yim);
+                  Jkl_coupling_T(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, sqrtn, J01, cos01, sin01, &yre, &yim);
                   // oscillator 0<->2
-                  Jkl_coupling_T(it, n0, n2, i0, i0p, i2, i2p, stridei0, stridei0p, stridei2, stridei2p, xptr, J02, cos02, sin02, &yre, &yim);
+                  Jkl_coupling_T(it, n0, n2, i0, i0p, i2, i2p, stridei0, stridei0p, stridei2, stridei2p, xptr, sqrtn, J02, cos02, sin02, &yre, &yim);
                   // oscillator 0<->3
-                  Jkl_coupling_T(it, n0, n3, i0, i0p, i3, i3p, stridei0, stridei0p, stridei3, stridei3p, xptr, J03, cos03, sin03, &yre, &yim);
+                  Jkl_coupling_T(it, n0, n3, i0, i0p, i3, i3p, stridei0, stridei0p, stridei3, stridei3p, xptr, sqrtn, J03, cos03, sin03, &yre, &yim);
                   // oscillator 1<->2
-                  Jkl_coupling_T(it, n1, n2, i1, i1p, i2, i2p, stridei1, stridei1p, stridei2, stridei2p, xptr, J12, cos12, sin12, &yre, &yim);
+                  Jkl_coupling_T(it, n1, n2, i1, i1p, i2, i2p, stridei1, stridei1p, stridei2, stridei2p, xptr, sqrtn, J12, cos12, sin12, &yre, &yim);
                   // oscillator 1<->3
-                  Jkl_coupling_T(it, n1, n3, i1, i1p, i3, i3p, stridei1, stridei1p, stridei3, stridei3p, xptr, J13, cos13, sin13, &yre, &yim);
+                  Jkl_coupling_T(it, n1, n3, i1, i1p, i3, i3p, stridei1, stridei1p, stridei3, stridei3p, xptr, sqrtn, J13, cos13, sin13, &yre, &yim);
                   // oscillator 2<->3
-                  Jkl_coupling_T(it, n2, n3, i2, i2p, i3, i3p, stridei2, stridei2p, stridei3, stridei3p, xptr, J23, cos23, sin23, &yre, &yim);
+                  Jkl_coupling_T(it, n2, n3, i2, i2p, i3, i3p, stridei2, stridei2p, stridei3, stridei3p, xptr, sqrtn, J23, cos23, sin23, &yre, &yim);
               
 
                   /* --- Offdiagonal part of decay L1^T */
                   // Oscillators 0
-                  L1decay_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
+                  L1decay_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, decay0, &yre, &yim);
                   // Oscillator 1
-                  L1decay_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
+                  L1decay_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, decay1, &yre, &yim);
                   // Oscillator 2
-                  L1decay_T(it, n2, i2, i2p, stridei2, stridei2p, xptr, decay2, &yre, &yim);
+                  L1decay_T(it, n2, i2, i2p, stridei2, stridei2p, xptr, sqrtn, decay2, &yre, &yim);
                   // Oscillator 3
-                  L1decay_T(it, n3, i3, i3p, stridei3, stridei3p, xptr, decay3, &yre, &yim);
+                  L1decay_T(it, n3, i3, i3p, stridei3, stridei3p, xptr, sqrtn, decay3, &yre, &yim);
 
                   /* --- Control hamiltonian  --- */
                   // Oscillator 0
-                  control_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, pt0, qt0, &yre, &yim);
+                  control_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, pt0, qt0, &yre, &yim);
                   // Oscillator 1
-                  control_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, pt1, qt1, &yre, &yim);
+                  control_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, pt1, qt1, &yre, &yim);
                   // Oscillator 2
-                  control_T(it, n2, i2, i2p, stridei2, stridei2p, xptr, pt2, qt2, &yre, &yim);
+                  control_T(it, n2, i2, i2p, stridei2, stridei2p, xptr, sqrtn, pt2, qt2, &yre, &yim);
                   // Oscillator 3
-                  control_T(it, n3, i3, i3p, stridei3, stridei3p, xptr, pt3, qt3, &yre, &yim);
+                  control_T(it, n3, i3, i3p, stridei3, stridei3p, xptr, sqrtn, pt3, qt3, &yre, &yim);
 
                   /* Update */
-                  yptr[2*it]   = yre;
-                  yptr[2*it+1] = yim;
+                  yptr[getIndexReal(it)]   = yre;
+                  yptr[getIndexImag(it)] = yim;
                   it++;
                 }
               }
@@ -2274,6 +2510,7 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   /* Restore x and y */
   VecRestoreArrayRead(x, &xptr);
   VecRestoreArray(y, &yptr);
+  VecRestoreArrayRead(*shellctx->diag, &diagptr);
 
   return 0;
 }
@@ -2292,23 +2529,11 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   double* yptr;
   VecGetArrayRead(x, &xptr);
   VecGetArray(y, &yptr); 
+  const double* diagptr;
+  VecGetArrayRead(*shellctx->diag, &diagptr);
+  const double* sqrtn = shellctx->sqrtn.data();
 
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
-  double xi2  = shellctx->oscil_vec[2]->getSelfkerr();   
-  double xi3  = shellctx->oscil_vec[3]->getSelfkerr();   
-  double xi4  = shellctx->oscil_vec[4]->getSelfkerr();   
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling
-  double xi02 = shellctx->crosskerr[1];  // zz-coupling
-  double xi03 = shellctx->crosskerr[2];  // zz-coupling
-  double xi04 = shellctx->crosskerr[3];  // zz-coupling
-  double xi12 = shellctx->crosskerr[4];  // zz-coupling
-  double xi13 = shellctx->crosskerr[5];  // zz-coupling
-  double xi14 = shellctx->crosskerr[6];  // zz-coupling
-  double xi23 = shellctx->crosskerr[7];  // zz-coupling
-  double xi24 = shellctx->crosskerr[8];  // zz-coupling
-  double xi34 = shellctx->crosskerr[9];  // zz-coupling
   double J01  = shellctx->Jkl[0];  // Jaynes-Cummings coupling
   double J02  = shellctx->Jkl[1];  // Jaynes-Cummings coupling
   double J03  = shellctx->Jkl[2];  // Jaynes-Cummings coupling
@@ -2329,31 +2554,16 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   double eta23 = shellctx->eta[7];
   double eta24 = shellctx->eta[8];
   double eta34 = shellctx->eta[9];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
-  double detuning_freq2 = shellctx->oscil_vec[2]->getDetuning();
-  double detuning_freq3 = shellctx->oscil_vec[3]->getDetuning();
-  double detuning_freq4 = shellctx->oscil_vec[4]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
   double decay2 = 0.0;
   double decay3 = 0.0;
   double decay4 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
-  double dephase2= 0.0;
-  double dephase3= 0.0;
-  double dephase4= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)   decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)   decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   if (shellctx->oscil_vec[2]->getDecayTime() > 1e-14 && shellctx->addT1)   decay2= 1./shellctx->oscil_vec[2]->getDecayTime();
-  if (shellctx->oscil_vec[2]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase2 = 1./shellctx->oscil_vec[2]->getDephaseTime();
   if (shellctx->oscil_vec[3]->getDecayTime() > 1e-14 && shellctx->addT1)   decay3= 1./shellctx->oscil_vec[3]->getDecayTime();
-  if (shellctx->oscil_vec[3]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase3 = 1./shellctx->oscil_vec[3]->getDephaseTime();
   if (shellctx->oscil_vec[4]->getDecayTime() > 1e-14 && shellctx->addT1)   decay4= 1./shellctx->oscil_vec[4]->getDecayTime();
-  if (shellctx->oscil_vec[4]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase4 = 1./shellctx->oscil_vec[4]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -2398,9 +2608,10 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   int stridei4p = TensorGetIndex(n0,n1,n2,n3,n4, 0,0,0,0,0,0,0,0,0,1);
 
    /* Iterate over indices of output vector y */
-  int it = 0;
+#pragma omp parallel for collapse(2)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
+      int it = i0p * stridei0p + i1p * stridei1p;  // first index of this (i0p,i1p) block
       for (int i2p = 0; i2p < n2; i2p++)  {
         for (int i3p = 0; i3p < n3; i3p++)  {
           for (int i4p = 0; i4p < n4; i4p++)  {
@@ -2411,76 +2622,65 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
                     for (int i4 = 0; i4 < n4; i4++)  {
 
                       /* --- Diagonal part ---*/
-                      double xre = xptr[2 * it];
-                      double xim = xptr[2 * it + 1];
-                      // drift Hamiltonian: uout = ( hd(ik) - hd(ik'))*vin
-                      //                    vout = (-hd(ik) + hd(ik'))*uin
-                      double hd  = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, detuning_freq4, i0, i1, i2, i3, i4)
-                                 + H_selfkerr(xi0, xi1, xi2, xi3, xi4, i0, i1, i2, i3, i4)
-                                 + H_crosskerr(xi01, xi02, xi03, xi04, xi12, xi13, xi14, xi23, xi24, xi34, i0, i1, i2, i3, i4);
-                      double hdp = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, detuning_freq4, i0p, i1p, i2p, i3p, i4p)
-                                 + H_selfkerr(xi0, xi1, xi2, xi3, xi4, i0p, i1p, i2p, i3p, i4p)
-                                 + H_crosskerr(xi01, xi02, xi03, xi04, xi12, xi13, xi14, xi23, xi24, xi34, i0p, i1p, i2p, i3p, i4p);
-                      double yre = ( hd - hdp ) * xim;
-                      double yim = (-hd + hdp ) * xre;
-                      // Decay l1, diagonal part: xout += l1diag xin
-                      // Dephasing l2: xout += l2(ik, ikp) xin
-                      double l1diag = L1diag(decay0, decay1, decay2, decay3, decay4, i0, i1, i2, i3, i4, i0p, i1p, i2p, i3p, i4p);
-                      double l2 = L2(dephase0, dephase1, dephase2, dephase3, dephase4, i0, i1, i2, i3, i4, i0p, i1p, i2p, i3p, i4p);
-                      yre += (l2 + l1diag) * xre;
-                      yim += (l2 + l1diag) * xim;
+                      double xre = xptr[getIndexReal(it)];
+                      double xim = xptr[getIndexImag(it)];
+                      // drift Hamiltonian and diagonal Lindblad terms, precomputed: diag = (l2 + l1diag) - i (hd(ik) - hd(ik'))
+                      double diagre = diagptr[getIndexReal(it)];
+                      double diagim = diagptr[getIndexImag(it)];
+                      double yre = diagre * xre - diagim * xim;
+                      double yim = diagre * xim + diagim * xre;
 
 
                       /* --- Offdiagonal: Jkl coupling  --- */
                       // oscillator 0<->1 
-                      Jkl_coupling(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, J01, cos01, sin01, &yre, &yim);
+                      Jkl_coupling(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, sqrtn, J01, cos01, sin01, &yre, &yim);
                       // oscillator 0<->2
-                      Jkl_coupling(it, n0, n2, i0, i0p, i2, i2p, stridei0, stridei0p, stridei2, stridei2p, xptr, J02, cos02, sin02, &yre, &yim);
+                      Jkl_coupling(it, n0, n2, i0, i0p, i2, i2p, stridei0, stridei0p, stridei2, stridei2p, xptr, sqrtn, J02, cos02, sin02, &yre, &yim);
                       // oscillator 0<->3
-                      Jkl_coupling(it, n0, n3, i0, i0p, i3, i3p, stridei0, stridei0p, stridei3, stridei3p, xptr, J03, cos03, sin03, &yre, &yim);
+                      Jkl_coupling(it, n0, n3, i0, i0p, i3, i3p, stridei0, stridei0p, stridei3, stridei3p, xptr, sqrtn, J03, cos03, sin03, &yre, &yim);
                       // oscillator 0<->4
-                      Jkl_coupling(it, n0, n4, i0, i0p, i4, i4p, stridei0, stridei0p, stridei4, stridei4p, xptr, J04, cos04, sin04, &yre, &yim);
+                      Jkl_coupling(it, n0, n4, i0, i0p, i4, i4p, stridei0, stridei0p, stridei4, stridei4p, xptr, sqrtn, J04, cos04, sin04, &yre, &yim);
                       // oscillator 1<->2
-                      Jkl_coupling(it, n1, n2, i1, i1p, i2, i2p, stridei1, stridei1p, stridei2, stridei2p, xptr, J12, cos12, sin12, &yre, &yim);
+                      Jkl_coupling(it, n1, n2, i1, i1p, i2, i2p, stridei1, stridei1p, stridei2, stridei2p, xptr, sqrtn, J12, cos12, sin12, &yre, &yim);
                       // oscillator 1<->3
-                      Jkl_coupling(it, n1, n3, i1, i1p, i3, i3p, stridei1, stridei1p, stridei3, stridei3p, xptr, J13, cos13, sin13, &yre, &yim);
+                      Jkl_coupling(it, n1, n3, i1, i1p, i3, i3p, stridei1, stridei1p, stridei3, stridei3p, xptr, sqrtn, J13, cos13, sin13, &yre, &yim);
                       // oscillator 1<->4
-                      Jkl_coupling(it, n1, n4, i1, i1p, i4, i4p, stridei1, stridei1p, stridei4, stridei4p, xptr, J14, cos14, sin14, &yre, &yim);
+                      Jkl_coupling(it, n1, n4, i1, i1p, i4, i4p, stridei1, stridei1p, stridei4, stridei4p, xptr, sqrtn, J14, cos14, sin14, &yre, &yim);
                       // oscillator 2<->3
-                      Jkl_coupling(it, n2, n3, i2, i2p, i3, i3p, stridei2, stridei2p, stridei3, stridei3p, xptr, J23, cos23, sin23, &yre, &yim);
+                      Jkl_coupling(it, n2, n3, i2, i2p, i3, i3p, stridei2, stridei2p, stridei3, stridei3p, xptr, sqrtn, J23, cos23, sin23, &yre, &yim);
                       // oscillator 2<->4
-                      Jkl_coupling(it, n2, n4, i2, i2p, i4, i4p, stridei2, stridei2p, stridei4, stridei4p, xptr, J24, cos24, sin24, &yre, &yim);
+                      Jkl_coupling(it, n2, n4, i2, i2p, i4, i4p, stridei2, stridei2p, stridei4, stridei4p, xptr, sqrtn, J24, cos24, sin24, &yre, &yim);
                       // oscillator 3<->4
-                      Jkl_coupling(it, n3, n4, i3, i3p, i4, i4p, stridei3, stridei3p, stridei4, stridei4p, xptr, J34, cos34, sin34, &yre, &yim);
+                      Jkl_coupling(it, n3, n4, i3, i3p, i4, i4p, stridei3, stridei3p, stridei4, stridei4p, xptr, sqrtn, J34, cos34, sin34, &yre, &yim);
 
                       /* --- Offdiagonal part of decay L1 */
                       // Oscillator 0
-                      L1decay(it, n0, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
+                      L1decay(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, decay0, &yre, &yim);
                       // Oscillator 1
-                      L1decay(it, n1, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
+                      L1decay(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, decay1, &yre, &yim);
                       // Oscillator 2
-                      L1decay(it, n2, i2, i2p, stridei2, stridei2p, xptr, decay2, &yre, &yim);
+                      L1decay(it, n2, i2, i2p, stridei2, stridei2p, xptr, sqrtn, decay2, &yre, &yim);
                       // Oscillator 3
-                      L1decay(it, n3, i3, i3p, stridei3, stridei3p, xptr, decay3, &yre, &yim);
+                      L1decay(it, n3, i3, i3p, stridei3, stridei3p, xptr, sqrtn, decay3, &yre, &yim);
                       // Oscillator 4
-                      L1decay(it, n4, i4, i4p, stridei4, stridei4p, xptr, decay4, &yre, &yim);
+                      L1decay(it, n4, i4, i4p, stridei4, stridei4p, xptr, sqrtn, decay4, &yre, &yim);
               
 
                       /* --- Control hamiltonian ---  */
                       // Oscillator 0 
-                      control(it, n0, i0, i0p, stridei0, stridei0p, xptr, pt0, qt0, &yre, &yim);
+                      control(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, pt0, qt0, &yre, &yim);
                       // Oscillator 1
-                      control(it, n1, i1, i1p, stridei1, stridei1p, xptr, pt1, qt1, &yre, &yim);
+                      control(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, pt1, qt1, &yre, &yim);
                       // Oscillator 2
-                      control(it, n2, i2, i2p, stridei2, stridei2p, xptr, pt2, qt2, &yre, &yim);
+                      control(it, n2, i2, i2p, stridei2, stridei2p, xptr, sqrtn, pt2, qt2, &yre, &yim);
                       // Oscillator 3
-                      control(it, n3, i3, i3p, stridei3, stridei3p, xptr, pt3, qt3, &yre, &yim);
+                      control(it, n3, i3, i3p, stridei3, stridei3p, xptr, sqrtn, pt3, qt3, &yre, &yim);
                       // Oscillator 4
-                      control(it, n4, i4, i4p, stridei4, stridei4p, xptr, pt4, qt4, &yre, &yim);
+                      control(it, n4, i4, i4p, stridei4, stridei4p, xptr, sqrtn, pt4, qt4, &yre, &yim);
               
                       /* --- Update --- */
-                      yptr[2*it]   = yre;
-                      yptr[2*it+1] = yim;
+                      yptr[getIndexReal(it)]   = yre;
+                      yptr[getIndexImag(it)] = yim;
                       it++;
                     }
                   }
@@ -2496,6 +2696,7 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   /* Restore x and y */
   VecRestoreArrayRead(x, &xptr);
   VecRestoreArray(y, &yptr);
+  VecRestoreArrayRead(*shellctx->diag, &diagptr);
 
   return 0;
 }
@@ -2514,23 +2715,11 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   double* yptr;
   VecGetArrayRead(x, &xptr);
   VecGetArray(y, &yptr);
+  const double* diagptr;
+  VecGetArrayRead(*shellctx->diag, &diagptr);
+  const double* sqrtn = shellctx->sqrtn.data();
 
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
-  double xi2  = shellctx->oscil_vec[2]->getSelfkerr();   
-  double xi3  = shellctx->oscil_vec[3]->getSelfkerr();   
-  double xi4  = shellctx->oscil_vec[4]->getSelfkerr();   
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling
-  double xi02 = shellctx->crosskerr[1];  // zz-coupling
-  double xi03 = shellctx->crosskerr[2];  // zz-coupling
-  double xi04 = shellctx->crosskerr[3];  // zz-coupling
-  double xi12 = shellctx->crosskerr[4];  // zz-coupling
-  double xi13 = shellctx->crosskerr[5];  // zz-coupling
-  double xi14 = shellctx->crosskerr[6];  // zz-coupling
-  double xi23 = shellctx->crosskerr[7];  // zz-coupling
-  double xi24 = shellctx->crosskerr[8];  // zz-coupling
-  double xi34 = shellctx->crosskerr[9];  // zz-coupling
   double J01  = shellctx->Jkl[0];  // Jaynes-Cummings coupling
   double J02  = shellctx->Jkl[1];  // Jaynes-Cummings coupling
   double J03  = shellctx->Jkl[2];  // Jaynes-Cummings coupling
@@ -2551,31 +2740,16 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   double eta23 = shellctx->eta[7];
   double eta24 = shellctx->eta[8];
   double eta34 = shellctx->eta[9];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
-  double detuning_freq2 = shellctx->oscil_vec[2]->getDetuning();
-  double detuning_freq3 = shellctx->oscil_vec[3]->getDetuning();
-  double detuning_freq4 = shellctx->oscil_vec[4]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
   double decay2 = 0.0;
   double decay3 = 0.0;
   double decay4 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
-  double dephase2= 0.0;
-  double dephase3= 0.0;
-  double dephase4= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)   decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)   decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   if (shellctx->oscil_vec[2]->getDecayTime() > 1e-14 && shellctx->addT1)   decay2= 1./shellctx->oscil_vec[2]->getDecayTime();
-  if (shellctx->oscil_vec[2]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase2 = 1./shellctx->oscil_vec[2]->getDephaseTime();
   if (shellctx->oscil_vec[3]->getDecayTime() > 1e-14 && shellctx->addT1)   decay3= 1./shellctx->oscil_vec[3]->getDecayTime();
-  if (shellctx->oscil_vec[3]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase3 = 1./shellctx->oscil_vec[3]->getDephaseTime();
   if (shellctx->oscil_vec[4]->getDecayTime() > 1e-14 && shellctx->addT1)   decay4= 1./shellctx->oscil_vec[4]->getDecayTime();
-  if (shellctx->oscil_vec[4]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase4 = 1./shellctx->oscil_vec[4]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -2620,9 +2794,10 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   int stridei4p = TensorGetIndex(n0,n1,n2,n3,n4, 0,0,0,0,0,0,0,0,0,1);
 
    /* Iterate over indices of output vector y */
-  int it = 0;
+#pragma omp parallel for collapse(2)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
+      int it = i0p * stridei0p + i1p * stridei1p;  // first index of this (i0p,i1p) block
       for (int i2p = 0; i2p < n2; i2p++)  {
         for (int i3p = 0; i3p < n3; i3p++)  {
           for (int i4p = 0; i4p < n4; i4p++)  {
@@ -2632,76 +2807,65 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
                   for (int i3 = 0; i3 < n3; i3++)  {
                     for (int i4 = 0; i4 < n4; i4++)  {
 
-                      double xre = xptr[2 * it];
-                      double xim = xptr[2 * it + 1];
+                      double xre = xptr[getIndexReal(it)];
+                      double xim = xptr[getIndexImag(it)];
 
                       /* --- Diagonal part ---*/
-                      // drift Hamiltonian Hd^T: uout = ( hd(ik) - hd(ik'))*vin
-                      //                         vout = (-hd(ik) + hd(ik'))*uin
-                      double hd  = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, detuning_freq4, i0, i1, i2, i3, i4)
-                                 + H_selfkerr(xi0, xi1, xi2, xi3, xi4, i0, i1, i2, i3, i4)
-                                 + H_crosskerr(xi01, xi02, xi03, xi04, xi12, xi13, xi14, xi23, xi24, xi34,i0, i1, i2, i3, i4);
-                      double hdp = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, detuning_freq4, i0p, i1p, i2p, i3p, i4p)
-                                 + H_selfkerr(xi0, xi1, xi2, xi3, xi4, i0p, i1p, i2p, i3p, i4p)
-                                 + H_crosskerr(xi01, xi02, xi03, xi04, xi12, xi13, xi14, xi23, xi24, xi34, i0p, i1p, i2p, i3p, i4p);
-                      double yre = (-hd + hdp ) * xim;
-                      double yim = ( hd - hdp ) * xre;
-                      // Decay l1^T, diagonal part: xout += l1diag xin
-                      // Dephasing l2^T: xout += l2(ik, ikp) xin
-                      double l1diag = L1diag(decay0, decay1, decay2, decay3, decay4, i0, i1, i2, i3, i4, i0p, i1p, i2p, i3p, i4p);
-                      double l2 = L2(dephase0, dephase1, dephase2, dephase3, dephase4, i0, i1, i2, i3, i4, i0p, i1p, i2p, i3p, i4p);
-                      yre += (l2 + l1diag) * xre;
-                      yim += (l2 + l1diag) * xim;
+                      // transpose of the precomputed diagonal part: conj(diag)
+                      double diagre = diagptr[getIndexReal(it)];
+                      double diagim = diagptr[getIndexImag(it)];
+                      double yre = diagre * xre + diagim * xim;
+                      double yim = diagre * xim - diagim * xre;
 
                       /* --- Offdiagonal coupling term J_kl --- */
                       // oscillator 0<->1
-                      Jkl_coupling_T(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, J01, cos01, sin01, &yre, &yim);
+                      Jkl_coupling_T(it, n0, n1, i0, i0p, i1, i1p, stridei0, stridei0p, stridei1, stridei1p, xptr, sqrtn, J01, cos01, sin01, &yre, &yim);
                       // oscillator 0<->2
-                      Jkl_coupling_T(it, n0, n2, i0, i0p, i2, i2p, stridei0, stridei0p, stridei2, stridei2p, xptr, J02, cos02, sin02, &yre, &yim);
+                      Jkl_coupling_T(it, n0, n2, i0, i0p, i2, i2p, stridei0, stridei0p, stridei2, stridei2p, xptr, sqrtn, J02, cos02, sin02, &yre, &yim);
                       // oscillator 0<->3
-                      Jkl_coupling_T(it, n0, n3, i0, i0p, i3, i3p, stridei0, stridei0p, stridei3, stridei3p, xptr, J03, cos03, sin03, &yre, &yim);
+                      Jkl_coupling_T(it, n0, n3, i0, i0p, i3, i3p, stridei0, stridei0p, stridei3, stridei3p, xptr, sqrtn, J03, cos03, sin03, &yre, &yim);
                       // oscillator 0<->4
-                      Jkl_coupling_T(it, n0, n4, i0, i0p, i4, i4p, stridei0, stridei0p, stridei4, stridei4p, xptr, J04, cos04, sin04, &yre, &yim);
+                      Jkl_coupling_T(it, n0, n4, i0, i0p, i4, i4p, stridei0, stridei0p, stridei4, stridei4p, xptr, sqrtn, J04, cos04, sin04, &yre, &yim);
                       // oscillator 1<->2
-                      Jkl_coupling_T(it, n1, n2, i1, i1p, i2, i2p, stridei1, stridei1p, stridei2, stridei2p, xptr, J12, cos12, sin12, &yre, &yim);
+                      Jkl_coupling_T(it, n1, n2, i1, i1p, i2, i2p, stridei1, stridei1p, stridei2, stridei2p, xptr, sqrtn, J12, cos12, sin12, &yre, &yim);
                       // oscillator 1<->3
-                      Jkl_coupling_T(it, n1, n3, i1, i1p, i3, i3p, stridei1, stridei1p, stridei3, stridei3p, xptr, J13, cos13, sin13, &yre, &yim);
+                      Jkl_coupling_T(it, n1, n3, i1, i1p, i3, i3p, stridei1, stridei1p, stridei3, stridei3p, xptr, sqrtn, J13, cos13, sin13, &yre, &yim);
                       // oscillator 1<->4
-                      Jkl_coupling_T(it, n1, n4, i1, i1p, i4, i4p, stridei1, stridei1p, stridei4, stridei4p, xptr, J14, cos14, sin14, &yre, &yim);
+                      Jkl_coupling_T(it, n1, n4, i1, i1p, i4, i4p, stridei1, stridei1p, stridei4, stridei4p, xptr, sqrtn, J14, cos14, sin14, &yre, &yim);
                       // oscillator 2<->3
-                      Jkl_coupling_T(it, n2, n3, i2, i2p, i3, i3p, stridei2, stridei2p, stridei3, stridei3p, xptr, J23, cos23, sin23, &yre, &yim);
+                      Jkl_coupling_T(it, n2, n3, i2, i2p, i3, i3p, stridei2, stridei2p, stridei3, stridei3p, xptr, sqrtn, J23, cos23, sin23, &yre, &yim);
                       // oscillator 2<->4
-                      Jkl_coupling_T(it, n2, n4, i2, i2p, i4, i4p, stridei2, stridei2p, stridei4, stridei4p, xptr, J24, cos24, sin24, &yre, &yim);
+                      Jkl_coupling_T(it, n2, n4, i2, i2p, i4, i4p, stridei2, stridei2p, stridei4, stridei4p, xptr, sqrtn, J24, cos24, sin24, &yre, &yim);
                       // oscillator 3<->4
-                      Jkl_coupling_T(it, n3, n4, i3, i3p, i4, i4p, stridei3, stridei3p, stridei4, stridei4p, xptr, J34, cos34, sin34, &yre, &yim);
+                      Jkl_coupling_T(it, n3, n4, i3, i3p, i4, i4p, stridei3, stridei3p, stridei4, stridei4p, xptr, sqrtn, J34, cos34, sin34, &yre, &yim);
               
                       /* --- Offdiagonal part of decay L1^T */
                       // Oscillators 0
-                      L1decay_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
+                      L1decay_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, decay0, &yre, &yim);
                       // Oscillator 1
-                      L1decay_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
+                      L1decay_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, decay1, &yre, &yim);
                       // Oscillator 2
-                      L1decay_T(it, n2, i2, i2p, stridei2, stridei2p, xptr, decay2, &yre, &yim);
+                      L1decay_T(it, n2, i2, i2p, stridei2, stridei2p, xptr, sqrtn, decay2, &yre, &yim);
                       // Oscillator 3
-                      L1decay_T(it, n3, i3, i3p, stridei3, stridei3p, xptr, decay3, &yre, &yim);
+                      L1decay_T(it, n3, i3, i3p, stridei3, stridei3p, xptr, sqrtn, decay3, &yre, &yim);
                       // Oscillator 4
-                      L1decay_T(it, n4, i4, i4p, stridei4, stridei4p, xptr, decay4, &yre, &yim);
+                      L1decay_T(it, n4, i4, i4p, stridei4, stridei4p, xptr, sqrtn, decay4, &yre, &yim);
 
                       /* --- Control hamiltonian  --- */
                       // Oscillator 0
-                      control_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, pt0, qt0, &yre, &yim);
+                      control_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, sqrtn, pt0, qt0, &yre, &yim);
                       // Oscillator 1
-                      control_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, pt1, qt1, &yre, &yim);
+                      control_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, sqrtn, pt1, qt1, &yre, &yim);
                       // Oscillator 2
-                      control_T(it, n2, i2, i2p, stridei2, stridei2p, xptr, pt2, qt2, &yre, &yim);
+                      control_T(it, n2, i2, i2p, stridei2, stridei2p, xptr, sqrtn, pt2, qt2, &yre, &yim);
                       // Oscillator 3
-                      control_T(it, n3, i3, i3p, stridei3, stridei3p, xptr, pt3, qt3, &yre, &yim);
+                      control_T(it, n3, i3, i3p, stridei3, stridei3p, xptr, sqrtn, pt3, qt3, &yre, &yim);
                       // Oscillator 4
-                      control_T(it, n4, i4, i4p, stridei4, stridei4p, xptr, pt4, qt4, &yre, &yim);
+                      control_T(it, n4, i4, i4p, stridei4, stridei4p, xptr, sqrtn, pt4, qt4, &yre, &yim);
 
                       /* Update */
-                      yptr[2*it]   = yre;
-                      yptr[2*it+1] = yim;
+                      yptr[getIndexReal(it)]   = yre;
+                      yptr[getIndexImag(it)] = yim;
                       it++;
                     }
                   }
@@ -2717,10 +2881,993 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   /* Restore x and y */
   VecRestoreArrayRead(x, &xptr);
   VecRestoreArray(y, &yptr);
+  VecRestoreArrayRead(*shellctx->diag, &diagptr);
+
+  return 0;
+}
+
+/* Matfree-solver for any number of oscillators and levels: Define the action of RHS on a vector x. 
+ * Strides are taken at runtime from the oscillators' dim_postOsc, tensor indices are advanced like an odometer. */
+int myMatMult_matfree_generic(Mat RHS, Vec x, Vec y){
+
+  /* Get the shell context */
+  MatShellCtx *shellctx;
+  MatShellGetContext(RHS, (void**) &shellctx);
+
+  /* Get access to x and y */
+  const double* xptr;
+  double* yptr;
+  matfree_getArrayHalo(shellctx, x, &xptr);
+  VecGetArray(y, &yptr); 
+
+  /* Evaluate coefficients and strides for each oscillator */
+  int nosc = shellctx->nlevels.size();
+  int dim_rho = 1;
+  for (int k = 0; k < nosc; k++) dim_rho *= shellctx->nlevels[k];
+  std::vector<int> n(nosc), stridei(nosc), strideip(nosc);
+  std::vector<double> decay(nosc, 0.0), pt(nosc), qt(nosc);
+  for (int k = 0; k < nosc; k++) {
+    n[k] = shellctx->nlevels[k];
+    stridei[k]  = shellctx->oscil_vec[k]->dim_postOsc;
+    strideip[k] = dim_rho * shellctx->oscil_vec[k]->dim_postOsc;
+    if (shellctx->oscil_vec[k]->getDecayTime() > 1e-14 && shellctx->addT1)   decay[k] = 1./shellctx->oscil_vec[k]->getDecayTime();
+    pt[k] = shellctx->control_Re[k];
+    qt[k] = shellctx->control_Im[k];
+  }
+  std::vector<double> cosJ(shellctx->eta.size()), sinJ(shellctx->eta.size());
+  for (int kl = 0; kl < shellctx->eta.size(); kl++) {
+    cosJ[kl] = cos(shellctx->eta[kl] * shellctx->time);
+    sinJ[kl] = sin(shellctx->eta[kl] * shellctx->time);
+  }
+
+  /* Precomputed diagonal and ladder factors */
+  const double* diagptr;
+  VecGetArrayRead(*shellctx->diag, &diagptr);
+  const double* sqrtn = shellctx->sqrtn.data();
+  std::vector<int> i(nosc), ip(nosc);
+
+  /* Iterate over the local indices of output vector y, one column of rho at a time */
+  int it_low = shellctx->it_low;
+  double alpha = shellctx->alpha;
+  double beta = shellctx->beta;
+  int it_upp = shellctx->it_upp;
+#pragma omp parallel for firstprivate(i, ip)
+  for (int col = it_low / dim_rho; col <= (it_upp-1) / dim_rho; col++) {
+    int row_first = std::max(it_low - col * dim_rho, 0);
+    int row_last  = std::min(it_upp - col * dim_rho, dim_rho);
+    int it = col * dim_rho + row_first;  // first local index in this column
+    for (int k = 0; k < nosc; k++) {
+      i[k]  = (row_first / stridei[k]) % n[k];
+      ip[k] = (col / stridei[k]) % n[k];
+    }
+    for (int row = row_first; row < row_last; row++) {
+
+      /* --- Diagonal part ---*/
+      //Get input x values
+      double xre = xptr[getIndexReal(it)];
+      double xim = xptr[getIndexImag(it)];
+      // drift Hamiltonian and diagonal Lindblad terms, precomputed: diag = (l2 + l1diag) - i (hd(ik) - hd(ik'))
+      double diagre = diagptr[getIndexReal(it - it_low)];
+      double diagim = diagptr[getIndexImag(it - it_low)];
+      double yre = diagre * xre - diagim * xim;
+      double yim = diagre * xim + diagim * xre;
+
+      /* --- Offdiagonal: Jkl coupling  --- */
+      int kl = 0;
+      for (int k = 0; k < nosc; k++) {
+        for (int l = k+1; l < nosc; l++) {
+          Jkl_coupling(it, n[k], n[l], i[k], ip[k], i[l], ip[l], stridei[k], strideip[k], stridei[l], strideip[l], xptr, sqrtn, shellctx->Jkl[kl], cosJ[kl], sinJ[kl], &yre, &yim);
+          kl++;
+        }
+      }
+
+      for (int k = 0; k < nosc; k++) {
+        /* --- Offdiagonal part of decay L1 */
+        L1decay(it, n[k], i[k], ip[k], stridei[k], strideip[k], xptr, sqrtn, decay[k], &yre, &yim);
+        /* --- Control hamiltonian ---  */
+        control(it, n[k], i[k], ip[k], stridei[k], strideip[k], xptr, sqrtn, pt[k], qt[k], &yre, &yim);
+      }
+
+      /* --- Update: y = alpha x + beta RHS x --- */
+      yptr[getIndexReal(it - it_low)]   = alpha * xre + beta * yre;
+      yptr[getIndexImag(it - it_low)] = alpha * xim + beta * yim;
+      it++;
+
+      /* Advance row indices i0,i1,... */
+      for (int k = nosc-1; k >= 0; k--) {
+        if (++i[k] < n[k]) break;
+        i[k] = 0;
+      }
+    }
+  }
+
+  /* Restore x and y */
+  matfree_restoreArrayHalo(shellctx, x, &xptr);
+  VecRestoreArray(y, &yptr);
+  VecRestoreArrayRead(*shellctx->diag, &diagptr);
+
+  return 0;
+}
+
+/* Matfree-solver for any number of oscillators and levels: Define the action of RHS^T on a vector x */
+int myMatMultTranspose_matfree_generic(Mat RHS, Vec x, Vec y){
+
+  /* Get the shell context */
+  MatShellCtx *shellctx;
+  MatShellGetContext(RHS, (void**) &shellctx);
+
+  /* Get access to x and y */
+  const double* xptr;
+  double* yptr;
+  matfree_getArrayHalo(shellctx, x, &xptr);
+  VecGetArray(y, &yptr); 
+
+  /* Evaluate coefficients and strides for each oscillator */
+  int nosc = shellctx->nlevels.size();
+  int dim_rho = 1;
+  for (int k = 0; k < nosc; k++) dim_rho *= shellctx->nlevels[k];
+  std::vector<int> n(nosc), stridei(nosc), strideip(nosc);
+  std::vector<double> decay(nosc, 0.0), pt(nosc), qt(nosc);
+  for (int k = 0; k < nosc; k++) {
+    n[k] = shellctx->nlevels[k];
+    stridei[k]  = shellctx->oscil_vec[k]->dim_postOsc;
+    strideip[k] = dim_rho * shellctx->oscil_vec[k]->dim_postOsc;
+    if (shellctx->oscil_vec[k]->getDecayTime() > 1e-14 && shellctx->addT1)   decay[k] = 1./shellctx->oscil_vec[k]->getDecayTime();
+    pt[k] = shellctx->control_Re[k];
+    qt[k] = shellctx->control_Im[k];
+  }
+  std::vector<double> cosJ(shellctx->eta.size()), sinJ(shellctx->eta.size());
+  for (int kl = 0; kl < shellctx->eta.size(); kl++) {
+    cosJ[kl] = cos(shellctx->eta[kl] * shellctx->time);
+    sinJ[kl] = sin(shellctx->eta[kl] * shellctx->time);
+  }
+
+  /* Precomputed diagonal and ladder factors */
+  const double* diagptr;
+  VecGetArrayRead(*shellctx->diag, &diagptr);
+  const double* sqrtn = shellctx->sqrtn.data();
+  std::vector<int> i(nosc), ip(nosc);
+
+  /* Iterate over the local indices of output vector y, one column of rho at a time */
+  int it_low = shellctx->it_low;
+  double alpha = shellctx->alpha;
+  double beta = shellctx->beta;
+  int it_upp = shellctx->it_upp;
+#pragma omp parallel for firstprivate(i, ip)
+  for (int col = it_low / dim_rho; col <= (it_upp-1) / dim_rho; col++) {
+    int row_first = std::max(it_low - col * dim_rho, 0);
+    int row_last  = std::min(it_upp - col * dim_rho, dim_rho);
+    int it = col * dim_rho + row_first;  // first local index in this column
+    for (int k = 0; k < nosc; k++) {
+      i[k]  = (row_first / stridei[k]) % n[k];
+      ip[k] = (col / stridei[k]) % n[k];
+    }
+    for (int row = row_first; row < row_last; row++) {
+
+      /* --- Diagonal part ---*/
+      //Get input x values
+      double xre = xptr[getIndexReal(it)];
+      double xim = xptr[getIndexImag(it)];
+      // transpose of the precomputed diagonal part: conj(diag)
+      double diagre = diagptr[getIndexReal(it - it_low)];
+      double diagim = diagptr[getIndexImag(it - it_low)];
+      double yre = diagre * xre + diagim * xim;
+      double yim = diagre * xim - diagim * xre;
+
+      /* --- Offdiagonal coupling term J_kl --- */
+      int kl = 0;
+      for (int k = 0; k < nosc; k++) {
+        for (int l = k+1; l < nosc; l++) {
+          Jkl_coupling_T(it, n[k], n[l], i[k], ip[k], i[l], ip[l], stridei[k], strideip[k], stridei[l], strideip[l], xptr, sqrtn, shellctx->Jkl[kl], cosJ[kl], sinJ[kl], &yre, &yim);
+          kl++;
+        }
+      }
+
+      for (int k = 0; k < nosc; k++) {
+        /* --- Offdiagonal part of decay L1^T */
+        L1decay_T(it, n[k], i[k], ip[k], stridei[k], strideip[k], xptr, sqrtn, decay[k], &yre, &yim);
+        /* --- Control hamiltonian  --- */
+        control_T(it, n[k], i[k], ip[k], stridei[k], strideip[k], xptr, sqrtn, pt[k], qt[k], &yre, &yim);
+      }
+
+      /* Update: y = alpha x + beta RHS^T x */
+      yptr[getIndexReal(it - it_low)]   = alpha * xre + beta * yre;
+      yptr[getIndexImag(it - it_low)] = alpha * xim + beta * yim;
+      it++;
+
+      /* Advance row indices i0,i1,... */
+      for (int k = nosc-1; k >= 0; k--) {
+        if (++i[k] < n[k]) break;
+        i[k] = 0;
+      }
+    }
+  }
+
+  /* Restore x and y */
+  matfree_restoreArrayHalo(shellctx, x, &xptr);
+  VecRestoreArray(y, &yptr);
+  VecRestoreArrayRead(*shellctx->diag, &diagptr);
 
   return 0;
 }
 
+/* Matfree-solver for state vectors (Schroedinger mode): Apply M = -iH(t) (or M^T) to psi, for any number of oscillators 
+ * and levels. Since H is Hermitian, the real-valued M is skew-symmetric and hence M^T psi = -M psi. */
+void matfree_schroedinger_apply(MatShellCtx* shellctx, const double* xptr, double* yptr, bool transpose){
+
+  /* Evaluate coefficients and strides for each oscillator */
+  int nosc = shellctx->nlevels.size();
+  std::vector<int> n(nosc), stridei(nosc);
+  std::vector<double> pt(nosc), qt(nosc);
+  for (int k = 0; k < nosc; k++) {
+    n[k] = shellctx->nlevels[k];
+    stridei[k]  = shellctx->oscil_vec[k]->dim_postOsc;
+    pt[k] = shellctx->control_Re[k];
+    qt[k] = shellctx->control_Im[k];
+  }
+  std::vector<double> cosJ(shellctx->eta.size()), sinJ(shellctx->eta.size());
+  for (int kl = 0; kl < shellctx->eta.size(); kl++) {
+    cosJ[kl] = cos(shellctx->eta[kl] * shellctx->time);
+    sinJ[kl] = sin(shellctx->eta[kl] * shellctx->time);
+  }
+  double sign = transpose ? -1.0 : 1.0;
+
+  /* Precomputed diagonal and ladder factors */
+  const double* diagptr;
+  VecGetArrayRead(*shellctx->diag, &diagptr);
+  const double* sqrtn = shellctx->sqrtn.data();
+  std::vector<int> i(nosc);
+
+  /* Iterate over the local indices of output vector y, one block of fixed i0 at a time */
+  int it_low = shellctx->it_low;
+  int it_upp = shellctx->it_upp;
+  int stride0 = stridei[0];
+#pragma omp parallel for firstprivate(i)
+  for (int blk = it_low / stride0; blk <= (it_upp-1) / stride0; blk++) {
+    int it_first = std::max(it_low, blk * stride0);
+    int it_last  = std::min(it_upp, (blk+1) * stride0);
+    for (int k = 0; k < nosc; k++) i[k] = (it_first / stridei[k]) % n[k];
+    for (int it = it_first; it < it_last; it++) {
+
+      /* --- Diagonal part ---*/
+      // drift Hamiltonian, precomputed: diag = -i hd(ik)
+      double xre = xptr[getIndexReal(it)];
+      double xim = xptr[getIndexImag(it)];
+      double diagim = diagptr[getIndexImag(it - it_low)];
+      double yre = - diagim * xim;
+      double yim =   diagim * xre;
+
+      /* --- Offdiagonal: Jkl coupling  --- */
+      int kl = 0;
+      for (int k = 0; k < nosc; k++) {
+        for (int l = k+1; l < nosc; l++) {
+          Jkl_coupling_schroedinger(it, n[k], n[l], i[k], i[l], stridei[k], stridei[l], xptr, sqrtn, shellctx->Jkl[kl], cosJ[kl], sinJ[kl], &yre, &yim);
+          kl++;
+        }
+      }
+
+      /* --- Control hamiltonian ---  */
+      for (int k = 0; k < nosc; k++) {
+        control_schroedinger(it, n[k], i[k], stridei[k], xptr, sqrtn, pt[k], qt[k], &yre, &yim);
+      }
+
+      /* --- Update --- */
+      yptr[getIndexReal(it - it_low)] = sign * yre;
+      yptr[getIndexImag(it - it_low)] = sign * yim;
+
+      /* Advance indices i0,i1,... */
+      for (int k = nosc-1; k >= 0; k--) {
+        if (++i[k] < n[k]) break;
+        i[k] = 0;
+      }
+    }
+  }
+
+  VecRestoreArrayRead(*shellctx->diag, &diagptr);
+}
+
+int myMatMult_schroedinger(Mat RHS, Vec x, Vec y){
+
+  /* Get the shell context */
+  MatShellCtx *shellctx;
+  MatShellGetContext(RHS, (void**) &shellctx);
+
+  /* Get access to x and y */
+  const double* xptr;
+  double* yptr;
+  matfree_getArrayHalo(shellctx, x, &xptr);
+  VecGetArray(y, &yptr);
+
+  matfree_schroedinger_apply(shellctx, xptr, yptr, false);
+
+  /* Restore x and y */
+  matfree_restoreArrayHalo(shellctx, x, &xptr);
+  VecRestoreArray(y, &yptr);
+
+  return 0;
+}
+
+int myMatMultTranspose_schroedinger(Mat RHS, Vec x, Vec y){
+
+  /* Get the shell context */
+  MatShellCtx *shellctx;
+  MatShellGetContext(RHS, (void**) &shellctx);
+
+  /* Get access to x and y */
+  const double* xptr;
+  double* yptr;
+  matfree_getArrayHalo(shellctx, x, &xptr);
+  VecGetArray(y, &yptr);
+
+  matfree_schroedinger_apply(shellctx, xptr, yptr, true);
+
+  /* Restore x and y */
+  matfree_restoreArrayHalo(shellctx, x, &xptr);
+  VecRestoreArray(y, &yptr);
+
+  return 0;
+}
+
+/* Offdiagonal term of the matrix-free RHS in the form y(it) += c * prod_a sqrt(max(l_a, l_a+d_a)) * x(it + shift), 
+ * where l_a is the row (or column) level of oscillator osc[a], shifted by d_a = +-1. Control, L1 decay and Jkl coupling 
+ * terms all fit this form. The transpose is obtained by flipping the shifts and conjugating c. */
+struct MatFreeTerm {
+  int nidx;          // Number of shifted levels (1 or 2)
+  int osc[2];        // Oscillator of each shifted level
+  bool primed[2];    // Shift in the column (true) or row (false) index
+  int disp[2];       // Displacement (+1 or -1)
+  double cre, cim;   // Complex coefficient
+  int shift;         // Resulting shift in the vectorized index
+};
+
+/* Collect the offdiagonal terms of the matrix-free RHS for control amplitudes pt, qt. If drift is false, only the 
+ * control terms are collected: since those are linear in (pt,qt), this gives the derivative terms with respect to 
+ * the controls for unit amplitudes. In Schroedinger mode, only the row index is shifted and there is no decay. */
+void matfree_collectTerms(MatShellCtx* shellctx, const std::vector<double>& pt, const std::vector<double>& qt, bool drift, std::vector<MatFreeTerm>& terms){
+  int nosc = shellctx->nlevels.size();
+  bool rho = !shellctx->schroedinger;
+  for (int k = 0; k < nosc; k++) {
+    // Control hamiltonian: rho(ik+1..,ik'..), rho(ik..,ik'+1..), rho(ik-1..,ik'..), rho(ik..,ik'-1..)
+    terms.push_back({1, {k, 0}, {false, false}, {+1, 0},  qt[k], -pt[k], 0});
+    if (rho) terms.push_back({1, {k, 0}, {true,  false}, {+1, 0},  qt[k],  pt[k], 0});
+    terms.push_back({1, {k, 0}, {false, false}, {-1, 0}, -qt[k], -pt[k], 0});
+    if (rho) terms.push_back({1, {k, 0}, {true,  false}, {-1, 0}, -qt[k],  pt[k], 0});
+    // Offdiagonal part of decay L1: rho(ik+1..,ik'+1..)
+    if (drift && rho && shellctx->addT1 && shellctx->oscil_vec[k]->getDecayTime() > 1e-14) {
+      double decay = 1./shellctx->oscil_vec[k]->getDecayTime();
+      if (fabs(decay) > 1e-12) 
+        terms.push_back({2, {k, k}, {false, true}, {+1, +1}, decay, 0.0, 0});
+    }
+  }
+  if (!drift) return;
+  int kl = 0;
+  for (int k = 0; k < nosc; k++) {
+    for (int l = k+1; l < nosc; l++) {
+      double J = shellctx->Jkl[kl];
+      if (fabs(J) > 1e-10) {
+        double cosJ = cos(shellctx->eta[kl] * shellctx->time);
+        double sinJ = sin(shellctx->eta[kl] * shellctx->time);
+        // Jkl coupling: rho(E-k+l i, i'), rho(E+k-l i, i'), rho(i, E-k+l i'), rho(i, E+k-l i')
+        terms.push_back({2, {k, l}, {false, false}, {-1, +1},  J*sinJ, -J*cosJ, 0});
+        terms.push_back({2, {k, l}, {false, false}, {+1, -1}, -J*sinJ, -J*cosJ, 0});
+        if (rho) terms.push_back({2, {k, l}, {true,  true},  {-1, +1},  J*sinJ,  J*cosJ, 0});
+        if (rho) terms.push_back({2, {k, l}, {true,  true},  {+1, -1}, -J*sinJ,  J*cosJ, 0});
+      }
+      kl++;
+    }
+  }
+}
+
+/* Transpose the terms if requested, and compute their shifts in the vectorized index */
+void matfree_setShifts(std::vector<MatFreeTerm>& terms, bool transpose, const std::vector<int>& stridei, const std::vector<int>& strideip){
+  for (int iterm = 0; iterm < terms.size(); iterm++) {
+    MatFreeTerm& term = terms[iterm];
+    if (transpose) {
+      for (int a = 0; a < term.nidx; a++) term.disp[a] = -term.disp[a];
+      term.cim = -term.cim;
+    }
+    term.shift = 0;
+    for (int a = 0; a < term.nidx; a++) 
+      term.shift += term.disp[a] * (term.primed[a] ? strideip[term.osc[a]] : stridei[term.osc[a]]);
+  }
+}
+
+/* Resolve the boundary checks of a term on the line [jlo,jhi) of the innermost oscillator, given the levels i, ip of 
+ * all other indices. Returns false if the term vanishes on this line. Otherwise, returns the weight w of the outer 
+ * levels, the range [jb,je) on which the term is nonzero, and wshift >= 0 if the weight further depends on the 
+ * innermost row level j as sqrtn[j + wshift]. */
+inline bool matfree_termLine(const MatFreeTerm& term, const int* i, const int* ip, const int* n, const int last, const int L, const double* sqrtn, const int jlo, const int jhi, double* w, int* jb, int* je, int* wshift){
+  *w = 1.0;
+  *jb = jlo;
+  *je = jhi;
+  *wshift = -1;
+  for (int a = 0; a < term.nidx; a++) {
+    int k = term.osc[a];
+    int d = term.disp[a];
+    if (term.primed[a] || k != last) {
+      int lev = term.primed[a] ? ip[k] : i[k];
+      if (lev + d < 0 || lev + d >= n[k]) return false;
+      *w *= sqrtn[std::max(lev, lev + d)];
+    } else { // peel the boundary of the innermost oscillator
+      if (d > 0) { *je = std::min(*je, L-1); *wshift = 1; }
+      else       { *jb = std::max(*jb, 1);   *wshift = 0; }
+    }
+  }
+  return *jb < *je;
+}
+
+/* Vectorized matrix-free apply of alpha x + beta RHS x (or RHS^T) to x. Iterates over lines of the innermost (contiguous) oscillator 
+ * index. All boundary checks are resolved once per line, and the innermost oscillator's boundary elements are peeled 
+ * off by shrinking the loop range, such that each term becomes a branch-free loop over the line. */
+void matfree_vectorized_apply(MatShellCtx* shellctx, const double* xptr, double* yptr, bool transpose){
+
+  /* Evaluate coefficients and strides for each oscillator */
+  int nosc = shellctx->nlevels.size();
+  int dim_rho = 1;
+  for (int k = 0; k < nosc; k++) dim_rho *= shellctx->nlevels[k];
+  std::vector<int> n(nosc), stridei(nosc), strideip(nosc);
+  for (int k = 0; k < nosc; k++) {
+    n[k] = shellctx->nlevels[k];
+    stridei[k]  = shellctx->oscil_vec[k]->dim_postOsc;
+    strideip[k] = dim_rho * shellctx->oscil_vec[k]->dim_postOsc;
+  }
+
+  /* Precomputed diagonal and ladder factors */
+  const double* diagptr;
+  VecGetArrayRead(*shellctx->diag, &diagptr);
+  const double* sqrtn = shellctx->sqrtn.data();
+  std::vector<int> i(nosc), ip(nosc);
+
+  /* Collect the offdiagonal terms */
+  std::vector<MatFreeTerm> terms;
+  matfree_collectTerms(shellctx, shellctx->control_Re, shellctx->control_Im, true, terms);
+  matfree_setShifts(terms, transpose, stridei, strideip);
+
+  /* Iterate over the local lines of the innermost oscillator */
+  int last = nosc-1;
+  int L = n[last];
+  double sign = transpose ? -1.0 : 1.0;
+  int it_low = shellctx->it_low;
+  int it_upp = shellctx->it_upp;
+  double alpha = shellctx->alpha;
+  double beta = shellctx->beta;
+#pragma omp parallel for firstprivate(i, ip)
+  for (int col = it_low / dim_rho; col <= (it_upp-1) / dim_rho; col++) {
+    for (int k = 0; k < nosc; k++) ip[k] = (col / stridei[k]) % n[k];
+    int row_first = std::max(it_low - col * dim_rho, 0) / L * L;
+    int row_last  = std::min(it_upp - col * dim_rho, dim_rho);
+    for (int row0 = row_first; row0 < row_last; row0 += L) {
+      int it0 = col * dim_rho + row0;  // first index of this line
+      int jlo = std::max(it_low - it0, 0);
+      int jhi = std::min(it_upp - it0, L);
+      for (int k = 0; k < last; k++) i[k] = (row0 / stridei[k]) % n[k];
+      const double* xline = xptr + getIndexReal(it0);
+      double* yline = yptr + getIndexReal(it0 - it_low);
+
+      /* --- Diagonal part: diag, or conj(diag) for the transpose, scaled and shifted: alpha x + beta diag x --- */
+      const double* dline = diagptr + getIndexReal(it0 - it_low);
+      #pragma omp simd
+      for (int j = jlo; j < jhi; j++) {
+        double dre = dline[getIndexReal(j)];
+        double dimag = sign * dline[getIndexImag(j)];
+        double xre = xline[getIndexReal(j)];
+        double xim = xline[getIndexImag(j)];
+        yline[getIndexReal(j)]   = alpha * xre + beta * (dre * xre - dimag * xim);
+        yline[getIndexImag(j)] = alpha * xim + beta * (dre * xim + dimag * xre);
+      }
+
+      /* --- Offdiagonal terms --- */
+      for (int iterm = 0; iterm < terms.size(); iterm++) {
+        const MatFreeTerm& term = terms[iterm];
+        double w;
+        int jb, je, wshift;
+        if (!matfree_termLine(term, i.data(), ip.data(), n.data(), last, L, sqrtn, jlo, jhi, &w, &jb, &je, &wshift)) continue;
+        double cre = beta * w * term.cre;
+        double cim = beta * w * term.cim;
+        const double* xs = xline + getIndexReal(term.shift);
+        if (wshift < 0) {
+          #pragma omp simd
+          for (int j = jb; j < je; j++) {
+            yline[getIndexReal(j)]   += cre * xs[getIndexReal(j)]   - cim * xs[getIndexImag(j)];
+            yline[getIndexImag(j)] += cre * xs[getIndexImag(j)] + cim * xs[getIndexReal(j)];
+          }
+        } else {
+          const double* sq = sqrtn + wshift;
+          #pragma omp simd
+          for (int j = jb; j < je; j++) {
+            yline[getIndexReal(j)]   += sq[j] * (cre * xs[getIndexReal(j)]   - cim * xs[getIndexImag(j)]);
+            yline[getIndexImag(j)] += sq[j] * (cre * xs[getIndexImag(j)] + cim * xs[getIndexReal(j)]);
+          }
+        }
+      }
+    }
+  }
+
+  VecRestoreArrayRead(*shellctx->diag, &diagptr);
+}
+
+#ifdef SANITY_CHECK
+/* Compare the vectorized apply against the scalar generic kernel */
+void matfree_vectorized_check(Mat RHS, Vec x, Vec y, bool transpose){
+  Vec yscalar;
+  VecDuplicate(y, &yscalar);
+  if (transpose) myMatMultTranspose_matfree_generic(RHS, x, yscalar);
+  else           myMatMult_matfree_generic(RHS, x, yscalar);
+  double ynorm, diff;
+  VecNorm(yscalar, NORM_INFINITY, &ynorm);
+  VecAXPY(yscalar, -1.0, y);
+  VecNorm(yscalar, NORM_INFINITY, &diff);
+  MatShellCtx *shellctx;
+  MatShellGetContext(RHS, (void**) &shellctx);
+  int mpirank_world;
+  MPI_Comm_rank(MPI_COMM_WORLD, &mpirank_world);
+  if (diff > 1e-12 * (1.0 + ynorm) && mpirank_world == 0) 
+    printf("WARNING at t=%f: Vectorized matrix-free kernel differs from the scalar kernel by %1.4e (|y| = %1.4e)!\n", shellctx->time, diff, ynorm);
+  VecDestroy(&yscalar);
+}
+#endif
+
+/* Vectorized matfree-solver for any number of oscillators and levels: Define the action of RHS on a vector x */
+int myMatMult_matfree_vectorized(Mat RHS, Vec x, Vec y){
+
+  /* Get the shell context */
+  MatShellCtx *shellctx;
+  MatShellGetContext(RHS, (void**) &shellctx);
+
+  /* Get access to x and y */
+  const double* xptr;
+  double* yptr;
+  matfree_getArrayHalo(shellctx, x, &xptr);
+  VecGetArray(y, &yptr); 
+
+  matfree_vectorized_apply(shellctx, xptr, yptr, false);
+
+  /* Restore x and y */
+  matfree_restoreArrayHalo(shellctx, x, &xptr);
+  VecRestoreArray(y, &yptr);
+
+#ifdef SANITY_CHECK
+  matfree_vectorized_check(RHS, x, y, false);
+#endif
+
+  return 0;
+}
+
+/* Vectorized matfree-solver for any number of oscillators and levels: Define the action of RHS^T on a vector x */
+int myMatMultTranspose_matfree_vectorized(Mat RHS, Vec x, Vec y){
+
+  /* Get the shell context */
+  MatShellCtx *shellctx;
+  MatShellGetContext(RHS, (void**) &shellctx);
+
+  /* Get access to x and y */
+  const double* xptr;
+  double* yptr;
+  matfree_getArrayHalo(shellctx, x, &xptr);
+  VecGetArray(y, &yptr); 
+
+  matfree_vectorized_apply(shellctx, xptr, yptr, true);
+
+  /* Restore x and y */
+  matfree_restoreArrayHalo(shellctx, x, &xptr);
+  VecRestoreArray(y, &yptr);
+
+#ifdef SANITY_CHECK
+  matfree_vectorized_check(RHS, x, y, true);
+#endif
+
+  return 0;
+}
+
+/* Batched matrix-free apply of RHS (or RHS^T) to nbatch states that are interleaved in x, i.e. Re(x_b(it)) is stored at 
+ * x[nbatch*getIndexReal(it) + b]. Iterates over the same lines as the vectorized kernel, with the innermost loop running 
+ * over the batch, such that all coefficients, weights and boundary checks are shared by the states. In Schroedinger mode, 
+ * the state vectors form a single column of length N. */
+void matfree_batch_apply(MatShellCtx* shellctx, const double* xptr, double* yptr, bool transpose){
+
+  /* Evaluate strides for each oscillator */
+  int nb = shellctx->nbatch;
+  int nosc = shellctx->nlevels.size();
+  int dim_rho = 1;
+  for (int k = 0; k < nosc; k++) dim_rho *= shellctx->nlevels[k];
+  std::vector<int> n(nosc), stridei(nosc), strideip(nosc);
+  for (int k = 0; k < nosc; k++) {
+    n[k] = shellctx->nlevels[k];
+    stridei[k]  = shellctx->oscil_vec[k]->dim_postOsc;
+    strideip[k] = dim_rho * shellctx->oscil_vec[k]->dim_postOsc;
+  }
+
+  /* Precomputed diagonal and ladder factors */
+  const double* diagptr;
+  VecGetArrayRead(*shellctx->diag, &diagptr);
+  const double* sqrtn = shellctx->sqrtn.data();
+  std::vector<int> i(nosc), ip(nosc);
+
+  /* Collect the offdiagonal terms */
+  std::vector<MatFreeTerm> terms;
+  matfree_collectTerms(shellctx, shellctx->control_Re, shellctx->control_Im, true, terms);
+  matfree_setShifts(terms, transpose, stridei, strideip);
+
+  /* Iterate over the local lines of the innermost oscillator */
+  int last = nosc-1;
+  int L = n[last];
+  double sign = transpose ? -1.0 : 1.0;
+  int it_low = shellctx->it_low;
+  int it_upp = shellctx->it_upp;
+#pragma omp parallel for firstprivate(i, ip)
+  for (int col = it_low / dim_rho; col <= (it_upp-1) / dim_rho; col++) {
+    for (int k = 0; k < nosc; k++) ip[k] = (col / stridei[k]) % n[k];
+    int row_first = std::max(it_low - col * dim_rho, 0) / L * L;
+    int row_last  = std::min(it_upp - col * dim_rho, dim_rho);
+    for (int row0 = row_first; row0 < row_last; row0 += L) {
+      int it0 = col * dim_rho + row0;  // first index of this line
+      int jlo = std::max(it_low - it0, 0);
+      int jhi = std::min(it_upp - it0, L);
+      for (int k = 0; k < last; k++) i[k] = (row0 / stridei[k]) % n[k];
+      const double* xline = xptr + nb * getIndexReal(it0);
+      double* yline = yptr + nb * getIndexReal(it0 - it_low);
+
+      /* --- Diagonal part: diag, or conj(diag) for the transpose --- */
+      const double* dline = diagptr + getIndexReal(it0 - it_low);
+      for (int j = jlo; j < jhi; j++) {
+        double dre = dline[getIndexReal(j)];
+        double dimag = sign * dline[getIndexImag(j)];
+        const double* xre = xline + nb * getIndexReal(j);
+        const double* xim = xline + nb * getIndexImag(j);
+        double* yre = yline + nb * getIndexReal(j);
+        double* yim = yline + nb * getIndexImag(j);
+        #pragma omp simd
+        for (int b = 0; b < nb; b++) {
+          yre[b] = dre * xre[b] - dimag * xim[b];
+          yim[b] = dre * xim[b] + dimag * xre[b];
+        }
+      }
+
+      /* --- Offdiagonal terms --- */
+      for (int iterm = 0; iterm < terms.size(); iterm++) {
+        const MatFreeTerm& term = terms[iterm];
+        double w;
+        int jb, je, wshift;
+        if (!matfree_termLine(term, i.data(), ip.data(), n.data(), last, L, sqrtn, jlo, jhi, &w, &jb, &je, &wshift)) continue;
+        const double* xs = xline + nb * getIndexReal(term.shift);
+        for (int j = jb; j < je; j++) {
+          double wj = wshift < 0 ? w : w * sqrtn[j + wshift];
+          double cre = wj * term.cre;
+          double cim = wj * term.cim;
+          const double* xre = xs + nb * getIndexReal(j);
+          const double* xim = xs + nb * getIndexImag(j);
+          double* yre = yline + nb * getIndexReal(j);
+          double* yim = yline + nb * getIndexImag(j);
+          #pragma omp simd
+          for (int b = 0; b < nb; b++) {
+            yre[b] += cre * xre[b] - cim * xim[b];
+            yim[b] += cre * xim[b] + cim * xre[b];
+          }
+        }
+      }
+    }
+  }
+
+  VecRestoreArrayRead(*shellctx->diag, &diagptr);
+}
+
+/* Apply the RHS (or RHS^T) kernel of the shell context, timed by the RHS log event */
+int myMatMult_logged(Mat RHS, Vec x, Vec y){
+  MatShellCtx *shellctx;
+  MatShellGetContext(RHS, (void**) &shellctx);
+  PetscLogEventBegin(EVENT_RHS, 0, 0, 0, 0);
+  int ierr = shellctx->mult(RHS, x, y);
+  PetscLogEventEnd(EVENT_RHS, 0, 0, 0, 0);
+  return ierr;
+}
+
+int myMatMultTranspose_logged(Mat RHS, Vec x, Vec y){
+  MatShellCtx *shellctx;
+  MatShellGetContext(RHS, (void**) &shellctx);
+  PetscLogEventBegin(EVENT_RHS, 0, 0, 0, 0);
+  int ierr = shellctx->multT(RHS, x, y);
+  PetscLogEventEnd(EVENT_RHS, 0, 0, 0, 0);
+  return ierr;
+}
+
+/* y = alpha x + beta RHS x (or RHS^T). Kernels with fused_shift apply it in their final update, others need an extra pass over y. */
+void myMatMultShifted(Mat RHS, Vec x, Vec y, double alpha, double beta, bool transpose){
+  MatShellCtx *shellctx;
+  MatShellGetContext(RHS, (void**) &shellctx);
+  if (shellctx->fused_shift) {
+    shellctx->alpha = alpha;
+    shellctx->beta = beta;
+  }
+  if (!transpose) MatMult(RHS, x, y);
+  else            MatMultTranspose(RHS, x, y);
+  if (shellctx->fused_shift) {
+    shellctx->alpha = 0.0;
+    shellctx->beta = 1.0;
+  }
+  else VecAXPBY(y, alpha, beta, x);
+}
+
+/* Batched matfree-solver: Define the action of RHS on nbatch interleaved states x */
+int myMatMult_batch(Mat RHS, Vec x, Vec y){
+
+  /* Get the shell context */
+  MatShellCtx *shellctx;
+  MatShellGetContext(RHS, (void**) &shellctx);
+
+  /* Get access to x and y */
+  const double* xptr;
+  double* yptr;
+  matfree_getArrayHalo(shellctx, x, &xptr);
+  VecGetArray(y, &yptr); 
+
+  matfree_batch_apply(shellctx, xptr, yptr, false);
+
+  /* Restore x and y */
+  matfree_restoreArrayHalo(shellctx, x, &xptr);
+  VecRestoreArray(y, &yptr);
+
+  return 0;
+}
+
+/* Batched matfree-solver: Define the action of RHS^T on nbatch interleaved states x */
+int myMatMultTranspose_batch(Mat RHS, Vec x, Vec y){
+
+  /* Get the shell context */
+  MatShellCtx *shellctx;
+  MatShellGetContext(RHS, (void**) &shellctx);
+
+  /* Get access to x and y */
+  const double* xptr;
+  double* yptr;
+  matfree_getArrayHalo(shellctx, x, &xptr);
+  VecGetArray(y, &yptr); 
+
+  matfree_batch_apply(shellctx, xptr, yptr, true);
+
+  /* Restore x and y */
+  matfree_restoreArrayHalo(shellctx, x, &xptr);
+  VecRestoreArray(y, &yptr);
+
+  return 0;
+}
+
+/* Batched gradient: grad += alpha * sum_b x_b^T (dRHS/dp)^T xbar_b. The control terms are linear in (p,q), hence collecting 
+ * them for unit amplitudes gives dRHS/dp and dRHS/dq, which are applied along the same lines as in the batched apply. */
+void MasterEq::computedRHSdp_batch(const double t, const Vec x, const Vec xbar, const double alpha, double* grad) {
+
+  MatShellCtx* shellctx = &RHSctx_batch;
+  int nb = nbatch;
+  const double* xptr, *xbarptr;
+  matfree_getArrayHalo(shellctx, x, &xptr);
+  VecGetArrayRead(xbar, &xbarptr);
+  const double* sqrtn = shellctx->sqrtn.data();
+
+  /* Strides */
+  int nosc = noscillators;
+  std::vector<int> n(nosc), stridei(nosc), strideip(nosc);
+  for (int k = 0; k < nosc; k++) {
+    n[k] = nlevels[k];
+    stridei[k]  = oscil_vec[k]->dim_postOsc;
+    strideip[k] = dim_rho * oscil_vec[k]->dim_postOsc;
+  }
+
+  /* Derivative terms: d/dp for all oscillators, followed by d/dq */
+  std::vector<double> one(nosc, 1.0), zero(nosc, 0.0);
+  std::vector<MatFreeTerm> terms;
+  matfree_collectTerms(shellctx, one, zero, false, terms);
+  int nterms_p = terms.size();
+  matfree_collectTerms(shellctx, zero, one, false, terms);
+  matfree_setShifts(terms, false, stridei, strideip);
+
+  /* coeff[k] = d/dp_k, coeff[nosc + k] = d/dq_k */
+  double* coeff = new double [2*nosc];
+  for (int k = 0; k < 2*nosc; k++) coeff[k] = 0.0;
+
+  /* Iterate over the local lines of xbar */
+  std::vector<int> i(nosc), ip(nosc);
+  int last = nosc-1;
+  int L = n[last];
+  int it_low = shellctx->it_low;
+  int it_upp = shellctx->it_upp;
+#pragma omp parallel for firstprivate(i, ip) reduction(+:coeff[:2*nosc])
+  for (int col = it_low / dim_rho; col <= (it_upp-1) / dim_rho; col++) {
+    for (int k = 0; k < nosc; k++) ip[k] = (col / stridei[k]) % n[k];
+    int row_first = std::max(it_low - col * dim_rho, 0) / L * L;
+    int row_last  = std::min(it_upp - col * dim_rho, dim_rho);
+    for (int row0 = row_first; row0 < row_last; row0 += L) {
+      int it0 = col * dim_rho + row0;  // first index of this line
+      int jlo = std::max(it_low - it0, 0);
+      int jhi = std::min(it_upp - it0, L);
+      for (int k = 0; k < last; k++) i[k] = (row0 / stridei[k]) % n[k];
+      const double* xline = xptr + nb * getIndexReal(it0);
+      const double* xbarline = xbarptr + nb * getIndexReal(it0 - it_low);
+
+      for (int iterm = 0; iterm < terms.size(); iterm++) {
+        const MatFreeTerm& term = terms[iterm];
+        double w;
+        int jb, je, wshift;
+        if (!matfree_termLine(term, i.data(), ip.data(), n.data(), last, L, sqrtn, jlo, jhi, &w, &jb, &je, &wshift)) continue;
+        const double* xs = xline + nb * getIndexReal(term.shift);
+        double sum = 0.0;
+        for (int j = jb; j < je; j++) {
+          const double* xre = xs + nb * getIndexReal(j);
+          const double* xim = xs + nb * getIndexImag(j);
+          const double* xbarre = xbarline + nb * getIndexReal(j);
+          const double* xbarim = xbarline + nb * getIndexImag(j);
+          // Re(conj(xbar) * c x) = cre (xre xbarre + xim xbarim) + cim (xre xbarim - xim xbarre)
+          double dot = 0.0, cross = 0.0;
+          #pragma omp simd reduction(+:dot, cross)
+          for (int b = 0; b < nb; b++) {
+            dot   += xre[b] * xbarre[b] + xim[b] * xbarim[b];
+            cross += xre[b] * xbarim[b] - xim[b] * xbarre[b];
+          }
+          double wj = wshift < 0 ? w : w * sqrtn[j + wshift];
+          sum += wj * (term.cre * dot + term.cim * cross);
+        }
+        coeff[(iterm < nterms_p ? 0 : nosc) + term.osc[0]] += sum;
+      }
+    }
+  }
+  matfree_restoreArrayHalo(shellctx, x, &xptr);
+  VecRestoreArrayRead(xbar, &xbarptr);
+
+  /* Set the gradient values */
+  addControlGradient(t, coeff, coeff + nosc, alpha, grad);
+
+  delete [] coeff;
+}
+
+/* Fused adjoint kernel for nbatch interleaved states (nbatch = 1 for a single state): y += RHS^T xbar, and the derivative 
+ * coefficients Re(conj(xbar) (dRHS/dp) x) are added to coeff[k] = d/dp_k and coeff[nosc + k] = d/dq_k. Iterates over the 
+ * same lines as the batched apply, with the transposed RHS terms acting on xbar and the derivative terms acting on x, 
+ * such that each line of xbar and y is visited once. Single processor only: x and xbar are indexed globally. */
+void matfree_adjoint_apply(MatShellCtx* shellctx, const double* xptr, const double* xbarptr, double* yptr, double* coeff){
+
+  /* Evaluate strides for each oscillator */
+  int nb = shellctx->nbatch;
+  int nosc = shellctx->nlevels.size();
+  int dim_rho = 1;
+  for (int k = 0; k < nosc; k++) dim_rho *= shellctx->nlevels[k];
+  std::vector<int> n(nosc), stridei(nosc), strideip(nosc);
+  for (int k = 0; k < nosc; k++) {
+    n[k] = shellctx->nlevels[k];
+    stridei[k]  = shellctx->oscil_vec[k]->dim_postOsc;
+    strideip[k] = dim_rho * shellctx->oscil_vec[k]->dim_postOsc;
+  }
+
+  /* Precomputed diagonal and ladder factors */
+  const double* diagptr;
+  VecGetArrayRead(*shellctx->diag, &diagptr);
+  const double* sqrtn = shellctx->sqrtn.data();
+  std::vector<int> i(nosc), ip(nosc);
+
+  /* Transposed offdiagonal terms of the RHS */
+  std::vector<MatFreeTerm> terms;
+  matfree_collectTerms(shellctx, shellctx->control_Re, shellctx->control_Im, true, terms);
+  matfree_setShifts(terms, true, stridei, strideip);
+
+  /* Derivative terms: d/dp for all oscillators, followed by d/dq */
+  std::vector<double> one(nosc, 1.0), zero(nosc, 0.0);
+  std::vector<MatFreeTerm> dterms;
+  matfree_collectTerms(shellctx, one, zero, false, dterms);
+  int nterms_p = dterms.size();
+  matfree_collectTerms(shellctx, zero, one, false, dterms);
+  matfree_setShifts(dterms, false, stridei, strideip);
+
+  /* Iterate over the local lines of the innermost oscillator */
+  int last = nosc-1;
+  int L = n[last];
+  int it_low = shellctx->it_low;
+  int it_upp = shellctx->it_upp;
+#pragma omp parallel for firstprivate(i, ip) reduction(+:coeff[:2*nosc])
+  for (int col = it_low / dim_rho; col <= (it_upp-1) / dim_rho; col++) {
+    for (int k = 0; k < nosc; k++) ip[k] = (col / stridei[k]) % n[k];
+    int row_first = std::max(it_low - col * dim_rho, 0) / L * L;
+    int row_last  = std::min(it_upp - col * dim_rho, dim_rho);
+    for (int row0 = row_first; row0 < row_last; row0 += L) {
+      int it0 = col * dim_rho + row0;  // first index of this line
+      int jlo = std::max(it_low - it0, 0);
+      int jhi = std::min(it_upp - it0, L);
+      for (int k = 0; k < last; k++) i[k] = (row0 / stridei[k]) % n[k];
+      const double* xline = xptr + nb * getIndexReal(it0);
+      const double* xbarline = xbarptr + nb * getIndexReal(it0);
+      double* yline = yptr + nb * getIndexReal(it0 - it_low);
+
+      /* --- Diagonal part: y += conj(diag) xbar --- */
+      const double* dline = diagptr + getIndexReal(it0 - it_low);
+      for (int j = jlo; j < jhi; j++) {
+        double dre = dline[getIndexReal(j)];
+        double dimag = -dline[getIndexImag(j)];
+        const double* xbarre = xbarline + nb * getIndexReal(j);
+        const double* xbarim = xbarline + nb * getIndexImag(j);
+        double* yre = yline + nb * getIndexReal(j);
+        double* yim = yline + nb * getIndexImag(j);
+        #pragma omp simd
+        for (int b = 0; b < nb; b++) {
+          yre[b] += dre * xbarre[b] - dimag * xbarim[b];
+          yim[b] += dre * xbarim[b] + dimag * xbarre[b];
+        }
+      }
+
+      /* --- Transposed offdiagonal terms: y += c xbar(it + shift) --- */
+      for (int iterm = 0; iterm < terms.size(); iterm++) {
+        const MatFreeTerm& term = terms[iterm];
+        double w;
+        int jb, je, wshift;
+        if (!matfree_termLine(term, i.data(), ip.data(), n.data(), last, L, sqrtn, jlo, jhi, &w, &jb, &je, &wshift)) continue;
+        const double* xbars = xbarline + nb * getIndexReal(term.shift);
+        for (int j = jb; j < je; j++) {
+          double wj = wshift < 0 ? w : w * sqrtn[j + wshift];
+          double cre = wj * term.cre;
+          double cim = wj * term.cim;
+          const double* xbarre = xbars + nb * getIndexReal(j);
+          const double* xbarim = xbars + nb * getIndexImag(j);
+          double* yre = yline + nb * getIndexReal(j);
+          double* yim = yline + nb * getIndexImag(j);
+          #pragma omp simd
+          for (int b = 0; b < nb; b++) {
+            yre[b] += cre * xbarre[b] - cim * xbarim[b];
+            yim[b] += cre * xbarim[b] + cim * xbarre[b];
+          }
+        }
+      }
+
+      /* --- Derivative terms: coeff += Re(conj(xbar) c x(it + shift)) --- */
+      for (int iterm = 0; iterm < dterms.size(); iterm++) {
+        const MatFreeTerm& term = dterms[iterm];
+        double w;
+        int jb, je, wshift;
+        if (!matfree_termLine(term, i.data(), ip.data(), n.data(), last, L, sqrtn, jlo, jhi, &w, &jb, &je, &wshift)) continue;
+        const double* xs = xline + nb * getIndexReal(term.shift);
+        double sum = 0.0;
+        for (int j = jb; j < je; j++) {
+          const double* xre = xs + nb * getIndexReal(j);
+          const double* xim = xs + nb * getIndexImag(j);
+          const double* xbarre = xbarline + nb * getIndexReal(j);
+          const double* xbarim = xbarline + nb * getIndexImag(j);
+          double dot = 0.0, cross = 0.0;
+          #pragma omp simd reduction(+:dot, cross)
+          for (int b = 0; b < nb; b++) {
+            dot   += xre[b] * xbarre[b] + xim[b] * xbarim[b];
+            cross += xre[b] * xbarim[b] - xim[b] * xbarre[b];
+          }
+          double wj = wshift < 0 ? w : w * sqrtn[j + wshift];
+          sum += wj * (term.cre * dot + term.cim * cross);
+        }
+        coeff[(iterm < nterms_p ? 0 : nosc) + term.osc[0]] += sum;
+      }
+    }
+  }
+
+  VecRestoreArrayRead(*shellctx->diag, &diagptr);
+}
+
+void MasterEq::computedRHSdp_fused(const double t, const Vec x, const Vec xbar, const double alpha, double* grad, Vec y) {
+
+  MatShellCtx* shellctx = nbatch > 1 ? &RHSctx_batch : &RHSctx;
+  const double* xptr, *xbarptr;
+  double* yptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArrayRead(xbar, &xbarptr);
+  VecGetArray(y, &yptr);
+
+  /* coeff[k] = d/dp_k, coeff[nosc + k] = d/dq_k */
+  int nosc = noscillators;
+  double* coeff = new double [2*nosc];
+  for (int k = 0; k < 2*nosc; k++) coeff[k] = 0.0;
+
+  matfree_adjoint_apply(shellctx, xptr, xbarptr, yptr, coeff);
+
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArrayRead(xbar, &xbarptr);
+  VecRestoreArray(y, &yptr);
+
+  /* Set the gradient values */
+  addControlGradient(t, coeff, coeff + nosc, alpha, grad);
+
+  delete [] coeff;
+}
+
 /* --- 2 Oscillator cases --- */
 int myMatMult_matfree_2Osc(Mat RHS, Vec x, Vec y){
   /* Get the shell context */
@@ -2735,10 +3882,7 @@ int myMatMult_matfree_2Osc(Mat RHS, Vec x, Vec y){
   else if (n0==2 && n1==2)   return myMatMult_matfree<2,2>(RHS, x, y);
   else if (n0==3 && n1==3)   return myMatMult_matfree<3,3>(RHS, x, y);
   else if (n0==20 && n1==20) return myMatMult_matfree<20,20>(RHS, x, y);
-  else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
-  }
+  else return myMatMult_matfree_generic(RHS, x, y);
 }
 int myMatMultTranspose_matfree_2Osc(Mat RHS, Vec x, Vec y){
  /* Get the shell context */
@@ -2753,10 +3897,7 @@ int myMatMultTranspose_matfree_2Osc(Mat RHS, Vec x, Vec y){
   else if (n0==2 && n1==2)   return myMatMultTranspose_matfree<2,2>(RHS, x, y);
   else if (n0==3 && n1==3)   return myMatMultTranspose_matfree<3,3>(RHS, x, y);
   else if (n0==20 && n1==20) return myMatMultTranspose_matfree<20,20>(RHS, x, y);
-  else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
-  }
+  else return myMatMultTranspose_matfree_generic(RHS, x, y);
 }
 
 
@@ -2771,10 +3912,7 @@ int myMatMult_matfree_3Osc(Mat RHS, Vec x, Vec y){
   if      (n0==2 && n1==2 && n2==2) return myMatMult_matfree<2,2,2>(RHS, x, y);
   else if (n0==2 && n1==3 && n2==4) return myMatMult_matfree<2,3,4>(RHS, x, y);
   else if (n0==3 && n1==3 && n2==3) return myMatMult_matfree<3,3,3>(RHS, x, y);
-  else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
-  }
+  else return myMatMult_matfree_generic(RHS, x, y);
 }
 int myMatMultTranspose_matfree_3Osc(Mat RHS, Vec x, Vec y){
  /* Get the shell context */
@@ -2786,10 +3924,7 @@ int myMatMultTranspose_matfree_3Osc(Mat RHS, Vec x, Vec y){
   if      (n0==2 && n1==2 && n2==2)  return myMatMultTranspose_matfree<2,2,2>(RHS, x, y);
   else if (n0==2 && n1==3 && n2==4)  return myMatMultTranspose_matfree<2,3,4>(RHS, x, y);
   else if (n0==3 && n1==3 && n2==3)  return myMatMultTranspose_matfree<3,3,3>(RHS, x, y);
-  else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
-  }
+  else return myMatMultTranspose_matfree_generic(RHS, x, y);
 }
 
 
@@ -2803,10 +3938,7 @@ int myMatMult_matfree_4Osc(Mat RHS, Vec x, Vec y){
   int n2 = shellctx->nlevels[2];
   int n3 = shellctx->nlevels[3];
   if      (n0==2 && n1==2 && n2==2 && n3 == 2) return myMatMult_matfree<2,2,2,2>(RHS, x, y);
-  else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
-  }
+  else return myMatMult_matfree_generic(RHS, x, y);
 }
 int myMatMultTranspose_matfree_4Osc(Mat RHS, Vec x, Vec y){
  /* Get the shell context */
@@ -2818,10 +3950,7 @@ int myMatMultTranspose_matfree_4Osc(Mat RHS, Vec x, Vec y){
   int n2 = shellctx->nlevels[2];
   int n3 = shellctx->nlevels[3];
   if      (n0==2 && n1==2 && n2==2 && n3==2)  return myMatMultTranspose_matfree<2,2,2,2>(RHS, x, y);
-  else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
-  }
+  else return myMatMultTranspose_matfree_generic(RHS, x, y);
 }
 
 
@@ -2836,10 +3965,7 @@ int myMatMult_matfree_5Osc(Mat RHS, Vec x, Vec y){
   int n3 = shellctx->nlevels[3];
   int n4 = shellctx->nlevels[4];
   if      (n0==2 && n1==2 && n2==2 && n3 == 2 && n4 == 2) return myMatMult_matfree<2,2,2,2,2>(RHS, x, y);
-  else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
-  }
+  else return myMatMult_matfree_generic(RHS, x, y);
 }
 int myMatMultTranspose_matfree_5Osc(Mat RHS, Vec x, Vec y){
  /* Get the shell context */
@@ -2852,9 +3978,6 @@ int myMatMultTranspose_matfree_5Osc(Mat RHS, Vec x, Vec y){
   int n3 = shellctx->nlevels[3];
   int n4 = shellctx->nlevels[4];
   if      (n0==2 && n1==2 && n2==2 && n3==2 && n4==2)  return myMatMultTranspose_matfree<2,2,2,2,2>(RHS, x, y);
-  else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
-  }
+  else return myMatMultTranspose_matfree_generic(RHS, x, y);
 }
 
@@ -127,7 +127,7 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
   }
 
   /* Finally initialize the optimization target struct */
-  optim_target = new OptimTarget(timestepper->mastereq->getDim(), purestateID, target_type, objective_type, targetgate, target_filename);
+  optim_target = new OptimTarget(timestepper->mastereq->getDim(), purestateID, target_type, objective_type, targetgate, target_filename, timestepper->mastereq->schroedinger);
 
   /* Get weights for the objective function (weighting the different initial conditions */
   config.GetVecDoubleParam("optim_weights", obj_weights, 1.0);
@@ -171,6 +171,10 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
     printf("\n\n ERROR: Wrong setting for initial condition.\n");
     exit(1);
   }
+  if (timestepper->mastereq->schroedinger && (initcond_type == InitialConditionType::ENSEMBLE || initcond_type == InitialConditionType::THREESTATES || initcond_type == InitialConditionType::NPLUSONE)) {
+    printf("\n\n ERROR: Initial condition '%s' is a mixed state and not available in Schroedinger mode. Choose 'pure', 'file', 'diagonal' or 'basis'.\n", initcondstr[0].c_str());
+    exit(1);
+  }
 
   /* Allocate the initial condition vector */
   VecCreate(PETSC_COMM_WORLD, &rho_t0); 
@@ -201,8 +205,9 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
       }
       diag_id += initcond_IDs[k] * dim_postkron;
     }
-    int ndim = (int)sqrt(timestepper->mastereq->getDim());
+    int ndim = timestepper->mastereq->getDimRho();
     int vec_id = getIndexReal(getVecID( diag_id, diag_id, ndim )); // Real part of x
+    if (timestepper->mastereq->schroedinger) vec_id = getIndexReal(diag_id); // psi = e_m
     if (ilow <= vec_id && vec_id < iupp) VecSetValue(rho_t0, vec_id, 1.0, INSERT_VALUES);
   }
   else if (initcond_type == InitialConditionType::FROMFILE) { 
@@ -211,24 +216,30 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
     // int dim = timestepper->mastereq->getDim();
     int dim_ess = timestepper->mastereq->getDimEss();
     int dim_rho = timestepper->mastereq->getDimRho();
-    double * vec = new double[2*dim_ess*dim_ess];
+    int dim_file = dim_ess*dim_ess;  // vectorized density matrix, or state vector in Schroedinger mode
+    if (timestepper->mastereq->schroedinger) dim_file = dim_ess;
+    double * vec = new double[2*dim_file];
     if (mpirank_world == 0) {
       assert (initcondstr.size()==2);
       std::string filename = initcondstr[1];
-      read_vector(filename.c_str(), vec, 2*dim_ess*dim_ess);
+      read_vector(filename.c_str(), vec, 2*dim_file);
     }
-    MPI_Bcast(vec, 2*dim_ess*dim_ess, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-    for (int i = 0; i < dim_ess*dim_ess; i++) {
+    MPI_Bcast(vec, 2*dim_file, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    for (int i = 0; i < dim_file; i++) {
       int k = i % dim_ess;
       int j = (int) i / dim_ess;
-      if (dim_ess*dim_ess < timestepper->mastereq->getDim()) {
+      if (dim_ess < dim_rho) {
         k = mapEssToFull(k, timestepper->mastereq->nlevels, timestepper->mastereq->nessential);
         j = mapEssToFull(j, timestepper->mastereq->nlevels, timestepper->mastereq->nessential);
       }
       int elemid_re = getIndexReal(getVecID(k,j,dim_rho));
       int elemid_im = getIndexImag(getVecID(k,j,dim_rho));
+      if (timestepper->mastereq->schroedinger) {
+        elemid_re = getIndexReal(k);
+        elemid_im = getIndexImag(k);
+      }
       if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(rho_t0, elemid_re, vec[i], INSERT_VALUES);        // RealPart
-      if (ilow <= elemid_im && elemid_im < iupp) VecSetValue(rho_t0, elemid_im, vec[i + dim_ess*dim_ess], INSERT_VALUES); // Imaginary Part
+      if (ilow <= elemid_im && elemid_im < iupp) VecSetValue(rho_t0, elemid_im, vec[i + dim_file], INSERT_VALUES); // Imaginary Part
       // printf("  -> k=%d j=%d, elemid=%d vals=%1.4e, %1.4e\n", k, j, elemid, vec[i], vec[i+dim_ess*dim_ess]);
     }
     delete [] vec;
@@ -286,6 +297,15 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
   VecZeroEntries(rho_t0_bar);
   VecAssemblyBegin(rho_t0_bar); VecAssemblyEnd(rho_t0_bar);
 
+  /* Allocate batches of initial conditions, if several are propagated simultaneously */
+  rho_t0_batch = rho_t0;
+  rho_t0_bar_batch = rho_t0_bar;
+  if (timestepper->nbatch > 1) {
+    MatCreateVecs(timestepper->mastereq->getRHSBatch(), &rho_t0_batch, NULL);
+    VecDuplicate(rho_t0_batch, &rho_t0_bar_batch);
+    VecDuplicate(rho_t0, &finalstate_col);
+  }
+
   /* Store optimization bounds */
   VecCreateSeq(PETSC_COMM_SELF, ndesign, &xlower);
   VecSetFromOptions(xlower);
@@ -340,6 +360,11 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
 OptimProblem::~OptimProblem() {
   delete [] mygrad;
   delete optim_target;
+  if (timestepper->nbatch > 1) {
+    VecDestroy(&rho_t0_batch);
+    VecDestroy(&rho_t0_bar_batch);
+    VecDestroy(&finalstate_col);
+  }
   VecDestroy(&rho_t0);
   VecDestroy(&rho_t0_bar);
 
@@ -368,38 +393,55 @@ double OptimProblem::evalF(const Vec x) {
   obj_penal = 0.0;
   fidelity = 0.0;
   double obj_cost_max = 0.0;
-  for (int iinit = 0; iinit < ninit_local; iinit++) {
-      
-    /* Prepare the initial condition in [rank * ninit_local, ... , (rank+1) * ninit_local - 1] */
-    int iinit_global = mpirank_init * ninit_local + iinit;
-    int initid = timestepper->mastereq->getRhoT0(iinit_global, ninit, initcond_type, initcond_IDs, rho_t0);
-    if (mpirank_braid == 0) printf("%d: Initial condition id=%d ...\n", mpirank_init, initid);
+  int nbatch = timestepper->nbatch;
+  for (int ifirst = 0; ifirst < ninit_local; ifirst += nbatch) {
+    int ncols = std::min(nbatch, ninit_local - ifirst);
+
+    /* Prepare the initial conditions in [rank * ninit_local, ... , (rank+1) * ninit_local - 1], nbatch at a time */
+    std::vector<int> initids;
+    if (nbatch > 1) VecZeroEntries(rho_t0_batch);
+    for (int b = 0; b < ncols; b++) {
+      int iinit_global = mpirank_init * ninit_local + ifirst + b;
+      int initid = timestepper->mastereq->getRhoT0(iinit_global, ninit, initcond_type, initcond_IDs, rho_t0);
+      if (mpirank_braid == 0) printf("%d: Initial condition id=%d ...\n", mpirank_init, initid);
+      timestepper->setColumn(rho_t0_batch, b, rho_t0);
+      initids.push_back(initid);
+    }
 
-    /* If gate optimiztion, compute the target state rho^target = Vrho(0)V^dagger */
-    optim_target->prepare(rho_t0);
+    /* If gate optimiztion, compute the target state rho^target = Vrho(0)V^dagger. For a batch, this is done once for each state. */
+    if (nbatch == 1) optim_target->prepare(rho_t0);
+    else {
+      for (int b = 0; b < ncols; b++) optim_target->prepare(timestepper->getColumn(rho_t0_batch, b, rho_t0), b);
+    }
 
-    /* Run forward with initial condition initid */
+    /* Run forward with initial conditions initids */
 #ifdef WITH_BRAID
-      primalbraidapp->PreProcess(initid, rho_t0, 0.0);
+      primalbraidapp->PreProcess(initids[0], rho_t0, 0.0);
       primalbraidapp->Drive();
       finalstate = primalbraidapp->PostProcess(); // this return NULL for all but the last time processor
 #else
-      finalstate = timestepper->solveODE(initid, rho_t0);
+      finalstate = timestepper->solveODE(initids, rho_t0_batch);
 #endif
 
     /* Add to integral penalty term */
     obj_penal += gamma_penalty * timestepper->penalty_integral;
 
-    /* Evaluate J(finalstate) and add to final-time cost */
-    double obj_iinit = optim_target->evalJ(finalstate);
-    obj_cost +=  obj_weights[iinit] * obj_iinit;
-    obj_cost_max = std::max(obj_cost_max, obj_iinit);
+    for (int b = 0; b < ncols; b++) {
+      int iinit = ifirst + b;
+      if (nbatch > 1) optim_target->selectBatch(b);
+      Vec finalstate_b = timestepper->getColumn(finalstate, b, finalstate_col);
+
+      /* Evaluate J(finalstate) and add to final-time cost */
+      double obj_iinit = optim_target->evalJ(finalstate_b);
+      obj_cost +=  obj_weights[iinit] * obj_iinit;
+      obj_cost_max = std::max(obj_cost_max, obj_iinit);
 
-    /* Add to final-time fidelity */
-    double fidelity_iinit = optim_target->evalFidelity(finalstate);
-    fidelity += fidelity_iinit;
+      /* Add to final-time fidelity */
+      double fidelity_iinit = optim_target->evalFidelity(finalstate_b);
+      fidelity += fidelity_iinit;
 
-    // printf("%d, %d: iinit objective: %f * %1.14e, Fid=%1.14e\n", mpirank_world, mpirank_init, obj_weights[iinit], obj_iinit, fidelity_iinit);
+      // printf("%d, %d: iinit objective: %f * %1.14e, Fid=%1.14e\n", mpirank_world, mpirank_init, obj_weights[iinit], obj_iinit, fidelity_iinit);
+    }
   }
 
 #ifdef WITH_BRAID
@@ -413,9 +455,11 @@ double OptimProblem::evalF(const Vec x) {
   double mypen = 1./ninit * obj_penal;
   double mycost = 1./ninit * obj_cost;
   double myfidelity = 1./ninit * fidelity;
+  PetscLogEventBegin(EVENT_REDUCTION, 0, 0, 0, 0);
   MPI_Allreduce(&mypen, &obj_penal, 1, MPI_DOUBLE, MPI_SUM, comm_init);
   MPI_Allreduce(&mycost, &obj_cost, 1, MPI_DOUBLE, MPI_SUM, comm_init);
   MPI_Allreduce(&myfidelity, &fidelity, 1, MPI_DOUBLE, MPI_SUM, comm_init);
+  PetscLogEventEnd(EVENT_REDUCTION, 0, 0, 0, 0);
 
   /* Evaluate regularization objective += gamma/2 * ||x||^2*/
   double xnorm;
@@ -460,54 +504,75 @@ void OptimProblem::evalGradF(const Vec x, Vec G){
   obj_regul = 0.0;
   obj_penal = 0.0;
   fidelity = 0.0;
-  for (int iinit = 0; iinit < ninit_local; iinit++) {
-
-    /* Prepare the initial condition */
-    int iinit_global = mpirank_init * ninit_local + iinit;
-    int initid = timestepper->mastereq->getRhoT0(iinit_global, ninit, initcond_type, initcond_IDs, rho_t0);
+  int nbatch = timestepper->nbatch;
+  for (int ifirst = 0; ifirst < ninit_local; ifirst += nbatch) {
+    int ncols = std::min(nbatch, ninit_local - ifirst);
+
+    /* Prepare the initial conditions, nbatch at a time */
+    std::vector<int> initids;
+    if (nbatch > 1) VecZeroEntries(rho_t0_batch);
+    for (int b = 0; b < ncols; b++) {
+      int iinit_global = mpirank_init * ninit_local + ifirst + b;
+      int initid = timestepper->mastereq->getRhoT0(iinit_global, ninit, initcond_type, initcond_IDs, rho_t0);
+      timestepper->setColumn(rho_t0_batch, b, rho_t0);
+      initids.push_back(initid);
+    }
 
-    /* If gate optimiztion, compute the target state rho^target = Vrho(0)V^dagger */
-    optim_target->prepare(rho_t0);
+    /* If gate optimiztion, compute the target state rho^target = Vrho(0)V^dagger. For a batch, this is done once for each state. */
+    if (nbatch == 1) optim_target->prepare(rho_t0);
+    else {
+      for (int b = 0; b < ncols; b++) optim_target->prepare(timestepper->getColumn(rho_t0_batch, b, rho_t0), b);
+    }
 
     /* --- Solve primal --- */
     // if (mpirank_braid == 0) printf("%d: %d FWD. ", mpirank_init, initid);
 
-    /* Run forward with initial condition rho_t0 */
+    /* Run forward with initial conditions rho_t0 */
 #ifdef WITH_BRAID 
-      primalbraidapp->PreProcess(initid, rho_t0, 0.0);
+      primalbraidapp->PreProcess(initids[0], rho_t0, 0.0);
       primalbraidapp->Drive();
       finalstate = primalbraidapp->PostProcess(); // this return NULL for all but the last time processor
 #else 
-      finalstate = timestepper->solveODE(initid, rho_t0);
+      finalstate = timestepper->solveODE(initids, rho_t0_batch);
 #endif
 
     /* Add to integral penalty term */
     obj_penal += gamma_penalty * timestepper->penalty_integral;
 
-    /* Evaluate J(finalstate) and add to final-time cost */
-    double obj_iinit = optim_target->evalJ(finalstate);
-    obj_cost += obj_weights[iinit] * obj_iinit;
-    // if (mpirank_braid == 0) printf("%d: iinit objective: %1.14e\n", mpirank_init, obj_iinit);
+    /* Reset adjoint */
+    if (nbatch > 1) VecZeroEntries(rho_t0_bar_batch);
 
-    /* Add to final-time fidelity */
-    fidelity += optim_target->evalFidelity(finalstate);
+    for (int b = 0; b < ncols; b++) {
+      int iinit = ifirst + b;
+      if (nbatch > 1) optim_target->selectBatch(b);
+      Vec finalstate_b = timestepper->getColumn(finalstate, b, finalstate_col);
 
-    /* --- Solve adjoint --- */
-    // if (mpirank_braid == 0) printf("%d: %d BWD.", mpirank_init, initid);
+      /* Evaluate J(finalstate) and add to final-time cost */
+      double obj_iinit = optim_target->evalJ(finalstate_b);
+      obj_cost += obj_weights[iinit] * obj_iinit;
+      // if (mpirank_braid == 0) printf("%d: iinit objective: %1.14e\n", mpirank_init, obj_iinit);
 
-    /* Reset adjoint */
-    VecZeroEntries(rho_t0_bar);
+      /* Add to final-time fidelity */
+      fidelity += optim_target->evalFidelity(finalstate_b);
+
+      /* --- Solve adjoint --- */
+      // if (mpirank_braid == 0) printf("%d: %d BWD.", mpirank_init, initid);
 
-    /* Derivative of final time objective J */
-    optim_target->evalJ_diff(finalstate, rho_t0_bar, 1.0 / ninit * obj_weights[iinit]);
+      /* Reset adjoint */
+      VecZeroEntries(rho_t0_bar);
+
+      /* Derivative of final time objective J */
+      optim_target->evalJ_diff(finalstate_b, rho_t0_bar, 1.0 / ninit * obj_weights[iinit]);
+      timestepper->setColumn(rho_t0_bar_batch, b, rho_t0_bar);
+    }
 
     /* Derivative of time-stepping */
 #ifdef WITH_BRAID
-      adjointbraidapp->PreProcess(initid, rho_t0_bar, 1.0 / ninit * gamma_penalty);
+      adjointbraidapp->PreProcess(initids[0], rho_t0_bar, 1.0 / ninit * gamma_penalty);
       adjointbraidapp->Drive();
       adjointbraidapp->PostProcess();
 #else
-      timestepper->solveAdjointODE(initid, rho_t0_bar, 1.0 / ninit * gamma_penalty);
+      timestepper->solveAdjointODE(initids, rho_t0_bar_batch, 1.0 / ninit * gamma_penalty);
 #endif
 
     /* Add to optimizers's gradient */
@@ -525,9 +590,11 @@ void OptimProblem::evalGradF(const Vec x, Vec G){
   double mypen = 1./ninit * obj_penal;
   double mycost = 1./ninit * obj_cost;
   double myfidelity = 1./ninit * fidelity;
+  PetscLogEventBegin(EVENT_REDUCTION, 0, 0, 0, 0);
   MPI_Allreduce(&mypen, &obj_penal, 1, MPI_DOUBLE, MPI_SUM, comm_init);
   MPI_Allreduce(&mycost, &obj_cost, 1, MPI_DOUBLE, MPI_SUM, comm_init);
   MPI_Allreduce(&myfidelity, &fidelity, 1, MPI_DOUBLE, MPI_SUM, comm_init);
+  PetscLogEventEnd(EVENT_REDUCTION, 0, 0, 0, 0);
 
   /* Evaluate regularization gamma/2 * ||x||^2*/
   double xnorm;
@@ -543,7 +610,9 @@ void OptimProblem::evalGradF(const Vec x, Vec G){
   for (int i=0; i<ndesign; i++) {
     mygrad[i] = grad[i];
   }
+  PetscLogEventBegin(EVENT_REDUCTION, 0, 0, 0, 0);
   MPI_Allreduce(mygrad, grad, ndesign, MPI_DOUBLE, MPI_SUM, comm_init);
+  PetscLogEventEnd(EVENT_REDUCTION, 0, 0, 0, 0);
   VecRestoreArray(G, &grad);
 
 #ifdef WITH_BRAID
@@ -552,7 +621,9 @@ void OptimProblem::evalGradF(const Vec x, Vec G){
   for (int i=0; i<ndesign; i++) {
     mygrad[i] = grad[i];
   }
+  PetscLogEventBegin(EVENT_REDUCTION, 0, 0, 0, 0);
   MPI_Allreduce(mygrad, grad, ndesign, MPI_DOUBLE, MPI_SUM, primalbraidapp->comm_braid);
+  PetscLogEventEnd(EVENT_REDUCTION, 0, 0, 0, 0);
   VecRestoreArray(G, &grad);
 #endif
 
@@ -1,7 +1,7 @@
 #include "optimtarget.hpp"
 
 
-OptimTarget::OptimTarget(int dim, int purestateID_, TargetType target_type_, ObjectiveType objective_type_, Gate* targetgate_, std::string target_filename_){
+OptimTarget::OptimTarget(int dim, int purestateID_, TargetType target_type_, ObjectiveType objective_type_, Gate* targetgate_, std::string target_filename_, bool schroedinger_){
 
   // initialize
   target_type = target_type_;
@@ -9,12 +9,14 @@ OptimTarget::OptimTarget(int dim, int purestateID_, TargetType target_type_, Obj
   targetgate = targetgate_;
   purestateID = purestateID_;
   target_filename = target_filename_;
+  schroedinger = schroedinger_;
 
   /* Allocate target state, if it is read from file, of if target is a gate transformation VrhoV */
   if (target_type == TargetType::GATE || target_type == TargetType::FROMFILE) {
-    VecCreate(PETSC_COMM_WORLD, &targetstate); 
-    VecSetSizes(targetstate,PETSC_DECIDE, 2*dim);   // input dim is the dimension of the vectorized system: dim=N^2
-    VecSetFromOptions(targetstate);
+    VecCreate(PETSC_COMM_WORLD, &targetstate_single); 
+    VecSetSizes(targetstate_single,PETSC_DECIDE, 2*dim);   // input dim is the dimension of the vectorized system: dim=N^2 (or N in Schroedinger mode)
+    VecSetFromOptions(targetstate_single);
+    targetstate = targetstate_single;
   }
 
   if (target_type == TargetType::FROMFILE) {
@@ -27,7 +29,7 @@ OptimTarget::OptimTarget(int dim, int purestateID_, TargetType target_type_, Obj
     // pass vec into the targetstate
     PetscInt ilow, iupp;
     VecGetOwnershipRange(targetstate, &ilow, &iupp);
-    for (int i = 0; i < dim; i++) { // iterates up to N^2
+    for (int i = 0; i < dim; i++) { // iterates up to N^2 (or N)
       int elemid_re = getIndexReal(i);
       int elemid_im = getIndexImag(i);
       if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(targetstate, elemid_re, vec[i],       INSERT_VALUES); // RealPart
@@ -48,7 +50,8 @@ OptimTarget::OptimTarget(int dim, int purestateID_, TargetType target_type_, Obj
 
 OptimTarget::~OptimTarget(){
   if (objective_type == ObjectiveType::JFROBENIUS) VecDestroy(&aux);
-  if (target_type == TargetType::GATE || target_type == TargetType::FROMFILE)  VecDestroy(&targetstate);
+  if (target_type == TargetType::GATE || target_type == TargetType::FROMFILE)  VecDestroy(&targetstate_single);
+  for (int i = 0; i < targetstate_batch.size(); i++) VecDestroy(&targetstate_batch[i]);
 }
 
 double OptimTarget::FrobeniusDistance(const Vec state){
@@ -70,33 +73,145 @@ void OptimTarget::FrobeniusDistance_diff(const Vec state, Vec statebar, const do
 }
 
 double OptimTarget::HilbertSchmidtOverlap(const Vec state, bool scalebypurity) {
-  // Tr(targetstate*state) = vec(targetstate)^dagger vec(state) 
   double J = 0.0;
-  VecTDot(targetstate, state, &J);
-  // scale by purity Tr(targetstate^2) = || vec(targetstate)||^2_2
+  if (schroedinger) {
+    // Tr(rho_target rho) = |<psi_target, psi>|^2
+    double ovl_re, ovl_im;
+    stateOverlap(state, &ovl_re, &ovl_im);
+    J = ovl_re*ovl_re + ovl_im*ovl_im;
+  } else {
+    // Tr(targetstate*state) = vec(targetstate)^dagger vec(state) 
+    VecTDot(targetstate, state, &J);
+  }
+  // scale by purity Tr(targetstate^2) = || vec(targetstate)||^2_2, or ||psi_target||^4 in Schroedinger mode
   if (scalebypurity){
     double dot;
     VecNorm(targetstate, NORM_2, &dot);
+    if (schroedinger) dot = dot*dot;
     J = J / (dot*dot);
   }
   return J;
 }
 
 void OptimTarget::HilbertSchmidtOverlap_diff(const Vec state, Vec statebar, const double Jbar, bool scalebypurity){
-  // Derivative of Trace: statebar += targetstate^\dagger Jbar / scale
   double scale = 1.0;
   if (scalebypurity){
     double dot;
     VecNorm(targetstate, NORM_2, &dot);
+    if (schroedinger) dot = dot*dot;
     scale = dot*dot;
   }
-  VecAXPY(statebar, Jbar/scale, targetstate);
+  if (schroedinger) {
+    // Derivative of |<psi_target, psi>|^2 = a^2 + b^2: statebar += 2 (a * psi_target + b * i psi_target) Jbar / scale
+    double ovl_re, ovl_im;
+    stateOverlap(state, &ovl_re, &ovl_im);
+    const double* tptr;
+    double* sbarptr;
+    PetscInt ilow, iupp;
+    VecGetOwnershipRange(statebar, &ilow, &iupp);
+    VecGetArrayRead(targetstate, &tptr);
+    VecGetArray(statebar, &sbarptr);
+    for (int i = 0; i < (iupp - ilow)/2; i++) {
+      double tre = tptr[getIndexReal(i)];
+      double tim = tptr[getIndexImag(i)];
+      sbarptr[getIndexReal(i)] += 2.0 * Jbar / scale * (ovl_re * tre - ovl_im * tim);
+      sbarptr[getIndexImag(i)] += 2.0 * Jbar / scale * (ovl_re * tim + ovl_im * tre);
+    }
+    VecRestoreArrayRead(targetstate, &tptr);
+    VecRestoreArray(statebar, &sbarptr);
+  } else {
+    // Derivative of Trace: statebar += targetstate^\dagger Jbar / scale
+    VecAXPY(statebar, Jbar/scale, targetstate);
+  }
+}
+
+void OptimTarget::stateOverlap(const Vec state, double* re, double* im){
+  // <psi_target, psi> = sum_i conj(psi_target_i) psi_i
+  const double* tptr, *xptr;
+  PetscInt ilow, iupp;
+  VecGetOwnershipRange(state, &ilow, &iupp);
+  VecGetArrayRead(targetstate, &tptr);
+  VecGetArrayRead(state, &xptr);
+  double mine[2] = {0.0, 0.0};
+  for (int i = 0; i < (iupp - ilow)/2; i++) {
+    double tre = tptr[getIndexReal(i)];
+    double tim = tptr[getIndexImag(i)];
+    double xre = xptr[getIndexReal(i)];
+    double xim = xptr[getIndexImag(i)];
+    mine[0] += tre * xre + tim * xim;
+    mine[1] += tre * xim - tim * xre;
+  }
+  VecRestoreArrayRead(targetstate, &tptr);
+  VecRestoreArrayRead(state, &xptr);
+  double ovl[2];
+  PetscLogEventBegin(EVENT_REDUCTION, 0, 0, 0, 0);
+  MPI_Allreduce(mine, ovl, 2, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
+  PetscLogEventEnd(EVENT_REDUCTION, 0, 0, 0, 0);
+  *re = ovl[0];
+  *im = ovl[1];
+}
+
+double OptimTarget::population(const Vec state, const int i, const int dim){
+  PetscInt ilo, ihi;
+  VecGetOwnershipRange(state, &ilo, &ihi);
+  double pop = 0.0;
+  if (schroedinger) {
+    // |psi_i|^2
+    PetscInt id_re = getIndexReal(i);
+    PetscInt id_im = getIndexImag(i);
+    double xre = 0.0, xim = 0.0;
+    if (ilo <= id_re && id_re < ihi) VecGetValues(state, 1, &id_re, &xre);
+    if (ilo <= id_im && id_im < ihi) VecGetValues(state, 1, &id_im, &xim);
+    pop = xre*xre + xim*xim;
+  } else {
+    // rho_ii
+    PetscInt diagID = getIndexReal(getVecID(i,i,dim));
+    if (ilo <= diagID && diagID < ihi) VecGetValues(state, 1, &diagID, &pop);
+  }
+  return pop;
+}
+
+void OptimTarget::population_diff(const Vec state, Vec statebar, const int i, const int dim, const double popbar){
+  PetscInt ilo, ihi;
+  VecGetOwnershipRange(state, &ilo, &ihi);
+  if (schroedinger) {
+    PetscInt id_re = getIndexReal(i);
+    PetscInt id_im = getIndexImag(i);
+    double xre = 0.0, xim = 0.0;
+    if (ilo <= id_re && id_re < ihi) VecGetValues(state, 1, &id_re, &xre);
+    if (ilo <= id_im && id_im < ihi) VecGetValues(state, 1, &id_im, &xim);
+    if (ilo <= id_re && id_re < ihi) VecSetValue(statebar, id_re, 2.0*xre*popbar, ADD_VALUES);
+    if (ilo <= id_im && id_im < ihi) VecSetValue(statebar, id_im, 2.0*xim*popbar, ADD_VALUES);
+  } else {
+    PetscInt diagID = getIndexReal(getVecID(i,i,dim));
+    if (ilo <= diagID && diagID < ihi) VecSetValue(statebar, diagID, popbar, ADD_VALUES);
+  }
 }
 
 
 void OptimTarget::prepare(const Vec rho_t0){
   // If gate optimization, apply the gate and store targetstate for later use. Else, do nothing.
-  if (target_type == TargetType::GATE) targetgate->applyGate(rho_t0, targetstate);
+  if (target_type == TargetType::GATE) {
+    targetstate = targetstate_single;
+    if (schroedinger) targetgate->applyGateVector(rho_t0, targetstate);  // psi_target = V psi(0)
+    else              targetgate->applyGate(rho_t0, targetstate);
+  }
+}
+
+void OptimTarget::prepare(const Vec rho_t0, int ibatch){
+  if (target_type == TargetType::GATE) {
+    while (targetstate_batch.size() <= ibatch) {
+      Vec target;
+      VecDuplicate(targetstate_single, &target);
+      targetstate_batch.push_back(target);
+    }
+    if (schroedinger) targetgate->applyGateVector(rho_t0, targetstate_batch[ibatch]);
+    else              targetgate->applyGate(rho_t0, targetstate_batch[ibatch]);
+  }
+}
+
+void OptimTarget::selectBatch(int ibatch){
+  if (target_type == TargetType::GATE) targetstate = targetstate_batch[ibatch];
 }
 
 
@@ -109,7 +224,8 @@ double OptimTarget::evalJ(const Vec state){
 
   PetscInt dim;
   VecGetSize(state, &dim);
-  dim = (int) sqrt(dim/2.0);  // dim = N with \rho \in C^{N\times N}
+  if (schroedinger) dim = dim/2;     // dim = N with \psi \in C^N
+  else dim = (int) sqrt(dim/2.0);  // dim = N with \rho \in C^{N\times N}
 
 
   switch(objective_type) {
@@ -123,8 +239,9 @@ double OptimTarget::evalJ(const Vec state){
       } 
       else {  // target = e_me_m^\dagger
         assert(target_type == TargetType::PURE);
-        // substract 1.0 from m-th diagonal element then take the vector norm 
+        // substract 1.0 from m-th diagonal element (or m-th element of psi) then take the vector norm 
         diagID = getIndexReal(getVecID(purestateID,purestateID,dim));
+        if (schroedinger) diagID = getIndexReal(purestateID);
         VecGetOwnershipRange(state, &ilo, &ihi);
         if (ilo <= diagID && diagID < ihi) VecSetValue(state, diagID, -1.0, ADD_VALUES);
         VecAssemblyBegin(state); VecAssemblyEnd(state);
@@ -146,12 +263,11 @@ double OptimTarget::evalJ(const Vec state){
       else { // target = e_m e_m^\dagger
         /* -> J_HS = 1 - Tr(e_m e_m^\dagger \rho(T)) = 1 - rho_mm(T) */
         assert(target_type == TargetType::PURE);
-        diagID = getIndexReal(getVecID(purestateID,purestateID,dim));
-        rhoii = 0.0;
-        VecGetOwnershipRange(state, &ilo, &ihi);
-        if (ilo <= diagID && diagID < ihi) VecGetValues(state, 1, &diagID, &rhoii);
-        mine = 1. - rhoii;
-        MPI_Allreduce(&mine, &objective, 1, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
+        rhoii = population(state, purestateID, dim);
+        PetscLogEventBegin(EVENT_REDUCTION, 0, 0, 0, 0);
+        MPI_Allreduce(&rhoii, &mine, 1, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
+        PetscLogEventEnd(EVENT_REDUCTION, 0, 0, 0, 0);
+        objective = 1. - mine;
       }
       break; // case J_HS
 
@@ -166,14 +282,13 @@ double OptimTarget::evalJ(const Vec state){
         // iterate over diagonal elements 
         sum = 0.0;
         for (int i=0; i<dim; i++){
-          diagID = getIndexReal(getVecID(i,i,dim));
-          rhoii = 0.0;
-          VecGetOwnershipRange(state, &ilo, &ihi);
-          if (ilo <= diagID && diagID < ihi) VecGetValues(state, 1, &diagID, &rhoii);
+          rhoii = population(state, i, dim);
           lambdai = fabs(i - purestateID);
           sum += lambdai * rhoii;
         }
+        PetscLogEventBegin(EVENT_REDUCTION, 0, 0, 0, 0);
         MPI_Allreduce(&sum, &objective, 1, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
+        PetscLogEventEnd(EVENT_REDUCTION, 0, 0, 0, 0);
       }
       break; // case J_MEASURE
   }
@@ -184,12 +299,13 @@ double OptimTarget::evalJ(const Vec state){
 
 void OptimTarget::evalJ_diff(const Vec state, Vec statebar, const double Jbar){
   PetscInt ilo, ihi;
-  double lambdai, val;
+  double lambdai;
   PetscInt diagID;
 
   PetscInt dim;
   VecGetSize(state, &dim);
-  dim = (int) sqrt(dim/2.0);  // dim = N with \rho \in C^{N\times N}
+  if (schroedinger) dim = dim/2;     // dim = N with \psi \in C^N
+  else dim = (int) sqrt(dim/2.0);  // dim = N with \rho \in C^{N\times N}
 
   switch (objective_type) {
 
@@ -201,8 +317,9 @@ void OptimTarget::evalJ_diff(const Vec state, Vec statebar, const double Jbar){
         assert(target_type == TargetType::PURE);         
         // Derivative of J = 1/2||x||^2 is xbar += x * Jbar, where x = rho(t) - E_mm
         VecAXPY(statebar, Jbar, state);
-        // now substract 1.0*Jbar from m-th diagonal element
+        // now substract 1.0*Jbar from m-th diagonal element (or m-th element of psi)
         diagID = getIndexReal(getVecID(purestateID,purestateID,dim));
+        if (schroedinger) diagID = getIndexReal(purestateID);
         VecGetOwnershipRange(state, &ilo, &ihi);
         if (ilo <= diagID && diagID < ihi) VecSetValue(statebar, diagID, -1.0*Jbar, ADD_VALUES);
       }
@@ -213,10 +330,7 @@ void OptimTarget::evalJ_diff(const Vec state, Vec statebar, const double Jbar){
           HilbertSchmidtOverlap_diff(state, statebar, -1.0 * Jbar, true);
       } else {
         assert(target_type == TargetType::PURE);         
-        diagID = getIndexReal(getVecID(purestateID,purestateID,dim));
-        val = -1. * Jbar;
-        VecGetOwnershipRange(state, &ilo, &ihi);
-        if (ilo <= diagID && diagID < ihi) VecSetValue(statebar, diagID, val, ADD_VALUES);
+        population_diff(state, statebar, purestateID, dim, -1. * Jbar);
       }
     break;
 
@@ -229,10 +343,7 @@ void OptimTarget::evalJ_diff(const Vec state, Vec statebar, const double Jbar){
         // iterate over diagonal elements 
         for (int i=0; i<dim; i++){
           lambdai = fabs(i - purestateID);
-          diagID = getIndexReal(getVecID(i,i,dim));
-          val = lambdai * Jbar;
-          VecGetOwnershipRange(state, &ilo, &ihi);
-          if (ilo <= diagID && diagID < ihi) VecSetValue(statebar, diagID, val, ADD_VALUES);
+          population_diff(state, statebar, i, dim, lambdai * Jbar);
         }
       }
     break;
@@ -244,21 +355,20 @@ void OptimTarget::evalJ_diff(const Vec state, Vec statebar, const double Jbar){
 double OptimTarget::evalFidelity(const Vec state){
   PetscInt dim;
   VecGetSize(state, &dim);
-  dim = (int) sqrt(dim/2.0);  // dim = N with \rho \in C^{N\times N}
+  if (schroedinger) dim = dim/2;     // dim = N with \psi \in C^N
+  else dim = (int) sqrt(dim/2.0);  // dim = N with \rho \in C^{N\times N}
 
-  PetscInt vecID, ihi, ilo;
   double rho_mm;
 
   /* Evaluate the Fidelity = Tr(targetstate^\dagger \rho) */
   double fidel = 0.0;
   if (target_type == TargetType::PURE) {
-    // if Pure target, then fidelity = rho(T)_mm
-      vecID = getIndexReal(getVecID(purestateID, purestateID, dim));
-      VecGetOwnershipRange(state, &ilo, &ihi);
-      rho_mm = 0.0;
-      if (ilo <= vecID && vecID < ihi) VecGetValues(state, 1, &vecID, &rho_mm); // local!
+    // if Pure target, then fidelity = rho(T)_mm (or |psi_m(T)|^2)
+      rho_mm = population(state, purestateID, dim); // local!
       // Communicate over all petsc processors.
+      PetscLogEventBegin(EVENT_REDUCTION, 0, 0, 0, 0);
       MPI_Allreduce(&rho_mm, &fidel, 1, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
+      PetscLogEventEnd(EVENT_REDUCTION, 0, 0, 0, 0);
   } else {
     assert(target_type == TargetType::FROMFILE || target_type == TargetType::GATE);
     fidel = HilbertSchmidtOverlap(state, true);   // scale by purity.
@@ -62,9 +62,10 @@ int Oscillator::evalControl(const double t, double* Re_ptr, double* Im_ptr){
     exit(1);
   }
 
+  PetscLogEventBegin(EVENT_CONTROL, 0, 0, 0, 0);
+
   /* Evaluate the spline at time t */
-  *Re_ptr = basisfunctions->evaluate(t, params, ground_freq, ControlType::RE);
-  *Im_ptr = basisfunctions->evaluate(t, params, ground_freq, ControlType::IM);
+  basisfunctions->evaluate(t, params, Re_ptr, Im_ptr);
 
   /* If pipulse: Overwrite controls by constant amplitude */
   for (int ipulse=0; ipulse< pipulse.tstart.size(); ipulse++){
@@ -75,6 +76,7 @@ int Oscillator::evalControl(const double t, double* Re_ptr, double* Im_ptr){
     }
   }
 
+  PetscLogEventEnd(EVENT_CONTROL, 0, 0, 0, 0);
   return 0;
 }
 
@@ -87,10 +89,11 @@ int Oscillator::evalControl_diff(const double t, double* dRedp, double* dImdp) {
   } 
 
   /* Evaluate derivative of spline basis at time t */
+  PetscLogEventBegin(EVENT_CONTROL, 0, 0, 0, 0);
   double Rebar = 1.0;
   double Imbar = 1.0;
-  basisfunctions->derivative(t, dRedp, Rebar, ControlType::RE);
-  basisfunctions->derivative(t, dImdp, Imbar, ControlType::IM);
+  basisfunctions->derivative(t, dRedp, dImdp, Rebar, Imbar);
+  PetscLogEventEnd(EVENT_CONTROL, 0, 0, 0, 0);
 
   /* TODO: Derivative of pipulse? */
   for (int ipulse=0; ipulse< pipulse.tstart.size(); ipulse++){
@@ -139,7 +142,8 @@ double Oscillator::expectedEnergy(const Vec x) {
  
   PetscInt dim;
   VecGetSize(x, &dim);
-  int dimmat = (int) sqrt(dim/2);
+  int dimmat = dim_preOsc * nlevels * dim_postOsc;
+  bool statevector = dim/2 < dimmat*dimmat;  // x holds psi (Schroedinger mode) instead of vectorized rho
 
   /* Get locally owned portion of x */
   PetscInt ilow, iupp;
@@ -152,10 +156,19 @@ double Oscillator::expectedEnergy(const Vec x) {
     /* Get diagonal element in number operator */
     int num_diag = i % (nlevels*dim_postOsc);
     num_diag = num_diag / dim_postOsc;
-    /* Get diagonal element in rho (real) */
-    PetscInt idx_diag = getIndexReal(getVecID(i,i,dimmat));
+    /* Get diagonal element in rho (real), or |psi_i|^2 */
     double xdiag = 0.0;
-    if (ilow <= idx_diag && idx_diag < iupp) VecGetValues(x, 1, &idx_diag, &xdiag);
+    if (statevector) {
+      PetscInt idx_re = getIndexReal(i);
+      PetscInt idx_im = getIndexImag(i);
+      double xre = 0.0, xim = 0.0;
+      if (ilow <= idx_re && idx_re < iupp) VecGetValues(x, 1, &idx_re, &xre);
+      if (ilow <= idx_im && idx_im < iupp) VecGetValues(x, 1, &idx_im, &xim);
+      xdiag = xre*xre + xim*xim;
+    } else {
+      PetscInt idx_diag = getIndexReal(getVecID(i,i,dimmat));
+      if (ilow <= idx_diag && idx_diag < iupp) VecGetValues(x, 1, &idx_diag, &xdiag);
+    }
     expected += num_diag * xdiag;
   }
   
@@ -170,7 +183,8 @@ double Oscillator::expectedEnergy(const Vec x) {
 void Oscillator::expectedEnergy_diff(const Vec x, Vec x_bar, const double obj_bar) {
   PetscInt dim;
   VecGetSize(x, &dim);
-  int dimmat = (int) sqrt(dim/2);
+  int dimmat = dim_preOsc * nlevels * dim_postOsc;
+  bool statevector = dim/2 < dimmat*dimmat;  // x holds psi (Schroedinger mode) instead of vectorized rho
   double num_diag;
 
   /* Get locally owned portion of x */
@@ -181,9 +195,22 @@ void Oscillator::expectedEnergy_diff(const Vec x, Vec x_bar, const double obj_ba
   for (int i=0; i<dimmat; i++) {
     int num_diag = i % (nlevels*dim_postOsc);
     num_diag = num_diag / dim_postOsc;
-    PetscInt idx_diag = getIndexReal(getVecID(i, i, dimmat));
-    double val = num_diag * obj_bar;
-    if (ilow <= idx_diag && idx_diag < iupp) VecSetValues(x_bar, 1, &idx_diag, &val, ADD_VALUES);
+    if (statevector) {
+      // Derivative of |psi_i|^2
+      PetscInt idx_re = getIndexReal(i);
+      PetscInt idx_im = getIndexImag(i);
+      double xre = 0.0, xim = 0.0;
+      if (ilow <= idx_re && idx_re < iupp) VecGetValues(x, 1, &idx_re, &xre);
+      if (ilow <= idx_im && idx_im < iupp) VecGetValues(x, 1, &idx_im, &xim);
+      double val_re = 2.0 * xre * num_diag * obj_bar;
+      double val_im = 2.0 * xim * num_diag * obj_bar;
+      if (ilow <= idx_re && idx_re < iupp) VecSetValues(x_bar, 1, &idx_re, &val_re, ADD_VALUES);
+      if (ilow <= idx_im && idx_im < iupp) VecSetValues(x_bar, 1, &idx_im, &val_im, ADD_VALUES);
+    } else {
+      PetscInt idx_diag = getIndexReal(getVecID(i, i, dimmat));
+      double val = num_diag * obj_bar;
+      if (ilow <= idx_diag && idx_diag < iupp) VecSetValues(x_bar, 1, &idx_diag, &val, ADD_VALUES);
+    }
   }
   VecAssemblyBegin(x_bar); VecAssemblyEnd(x_bar);
 
@@ -193,6 +220,9 @@ void Oscillator::expectedEnergy_diff(const Vec x, Vec x_bar, const double obj_ba
 void Oscillator::population(const Vec x, std::vector<double> &pop) {
 
   int dimN = dim_preOsc * nlevels * dim_postOsc;
+  PetscInt dim;
+  VecGetSize(x, &dim);
+  bool statevector = dim/2 < dimN*dimN;  // x holds psi (Schroedinger mode) instead of vectorized rho
 
   assert (pop.size() == nlevels);
 
@@ -213,9 +243,18 @@ void Oscillator::population(const Vec x, std::vector<double> &pop) {
       for (int l=0; l < dim_postOsc; l++) {
         /* Get diagonal element */
         int rhoID = blockstartID + identitystartID + l; // Diagonal element of rho
-        PetscInt diagID = getIndexReal(getVecID(rhoID, rhoID, dimN));  // Position in vectorized rho
         double val = 0.0;
-        if (ilow <= diagID && diagID < iupp)  VecGetValues(x, 1, &diagID, &val);
+        if (statevector) { // |psi_i|^2
+          PetscInt id_re = getIndexReal(rhoID);
+          PetscInt id_im = getIndexImag(rhoID);
+          double xre = 0.0, xim = 0.0;
+          if (ilow <= id_re && id_re < iupp)  VecGetValues(x, 1, &id_re, &xre);
+          if (ilow <= id_im && id_im < iupp)  VecGetValues(x, 1, &id_im, &xim);
+          val = xre*xre + xim*xim;
+        } else {
+          PetscInt diagID = getIndexReal(getVecID(rhoID, rhoID, dimN));  // Position in vectorized rho
+          if (ilow <= diagID && diagID < iupp)  VecGetValues(x, 1, &diagID, &val);
+        }
         sum += val;
       }
     }
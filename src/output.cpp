@@ -8,6 +8,7 @@ Output::Output(){
   optim_monitor_freq = 0;
   output_frequency = 0;
   optim_iter = 0;
+  perf_report = false;
 }
 
 Output::Output(MapParam& config, MPI_Comm comm_petsc, MPI_Comm comm_init, int noscillators) : Output() {
@@ -17,6 +18,8 @@ Output::Output(MapParam& config, MPI_Comm comm_petsc, MPI_Comm comm_init, int no
   MPI_Comm_rank(comm_petsc, &mpirank_petsc);
   MPI_Comm_size(comm_petsc, &mpisize_petsc);
   MPI_Comm_rank(comm_init, &mpirank_init);
+  MPI_Comm_size(MPI_COMM_WORLD, &mpisize_world);
+  this->comm_init = comm_init;
 
 
   /* Create Data directory */
@@ -28,6 +31,8 @@ Output::Output(MapParam& config, MPI_Comm comm_petsc, MPI_Comm comm_init, int no
   /* Prepare output for optimizer */
   optim_monitor_freq = config.GetIntParam("optim_monitor_frequency", 10);
   output_frequency = config.GetIntParam("output_frequency", 1);
+  perf_report = config.GetBoolParam("performance_report", false);
+  if (perf_report) PetscLogDefaultBegin();
   if (mpirank_world == 0) {
     char filename[255];
     sprintf(filename, "%s/optim_history.dat", datadir.c_str());
@@ -50,11 +55,12 @@ Output::Output(MapParam& config, MPI_Comm comm_petsc, MPI_Comm comm_init, int no
     }
   }
 
-  /* Prepare data output files */
-  ufile = NULL;
-  vfile = NULL;
-  for (int i=0; i< outputstr.size(); i++) expectedfile.push_back (NULL);
-  for (int i=0; i< outputstr.size(); i++) populationfile.push_back (NULL);
+  /* Prepare data output files, one slot for now. More slots are added when opened. */
+  ufile.push_back(NULL);
+  vfile.push_back(NULL);
+  expectedfile.push_back(std::vector<FILE*>(outputstr.size(), NULL));
+  populationfile.push_back(std::vector<FILE*>(outputstr.size(), NULL));
+  slot_active.push_back(false);
 
 }
 
@@ -71,10 +77,12 @@ Output::~Output(){
 
 void Output::writeOptimFile(double objective, double gnorm, double stepsize, double Favg, double costT, double tikh_regul, double penalty){
 
+  PetscLogEventBegin(EVENT_OUTPUT, 0, 0, 0, 0);
   if (mpirank_world == 0){
     fprintf(optimfile, "%05d  %1.14e  %1.14e  %.8f  %1.14e  %1.14e  %1.14e  %1.14e\n", optim_iter, objective, gnorm, stepsize, Favg, costT, tikh_regul, penalty);
     fflush(optimfile);
   } 
+  PetscLogEventEnd(EVENT_OUTPUT, 0, 0, 0, 0);
 
 }
 
@@ -82,6 +90,7 @@ void Output::writeGradient(Vec grad){
   char filename[255];  
   PetscInt ngrad;
   VecGetSize(grad, &ngrad);
+  PetscLogEventBegin(EVENT_OUTPUT, 0, 0, 0, 0);
 
   /* Print current gradients to file */
   FILE *file;
@@ -97,11 +106,13 @@ void Output::writeGradient(Vec grad){
   fclose(file);
   VecRestoreArrayRead(grad, &grad_ptr);
   printf("File written: %s\n", filename);
+  PetscLogEventEnd(EVENT_OUTPUT, 0, 0, 0, 0);
 }
 
 void Output::writeControls(Vec params, MasterEq* mastereq, int ntime, double dt){
 
   /* Write controls every <outfreq> iterations */
+  PetscLogEventBegin(EVENT_OUTPUT, 0, 0, 0, 0);
   if ( mpirank_world == 0 && optim_iter % optim_monitor_freq == 0 ) { 
 
     char filename[255];
@@ -144,11 +155,22 @@ void Output::writeControls(Vec params, MasterEq* mastereq, int ntime, double dt)
     }
 
   }
+  PetscLogEventEnd(EVENT_OUTPUT, 0, 0, 0, 0);
 }
 
 
-void Output::openDataFiles(std::string prefix, int initid){
+void Output::openDataFiles(std::string prefix, int initid, int slot){
   char filename[255];
+  PetscLogEventBegin(EVENT_OUTPUT, 0, 0, 0, 0);
+
+  /* Add slots if needed */
+  while (ufile.size() <= slot) {
+    ufile.push_back(NULL);
+    vfile.push_back(NULL);
+    expectedfile.push_back(std::vector<FILE*>(outputstr.size(), NULL));
+    populationfile.push_back(std::vector<FILE*>(outputstr.size(), NULL));
+    slot_active.push_back(false);
+  }
 
   /* Flag to determine of this optimization iteration will write data output */
   bool write_this_iter = false;
@@ -159,12 +181,21 @@ void Output::openDataFiles(std::string prefix, int initid){
   sprintf(postchar,"");
   if (mpirank_braid >= 0) sprintf(postchar, ".braidrank%04d", mpirank_braid);
 
+  /* Mark the slot as active if any data will be written */
+  slot_active[slot] = false;
+  if (write_this_iter && writefullstate) slot_active[slot] = true;
+  for (int i=0; i<outputstr.size(); i++) {
+    for (int j=0; j<outputstr[i].size(); j++) {
+      if (write_this_iter && (outputstr[i][j].compare("expectedEnergy") == 0 || outputstr[i][j].compare("population") == 0)) slot_active[slot] = true;
+    }
+  }
+
   /* Open files for state vector */
   if (mpirank_petsc == 0 && writefullstate && write_this_iter) {
     sprintf(filename, "%s/%s_Re.iinit%04d%s.dat", datadir.c_str(), prefix.c_str(), initid, postchar);
-    ufile = fopen(filename, "w");
+    ufile[slot] = fopen(filename, "w");
     sprintf(filename, "%s/%s_Im.iinit%04d%s.dat", datadir.c_str(), prefix.c_str(), initid, postchar);
-    vfile = fopen(filename, "w"); 
+    vfile[slot] = fopen(filename, "w"); 
   }
 
   /* Open files for expected energy */
@@ -173,42 +204,44 @@ void Output::openDataFiles(std::string prefix, int initid){
       for (int j=0; j<outputstr[i].size(); j++) {
         if (outputstr[i][j].compare("expectedEnergy") == 0) {
           sprintf(filename, "%s/expected%d.iinit%04d%s.dat", datadir.c_str(), i, initid, postchar);
-          expectedfile[i] = fopen(filename, "w");
-          fprintf(expectedfile[i], "# time      expected energy level\n");
+          expectedfile[slot][i] = fopen(filename, "w");
+          fprintf(expectedfile[slot][i], "# time      expected energy level\n");
         }
         if (outputstr[i][j].compare("population") == 0) {
           sprintf(filename, "%s/population%d.iinit%04d%s.dat", datadir.c_str(), i, initid, postchar);
-          populationfile[i] = fopen(filename, "w");
-          fprintf(populationfile[i], "# time      diagonal of the density matrix \n");
+          populationfile[slot][i] = fopen(filename, "w");
+          fprintf(populationfile[slot][i], "# time      diagonal of the density matrix \n");
         }
       }
     }
   }
 
+  PetscLogEventEnd(EVENT_OUTPUT, 0, 0, 0, 0);
 }
 
-void Output::writeDataFiles(int timestep, double time, const Vec state, MasterEq* mastereq){
+void Output::writeDataFiles(int timestep, double time, const Vec state, MasterEq* mastereq, int slot){
 
   /* Write output only every <num> time-steps */
+  PetscLogEventBegin(EVENT_OUTPUT, 0, 0, 0, 0);
   if (timestep % output_frequency == 0) {
 
     /* Write expected energy levels to file */
-    for (int iosc = 0; iosc < expectedfile.size(); iosc++) {
+    for (int iosc = 0; iosc < expectedfile[slot].size(); iosc++) {
       double expected = mastereq->getOscillator(iosc)->expectedEnergy(state);
-      if (expectedfile[iosc] != NULL) fprintf(expectedfile[iosc], "%.8f %1.14e\n", time, expected);
+      if (expectedfile[slot][iosc] != NULL) fprintf(expectedfile[slot][iosc], "%.8f %1.14e\n", time, expected);
     }
 
     /* Write population to file */
-    for (int iosc = 0; iosc < populationfile.size(); iosc++) {
+    for (int iosc = 0; iosc < populationfile[slot].size(); iosc++) {
       std::vector<double> pop (mastereq->getOscillator(iosc)->getNLevels(), 0.0);
       mastereq->getOscillator(iosc)->population(state, pop);
       // write
-      if (populationfile[iosc] != NULL) {
-        fprintf(populationfile[iosc], "%.8f ", time);
+      if (populationfile[slot][iosc] != NULL) {
+        fprintf(populationfile[slot][iosc], "%.8f ", time);
         for (int i = 0; i<pop.size(); i++) {
-          fprintf(populationfile[iosc], " %1.14e", pop[i]);
+          fprintf(populationfile[slot][iosc], " %1.14e", pop[i]);
         }
-        fprintf(populationfile[iosc], "\n");
+        fprintf(populationfile[slot][iosc], "\n");
       }
     }
 
@@ -222,18 +255,18 @@ void Output::writeDataFiles(int timestep, double time, const Vec state, MasterEq
       // VecScatterEnd(scat, u->x, xseq, INSERT_VALUES, SCATTER_FORWARD);
 
       /* Write full state vector to file */
-      if (ufile != NULL && vfile != NULL) {
-        fprintf(ufile,  "%.8f  ", time);
-        fprintf(vfile,  "%.8f  ", time);
+      if (ufile[slot] != NULL && vfile[slot] != NULL) {
+        fprintf(ufile[slot],  "%.8f  ", time);
+        fprintf(vfile[slot],  "%.8f  ", time);
 
         const PetscScalar *x;
         VecGetArrayRead(state, &x);
         for (int i=0; i<mastereq->getDim(); i++) {
-          fprintf(ufile, "%1.10e  ", x[getIndexReal(i)]);  
-          fprintf(vfile, "%1.10e  ", x[getIndexImag(i)]);  
+          fprintf(ufile[slot], "%1.10e  ", x[getIndexReal(i)]);  
+          fprintf(vfile[slot], "%1.10e  ", x[getIndexImag(i)]);  
         }
-        fprintf(ufile, "\n");
-        fprintf(vfile, "\n");
+        fprintf(ufile[slot], "\n");
+        fprintf(vfile[slot], "\n");
         VecRestoreArrayRead(state, &x);
       }
         /* Destroy scatter context and vector */
@@ -241,29 +274,107 @@ void Output::writeDataFiles(int timestep, double time, const Vec state, MasterEq
         // VecDestroy(&xseq); // TODO create and destroy scatter and xseq in contructor/destructor
     }
   }
+  PetscLogEventEnd(EVENT_OUTPUT, 0, 0, 0, 0);
+}
+
+bool Output::writesDataFiles(int timestep, int slot){
+  if (slot >= slot_active.size()) return false;
+  return slot_active[slot] && timestep % output_frequency == 0;
 }
 
 void Output::closeDataFiles(){
 
   /* Close output data files */
-  if (ufile != NULL) {
-    fclose(ufile);
-    ufile = NULL;
-  }
-  if (vfile != NULL) {
-    fclose(vfile);
-    vfile = NULL;
+  PetscLogEventBegin(EVENT_OUTPUT, 0, 0, 0, 0);
+  for (int slot = 0; slot < ufile.size(); slot++) {
+    slot_active[slot] = false;
+    if (ufile[slot] != NULL) {
+      fclose(ufile[slot]);
+      ufile[slot] = NULL;
+    }
+    if (vfile[slot] != NULL) {
+      fclose(vfile[slot]);
+      vfile[slot] = NULL;
+    }
+    for (int i=0; i< expectedfile[slot].size(); i++) {
+      if (expectedfile[slot][i] != NULL) {
+        fclose(expectedfile[slot][i]);
+        expectedfile[slot][i] = NULL;
+      }
+    }
+    for (int i=0; i< populationfile[slot].size(); i++) {
+      if (populationfile[slot][i] != NULL) {
+        fclose(populationfile[slot][i]);
+        populationfile[slot][i] = NULL;
+      }
+    }
   }
-  for (int i=0; i< expectedfile.size(); i++) {
-    if (expectedfile[i] != NULL) {
-      fclose(expectedfile[i]);
-      expectedfile[i] = NULL;
+  PetscLogEventEnd(EVENT_OUTPUT, 0, 0, 0, 0);
+}
+
+
+void Output::writePerformanceReport(double runtime, double memory, const std::vector<int>& iter_histogram){
+
+  if (!perf_report) return;
+
+  /* Time, number of calls and number of MPI reductions of each event in each stage. Maximum over all processors. */
+  const int nstages = 3;
+  const int nevents = 6;
+  PetscLogStage stages[nstages] = {0, STAGE_FORWARD, STAGE_ADJOINT};
+  const char* stagenames[nstages] = {"main", "forward", "adjoint"};
+  PetscLogEvent events[nevents] = {EVENT_RHS, EVENT_LINSOLVE, EVENT_CONTROL, EVENT_GRADIENT, EVENT_OUTPUT, EVENT_REDUCTION};
+  const char* eventnames[nevents] = {"rhs_apply", "linear_solve", "control_eval", "gradient", "output_io", "mpi_reduction"};
+  std::vector<double> perf(3*nstages*nevents, 0.0);
+  for (int is = 0; is < nstages; is++) {
+    for (int ie = 0; ie < nevents; ie++) {
+      PetscEventPerfInfo info;
+      PetscLogEventGetPerfInfo(stages[is], events[ie], &info);
+      perf[3*(is*nevents + ie) + 0] = info.time;
+      perf[3*(is*nevents + ie) + 1] = info.count;
+      perf[3*(is*nevents + ie) + 2] = info.numReductions;
     }
   }
-  for (int i=0; i< populationfile.size(); i++) {
-    if (populationfile[i] != NULL) {
-      fclose(populationfile[i]);
-      populationfile[i] = NULL;
+  MPI_Allreduce(MPI_IN_PLACE, perf.data(), perf.size(), MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+  /* Iteration histogram, summed over the processors of different initial conditions */
+  int nbins = iter_histogram.size();
+  MPI_Allreduce(MPI_IN_PLACE, &nbins, 1, MPI_INT, MPI_MAX, comm_init);
+  std::vector<int> histogram(iter_histogram);
+  histogram.resize(nbins, 0);
+  MPI_Allreduce(MPI_IN_PLACE, histogram.data(), nbins, MPI_INT, MPI_SUM, comm_init);
+  long nsolves = 0, niters = 0;
+  for (int i = 0; i < nbins; i++) {
+    nsolves += histogram[i];
+    niters  += (long) i * histogram[i];
+  }
+
+  if (mpirank_world == 0) {
+    char filename[255];
+    sprintf(filename, "%s/performance.json", datadir.c_str());
+    FILE* file = fopen(filename, "w");
+    fprintf(file, "{\n");
+    fprintf(file, "  \"processors\": %d,\n", mpisize_world);
+    fprintf(file, "  \"runtime\": %1.8e,\n", runtime);
+    fprintf(file, "  \"memory_MB\": %1.8e,\n", memory);
+    fprintf(file, "  \"stages\": {\n");
+    for (int is = 0; is < nstages; is++) {
+      fprintf(file, "    \"%s\": {\n", stagenames[is]);
+      for (int ie = 0; ie < nevents; ie++) {
+        const double* p = &perf[3*(is*nevents + ie)];
+        fprintf(file, "      \"%s\": {\"time\": %1.8e, \"count\": %.0f, \"reductions\": %.0f}%s\n", eventnames[ie], p[0], p[1], p[2], ie < nevents-1 ? "," : "");
+      }
+      fprintf(file, "    }%s\n", is < nstages-1 ? "," : "");
     }
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"linear_solver\": {\n");
+    fprintf(file, "    \"solves\": %ld,\n", nsolves);
+    fprintf(file, "    \"average_iterations\": %1.8e,\n", nsolves > 0 ? (double) niters / nsolves : 0.0);
+    fprintf(file, "    \"histogram\": [");
+    for (int i = 0; i < nbins; i++) fprintf(file, "%s%d", i > 0 ? ", " : "", histogram[i]);
+    fprintf(file, "]\n");
+    fprintf(file, "  }\n");
+    fprintf(file, "}\n");
+    fclose(file);
+    printf("File written: %s\n", filename);
   }
 }
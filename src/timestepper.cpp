@@ -1,5 +1,9 @@
 #include "timestepper.hpp"
 #include "petscvec.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
 
 TimeStepper::TimeStepper() {
   dim = 0;
@@ -8,25 +12,95 @@ TimeStepper::TimeStepper() {
   total_time = 0.0;
   dt = 0.0;
   storeFWD = false;
+  storeHermitian = false;
+  nbatch = 1;
+  ncheckpoints = 0;
+  store_map = NULL;
+  store_mapsize = 0;
+  store_stride = 0;
+  store_readahead = 0;
+  store_fd = -1;
+  store_compression = StoreCompression::NONE;
+  store_tol = 0.0;
+  store_buffer = NULL;
+  store_recon = NULL;
+  store_decoded = NULL;
+  store_recon_tindex = -1;
+  store_decoded_tindex = -1;
+  adaptive = false;
+  adjoint_sweep = false;
+  adapt_tol = 0.0;
+  adapt_h = 0.0;
+  x_prev = NULL;
+  errest = -1.0;
+  errest_order = 0;
+  nsteps = 0;
+  nrejected = 0;
 }
 
-TimeStepper::TimeStepper(MasterEq* mastereq_, int ntime_, double total_time_, Output* output_, bool storeFWD_) : TimeStepper() {
+/* Position of Re(rho(i,j)) and Im(rho(i,j)), i<=j, in the Hermitian-packed storage: Real parts of the upper triangle 
+ * including the diagonal (column by column), followed by imaginary parts of the strict upper triangle. Total: N^2 reals. */
+inline int getPackedIndexReal(const int i, const int j, const int N) { return j*(j+1)/2 + i; }
+inline int getPackedIndexImag(const int i, const int j, const int N) { return N*(N+1)/2 + j*(j-1)/2 + i; }
+
+TimeStepper::TimeStepper(MasterEq* mastereq_, int ntime_, double total_time_, Output* output_, const StorageOptions& storage, int nbatch_) : TimeStepper() {
   mastereq = mastereq_;
-  dim = 2*mastereq->getDim();
+  nbatch = nbatch_;
+  dim = 2*mastereq->getDim()*nbatch;
   ntime = ntime_;
   total_time = total_time_;
   output = output_;
-  storeFWD = storeFWD_;
+  storeFWD = storage.storeFWD;
+  storeHermitian = storage.hermitian && storeFWD && !mastereq->schroedinger && nbatch == 1;  // state vectors have no Hermitian symmetry; batches are stored in full
 
   /* Set the time-step size */
   dt = total_time / ntime;
+  nsteps = ntime;
+
+  /* Binomial checkpointing keeps at least the initial and the final state. Store all states if that is not less. */
+  ncheckpoints = 0;
+  if (storeFWD && storage.ncheckpoints > 0) ncheckpoints = std::max(storage.ncheckpoints, 2);
+  if (ncheckpoints >= ntime+1) ncheckpoints = 0;
+
+  /* Compression of the stored states. It relies on storing all states in memory, in order. */
+  store_compression = storeFWD ? storage.compression : StoreCompression::NONE;
+  store_tol = storage.compression_tol;
+  if (store_compression != StoreCompression::NONE && (ncheckpoints > 0 || storage.scratchdir.size() > 0)) {
+    printf("ERROR: Compressed storage of the states can't be combined with checkpointing or a scratch file.\n");
+    exit(1);
+  }
+
+  /* A batch interleaves nbatch states, its local size is nbatch times that of a single state */
+  PetscInt dim_local = PETSC_DECIDE;
+  if (nbatch > 1) {
+    PetscInt mlocal;
+    MatGetLocalSize(mastereq->getRHS(), &mlocal, NULL);
+    dim_local = nbatch * mlocal;
+  }
 
-  /* Allocate storage of primal state */
-  if (storeFWD) { 
-    for (int n = 0; n <=ntime; n++) {
+  /* Allocate storage of primal state. Hermitian-packed storage holds N^2 instead of 2N^2 reals per state. */
+  int dim_store = storeHermitian ? dim/2 : dim;
+  int nstore = ncheckpoints > 0 ? ncheckpoints : ntime+1;
+  if (storeFWD && storage.scratchdir.size() > 0) mapStorage(storage.scratchdir, nstore, dim_local, dim_store);
+  else if (storeFWD && store_compression != StoreCompression::NONE) {
+    /* Compressed storage: Uncompressed states are allocated when needed */
+    VecCreate(PETSC_COMM_WORLD, &store_buffer);
+    VecSetSizes(store_buffer, dim_local, dim_store);
+    if (nbatch > 1) VecSetBlockSize(store_buffer, nbatch);
+    VecSetFromOptions(store_buffer);
+    VecDuplicate(store_buffer, &store_recon);
+    VecDuplicate(store_buffer, &store_decoded);
+    store_states.assign(nstore, NULL);
+    store_iskey.assign(nstore, false);
+    store_single.resize(nstore);
+    store_delta.resize(nstore);
+  }
+  else if (storeFWD) { 
+    for (int n = 0; n < nstore; n++) {
       Vec state;
       VecCreate(PETSC_COMM_WORLD, &state);
-      VecSetSizes(state, PETSC_DECIDE, dim);
+      VecSetSizes(state, dim_local, dim_store);
+      if (nbatch > 1) VecSetBlockSize(state, nbatch);
       VecSetFromOptions(state);
       store_states.push_back(state);
     }
@@ -34,9 +108,56 @@ TimeStepper::TimeStepper(MasterEq* mastereq_, int ntime_, double total_time_, Ou
 
   /* Allocate auxiliary state vector */
   VecCreate(PETSC_COMM_WORLD, &x);
-  VecSetSizes(x, PETSC_DECIDE, dim);
+  VecSetSizes(x, dim_local, dim);
+  if (nbatch > 1) VecSetBlockSize(x, nbatch);
   VecSetFromOptions(x);
   VecZeroEntries(x);
+  if (ncheckpoints > 0) VecDuplicate(x, &x_recompute);
+
+  /* Allocate buffers for single states of a batch */
+  if (nbatch > 1) {
+    MatCreateVecs(mastereq->getRHS(), &xcol, NULL);
+    VecDuplicate(xcol, &xcol_adj);
+  }
+
+  /* Set up packing and unpacking of Hermitian states rho(j,i) = conj(rho(i,j)) */
+  if (storeHermitian) {
+    VecDuplicate(x, &state_unpacked);
+    VecZeroEntries(state_unpacked);  // Im(rho(i,i)) stays zero
+    int N = mastereq->getDimRho();
+    PetscInt ilow, iupp;
+    VecGetOwnershipRange(x, &ilow, &iupp);
+    std::vector<PetscInt> pack_full, pack_packed, unpack_packed, unpack_full;
+    for (int it = 0; it < dim/2; it++) {
+      int row = it % N;
+      int col = it / N;
+      int i = std::min(row, col);
+      int j = std::max(row, col);
+      PetscInt id_re = getIndexReal(it);
+      PetscInt id_im = getIndexImag(it);
+      if (ilow <= id_re && id_re < iupp) {
+        if (row <= col) { pack_full.push_back(id_re); pack_packed.push_back(getPackedIndexReal(i,j,N)); }
+        unpack_packed.push_back(getPackedIndexReal(i,j,N)); unpack_full.push_back(id_re);
+      }
+      if (ilow <= id_im && id_im < iupp && row != col) {
+        if (row < col) { pack_full.push_back(id_im); pack_packed.push_back(getPackedIndexImag(i,j,N)); }
+        unpack_packed.push_back(getPackedIndexImag(i,j,N)); unpack_full.push_back(id_im);
+        if (row > col) unpack_conj.push_back(id_im - ilow);
+      }
+    }
+    IS is_from, is_to;
+    ISCreateGeneral(PETSC_COMM_WORLD, pack_full.size(), pack_full.data(), PETSC_COPY_VALUES, &is_from);
+    ISCreateGeneral(PETSC_COMM_WORLD, pack_packed.size(), pack_packed.data(), PETSC_COPY_VALUES, &is_to);
+    Vec store_layout = store_buffer != NULL ? store_buffer : store_states[0];
+    VecScatterCreate(x, is_from, store_layout, is_to, &scat_pack);
+    ISDestroy(&is_from);
+    ISDestroy(&is_to);
+    ISCreateGeneral(PETSC_COMM_WORLD, unpack_packed.size(), unpack_packed.data(), PETSC_COPY_VALUES, &is_from);
+    ISCreateGeneral(PETSC_COMM_WORLD, unpack_full.size(), unpack_full.data(), PETSC_COPY_VALUES, &is_to);
+    VecScatterCreate(store_layout, is_from, state_unpacked, is_to, &scat_unpack);
+    ISDestroy(&is_from);
+    ISDestroy(&is_to);
+  }
 
   /* Allocate the reduced gradient */
   int ndesign = 0;
@@ -55,98 +176,690 @@ TimeStepper::~TimeStepper() {
   for (int n = 0; n < store_states.size(); n++) {
     VecDestroy(&(store_states[n]));
   }
+  if (store_map != NULL) {
+    munmap(store_map, store_mapsize);
+    close(store_fd);
+  }
+  if (store_buffer != NULL) {
+    VecDestroy(&store_buffer);
+    VecDestroy(&store_recon);
+    VecDestroy(&store_decoded);
+  }
+  if (storeHermitian) {
+    VecScatterDestroy(&scat_pack);
+    VecScatterDestroy(&scat_unpack);
+    VecDestroy(&state_unpacked);
+  }
+  if (nbatch > 1) {
+    VecDestroy(&xcol);
+    VecDestroy(&xcol_adj);
+  }
+  if (ncheckpoints > 0) VecDestroy(&x_recompute);
+  if (adaptive) VecDestroy(&x_prev);
   VecDestroy(&x);
   VecDestroy(&redgrad);
 }
 
 
+void TimeStepper::setAdaptive(double tol){
+  if (tol <= 0.0) return;
+  if (!adaptive) VecDuplicate(x, &x_prev);
+  adaptive = true;
+  adapt_tol = tol;
+  adapt_grids.clear();
+}
+
+
+double TimeStepper::getTime(int tindex){
+  if (adaptive) return tgrid[tindex];
+  return tindex * dt;
+}
+
+
+void TimeStepper::storeSlot(int islot, const Vec x){
+
+  /* Compressed storage */
+  if (store_compression != StoreCompression::NONE) {
+    encodeState(islot, x);
+    return;
+  }
+  if (store_states[islot] == NULL) VecDuplicate(store_buffer, &(store_states[islot]));  // compression has been switched off
+
+  if (storeHermitian) {
+    VecScatterBegin(scat_pack, x, store_states[islot], INSERT_VALUES, SCATTER_FORWARD);
+    VecScatterEnd(scat_pack, x, store_states[islot], INSERT_VALUES, SCATTER_FORWARD);
+  } else {
+    VecCopy(x, store_states[islot]);
+  }
+
+  /* Memory-mapped storage: Start writing the state to disk and release its pages */
+  if (store_map != NULL) {
+#ifdef __linux__
+    sync_file_range(store_fd, islot*store_stride*sizeof(double), store_stride*sizeof(double), SYNC_FILE_RANGE_WRITE);
+#endif
+    adviseSlots(islot, 1, MADV_DONTNEED);
+  }
+}
+
+
+Vec TimeStepper::getSlot(int islot){
+
+  /* Memory-mapped storage: The backward sweep reads states in reverse order. Prefetch the ones before islot, release the one after. */
+  if (store_map != NULL && ncheckpoints == 0) {
+    adviseSlots(islot - store_readahead, store_readahead, MADV_WILLNEED);
+    adviseSlots(islot + 1, 1, MADV_DONTNEED);
+  }
+
+  /* Compressed storage: Decode, unless the state is stored uncompressed */
+  Vec xstore = store_states[islot];
+  if (store_compression != StoreCompression::NONE && !store_iskey[islot]) xstore = decodeState(islot);
+
+  if (!storeHermitian) return xstore;
+
+  /* Unpack the upper triangle and set the lower triangle to its complex conjugate */
+  VecScatterBegin(scat_unpack, xstore, state_unpacked, INSERT_VALUES, SCATTER_FORWARD);
+  VecScatterEnd(scat_unpack, xstore, state_unpacked, INSERT_VALUES, SCATTER_FORWARD);
+  double* xptr;
+  VecGetArray(state_unpacked, &xptr);
+  for (int k = 0; k < unpack_conj.size(); k++) xptr[unpack_conj[k]] = -xptr[unpack_conj[k]];
+  VecRestoreArray(state_unpacked, &xptr);
+
+  return state_unpacked;
+}
+
+
+void TimeStepper::mapStorage(const std::string& scratchdir, int nstore, PetscInt dim_local, PetscInt dim_store){
+
+  /* Get the local size of a stored state */
+  Vec state;
+  PetscInt nlocal;
+  VecCreate(PETSC_COMM_WORLD, &state);
+  VecSetSizes(state, dim_local, dim_store);
+  VecSetFromOptions(state);
+  VecGetLocalSize(state, &nlocal);
+  VecDestroy(&state);
+
+  /* Each state starts at a page boundary, so that its pages can be advised individually */
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  size_t slotbytes = ((nlocal * sizeof(double) + pagesize - 1) / pagesize) * pagesize;
+  store_stride = slotbytes / sizeof(double);
+  store_mapsize = nstore * slotbytes;
+  store_readahead = std::min(nstore, std::max(1, (int) ((32 << 20) / slotbytes)));  // about 32MB
+
+  /* Create the scratch file. It is unlinked right away, so that it is removed when closed. */
+  std::string filename = scratchdir + "/quandary_states.XXXXXX";
+  std::vector<char> fname(filename.begin(), filename.end());
+  fname.push_back('\0');
+  store_fd = mkstemp(fname.data());
+  if (store_fd < 0) {
+    printf("ERROR: Can't create scratch file for the stored states in %s\n", scratchdir.c_str());
+    exit(1);
+  }
+  unlink(fname.data());
+  mapSlots(nstore, nlocal, dim_store);
+}
+
+
+void TimeStepper::mapSlots(int nstore, PetscInt nlocal, PetscInt dim_store){
+
+  /* Size the scratch file and map it */
+  store_mapsize = nstore * store_stride * sizeof(double);
+  if (ftruncate(store_fd, store_mapsize) != 0) {
+    printf("ERROR: Can't allocate %zu bytes for the stored states in the scratch file\n", store_mapsize);
+    exit(1);
+  }
+  void* ptr = mmap(NULL, store_mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, store_fd, 0);
+  if (ptr == MAP_FAILED) {
+    printf("ERROR: Can't map the stored states in the scratch file\n");
+    exit(1);
+  }
+  store_map = (double*) ptr;
+
+  /* Create the stored states on the mapped arrays */
+  int mpisize;
+  MPI_Comm_size(PETSC_COMM_WORLD, &mpisize);
+  for (int n = 0; n < nstore; n++) {
+    Vec state;
+    if (mpisize == 1) VecCreateSeqWithArray(PETSC_COMM_WORLD, nbatch, nlocal, store_map + n*store_stride, &state);
+    else VecCreateMPIWithArray(PETSC_COMM_WORLD, nbatch, nlocal, dim_store, store_map + n*store_stride, &state);
+    store_states.push_back(state);
+  }
+}
+
+
+void TimeStepper::growStorage(int nstore){
+  int nold = store_states.size();
+  if (nstore <= nold) return;
+
+  /* Memory-mapped storage: Enlarge the scratch file and map it anew. The stored states remain in the file. */
+  if (store_map != NULL) {
+    PetscInt nlocal, dim_store;
+    VecGetLocalSize(store_states[0], &nlocal);
+    VecGetSize(store_states[0], &dim_store);
+    for (int n = 0; n < nold; n++) VecDestroy(&(store_states[n]));
+    store_states.clear();
+    munmap(store_map, store_mapsize);
+    mapSlots(nstore, nlocal, dim_store);
+    return;
+  }
+
+  /* Compressed storage: Uncompressed states are allocated when needed */
+  if (store_buffer != NULL) {
+    store_states.resize(nstore, NULL);
+    store_iskey.resize(nstore, false);
+    store_single.resize(nstore);
+    store_delta.resize(nstore);
+    return;
+  }
+
+  for (int n = nold; n < nstore; n++) {
+    Vec state;
+    VecDuplicate(store_states[0], &state);
+    store_states.push_back(state);
+  }
+}
+
+
+void TimeStepper::adviseSlots(int ifirst, int nslots, int advice){
+  int ilast = std::min(ifirst + nslots, (int) store_states.size());
+  ifirst = std::max(ifirst, 0);
+  if (ilast <= ifirst) return;
+  madvise(store_map + ifirst*store_stride, (ilast - ifirst)*store_stride*sizeof(double), advice);
+}
+
+
+void TimeStepper::setStoreCompression(StoreCompression compression){
+  if (compression != StoreCompression::NONE && store_buffer == NULL) {
+    printf("ERROR: Compression of the stored states must be enabled when creating the time-stepper.\n");
+    exit(1);
+  }
+  store_compression = compression;
+  store_recon_tindex = -1;
+  store_decoded_tindex = -1;
+}
+
+
+void TimeStepper::encodeState(int tindex, const Vec x){
+
+  /* Get the state in storage layout */
+  Vec xstore = x;
+  if (storeHermitian) {
+    VecScatterBegin(scat_pack, x, store_buffer, INSERT_VALUES, SCATTER_FORWARD);
+    VecScatterEnd(scat_pack, x, store_buffer, INSERT_VALUES, SCATTER_FORWARD);
+    xstore = store_buffer;
+  }
+  PetscInt nlocal;
+  const double* xptr;
+  VecGetLocalSize(xstore, &nlocal);
+  VecGetArrayRead(xstore, &xptr);
+
+  /* The initial state is always stored uncompressed */
+  bool iskey = (tindex == 0);
+
+  /* SINGLE: Round to single precision */
+  if (store_compression == StoreCompression::SINGLE && !iskey) {
+    store_single[tindex].resize(nlocal);
+    for (int i = 0; i < nlocal; i++) store_single[tindex][i] = (float) xptr[i];
+  }
+
+  /* DELTA: Quantize the difference to the previous (encoded) state with step size 2*store_tol, so that the error is at most store_tol. Store uncompressed if the previous state is missing or the quantized difference overflows. */
+  if (store_compression == StoreCompression::DELTA && !iskey) {
+    iskey = (store_recon_tindex != tindex - 1);
+    if (!iskey) {
+      double h = 2.0 * store_tol;
+      double* rptr;
+      VecGetArray(store_recon, &rptr);
+      store_delta[tindex].resize(nlocal);
+      int overflow = 0;
+      for (int i = 0; i < nlocal; i++) {
+        double q = round((xptr[i] - rptr[i]) / h);
+        if (fabs(q) > INT_MAX) { overflow = 1; break; }
+        store_delta[tindex][i] = (int) q;
+      }
+      int myoverflow = overflow;
+      MPI_Allreduce(&myoverflow, &overflow, 1, MPI_INT, MPI_MAX, PETSC_COMM_WORLD);
+      if (!overflow) {
+        for (int i = 0; i < nlocal; i++) rptr[i] += store_delta[tindex][i] * h;
+      }
+      VecRestoreArray(store_recon, &rptr);
+      iskey = overflow;
+    }
+  }
+  VecRestoreArrayRead(xstore, &xptr);
+
+  /* Store uncompressed, or free the uncompressed state if not needed anymore */
+  if (iskey) {
+    if (store_states[tindex] == NULL) VecDuplicate(store_buffer, &(store_states[tindex]));
+    VecCopy(xstore, store_states[tindex]);
+    if (store_compression == StoreCompression::DELTA) VecCopy(xstore, store_recon);
+    std::vector<float>().swap(store_single[tindex]);
+    std::vector<int>().swap(store_delta[tindex]);
+  } 
+  else if (store_states[tindex] != NULL) VecDestroy(&(store_states[tindex]));
+  store_iskey[tindex] = iskey;
+  store_recon_tindex = tindex;
+  store_decoded_tindex = -1;
+}
+
+
+Vec TimeStepper::decodeState(int tindex){
+
+  if (store_decoded_tindex == tindex) return store_decoded;
+
+  double* dptr;
+  if (store_compression == StoreCompression::SINGLE) {
+    VecGetArray(store_decoded, &dptr);
+    for (int i = 0; i < store_single[tindex].size(); i++) dptr[i] = store_single[tindex][i];
+    VecRestoreArray(store_decoded, &dptr);
+  }
+  else {
+    double h = 2.0 * store_tol;
+    /* Step backwards from the next state (the usual access during the adjoint), forward from the previous state, or forward from the last uncompressed state */
+    if (store_decoded_tindex == tindex + 1 && !store_iskey[tindex + 1]) {
+      VecGetArray(store_decoded, &dptr);
+      for (int i = 0; i < store_delta[tindex+1].size(); i++) dptr[i] -= store_delta[tindex+1][i] * h;
+      VecRestoreArray(store_decoded, &dptr);
+    }
+    else {
+      int kstart = tindex;
+      while (!store_iskey[kstart]) kstart--;
+      if (store_decoded_tindex >= kstart && store_decoded_tindex < tindex) kstart = store_decoded_tindex + 1;
+      for (int n = kstart; n <= tindex; n++) {
+        if (store_iskey[n]) {
+          VecCopy(store_states[n], store_decoded);
+          continue;
+        }
+        VecGetArray(store_decoded, &dptr);
+        for (int i = 0; i < store_delta[n].size(); i++) dptr[i] += store_delta[n][i] * h;
+        VecRestoreArray(store_decoded, &dptr);
+      }
+    }
+  }
+  store_decoded_tindex = tindex;
+
+  return store_decoded;
+}
+
+
+void TimeStepper::storeState(int tindex, const Vec x){
+  if (ncheckpoints == 0) {
+    /* Adaptive time stepping may take more than ntime steps. Grow the storage geometrically. */
+    if (tindex >= store_states.size()) growStorage(std::max(tindex + 1, 2 * (int) store_states.size()));
+    storeSlot(tindex, x);
+    return;
+  }
+  for (int islot = 0; islot < ncheckpoints; islot++) {
+    if (checkpoint_tindex[islot] == tindex) storeSlot(islot, x);
+  }
+}
+
 
 Vec TimeStepper::getState(int tindex){
   
-  if (tindex >= store_states.size()) {
-    printf("ERROR: Time-stepper requested state at time index %d, but didn't store it.\n", tindex);
-    exit(1);
+  /* All states are stored */
+  if (ncheckpoints == 0) {
+    if (tindex >= store_states.size()) {
+      printf("ERROR: Time-stepper requested state at time index %d, but didn't store it.\n", tindex);
+      exit(1);
+    }
+    return getSlot(tindex);
+  }
+
+  /* Checkpointing: Only states at a checkpoint are stored */
+  for (int islot = 0; islot < ncheckpoints; islot++) {
+    if (checkpoint_tindex[islot] == tindex) return getSlot(islot);
   }
+  printf("ERROR: Time-stepper requested state at time index %d, but there is no checkpoint.\n", tindex);
+  exit(1);
+}
+
 
-  return store_states[tindex];
+/* Number of time steps that can be reversed with s free checkpoints if each step is recomputed at most t times: binomial(s+t, s) */
+inline double binomialSteps(const int s, const int t) {
+  double beta = 1.0;
+  for (int i = 1; i <= s; i++) beta = beta * (t + i) / i;
+  return beta;
 }
 
+
+int TimeStepper::checkpointSplit(int a, int b, int s){
+  /* Smallest number of recomputations t that reverses b-a steps */
+  int t = 0;
+  while (binomialSteps(s, t) < b - a) t++;
+  /* The left segment is reversed with s checkpoints and t-1 recomputations, the right one with s-1 checkpoints and t recomputations */
+  int m = a + (int) binomialSteps(s, t-1);
+  return std::max(a+1, std::min(m, b-1));
+}
+
+
+void TimeStepper::reverseSegment(int a, int b, int s, int islot_a, const std::vector<int>& initids, double Jbar){
+
+  /* Single step: Run the adjoint with the stored state */
+  if (b - a == 1) {
+    Vec xa = getSlot(islot_a);
+    evolveBWD(getTime(b), getTime(a), xa, x, redgrad, true);
+    if (a > 0) penaltyIntegral_diff_batch(a, xa, initids, Jbar);
+    return;
+  }
+
+  /* No free checkpoints left: Recompute each state from the checkpoint at a */
+  if (s == 0) {
+    for (int n = b-1; n >= a; n--) {
+      VecCopy(getSlot(islot_a), x_recompute);
+      for (int k = a; k < n; k++) evolveFWD(getTime(k), getTime(k+1), x_recompute);
+      evolveBWD(getTime(n+1), getTime(n), x_recompute, x, redgrad, true);
+      if (n > 0) penaltyIntegral_diff_batch(n, x_recompute, initids, Jbar);
+    }
+    return;
+  }
+
+  /* Store a checkpoint at the split point m, unless the forward solve already did, then reverse [m,b] and [a,m]. */
+  int m = checkpointSplit(a, b, s);
+  int islot_m = ncheckpoints - s;
+  if (checkpoint_tindex[islot_m] != m) {
+    VecCopy(getSlot(islot_a), x_recompute);
+    for (int k = a; k < m; k++) evolveFWD(getTime(k), getTime(k+1), x_recompute);
+    storeSlot(islot_m, x_recompute);
+    checkpoint_tindex[islot_m] = m;
+  }
+  reverseSegment(m, b, s-1, islot_m, initids, Jbar);
+  checkpoint_tindex[islot_m] = -1;
+  reverseSegment(a, m, s, islot_a, initids, Jbar);
+}
+
+
+Mat TimeStepper::getRHS(){
+  if (nbatch > 1) return mastereq->getRHSBatch();
+  else return mastereq->getRHS();
+}
+
+
+void TimeStepper::computedRHSdp(const double t, const Vec x, const Vec x_bar, const double alpha, Vec grad){
+  PetscLogEventBegin(EVENT_GRADIENT, 0, 0, 0, 0);
+  double* gradptr;
+  VecGetArray(grad, &gradptr);
+  if (nbatch > 1) mastereq->computedRHSdp_batch(t, x, x_bar, alpha, gradptr);
+  else mastereq->computedRHSdp(t, x, x_bar, alpha, gradptr);
+  VecRestoreArray(grad, &gradptr);
+  PetscLogEventEnd(EVENT_GRADIENT, 0, 0, 0, 0);
+}
+
+
+void TimeStepper::computeAdjointRHS(const double t, const Vec x, const Vec x_bar, const double alpha, Vec x_adj, Vec grad){
+  if (!mastereq->hasFusedAdjoint()) {
+    computedRHSdp(t, x, x_bar, alpha, grad);
+    MatMultTransposeAdd(getRHS(), x_bar, x_adj, x_adj);
+    return;
+  }
+
+  PetscLogEventBegin(EVENT_GRADIENT, 0, 0, 0, 0);
+  double* gradptr;
+  VecGetArray(grad, &gradptr);
+  mastereq->computedRHSdp_fused(t, x, x_bar, alpha, gradptr, x_adj);
+  VecRestoreArray(grad, &gradptr);
+  PetscLogEventEnd(EVENT_GRADIENT, 0, 0, 0, 0);
+}
+
+
+void TimeStepper::reduceGradient(){
+  int mpisize_petsc;
+  MPI_Comm_size(PETSC_COMM_WORLD, &mpisize_petsc);
+  if (mpisize_petsc == 1) return;
+
+  PetscLogEventBegin(EVENT_REDUCTION, 0, 0, 0, 0);
+  PetscInt ndesign;
+  double* gradptr;
+  VecGetSize(redgrad, &ndesign);
+  VecGetArray(redgrad, &gradptr);
+  MPI_Allreduce(MPI_IN_PLACE, gradptr, ndesign, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
+  VecRestoreArray(redgrad, &gradptr);
+  PetscLogEventEnd(EVENT_REDUCTION, 0, 0, 0, 0);
+}
+
+
+void TimeStepper::recordIterations(int iters){
+  if (iters >= iter_histogram.size()) iter_histogram.resize(iters + 1, 0);
+  iter_histogram[iters]++;
+}
+
+
+Vec TimeStepper::getColumn(const Vec xbatch, int b, Vec xcol){
+  if (nbatch == 1) return xbatch;
+  VecStrideGather(xbatch, b, xcol, INSERT_VALUES);
+  return xcol;
+}
+
+
+void TimeStepper::setColumn(Vec xbatch, int b, const Vec xcol){
+  if (xcol == xbatch) return;
+  VecStrideScatter(xcol, b, xbatch, INSERT_VALUES);
+}
+
+
 Vec TimeStepper::solveODE(int initid, Vec rho_t0){
+  std::vector<int> initids(1, initid);
+  return solveODE(initids, rho_t0);
+}
+
+
+Vec TimeStepper::solveODE(const std::vector<int>& initids, Vec rho_t0){
 
-  /* Open output files */
-  output->openDataFiles("rho", initid);
+  PetscLogStagePush(STAGE_FORWARD);
+
+  /* Checkpointing: Store the initial and final state, and the checkpoints that are set first when reversing [0,ntime]. 
+   * If adaptive, the number of steps is not known in advance, and the adjoint sets all other checkpoints. */
+  if (storeFWD && ncheckpoints > 0) {
+    checkpoint_tindex.assign(ncheckpoints, -1);
+    checkpoint_tindex[0] = 0;
+    if (!adaptive) {
+      checkpoint_tindex[1] = ntime;
+      int a = 0;
+      for (int islot = 2; islot < ncheckpoints && ntime - a > 1; islot++) {
+        a = checkpointSplit(a, ntime, ncheckpoints - islot);
+        checkpoint_tindex[islot] = a;
+      }
+    }
+  }
+
+  /* Adaptive: Replay the time grid of this batch, or choose one and record the time points of the accepted steps, starting from step size dt */
+  if (adaptive) {
+    if (adapt_grids.count(initids[0]) > 0) tgrid = adapt_grids[initids[0]];
+    else tgrid.assign(1, 0.0);
+    adapt_h = dt;
+    nrejected = 0;
+  }
+
+  /* Open output files, one set for each state of the batch */
+  for (int b = 0; b < initids.size(); b++) {
+    output->openDataFiles("rho", initids[b], b);
+  }
 
   /* Set initial condition  */
   VecCopy(rho_t0, x);
 
+  /* Hermitian-packed storage drops the lower triangle, hence the initial state must be Hermitian. The check runs in serial only. */
+  if (storeHermitian) {
+    int mpisize_petsc;
+    MPI_Comm_size(PETSC_COMM_WORLD, &mpisize_petsc);
+    PetscBool hermitian = PETSC_TRUE;
+    if (mpisize_petsc == 1) StateIsHermitian(x, 1e-12, &hermitian);
+    if (!hermitian) {
+      printf("ERROR: Hermitian-packed storage (store_hermitian = true) requires Hermitian initial conditions, but initial condition %d is not Hermitian.\n", initids[0]);
+      exit(1);
+    }
+  }
+
   /* --- Loop over time interval --- */
   penalty_integral = 0.0;
-  for (int n = 0; n < ntime; n++){
-
-    /* current time */
-    double tstart = n * dt;
-    double tstop  = (n+1) * dt;
+  int n = 0;
+  double tstart = 0.0;
+  while (adaptive ? tstart < total_time : n < ntime){
 
     /* store and write current state. */
-    if (storeFWD) VecCopy(x, store_states[n]);
-    output->writeDataFiles(n, tstart, x, mastereq);
+    if (storeFWD) storeState(n, x);
+    for (int b = 0; b < initids.size(); b++) {
+      if (output->writesDataFiles(n, b)) output->writeDataFiles(n, tstart, getColumn(x, b, xcol), mastereq, b);
+    }
 
     /* Take one time step */
-    evolveFWD(tstart, tstop, x);
+    double tstop;
+    if (adaptive) {
+      tstop = adaptiveStep(n, tstart, x);
+    } else {
+      tstop = (n+1) * dt;
+      evolveFWD(tstart, tstop, x);
+    }
 
-    /* Add to penalty objective term */
-    if (gamma_penalty > 1e-13) penalty_integral += penaltyIntegral(tstop, x);
+    /* Add to penalty objective term. For a batch, the target of each state has been prepared once per batch. */
+    if (gamma_penalty > 1e-13) {
+      for (int b = 0; b < initids.size(); b++) {
+        if (nbatch > 1) optim_target->selectBatch(b);
+        penalty_integral += penaltyIntegral(tstop, tstop - tstart, getColumn(x, b, xcol));
+      }
+    }
 
 #ifdef SANITY_CHECK
-    SanityTests(x, tstart);
+    for (int b = 0; b < initids.size(); b++) {
+      SanityTests(getColumn(x, b, xcol), tstart);
+    }
 #endif
+
+    n++;
+    tstart = tstop;
   }
+  nsteps = n;
+  if (adaptive) adapt_grids[initids[0]] = tgrid;
 
   /* Store last time step */
-  if (storeFWD) VecCopy(x, store_states[ntime]);
+  if (storeFWD && ncheckpoints > 0) checkpoint_tindex[1] = nsteps;
+  if (storeFWD) storeState(nsteps, x);
 
   /* Write last time step and close files */
-  output->writeDataFiles(ntime, ntime*dt, x, mastereq);
+  for (int b = 0; b < initids.size(); b++) {
+    if (output->writesDataFiles(nsteps, b)) output->writeDataFiles(nsteps, getTime(nsteps), getColumn(x, b, xcol), mastereq, b);
+  }
   output->closeDataFiles();
-  
+
+  PetscLogStagePop();
 
   return x;
 }
 
 
 void TimeStepper::solveAdjointODE(int initid, Vec rho_t0_bar, double Jbar) {
+  std::vector<int> initids(1, initid);
+  solveAdjointODE(initids, rho_t0_bar, Jbar);
+}
+
+
+void TimeStepper::solveAdjointODE(const std::vector<int>& initids, Vec rho_t0_bar, double Jbar) {
+
+  PetscLogStagePush(STAGE_ADJOINT);
 
   /* Reset gradient */
   VecZeroEntries(redgrad);
+  adjoint_sweep = true;
 
   /* Set terminal condition */
   VecCopy(rho_t0_bar, x);
 
-  /* Loop over time interval */
-  for (int n = ntime; n > 0; n--){
-    double tstop  = n * dt;
-    double tstart = (n-1) * dt;
+  /* Checkpointing: Reverse [0,nsteps] recursively, recomputing states from the checkpoints */
+  if (ncheckpoints > 0) {
+    penaltyIntegral_diff_batch(nsteps, getState(nsteps), initids, Jbar);
+    reverseSegment(0, nsteps, ncheckpoints - 2, 0, initids, Jbar);
+  }
+
+  /* Loop over time interval. If adaptive, replay the steps of the forward solve. */
+  else {
+    for (int n = nsteps; n > 0; n--){
+      double tstop  = getTime(n);
+      double tstart = getTime(n-1);
+
+      /* Derivative of penalty objective term */
+      penaltyIntegral_diff_batch(n, getState(n), initids, Jbar);
 
-    /* Derivative of penalty objective term */
-    if (gamma_penalty > 1e-13) penaltyIntegral_diff(tstop, getState(n), x, Jbar);
+      /* Take one time step backwards */
+      evolveBWD(tstop, tstart, getState(n-1), x, redgrad, true);
+    }
+  }
+
+  adjoint_sweep = false;
+
+  /* Sum the gradient contributions of petsc's processors */
+  reduceGradient();
+
+  PetscLogStagePop();
+}
+
+
+double TimeStepper::adaptiveStep(int n, double tstart, Vec x){
+
+  if (errest_order == 0) {
+    printf("ERROR: This time-stepper doesn't provide an error estimate for adaptive time stepping.\n");
+    exit(1);
+  }
+
+  while (true) {
+    /* Replay the step of the grid, or take a step of size adapt_h. Stretch the last step rather than leaving a tiny one. */
+    bool replay = n + 1 < tgrid.size();
+    double tstop;
+    if (replay) tstop = tgrid[n+1];
+    else {
+      double h = adapt_h;
+      if (tstart + 1.01*h >= total_time) h = total_time - tstart;
+      tstop = (h == total_time - tstart) ? total_time : tstart + h;
+      if (h < 1e-12 * total_time) {
+        printf("ERROR: Adaptive time step size underflow at t=%1.8e. Increase timestepper_adaptive_tol.\n", tstart);
+        exit(1);
+      }
+    }
+    double h = tstop - tstart;
+
+    VecCopy(x, x_prev);
+    evolveFWD(tstart, tstop, x);
+
+    /* Propose the next step size from the error estimate of the embedded method of order q, which is O(h^(q+1)) */
+    double fac = errest > 0.0 ? 0.9 * pow(adapt_tol / errest, 1.0 / (errest_order + 1)) : 5.0;
+    adapt_h = h * std::min(5.0, std::max(0.2, fac));
+
+    /* Accept the step. A step of the grid is replayed up to twice the tolerance, such that small changes of the parameters 
+     * (e.g. in a line search) keep the grid, and the objective stays differentiable. Otherwise, the rest of the grid is 
+     * dropped and the step is retaken with the smaller step size. */
+    if (errest <= (replay ? 2.0 : 1.0) * adapt_tol) {
+      if (!replay) tgrid.push_back(tstop);
+      return tstop;
+    }
+    tgrid.resize(n + 1);
+    mastereq->eraseControlSamples(tstart, tstop);
+    VecCopy(x_prev, x);
+    nrejected++;
+  }
+}
 
-    /* Take one time step backwards */
-    evolveBWD(tstop, tstart, getState(n-1), x, redgrad, true);
 
+void TimeStepper::penaltyIntegral_diff_batch(int tindex, const Vec state, const std::vector<int>& initids, double Jbar){
+  if (gamma_penalty <= 1e-13) return;
+
+  /* For a batch, the target of each state has been prepared once per batch. */
+  for (int b = 0; b < initids.size(); b++) {
+    if (nbatch > 1) optim_target->selectBatch(b);
+    Vec xbar = getColumn(x, b, xcol_adj);
+    penaltyIntegral_diff(getTime(tindex), getTime(tindex) - getTime(tindex-1), getColumn(state, b, xcol), xbar, Jbar);
+    setColumn(x, b, xbar);
   }
 }
 
 
-double TimeStepper::penaltyIntegral(double time, const Vec x){
+double TimeStepper::penaltyIntegral(double time, double h, const Vec x){
   double penalty = 0.0;
-  int dim_rho = (int)sqrt(dim/2);  // dim = 2*N^2 vectorized system. dim_rho = N = dimension of matrix system
+  int dim_rho = mastereq->getDimRho();  // N = dimension of matrix system
   double x_re, x_im;
 
   /* weighted integral of the objective function */
   if (penalty_param > 1e-13) {
     double weight = 1./penalty_param * exp(- pow((time - total_time)/penalty_param, 2));
     double obj = optim_target->evalJ(x);
-    penalty = weight * obj * dt;
+    penalty = weight * obj * h;
   }
 
   /* If gate optimization: Add guard-level occupation to prevent leakage. A guard level is the LAST NON-ESSENTIAL energy level of an oscillator */
@@ -157,12 +870,13 @@ double TimeStepper::penaltyIntegral(double time, const Vec x){
       for (int i=0; i<dim_rho; i++) {
         if ( isGuardLevel(i, mastereq->nlevels, mastereq->nessential) ) {
           // printf("isGuard: %d / %d\n", i, dim_rho);
-          PetscInt vecID_re = getIndexReal(getVecID(i,i,dim_rho));
-          PetscInt vecID_im = getIndexImag(getVecID(i,i,dim_rho));
+          int vecID = mastereq->schroedinger ? i : getVecID(i,i,dim_rho);  // rho(i,i), or psi(i) in Schroedinger mode
+          PetscInt vecID_re = getIndexReal(vecID);
+          PetscInt vecID_im = getIndexImag(vecID);
           x_re = 0.0; x_im = 0.0;
           if (ilow <= vecID_re && vecID_re < iupp) VecGetValues(x, 1, &vecID_re, &x_re);
           if (ilow <= vecID_im && vecID_im < iupp) VecGetValues(x, 1, &vecID_im, &x_im);  // those should be zero!? 
-          penalty += dt * (x_re * x_re + x_im * x_im);
+          penalty += h * (x_re * x_re + x_im * x_im);
         }
       }
       double mine = penalty;
@@ -172,13 +886,13 @@ double TimeStepper::penaltyIntegral(double time, const Vec x){
   return penalty;
 }
 
-void TimeStepper::penaltyIntegral_diff(double time, const Vec x, Vec xbar, double penaltybar){
-  int dim_rho = (int)sqrt(dim/2);  // dim = 2*N^2 vectorized system. dim_rho = N = dimension of matrix system
+void TimeStepper::penaltyIntegral_diff(double time, double h, const Vec x, Vec xbar, double penaltybar){
+  int dim_rho = mastereq->getDimRho();  // N = dimension of matrix system
 
   /* Derivative of weighted integral of the objective function */
   if (penalty_param > 1e-13){
     double weight = 1./penalty_param * exp(- pow((time - total_time)/penalty_param, 2));
-    optim_target->evalJ_diff(x, xbar, weight*penaltybar*dt);
+    optim_target->evalJ_diff(x, xbar, weight*penaltybar*h);
   }
 
   /* If gate optimization: Derivative of adding guard-level occupation */
@@ -188,14 +902,15 @@ void TimeStepper::penaltyIntegral_diff(double time, const Vec x, Vec xbar, doubl
     double x_re, x_im;
     for (int i=0; i<dim_rho; i++) {
       if ( isGuardLevel(i, mastereq->nlevels, mastereq->nessential) ) {
-        PetscInt vecID_re = getIndexReal(getVecID(i,i,dim_rho));
-        PetscInt vecID_im = getIndexImag(getVecID(i,i,dim_rho));
+        int vecID = mastereq->schroedinger ? i : getVecID(i,i,dim_rho);  // rho(i,i), or psi(i) in Schroedinger mode
+        PetscInt vecID_re = getIndexReal(vecID);
+        PetscInt vecID_im = getIndexImag(vecID);
         x_re = 0.0; x_im = 0.0;
         if (ilow <= vecID_re && vecID_re < iupp) VecGetValues(x, 1, &vecID_re, &x_re);
         if (ilow <= vecID_im && vecID_im < iupp) VecGetValues(x, 1, &vecID_im, &x_im);
-        // Derivative: 2 * rho(i,i) * weights * penalbar * dt
-        if (ilow <= vecID_re && vecID_re < iupp) VecSetValue(xbar, vecID_re, 2.*x_re*dt*penaltybar, ADD_VALUES);
-        if (ilow <= vecID_im && vecID_im < iupp) VecSetValue(xbar, vecID_im, 2.*x_im*dt*penaltybar, ADD_VALUES);
+        // Derivative: 2 * rho(i,i) * weights * penalbar * h
+        if (ilow <= vecID_re && vecID_re < iupp) VecSetValue(xbar, vecID_re, 2.*x_re*h*penaltybar, ADD_VALUES);
+        if (ilow <= vecID_im && vecID_im < iupp) VecSetValue(xbar, vecID_im, 2.*x_im*h*penaltybar, ADD_VALUES);
       }
       VecAssemblyBegin(xbar);
       VecAssemblyEnd(xbar);
@@ -205,8 +920,8 @@ void TimeStepper::penaltyIntegral_diff(double time, const Vec x, Vec xbar, doubl
 
 void TimeStepper::evolveBWD(const double tstart, const double tstop, const Vec x_stop, Vec x_adj, Vec grad, bool compute_gradient){}
 
-ExplEuler::ExplEuler(MasterEq* mastereq_, int ntime_, double total_time_, Output* output_, bool storeFWD_) : TimeStepper(mastereq_, ntime_, total_time_, output_, storeFWD_) {
-  MatCreateVecs(mastereq->getRHS(), &stage, NULL);
+ExplEuler::ExplEuler(MasterEq* mastereq_, int ntime_, double total_time_, Output* output_, const StorageOptions& storage, int nbatch_) : TimeStepper(mastereq_, ntime_, total_time_, output_, storage, nbatch_) {
+  MatCreateVecs(getRHS(), &stage, NULL);
   VecZeroEntries(stage);
 }
 
@@ -220,7 +935,7 @@ void ExplEuler::evolveFWD(const double tstart,const  double tstop, Vec x) {
 
    /* Compute A(tstart) */
   mastereq->assemble_RHS(tstart);
-  Mat A = mastereq->getRHS(); 
+  Mat A = getRHS(); 
 
   /* update x = x + hAx */
   MatMult(A, x, stage);
@@ -233,24 +948,27 @@ void ExplEuler::evolveBWD(const double tstop,const  double tstart,const  Vec x,
 
   /* Add to reduced gradient */
   if (compute_gradient) {
-    mastereq->computedRHSdp(tstop, x, x_adj, dt, grad);
+    computedRHSdp(tstop, x, x_adj, dt, grad);
   }
 
   /* update x_adj = x_adj + hA^Tx_adj */
   mastereq->assemble_RHS(tstop);
-  Mat A = mastereq->getRHS(); 
+  Mat A = getRHS(); 
   MatMultTranspose(A, x_adj, stage);
   VecAXPY(x_adj, dt, stage);
 
 }
 
-ImplMidpoint::ImplMidpoint(MasterEq* mastereq_, int ntime_, double total_time_, LinearSolverType linsolve_type_, int linsolve_maxiter_, Output* output_, bool storeFWD_) : TimeStepper(mastereq_, ntime_, total_time_, output_, storeFWD_) {
+ImplMidpoint::ImplMidpoint(MasterEq* mastereq_, int ntime_, double total_time_, LinearSolverType linsolve_type_, int linsolve_maxiter_, PreconditionerType precond_type_, bool linsolve_warmstart_, Output* output_, const StorageOptions& storage, int nbatch_) : TimeStepper(mastereq_, ntime_, total_time_, output_, storage, nbatch_) {
 
   /* Create and reset the intermediate vectors */
-  MatCreateVecs(mastereq->getRHS(), &stage, NULL);
+  MatCreateVecs(getRHS(), &stage, NULL);
   VecDuplicate(stage, &stage_adj);
   VecDuplicate(stage, &rhs);
   VecDuplicate(stage, &rhs_adj);
+  VecDuplicate(stage, &state_next);
+  state_next_time = -1.0;
+  errest_order = 1;
   VecZeroEntries(stage);
   VecZeroEntries(stage_adj);
   VecZeroEntries(rhs);
@@ -262,40 +980,90 @@ ImplMidpoint::ImplMidpoint(MasterEq* mastereq_, int ntime_, double total_time_,
   linsolve_iterstaken_avg = 0;
   linsolve_counter = 0;
   linsolve_error_avg = 0.0;
+  precond_type = precond_type_;
+  precond_dt = -1.0;
+  impl_dt = 0.0;
+  linsolve_warmstart = linsolve_warmstart_ && linsolve_type == LinearSolverType::GMRES;
+  cheb_fallbacks = 0;
+
+  /* GMRES, also as the fallback of the Chebyshev iterations if their residual grows */
+  if (linsolve_type == LinearSolverType::GMRES || linsolve_type == LinearSolverType::CHEBYSHEV) {
+    /* Create the matrix-free I-dt/2 A with the layout of the RHS */
+    PetscInt mlocal, nlocal, mglobal, nglobal;
+    MatGetLocalSize(getRHS(), &mlocal, &nlocal);
+    MatGetSize(getRHS(), &mglobal, &nglobal);
+    MatCreateShell(PETSC_COMM_WORLD, mlocal, nlocal, mglobal, nglobal, (void*) this, &implmat);
+    if (nbatch > 1) MatSetBlockSizes(implmat, nbatch, nbatch);
+    MatShellSetOperation(implmat, MATOP_MULT, (void(*)(void)) myMatMult_implmidpoint);
+    MatShellSetOperation(implmat, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_implmidpoint);
+    MatSetUp(implmat);
+    MatAssemblyBegin(implmat, MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(implmat, MAT_FINAL_ASSEMBLY);
 
-  if (linsolve_type == LinearSolverType::GMRES) {
     /* Create Petsc's linear solver */
     KSPCreate(PETSC_COMM_WORLD, &ksp);
     KSPGetPC(ksp, &preconditioner);
-    PCSetType(preconditioner, PCNONE);
+    if (precond_type == PreconditionerType::DIAGONAL) {
+      /* Diagonal preconditioner, set up from the constant diagonal when the step size is known */
+      MatCreateVecs(mastereq->getRHS(), &precond_constdiag, NULL);
+      VecDuplicate(precond_constdiag, &precond_diag);
+      mastereq->getConstantDiagonal(precond_constdiag);
+      PCSetType(preconditioner, PCSHELL);
+      PCShellSetApply(preconditioner, myPCApply_diagonal);
+      PCShellSetApplyTranspose(preconditioner, myPCApplyTranspose_diagonal);
+      PCShellSetContext(preconditioner, (void*) this);
+    } else {
+      PCSetType(preconditioner, PCNONE);
+    }
     KSPSetTolerances(ksp, linsolve_reltol, linsolve_abstol, PETSC_DEFAULT, linsolve_maxiter);
     KSPSetType(ksp, KSPGMRES);
-    KSPSetOperators(ksp, mastereq->getRHS(), mastereq->getRHS());
+    KSPSetOperators(ksp, implmat, implmat);
+    if (linsolve_warmstart) {
+      /* Start from the stages of the previous steps */
+      KSPSetInitialGuessNonzero(ksp, PETSC_TRUE);
+      VecDuplicate(stage, &stage_prev);
+      VecDuplicate(stage, &stage_adj_prev);
+      VecZeroEntries(stage_prev);
+      VecZeroEntries(stage_adj_prev);
+    }
     KSPSetFromOptions(ksp);
   }
-  else {
+  if (linsolve_type != LinearSolverType::GMRES) {
     /* For Neumann iterations, allocate a temporary vector */
-    MatCreateVecs(mastereq->getRHS(), &tmp, NULL);
-    MatCreateVecs(mastereq->getRHS(), &err, NULL);
+    MatCreateVecs(getRHS(), &tmp, NULL);
+    MatCreateVecs(getRHS(), &err, NULL);
+    if (linsolve_type == LinearSolverType::CHEBYSHEV || linsolve_type == LinearSolverType::CHEBYSHEV_FIXED) MatCreateVecs(getRHS(), &cheb_dir, NULL);
   }
+  cheb_normA = -1.0;
+  cheb_decay = 0.0;
 }
 
 
 ImplMidpoint::~ImplMidpoint(){
 
   /* Print linear solver statistics */
-  linsolve_iterstaken_avg = (int) linsolve_iterstaken_avg / linsolve_counter;
-  linsolve_error_avg = linsolve_error_avg / linsolve_counter;
   int myrank;
-  // MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
-  // if (myrank == 0) printf("Linear solver type %d: Average iterations = %d, average error = %1.2e\n", linsolve_type, linsolve_iterstaken_avg, linsolve_error_avg);
+  MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
+  if (myrank == 0 && linsolve_counter > 0) printf("Linear solver: Average iterations = %.2f, average error = %1.2e\n", (double) linsolve_iterstaken_avg / linsolve_counter, linsolve_error_avg / linsolve_counter);
+  if (myrank == 0 && cheb_fallbacks > 0) printf("Linear solver: %d Chebyshev solves diverged and were solved with GMRES\n", cheb_fallbacks);
 
   /* Free up Petsc's linear solver */
-  if (linsolve_type == LinearSolverType::GMRES) {
+  if (linsolve_type == LinearSolverType::GMRES || linsolve_type == LinearSolverType::CHEBYSHEV) {
     KSPDestroy(&ksp);
-  } else {
+    MatDestroy(&implmat);
+    if (linsolve_warmstart) {
+      VecDestroy(&stage_prev);
+      VecDestroy(&stage_adj_prev);
+    }
+    if (precond_type == PreconditionerType::DIAGONAL) {
+      VecDestroy(&precond_constdiag);
+      VecDestroy(&precond_diag);
+    }
+  }
+  if (linsolve_type != LinearSolverType::GMRES) {
     VecDestroy(&tmp);
     VecDestroy(&err);
+    if (linsolve_type == LinearSolverType::CHEBYSHEV || linsolve_type == LinearSolverType::CHEBYSHEV_FIXED) VecDestroy(&cheb_dir);
   }
 
   /* Free up intermediate vectors */
@@ -303,6 +1071,7 @@ ImplMidpoint::~ImplMidpoint(){
   VecDestroy(&stage);
   VecDestroy(&rhs_adj);
   VecDestroy(&rhs);
+  VecDestroy(&state_next);
 
 }
 
@@ -313,41 +1082,53 @@ void ImplMidpoint::evolveFWD(const double tstart,const  double tstop, Vec x) {
 
   /* Compute A(t_n+h/2) */
   mastereq->assemble_RHS( (tstart + tstop) / 2.0);
-  Mat A = mastereq->getRHS(); 
+  Mat A = getRHS(); 
 
   /* Compute rhs = A x */
   MatMult(A, x, rhs);
 
   /* Solve for the stage variable (I-dt/2 A) k1 = Ax */
+  PetscLogEventBegin(EVENT_LINSOLVE, 0, 0, 0, 0);
+  PetscInt iters_taken = 0;
   switch (linsolve_type) {
     case LinearSolverType::GMRES:
-      /* Set up I-dt/2 A, then solve */
-      MatScale(A, - dt/2.0);
-      MatShift(A, 1.0);  
+      /* Solve with the matrix-free I-dt/2 A */
+      setupPreconditioner(dt);
+      impl_dt = dt;
+      if (linsolve_warmstart) extrapolateGuess(&stage, &stage_prev);
       KSPSolve(ksp, rhs, stage);
 
       /* Monitor error */
       double rnorm;
-      PetscInt iters_taken;
       KSPGetResidualNorm(ksp, &rnorm);
       KSPGetIterationNumber(ksp, &iters_taken);
       //printf("Residual norm %d: %1.5e\n", iters_taken, rnorm);
-      linsolve_iterstaken_avg += iters_taken;
       linsolve_error_avg += rnorm;
-
-      /* Revert the scaling and shifting if gmres solver */
-      MatAssemblyBegin(A, MAT_FINAL_ASSEMBLY);
-      MatAssemblyEnd(A, MAT_FINAL_ASSEMBLY);
       break;
 
     case LinearSolverType::NEUMANN:
-      linsolve_iterstaken_avg += NeumannSolve(A, rhs, stage, dt/2.0, false);
+      iters_taken = NeumannSolve(A, rhs, stage, dt/2.0, false);
+      break;
+
+    case LinearSolverType::CHEBYSHEV:
+    case LinearSolverType::CHEBYSHEV_FIXED:
+      iters_taken = ChebyshevSolve(A, rhs, stage, dt/2.0, false);
       break;
   }
+  PetscLogEventEnd(EVENT_LINSOLVE, 0, 0, 0, 0);
+  linsolve_iterstaken_avg += iters_taken;
   linsolve_counter++;
+  recordIterations(iters_taken);
 
   /* --- Update state x += dt * stage --- */
   VecAXPY(x, dt, stage);
+
+  /* Error estimate for adaptive time stepping: Difference to the explicit Euler step x + dt * A x (embedded method of order 1) */
+  if (adaptive) {
+    VecAXPY(rhs, -1.0, stage);
+    VecNorm(rhs, NORM_2, &errest);
+    errest *= dt;
+  }
 }
 
 void ImplMidpoint::evolveBWD(const double tstop, const double tstart, const Vec x, Vec x_adj, Vec grad, bool compute_gradient){
@@ -359,56 +1140,301 @@ void ImplMidpoint::evolveBWD(const double tstop, const double tstart, const Vec
 
   /* Assemble RHS(t_1/2) */
   mastereq->assemble_RHS( (tstart + tstop) / 2.0);
-  A = mastereq->getRHS();
+  A = getRHS();
 
-  /* Get Ax_n for use in gradient */
+  /* Get the primal state at the midpoint x_n + dt/2 k for use in gradient. During an adjoint sweep, the state x_n+1 at the 
+   * end of this step has been passed to the previous call, and the midpoint state is (x_n + x_n+1) / 2. Otherwise, the 
+   * stage k is recomputed. */
+  PetscInt iters_taken = 0;
   if (compute_gradient) {
-    MatMult(A, x, rhs);
+    if (adjoint_sweep && state_next_time == tstop) {
+      VecWAXPY(rhs, 1.0, x, state_next);
+      VecScale(rhs, 0.5);
+    } else {
+      MatMult(A, x, rhs);
+      PetscLogEventBegin(EVENT_LINSOLVE, 0, 0, 0, 0);
+      switch (linsolve_type) {
+        case LinearSolverType::GMRES: 
+          setupPreconditioner(dt);
+          impl_dt = dt;
+          if (linsolve_warmstart) extrapolateGuess(&stage, &stage_prev);
+          KSPSolve(ksp, rhs, stage);
+          KSPGetIterationNumber(ksp, &iters_taken);
+          break;
+        case LinearSolverType::NEUMANN:
+          iters_taken = NeumannSolve(A, rhs, stage, dt/2.0, false);
+          break;
+        case LinearSolverType::CHEBYSHEV:
+        case LinearSolverType::CHEBYSHEV_FIXED:
+          iters_taken = ChebyshevSolve(A, rhs, stage, dt/2.0, false);
+          break;
+      }
+      PetscLogEventEnd(EVENT_LINSOLVE, 0, 0, 0, 0);
+      recordIterations(iters_taken);
+      VecWAXPY(rhs, dt / 2.0, stage, x);
+    }
+
+    /* Keep x_n for the next step backwards */
+    if (adjoint_sweep) {
+      VecCopy(x, state_next);
+      state_next_time = tstart;
+    }
   }
 
   /* Solve for adjoint stage variable */
+  PetscLogEventBegin(EVENT_LINSOLVE, 0, 0, 0, 0);
   switch (linsolve_type) {
     case LinearSolverType::GMRES:
-      MatScale(A, - dt/2.0);
-      MatShift(A, 1.0);  // WARNING: this can be very slow if some diagonal elements are missing.
+      setupPreconditioner(dt);
+      impl_dt = dt;
+      if (linsolve_warmstart) extrapolateGuess(&stage_adj, &stage_adj_prev);
       KSPSolveTranspose(ksp, x_adj, stage_adj);
       double rnorm;
       KSPGetResidualNorm(ksp, &rnorm);
+      KSPGetIterationNumber(ksp, &iters_taken);
       if (rnorm > 1e-3)  printf("Residual norm: %1.5e\n", rnorm);
       break;
 
     case LinearSolverType::NEUMANN: 
-      NeumannSolve(A, x_adj, stage_adj, dt/2.0, true);
+      iters_taken = NeumannSolve(A, x_adj, stage_adj, dt/2.0, true);
+      break;
+
+    case LinearSolverType::CHEBYSHEV:
+    case LinearSolverType::CHEBYSHEV_FIXED:
+      iters_taken = ChebyshevSolve(A, x_adj, stage_adj, dt/2.0, true);
       break;
   }
+  PetscLogEventEnd(EVENT_LINSOLVE, 0, 0, 0, 0);
+  recordIterations(iters_taken);
 
   // k_bar = h*k_bar 
   VecScale(stage_adj, dt);
 
-  /* Add to reduced gradient */
-  if (compute_gradient) {
-    switch (linsolve_type) {
-      case LinearSolverType::GMRES: 
-        KSPSolve(ksp, rhs, stage);
-        break;
-      case LinearSolverType::NEUMANN:
-        NeumannSolve(A, rhs, stage, dt/2.0, false);
-        break;
+  /* Update adjoint state x_adj += dt * A^Tstage_adj, and add to reduced gradient */
+  if (compute_gradient) computeAdjointRHS(thalf, rhs, stage_adj, 1.0, x_adj, grad);
+  else MatMultTransposeAdd(A, stage_adj, x_adj, x_adj);
+
+  /* Warm start: Keep the unscaled k_bar, which is the solution of the linear system, for the extrapolation */
+  if (linsolve_warmstart) VecScale(stage_adj, 1.0/dt);
+}
+
+
+int ImplMidpoint::ChebyshevSolve(Mat A, Vec b, Vec y, double alpha, bool transpose){
+
+  bool fixed = linsolve_type == LinearSolverType::CHEBYSHEV_FIXED;
+  if (cheb_normA < 0.0) estimateSpectrum(A);
+
+  int iter = 0;
+  double rnorm = 0.0, rnorm0 = 0.0;
+
+  /* Ellipse enclosing the eigenvalues 1 - alpha*lambda of I - alpha A, i.e. the rectangle [1, 1+delta] x [-i rho, i rho]: 
+   * Center d = 1 + delta/2, left vertex 1 - m, and the corners 1 +- i rho on the ellipse. The margin m minimizes 
+   * the convergence factor (a + b) / (d + sqrt(d^2 - a^2 + b^2)) for semi-axes a, b. c^2 = a^2 - b^2 is the squared focal distance. */
+  double rho   = alpha * cheb_normA;
+  double delta = alpha * cheb_decay;
+  double d = 1.0 + delta/2.0;
+  double c2 = 0.0;
+  double kappa_min = 1e+300;
+  for (int i = 0; i <= 100; i++) {
+    double m = (delta > 0.0) ? pow(10.0, -4.0 + 4.0 * i / 100.0) * 0.99 : 0.0;
+    double ea = delta/2.0 + m;
+    double eb2 = (delta > 0.0) ? rho*rho / (1.0 - pow(delta/2.0 / ea, 2)) : rho*rho;
+    double kappa = (ea + sqrt(eb2)) / (d + sqrt(d*d - ea*ea + eb2));
+    if (kappa < kappa_min) {
+      kappa_min = kappa;
+      c2 = ea*ea - eb2;
     }
-    VecAYPX(stage, dt / 2.0, x);
-    mastereq->computedRHSdp(thalf, stage, stage_adj, 1.0, grad);
   }
 
-  /* Revert changes to RHS from above, if gmres solver */
-  A = mastereq->getRHS();
-  if (linsolve_type == LinearSolverType::GMRES) {
-    MatAssemblyBegin(A, MAT_FINAL_ASSEMBLY);
-    MatAssemblyEnd(A, MAT_FINAL_ASSEMBLY);
+  /* Start from y = b, residual r = b - (I-alpha A) y = alpha A b */
+  VecCopy(b, y);
+  if (!transpose) MatMult(A, y, err);
+  else            MatMultTranspose(A, y, err);
+  VecScale(err, alpha);
+  VecCopy(err, cheb_dir);
+  VecScale(cheb_dir, 1.0/d);
+  if (!fixed) VecNorm(err, NORM_2, &rnorm0);
+  if (!fixed && rnorm0 < linsolve_abstol) return 0;
+
+  /* Chebyshev iterations in real arithmetic (eta_k = rho_k / c in Saad's notation) */
+  double eta = 1.0 / d;
+  for (iter = 0; iter < linsolve_maxiter; iter++) {
+    // y += dir,  r -= (I - alpha A) dir
+    VecAXPY(y, 1.0, cheb_dir);
+    if (!transpose) MatMult(A, cheb_dir, tmp);
+    else            MatMultTranspose(A, cheb_dir, tmp);
+    VecAXPBYPCZ(err, -1.0, alpha, 1.0, cheb_dir, tmp);
+
+    /* Stopping criteria. Stop early if the iterations clearly diverge. */
+    if (!fixed) {
+      VecNorm(err, NORM_2, &rnorm);
+      if (rnorm < linsolve_abstol) break;
+      if (rnorm / rnorm0 < linsolve_reltol) break;
+      if (rnorm > 100.0 * rnorm0) break;
+    }
+
+    // dir = c^2 eta_k+1 eta_k dir + 2 eta_k+1 r
+    double eta_next = 1.0 / (2.0*d - c2*eta);
+    VecAXPBY(cheb_dir, 2.0 * eta_next, c2 * eta_next * eta, err);
+    eta = eta_next;
+  }
+
+  /* If the residual grew, the spectral bound was too small: Enlarge it for the following solves, and solve this system with GMRES */
+  if (!fixed && rnorm > rnorm0) {
+    cheb_normA *= 2.0;
+    cheb_fallbacks++;
+    setupPreconditioner(2.0 * alpha);
+    impl_dt = 2.0 * alpha;
+    if (!transpose) KSPSolve(ksp, b, y);
+    else            KSPSolveTranspose(ksp, b, y);
+    PetscInt gmres_iters;
+    KSPGetResidualNorm(ksp, &rnorm);
+    KSPGetIterationNumber(ksp, &gmres_iters);
+    iter += gmres_iters;
+  }
+
+  linsolve_error_avg += rnorm;
+
+  return iter;
+}
+
+
+void ImplMidpoint::estimateSpectrum(Mat A){
+
+  /* Deterministic start vector */
+  double* vptr;
+  PetscInt ilow, iupp;
+  VecGetOwnershipRange(tmp, &ilow, &iupp);
+  VecGetArray(tmp, &vptr);
+  for (int i = 0; i < iupp - ilow; i++) vptr[i] = 1.0 + ((ilow + i) % 7) / 7.0;
+  VecRestoreArray(tmp, &vptr);
+
+  /* Power iterations for the largest eigenvalue of A^T A */
+  double sigma2 = 0.0, norm;
+  VecNorm(tmp, NORM_2, &norm);
+  VecScale(tmp, 1.0 / norm);
+  for (int iter = 0; iter < 20; iter++) {
+    MatMult(A, tmp, err);
+    MatMultTranspose(A, err, tmp);
+    VecNorm(tmp, NORM_2, &sigma2);
+    if (sigma2 == 0.0) break;
+    VecScale(tmp, 1.0 / sigma2);
   }
+  /* Power iterations approach the norm from below, and the controls change over time. If this is still too small, ChebyshevSolve enlarges it. */
+  cheb_normA = 1.2 * sqrt(sigma2);
+
+  /* Largest decay rate -Re(lambda) from the real part of the constant diagonal (Lindblad terms) */
+  Vec constdiag;
+  const double* dptr;
+  PetscInt nlocal;
+  MatCreateVecs(mastereq->getRHS(), &constdiag, NULL);
+  mastereq->getConstantDiagonal(constdiag);
+  VecGetLocalSize(constdiag, &nlocal);
+  VecGetArrayRead(constdiag, &dptr);
+  double mydecay = 0.0;
+  for (int it = 0; it < nlocal/2; it++) mydecay = std::max(mydecay, -dptr[getIndexReal(it)]);
+  VecRestoreArrayRead(constdiag, &dptr);
+  VecDestroy(&constdiag);
+  MPI_Allreduce(&mydecay, &cheb_decay, 1, MPI_DOUBLE, MPI_MAX, PETSC_COMM_WORLD);
+}
+
+
+void ImplMidpoint::extrapolateGuess(Vec* k, Vec* kprev){
+  /* kprev = 2 k - kprev, then swap, such that k holds the guess and kprev the last stage */
+  VecAXPBY(*kprev, 2.0, -1.0, *k);
+  std::swap(*k, *kprev);
+}
 
-  /* Update adjoint state x_adj += dt * A^Tstage_adj --- */
-  MatMultTransposeAdd(A, stage_adj, x_adj, x_adj);
 
+void ImplMidpoint::applyImplicitMatrix(Vec x, Vec y, bool transpose){
+  /* y = x - dt/2 A x, with A assembled at the midpoint of the current step */
+  myMatMultShifted(getRHS(), x, y, 1.0, -impl_dt/2.0, transpose);
+}
+
+
+int myMatMult_implmidpoint(Mat M, Vec x, Vec y){
+  ImplMidpoint *timestepper;
+  MatShellGetContext(M, (void**) &timestepper);
+  timestepper->applyImplicitMatrix(x, y, false);
+  return 0;
+}
+
+
+int myMatMultTranspose_implmidpoint(Mat M, Vec x, Vec y){
+  ImplMidpoint *timestepper;
+  MatShellGetContext(M, (void**) &timestepper);
+  timestepper->applyImplicitMatrix(x, y, true);
+  return 0;
+}
+
+
+void ImplMidpoint::setupPreconditioner(double dt){
+  if (precond_type != PreconditionerType::DIAGONAL || dt == precond_dt) return;
+  precond_dt = dt;
+
+  /* Invert the complex entries 1 - dt/2 d of I - dt/2 D */
+  const double* dptr;
+  double* pptr;
+  PetscInt nlocal;
+  VecGetLocalSize(precond_constdiag, &nlocal);
+  VecGetArrayRead(precond_constdiag, &dptr);
+  VecGetArray(precond_diag, &pptr);
+  for (int it = 0; it < nlocal/2; it++) {
+    double mre = 1.0 - dt/2.0 * dptr[getIndexReal(it)];
+    double mim =     - dt/2.0 * dptr[getIndexImag(it)];
+    double mabs2 = mre*mre + mim*mim;
+    pptr[getIndexReal(it)] =  mre / mabs2;
+    pptr[getIndexImag(it)] = -mim / mabs2;
+  }
+  VecRestoreArray(precond_diag, &pptr);
+  VecRestoreArrayRead(precond_constdiag, &dptr);
+}
+
+
+void ImplMidpoint::applyPreconditioner(Vec x, Vec y, bool transpose){
+  const double* xptr;
+  const double* pptr;
+  double* yptr;
+  PetscInt nlocal;
+  VecGetLocalSize(precond_diag, &nlocal);
+  VecGetArrayRead(x, &xptr);
+  VecGetArrayRead(precond_diag, &pptr);
+  VecGetArray(y, &yptr);
+
+  /* Complex product with the inverse diagonal, or with its conjugate for the transpose. Batched states share the diagonal. */
+  double sign = transpose ? -1.0 : 1.0;
+  for (int it = 0; it < nlocal/2; it++) {
+    int ire = getIndexReal(it);
+    int iim = getIndexImag(it);
+    double pre = pptr[ire];
+    double pim = sign * pptr[iim];
+    for (int b = 0; b < nbatch; b++) {
+      double xre = xptr[nbatch*ire + b];
+      double xim = xptr[nbatch*iim + b];
+      yptr[nbatch*ire + b] = pre * xre - pim * xim;
+      yptr[nbatch*iim + b] = pre * xim + pim * xre;
+    }
+  }
+
+  VecRestoreArray(y, &yptr);
+  VecRestoreArrayRead(precond_diag, &pptr);
+  VecRestoreArrayRead(x, &xptr);
+}
+
+
+int myPCApply_diagonal(PC pc, Vec x, Vec y){
+  ImplMidpoint *timestepper;
+  PCShellGetContext(pc, (void**) &timestepper);
+  timestepper->applyPreconditioner(x, y, false);
+  return 0;
+}
+
+
+int myPCApplyTranspose_diagonal(PC pc, Vec x, Vec y){
+  ImplMidpoint *timestepper;
+  PCShellGetContext(pc, (void**) &timestepper);
+  timestepper->applyPreconditioner(x, y, true);
+  return 0;
 }
 
 
@@ -444,6 +1470,373 @@ int ImplMidpoint::NeumannSolve(Mat A, Vec b, Vec y, double alpha, bool transpose
   return iter;
 }
 
+GaussLegendre::GaussLegendre(MasterEq* mastereq_, int ntime_, double total_time_, int nstages_, LinearSolverType linsolve_type_, int linsolve_maxiter_, Output* output_, const StorageOptions& storage, int nbatch_) : TimeStepper(mastereq_, ntime_, total_time_, output_, storage, nbatch_) {
+
+  /* Set the Butcher tableau */
+  nstages = nstages_;
+  if (nstages == 2) {
+    double s3 = sqrt(3.0);
+    a = {1./4.,          1./4. - s3/6.,
+         1./4. + s3/6.,  1./4.};
+    b = {1./2., 1./2.};
+    c = {1./2. - s3/6., 1./2. + s3/6.};
+  } else if (nstages == 3) {
+    double s15 = sqrt(15.0);
+    a = {5./36.,             2./9. - s15/15.,  5./36. - s15/30.,
+         5./36. + s15/24.,   2./9.,            5./36. - s15/24.,
+         5./36. + s15/30.,   2./9. + s15/15.,  5./36.};
+    b = {5./18., 4./9., 5./18.};
+    c = {1./2. - s15/10., 1./2., 1./2. + s15/10.};
+  } else {
+    printf("\n ERROR: Gauss-Legendre time-stepping with %d stages is not available. Choose 2 or 3.\n", nstages);
+    exit(1);
+  }
+  stage_tstart = 0.0;
+  stage_dt = 0.0;
+
+  /* Weights of the embedded error estimate: e_i = l_i(0), such that sum_i e_i p(c_i) = p(0) for polynomials p of degree < s */
+  e.assign(nstages, 1.0);
+  for (int i = 0; i < nstages; i++) {
+    for (int j = 0; j < nstages; j++) {
+      if (j != i) e[i] *= c[j] / (c[j] - c[i]);
+    }
+  }
+  errest_order = nstages;
+
+  /* Allocate auxiliary vectors of state size */
+  MatCreateVecs(getRHS(), &u, NULL);
+  VecDuplicate(u, &w);
+  VecGetLocalSize(u, &nlocal);
+
+  /* Create the stage system matrix. The local part of stage i is [i*nlocal, (i+1)*nlocal) of the local part of stacked vectors. */
+  MatCreateShell(PETSC_COMM_WORLD, nstages*nlocal, nstages*nlocal, nstages*dim, nstages*dim, (void*) this, &stagemat);
+  MatShellSetOperation(stagemat, MATOP_MULT, (void(*)(void)) myMatMult_stages);
+  MatShellSetOperation(stagemat, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_stages);
+  MatSetUp(stagemat);
+  MatAssemblyBegin(stagemat, MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(stagemat, MAT_FINAL_ASSEMBLY);
+
+  /* Create and reset the stacked stage vectors */
+  MatCreateVecs(stagemat, &stages, NULL);
+  VecDuplicate(stages, &stages_adj);
+  VecDuplicate(stages, &rhs);
+  VecDuplicate(stages, &work);
+  VecZeroEntries(stages);
+  VecZeroEntries(stages_adj);
+  VecZeroEntries(rhs);
+  VecZeroEntries(work);
+
+  /* Create views on single stages. Their arrays are placed when used. */
+  int mpisize;
+  MPI_Comm_size(PETSC_COMM_WORLD, &mpisize);
+  if (mpisize == 1) {
+    VecCreateSeqWithArray(PETSC_COMM_WORLD, nbatch, nlocal, NULL, &view_in);
+    VecCreateSeqWithArray(PETSC_COMM_WORLD, nbatch, nlocal, NULL, &view_out);
+  } else {
+    VecCreateMPIWithArray(PETSC_COMM_WORLD, nbatch, nlocal, dim, NULL, &view_in);
+    VecCreateMPIWithArray(PETSC_COMM_WORLD, nbatch, nlocal, dim, NULL, &view_out);
+  }
+
+  /* Set up the linear solver for the stage system */
+  linsolve_type = linsolve_type_;
+  if (linsolve_type != LinearSolverType::GMRES && linsolve_type != LinearSolverType::NEUMANN) {
+    printf("\n ERROR: Gauss-Legendre time-stepping requires the gmres or neumann linear solver.\n");
+    exit(1);
+  }
+  linsolve_maxiter = linsolve_maxiter_;
+  linsolve_reltol = 1.e-20;
+  linsolve_abstol = 1.e-10;
+  if (linsolve_type == LinearSolverType::GMRES) {
+    KSPCreate(PETSC_COMM_WORLD, &ksp);
+    KSPGetPC(ksp, &preconditioner);
+    PCSetType(preconditioner, PCNONE);
+    KSPSetTolerances(ksp, linsolve_reltol, linsolve_abstol, PETSC_DEFAULT, linsolve_maxiter);
+    KSPSetType(ksp, KSPGMRES);
+    KSPSetOperators(ksp, stagemat, stagemat);
+    KSPSetFromOptions(ksp);
+  }
+  else {
+    /* For Neumann iterations, allocate temporary vectors */
+    VecDuplicate(stages, &tmp);
+    VecDuplicate(stages, &err);
+  }
+
+  /* Stored stages: Only if the forward trajectory is stored in full */
+  storeStages = storage.stages && storeFWD;
+  kstore_count = 0;
+  if (storeStages && ncheckpoints > 0) {
+    printf("\n ERROR: Storing the Gauss-Legendre stages (store_stages = true) is not available with checkpointing.\n");
+    exit(1);
+  }
+}
+
+
+GaussLegendre::~GaussLegendre(){
+  if (linsolve_type == LinearSolverType::GMRES) {
+    KSPDestroy(&ksp);
+  } else {
+    VecDestroy(&tmp);
+    VecDestroy(&err);
+  }
+  MatDestroy(&stagemat);
+  VecDestroy(&stages);
+  VecDestroy(&stages_adj);
+  VecDestroy(&rhs);
+  VecDestroy(&work);
+  VecDestroy(&view_in);
+  VecDestroy(&view_out);
+  VecDestroy(&u);
+  VecDestroy(&w);
+  for (int n = 0; n < kstore.size(); n++) VecDestroy(&(kstore[n]));
+}
+
+
+void GaussLegendre::storeStageVec(double tstart, const Vec k){
+  /* A forward solve starts at 0. If adaptive, a rejected step is retaken from the same start time and replaces it. */
+  if (tstart == 0.0) kstore_count = 0;
+  else if (kstore_count > 0 && kstore_time[kstore_count-1] == tstart) kstore_count--;
+
+  if (kstore_count == kstore.size()) {
+    kstore.push_back(NULL);
+    VecDuplicate(k, &(kstore[kstore_count]));
+    kstore_time.push_back(0.0);
+  }
+  VecCopy(k, kstore[kstore_count]);
+  kstore_time[kstore_count] = tstart;
+  kstore_count++;
+}
+
+
+Vec GaussLegendre::getStageVec(double tstart){
+  std::vector<double>::iterator it = std::lower_bound(kstore_time.begin(), kstore_time.begin() + kstore_count, tstart);
+  if (it == kstore_time.begin() + kstore_count || *it != tstart) return NULL;
+  return kstore[it - kstore_time.begin()];
+}
+
+
+void GaussLegendre::placeStage(Vec view, const double* ptr, int i){
+  VecPlaceArray(view, ptr + i*nlocal);
+}
+
+
+void GaussLegendre::applyStageMatrix(Vec x, Vec y, bool transpose){
+  double h = stage_dt;
+  const double* xptr;
+  double* yptr;
+
+  if (!transpose) {
+    /* y_i = x_i - h A(t_i) sum_j a_ij x_j */
+    VecGetArrayRead(x, &xptr);
+    VecGetArray(y, &yptr);
+    for (int i = 0; i < nstages; i++) {
+      VecZeroEntries(u);
+      for (int j = 0; j < nstages; j++) {
+        placeStage(view_in, xptr, j);
+        VecAXPY(u, a[i*nstages + j], view_in);
+        VecResetArray(view_in);
+      }
+      mastereq->assemble_RHS(stage_tstart + c[i]*h);
+      MatMult(getRHS(), u, w);
+      placeStage(view_in, xptr, i);
+      placeStage(view_out, yptr, i);
+      VecWAXPY(view_out, -h, w, view_in);
+      VecResetArray(view_in);
+      VecResetArray(view_out);
+    }
+    VecRestoreArray(y, &yptr);
+    VecRestoreArrayRead(x, &xptr);
+  } 
+  else {
+    /* y_i = x_i - h sum_j a_ji A(t_j)^T x_j */
+    VecCopy(x, y);
+    VecGetArrayRead(x, &xptr);
+    VecGetArray(y, &yptr);
+    for (int j = 0; j < nstages; j++) {
+      mastereq->assemble_RHS(stage_tstart + c[j]*h);
+      placeStage(view_in, xptr, j);
+      MatMultTranspose(getRHS(), view_in, w);
+      VecResetArray(view_in);
+      for (int i = 0; i < nstages; i++) {
+        placeStage(view_out, yptr, i);
+        VecAXPY(view_out, -h * a[j*nstages + i], w);
+        VecResetArray(view_out);
+      }
+    }
+    VecRestoreArray(y, &yptr);
+    VecRestoreArrayRead(x, &xptr);
+  }
+}
+
+
+void GaussLegendre::solveStages(Vec b, Vec y, bool transpose){
+  double errnorm, errnorm0;
+  PetscInt iters_taken = 0;
+
+  PetscLogEventBegin(EVENT_LINSOLVE, 0, 0, 0, 0);
+  switch (linsolve_type) {
+    case LinearSolverType::GMRES:
+      if (!transpose) KSPSolve(ksp, b, y);
+      else            KSPSolveTranspose(ksp, b, y);
+      KSPGetIterationNumber(ksp, &iters_taken);
+      break;
+
+    case LinearSolverType::NEUMANN:
+      /* Iterate y = b + (I - M) y, starting from y = b */
+      VecCopy(b, y);
+      for (int iter = 0; iter < linsolve_maxiter; iter++) {
+        iters_taken = iter + 1;
+        VecCopy(y, err);
+        applyStageMatrix(y, tmp, transpose);
+        VecAXPBYPCZ(y, 1.0, -1.0, 1.0, b, tmp);
+
+        /* Error approximation  */
+        VecAXPY(err, -1.0, y); // err = yprev - y 
+        VecNorm(err, NORM_2, &errnorm);
+
+        /* Stopping criteria */
+        if (iter == 0) errnorm0 = errnorm;
+        if (errnorm < linsolve_abstol) break;
+        if (errnorm / errnorm0 < linsolve_reltol) break;
+      }
+      break;
+  }
+  PetscLogEventEnd(EVENT_LINSOLVE, 0, 0, 0, 0);
+  recordIterations(iters_taken);
+}
+
+
+void GaussLegendre::evolveFWD(const double tstart, const double tstop, Vec x) {
+
+  /* Compute time step size */
+  double dt = fabs(tstop - tstart); // absolute values needed in case this runs backwards! 
+  stage_tstart = tstart;
+  stage_dt = dt;
+
+  /* Compute rhs_i = A(t_i) x */
+  double* rptr;
+  VecGetArray(rhs, &rptr);
+  for (int i = 0; i < nstages; i++) {
+    mastereq->assemble_RHS(stage_tstart + c[i]*dt);
+    placeStage(view_out, rptr, i);
+    MatMult(getRHS(), x, view_out);
+    VecResetArray(view_out);
+  }
+  VecRestoreArray(rhs, &rptr);
+
+  /* Solve for the stage variables */
+  solveStages(rhs, stages, false);
+  if (storeStages) storeStageVec(tstart, stages);
+
+  /* Update x += dt * sum_i b_i K_i. If adaptive, accumulate u = sum_i e_i (K_i - A(t_i) x) for the error estimate. */
+  const double* kptr;
+  if (adaptive) VecZeroEntries(u);
+  VecGetArrayRead(stages, &kptr);
+  VecGetArray(rhs, &rptr);
+  for (int i = 0; i < nstages; i++) {
+    placeStage(view_in, kptr, i);
+    VecAXPY(x, dt * b[i], view_in);
+    if (adaptive) {
+      placeStage(view_out, rptr, i);
+      VecAXPBYPCZ(u, e[i], -e[i], 1.0, view_in, view_out);
+      VecResetArray(view_out);
+    }
+    VecResetArray(view_in);
+  }
+  VecRestoreArray(rhs, &rptr);
+  VecRestoreArrayRead(stages, &kptr);
+
+  /* Error estimate for adaptive time stepping. K_i - A(t_i) x = dt A(t_i) sum_j a_ij K_j is, up to the stage order s, a 
+   * smooth function of the node c_i that vanishes at c = 0. Its extrapolation to c = 0 is O(dt^s), such that the estimate 
+   * is O(dt^(s+1)): It is the difference to an embedded method of order s, built from the stages and A(t_i) x. */
+  if (adaptive) {
+    VecNorm(u, NORM_2, &errest);
+    errest *= dt;
+  }
+}
+
+
+void GaussLegendre::evolveBWD(const double tstop, const double tstart, const Vec x, Vec x_adj, Vec grad, bool compute_gradient){
+
+  /* Compute time step size */
+  double dt = fabs(tstop - tstart); // absolute values needed in case this runs backwards! 
+  stage_tstart = std::min(tstart, tstop);
+  stage_dt = dt;
+
+  /* Solve for adjoint stage variables M^T Z = (dt b_i x_adj)_i */
+  double* rptr;
+  VecGetArray(rhs, &rptr);
+  for (int i = 0; i < nstages; i++) {
+    placeStage(view_out, rptr, i);
+    VecCopy(x_adj, view_out);
+    VecScale(view_out, dt * b[i]);
+    VecResetArray(view_out);
+  }
+  VecRestoreArray(rhs, &rptr);
+  solveStages(rhs, stages_adj, true);
+
+  const double* zptr;
+  const double* kptr;
+  VecGetArrayRead(stages_adj, &zptr);
+
+  /* Add to reduced gradient: sum_i Z_i^T dA(t_i)/dp Y_i with stage values Y_i = x + dt sum_j a_ij K_j. 
+   * The stages K_j are those of the forward step if stored, otherwise they are recomputed. */
+  if (compute_gradient) {
+    Vec k = storeStages ? getStageVec(stage_tstart) : NULL;
+    if (k == NULL) {
+      VecGetArray(rhs, &rptr);
+      for (int i = 0; i < nstages; i++) {
+        mastereq->assemble_RHS(stage_tstart + c[i]*dt);
+        placeStage(view_out, rptr, i);
+        MatMult(getRHS(), x, view_out);
+        VecResetArray(view_out);
+      }
+      VecRestoreArray(rhs, &rptr);
+      solveStages(rhs, stages, false);
+      k = stages;
+    }
+
+    VecGetArrayRead(k, &kptr);
+    for (int i = 0; i < nstages; i++) {
+      VecCopy(x, u);
+      for (int j = 0; j < nstages; j++) {
+        placeStage(view_in, kptr, j);
+        VecAXPY(u, dt * a[i*nstages + j], view_in);
+        VecResetArray(view_in);
+      }
+      placeStage(view_in, zptr, i);
+      computedRHSdp(stage_tstart + c[i]*dt, u, view_in, 1.0, grad);
+      VecResetArray(view_in);
+    }
+    VecRestoreArrayRead(k, &kptr);
+  }
+
+  /* Update adjoint state x_adj += sum_i A(t_i)^T Z_i */
+  for (int i = 0; i < nstages; i++) {
+    mastereq->assemble_RHS(stage_tstart + c[i]*dt);
+    placeStage(view_in, zptr, i);
+    MatMultTransposeAdd(getRHS(), view_in, x_adj, x_adj);
+    VecResetArray(view_in);
+  }
+  VecRestoreArrayRead(stages_adj, &zptr);
+}
+
+
+int myMatMult_stages(Mat M, Vec x, Vec y){
+  GaussLegendre *stepper;
+  MatShellGetContext(M, (void**) &stepper);
+  stepper->applyStageMatrix(x, y, false);
+  return 0;
+}
+
+
+int myMatMultTranspose_stages(Mat M, Vec x, Vec y){
+  GaussLegendre *stepper;
+  MatShellGetContext(M, (void**) &stepper);
+  stepper->applyStageMatrix(x, y, true);
+  return 0;
+}
+
+
 PetscErrorCode RHSJacobian(TS ts,PetscReal t,Vec u,Mat M,Mat P,void *ctx){
 
   /* Cast ctx to equation pointer */
@@ -654,3 +2047,346 @@ PetscErrorCode  TSSetAdjointSolution(TS ts,Vec lambda, Vec mu)
   PetscFunctionReturn(0);
 }
 
+
+
+KrylovExp::KrylovExp(MasterEq* mastereq_, int ntime_, double total_time_, int krylov_maxdim_, double krylov_tol_, Output* output_, const StorageOptions& storage, int nbatch_) : TimeStepper(mastereq_, ntime_, total_time_, output_, storage, nbatch_) {
+
+  krylov_maxdim = krylov_maxdim_;
+  krylov_tol = krylov_tol_;
+  if (krylov_maxdim < 1) {
+    printf("\n ERROR: The maximum Krylov dimension must be positive, but is %d.\n", krylov_maxdim);
+    exit(1);
+  }
+
+  /* Allocate auxiliary vectors and the Arnoldi bases */
+  MatCreateVecs(getRHS(), &u, NULL);
+  VecDuplicate(u, &w);
+  VecDuplicate(u, &x0);
+  VecDuplicateVecs(u, krylov_maxdim + 1, &basis);
+  VecDuplicateVecs(u, krylov_maxdim + 1, &basis_adj);
+  hess.assign((krylov_maxdim + 1) * krylov_maxdim, 0.0);
+  hess_adj.assign((krylov_maxdim + 1) * krylov_maxdim, 0.0);
+  fwd_tstart = -1.0;
+  fwd_count = 0;
+}
+
+
+KrylovExp::~KrylovExp(){
+  for (int k = 0; k < substates.size(); k++) VecDestroy(&substates[k]);
+  for (std::map<double, std::vector<Vec> >::iterator it = fwd_substates.begin(); it != fwd_substates.end(); ++it) {
+    for (int k = 0; k < it->second.size(); k++) VecDestroy(&it->second[k]);
+  }
+  VecDestroyVecs(krylov_maxdim + 1, &basis);
+  VecDestroyVecs(krylov_maxdim + 1, &basis_adj);
+  VecDestroy(&u);
+  VecDestroy(&w);
+  VecDestroy(&x0);
+}
+
+
+double KrylovExp::krylovError(const std::vector<double>& H, int m, double tau){
+  std::vector<double> expcol(m, 0.0);
+  expcol[0] = 1.0;
+  expmvDense(m, H.data(), krylov_maxdim, tau, expcol);
+  return fabs(tau * H[m*krylov_maxdim + m-1] * expcol[m-1]);
+}
+
+
+int KrylovExp::arnoldi(Mat A, Vec v, double tau, bool transpose, Vec* V, std::vector<double>& H, double* beta, bool* converged){
+  int ld = krylov_maxdim;
+
+  std::fill(H.begin(), H.end(), 0.0);
+  *converged = true;
+  VecNorm(v, NORM_2, beta);
+  if (*beta == 0.0) return 0;
+  VecCopy(v, V[0]);
+  VecScale(V[0], 1.0 / *beta);
+
+  for (int m = 1; m <= krylov_maxdim; m++) {
+    int j = m - 1;
+    if (!transpose) MatMult(A, V[j], V[m]);
+    else            MatMultTranspose(A, V[j], V[m]);
+    double colnorm;
+    VecNorm(V[m], NORM_2, &colnorm);
+
+    /* Modified Gram-Schmidt */
+    for (int i = 0; i <= j; i++) {
+      double hij;
+      VecDot(V[m], V[i], &hij);
+      H[i*ld + j] = hij;
+      VecAXPY(V[m], -hij, V[i]);
+    }
+    double hnext;
+    VecNorm(V[m], NORM_2, &hnext);
+    H[m*ld + j] = hnext;
+
+    /* Stop if the Krylov space is invariant, or if the error estimate is below the tolerance */
+    if (hnext <= 1e-12 * colnorm) return m;
+    if (krylovError(H, m, tau) <= krylov_tol) return m;
+    VecScale(V[m], 1.0 / hnext);
+  }
+
+  *converged = false;
+  return krylov_maxdim;
+}
+
+
+void KrylovExp::krylovExp(Vec* V, const std::vector<double>& H, int m, double beta, double tau, Vec y){
+  VecZeroEntries(y);
+  if (m == 0) return;
+
+  std::vector<double> coeffs(m, 0.0);
+  coeffs[0] = beta;
+  expmvDense(m, H.data(), krylov_maxdim, tau, coeffs);
+  VecMAXPY(y, m, coeffs.data(), V);
+}
+
+
+/* Maximum number of Gauss nodes per panel of the gradient quadrature in expmvAdjoint */
+static const int expmv_maxnodes = 20;
+
+int KrylovExp::expmv(Mat A, double dt, Vec x, bool transpose, bool keep_substates){
+  Vec* V = transpose ? basis_adj : basis;
+  std::vector<double>& H = transpose ? hess_adj : hess;
+  double beta;
+  bool converged;
+
+  /* Krylov space for the whole step. If the maximum dimension doesn't suffice, halve the substeps until the error estimate passes. 
+   * The Krylov space doesn't depend on the step size. The substeps rebuild it, such that the adjoint finds the same dimensions. */
+  int nsub = 1;
+  int m = arnoldi(A, x, dt, transpose, V, H, &beta, &converged);
+  recordIterations(m);
+  while (!converged) {
+    nsub *= 2;
+    converged = krylovError(H, m, dt / nsub) <= krylov_tol;
+  }
+  if (nsub > 1) VecCopy(x, x0);
+
+  /* Keep the substeps of the forward step, except its first state */
+  bool keep_fwd = !transpose && fwd_tstart >= 0.0;
+  bool first_of_step = keep_fwd && fwd_nsub[fwd_tstart].empty();
+  int count_start = fwd_count;
+
+  /* Apply the substeps. If a substep's Krylov space doesn't pass the error estimate, restart with twice the substeps. */
+  int k = 0;
+  while (k < nsub) {
+    double tau = dt / nsub;
+    if (keep_substates) {
+      if (k >= substates.size()) {
+        substates.push_back(NULL);
+        VecDuplicate(x, &substates[k]);
+      }
+      VecCopy(x, substates[k]);
+    }
+    if (keep_fwd && !(first_of_step && k == 0)) {
+      std::vector<Vec>& states = fwd_substates[fwd_tstart];
+      if (fwd_count >= states.size()) {
+        states.push_back(NULL);
+        VecDuplicate(x, &states[fwd_count]);
+      }
+      VecCopy(x, states[fwd_count]);
+      fwd_count++;
+    }
+    if (nsub > 1) {
+      m = arnoldi(A, x, tau, transpose, V, H, &beta, &converged);
+      recordIterations(m);
+      if (!converged) {
+        nsub *= 2;
+        if (nsub > 65536) {
+          printf("\n ERROR: The Krylov exponential needs more than 65536 substeps. Increase krylov_maxdim or decrease the time step.\n");
+          exit(1);
+        }
+        VecCopy(x0, x);
+        fwd_count = count_start;
+        k = 0;
+        continue;
+      }
+    }
+    krylovExp(V, H, m, beta, tau, u);
+    VecCopy(u, x);
+    k++;
+  }
+  if (keep_fwd) fwd_nsub[fwd_tstart].push_back(nsub);
+
+  return nsub;
+}
+
+
+void KrylovExp::beginForwardStep(double tstart){
+  fwd_tstart = -1.0;
+  if (!storeFWD || ncheckpoints > 0) return;
+  fwd_tstart = tstart;
+  fwd_nsub[tstart].clear();
+  fwd_count = 0;
+}
+
+
+void KrylovExp::getSubstates(double tstart, int iexp, const Vec x, std::vector<Vec>& xs){
+  xs.clear();
+  std::map<double, std::vector<int> >::iterator it = fwd_nsub.find(tstart);
+  if (it == fwd_nsub.end() || it->second.size() <= iexp) return;
+
+  /* The kept states start with the second substep of the first exponential */
+  std::vector<Vec>& states = fwd_substates[tstart];
+  int offset = -1;
+  for (int j = 0; j < iexp; j++) offset += it->second[j];
+  for (int k = 0; k < it->second[iexp]; k++) xs.push_back(offset + k < 0 ? x : states[offset + k]);
+}
+
+
+void KrylovExp::evolveFWD(const double tstart, const double tstop, Vec x) {
+
+  /* Compute time step size */
+  double dt = fabs(tstop - tstart); // absolute values needed in case this runs backwards! 
+
+  /* Compute A(t_n+h/2), then x = exp(dt*A) x */
+  mastereq->assemble_RHS( (tstart + tstop) / 2.0);
+  beginForwardStep(tstart);
+  expmv(getRHS(), dt, x, false, false);
+  fwd_tstart = -1.0;
+}
+
+
+void KrylovExp::evolveBWD(const double tstop, const double tstart, const Vec x, Vec x_adj, Vec grad, bool compute_gradient){
+
+  /* Compute time step size */
+  double dt = fabs(tstop - tstart); // absolute values needed in case this runs backwards! 
+  double thalf = (tstart + tstop) / 2.0;
+
+  /* Assemble RHS(t_1/2), update the adjoint and the gradient */
+  mastereq->assemble_RHS(thalf);
+  std::vector<Vec> xs;
+  getSubstates(tstart, 0, x, xs);
+  expmvAdjoint(getRHS(), dt, x, xs, x_adj, std::vector<double>(1, thalf), std::vector<double>(1, 1.0), grad, compute_gradient);
+}
+
+
+void KrylovExp::expmvAdjoint(Mat A, double dt, const Vec x, const std::vector<Vec>& xs, Vec x_adj, const std::vector<double>& times, const std::vector<double>& coeffs, Vec grad, bool compute_gradient){
+
+  /* Without gradient, update the adjoint x_adj = exp(dt*A^T) x_adj */
+  if (!compute_gradient) {
+    expmv(A, dt, x_adj, true, false);
+    return;
+  }
+
+  /* Substeps of the forward step, recomputed from x if they were not kept */
+  std::vector<Vec> xsub(xs);
+  if (xsub.empty()) {
+    VecCopy(x, w);
+    int nsub = expmv(A, dt, w, false, true);
+    xsub.assign(substates.begin(), substates.begin() + nsub);
+  }
+  int nsub = xsub.size();
+  double tau = dt / nsub;
+
+  std::vector<double> nodes, weights;
+  for (int k = nsub - 1; k >= 0; k--) {
+    double beta, beta_adj;
+    bool converged, converged_adj;
+    int m     = arnoldi(A, xsub[k], tau, false, basis, hess, &beta, &converged);
+    int m_adj = arnoldi(A, x_adj, tau, true, basis_adj, hess_adj, &beta_adj, &converged_adj);
+    recordIterations(m);
+    recordIterations(m_adj);
+    if (!converged_adj) {
+      printf("\n ERROR: The Krylov space of the adjoint exponential failed the error estimate. Increase krylov_maxdim or decrease the time step.\n");
+      exit(1);
+    }
+
+    /* Number of quadrature nodes from the bound tau*|H|_1 on the oscillations of the integrand. 
+     * Split [0,1] into panels of at most expmv_maxnodes Gauss nodes each. */
+    double hnorm = 0.0;
+    for (int j = 0; j < krylov_maxdim; j++) {
+      double colsum = 0.0, colsum_adj = 0.0;
+      for (int i = 0; i <= krylov_maxdim; i++) {
+        colsum     += fabs(hess[i*krylov_maxdim + j]);
+        colsum_adj += fabs(hess_adj[i*krylov_maxdim + j]);
+      }
+      hnorm = std::max(hnorm, std::max(colsum, colsum_adj));
+    }
+    int npanel = std::max(1, (int) ceil(tau * hnorm / (2.0 * (expmv_maxnodes - 5))));
+    getGaussLegendre(5 + (int) ceil(tau * hnorm / (2.0 * npanel)), nodes, weights);
+
+    /* Add to reduced gradient: tau * int_0^1 (exp((1-s)tau A^T) x_adj)^T dA/dp exp(s tau A) x_k ds, with dA/dp = sum_j coeffs[j] dRHS(times[j])/dp */
+    for (int ip = 0; ip < npanel; ip++) {
+      for (int iq = 0; iq < nodes.size(); iq++) {
+        double s = (ip + nodes[iq]) / npanel;
+        krylovExp(basis, hess, m, beta, s * tau, u);
+        krylovExp(basis_adj, hess_adj, m_adj, beta_adj, (1.0 - s) * tau, w);
+        for (int j = 0; j < times.size(); j++) computedRHSdp(times[j], u, w, coeffs[j] * weights[iq] / npanel * tau, grad);
+      }
+    }
+
+    /* Update adjoint state x_adj = exp(tau*A^T) x_adj */
+    krylovExp(basis_adj, hess_adj, m_adj, beta_adj, tau, w);
+    VecCopy(w, x_adj);
+  }
+}
+
+
+/* Commutator-free Magnus: Gauss nodes c1,2 = 1/2 -+ sqrt(3)/6 and weights a1,2 = 1/4 -+ sqrt(3)/6 */
+static const double cfm4_c1 = 0.5 - sqrt(3.0) / 6.0;
+static const double cfm4_c2 = 0.5 + sqrt(3.0) / 6.0;
+static const double cfm4_a1 = 0.25 - sqrt(3.0) / 6.0;
+static const double cfm4_a2 = 0.25 + sqrt(3.0) / 6.0;
+
+CFMagnus4::CFMagnus4(MasterEq* mastereq_, int ntime_, double total_time_, int krylov_maxdim_, double krylov_tol_, Output* output_, const StorageOptions& storage, int nbatch_) : KrylovExp(mastereq_, ntime_, total_time_, krylov_maxdim_, krylov_tol_, output_, storage, nbatch_) {
+  VecDuplicate(u, &x_stage);
+}
+
+
+CFMagnus4::~CFMagnus4(){
+  VecDestroy(&x_stage);
+}
+
+
+void CFMagnus4::evolveFWD(const double tstart, const double tstop, Vec x) {
+
+  /* Compute time step size and the Gauss nodes */
+  double dt = fabs(tstop - tstart); // absolute values needed in case this runs backwards! 
+  double t1 = tstart + cfm4_c1 * (tstop - tstart);
+  double t2 = tstart + cfm4_c2 * (tstop - tstart);
+
+  /* x = exp(dt/2 * 2(a2 A(t1) + a1 A(t2))) x, then x = exp(dt/2 * 2(a1 A(t1) + a2 A(t2))) x */
+  beginForwardStep(tstart);
+  mastereq->assemble_RHS_combined(t1, cfm4_a2, t2, cfm4_a1);
+  expmv(getRHS(), dt / 2.0, x, false, false);
+  mastereq->assemble_RHS_combined(t1, cfm4_a1, t2, cfm4_a2);
+  expmv(getRHS(), dt / 2.0, x, false, false);
+  fwd_tstart = -1.0;
+}
+
+
+void CFMagnus4::evolveBWD(const double tstop, const double tstart, const Vec x, Vec x_adj, Vec grad, bool compute_gradient){
+
+  /* Compute time step size and the Gauss nodes */
+  double dt = fabs(tstop - tstart); // absolute values needed in case this runs backwards! 
+  double t1 = tstart + cfm4_c1 * (tstop - tstart);
+  double t2 = tstart + cfm4_c2 * (tstop - tstart);
+  std::vector<double> times(2);
+  times[0] = t1;
+  times[1] = t2;
+
+  /* Substeps of both exponentials kept by the forward sweep. Otherwise, recompute the state after the first exponential. */
+  std::vector<Vec> xs1, xs2;
+  getSubstates(tstart, 0, x, xs1);
+  getSubstates(tstart, 1, x, xs2);
+  Vec x_mid = x_stage;
+  if (compute_gradient && !xs2.empty()) x_mid = xs2[0];
+  else if (compute_gradient) {
+    VecCopy(x, x_stage);
+    mastereq->assemble_RHS_combined(t1, cfm4_a2, t2, cfm4_a1);
+    expmv(getRHS(), dt / 2.0, x_stage, false, false);
+  }
+
+  /* Adjoint of the second, then of the first exponential. Each exponent is dt/2 times the combined RHS 2(a A(t1) + b A(t2)), hence the gradient weights 2a, 2b. */
+  std::vector<double> coeffs(2);
+  coeffs[0] = 2.0 * cfm4_a1;
+  coeffs[1] = 2.0 * cfm4_a2;
+  mastereq->assemble_RHS_combined(t1, cfm4_a1, t2, cfm4_a2);
+  expmvAdjoint(getRHS(), dt / 2.0, x_mid, xs2, x_adj, times, coeffs, grad, compute_gradient);
+
+  coeffs[0] = 2.0 * cfm4_a2;
+  coeffs[1] = 2.0 * cfm4_a1;
+  mastereq->assemble_RHS_combined(t1, cfm4_a2, t2, cfm4_a1);
+  expmvAdjoint(getRHS(), dt / 2.0, x, xs1, x_adj, times, coeffs, grad, compute_gradient);
+}
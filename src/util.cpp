@@ -1,11 +1,51 @@
 #include "util.hpp"
+#include <assert.h>
 
-int getIndexReal(const int i) {
-  return 2*i;
+int storage_dim = 0;
+
+void setStorageDim(const int dim){
+  /* All states of a run share one dimension: set it only once */
+  assert(storage_dim == 0);
+  storage_dim = dim;
+}
+
+PetscLogStage STAGE_FORWARD, STAGE_ADJOINT;
+PetscLogEvent EVENT_RHS, EVENT_LINSOLVE, EVENT_CONTROL, EVENT_GRADIENT, EVENT_OUTPUT, EVENT_REDUCTION;
+
+void registerLogEvents(){
+  PetscClassId classid;
+  PetscClassIdRegister("Quandary", &classid);
+  PetscLogStageRegister("Forward", &STAGE_FORWARD);
+  PetscLogStageRegister("Adjoint", &STAGE_ADJOINT);
+  PetscLogEventRegister("RHSApply",    classid, &EVENT_RHS);
+  PetscLogEventRegister("LinearSolve", classid, &EVENT_LINSOLVE);
+  PetscLogEventRegister("ControlEval", classid, &EVENT_CONTROL);
+  PetscLogEventRegister("GradientAcc", classid, &EVENT_GRADIENT);
+  PetscLogEventRegister("OutputIO",    classid, &EVENT_OUTPUT);
+  PetscLogEventRegister("Reduction",   classid, &EVENT_REDUCTION);
+}
+
+void createReImIndexSets(const int n, const int ilow, IS* isu, IS* isv){
+#ifdef BLOCKED_STORAGE
+  ISCreateStride(PETSC_COMM_WORLD, n, getIndexReal(ilow), 1, isu);
+  ISCreateStride(PETSC_COMM_WORLD, n, getIndexImag(ilow), 1, isv);
+#else
+  ISCreateStride(PETSC_COMM_WORLD, n, getIndexReal(ilow), 2, isu);
+  ISCreateStride(PETSC_COMM_WORLD, n, getIndexImag(ilow), 2, isv);
+#endif
 }
 
-int getIndexImag(const int i) {
-  return 2*i + 1;
+double localDot(const Vec x, const Vec y){
+  const double *xptr, *yptr;
+  PetscInt nlocal;
+  VecGetLocalSize(x, &nlocal);
+  VecGetArrayRead(x, &xptr);
+  VecGetArrayRead(y, &yptr);
+  double dot = 0.0;
+  for (int i = 0; i < nlocal; i++) dot += xptr[i] * yptr[i];
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArrayRead(y, &yptr);
+  return dot;
 }
 
 int getVecID(const int row, const int col, const int dim){
@@ -302,8 +342,7 @@ PetscErrorCode StateIsHermitian(Vec x, PetscReal tol, PetscBool *flag) {
   IS isu, isv;
 
   int dimis = dim;
-  ierr = ISCreateStride(PETSC_COMM_WORLD, dimis, 0, 2, &isu); CHKERRQ(ierr);
-  ierr = ISCreateStride(PETSC_COMM_WORLD, dimis, 1, 2, &isv); CHKERRQ(ierr);
+  createReImIndexSets(dimis, 0, &isu, &isv);
   ierr = VecGetSubVector(x, isu, &u); CHKERRQ(ierr);
   ierr = VecGetSubVector(x, isv, &v); CHKERRQ(ierr);
 
@@ -351,8 +390,7 @@ PetscErrorCode StateHasTrace1(Vec x, PetscReal tol, PetscBool *flag) {
   int dimis = dim/2;
   Vec u, v;
   IS isu, isv;
-  ierr = ISCreateStride(PETSC_COMM_WORLD, dimis, 0, 2, &isu); CHKERRQ(ierr);
-  ierr = ISCreateStride(PETSC_COMM_WORLD, dimis, 1, 2, &isv); CHKERRQ(ierr);
+  createReImIndexSets(dimis, 0, &isu, &isv);
   ierr = VecGetSubVector(x, isu, &u); CHKERRQ(ierr);
   ierr = VecGetSubVector(x, isv, &v); CHKERRQ(ierr);
 
@@ -542,4 +580,64 @@ bool isUnitary(const Mat V_re, const Mat V_im){
   MatDestroy(&D);
 
   return isunitary;
-}
\ No newline at end of file
+}
+
+void expmvDense(const int m, const double* H, const int ldh, const double tau, std::vector<double>& v){
+
+  /* Number of substeps from the 1-norm of tau*H */
+  double hnorm = 0.0;
+  for (int j = 0; j < m; j++) {
+    double colsum = 0.0;
+    for (int i = 0; i < m; i++) colsum += fabs(H[i*ldh + j]);
+    hnorm = std::max(hnorm, colsum);
+  }
+  int nsub = std::max(1, (int) ceil(2.0 * fabs(tau) * hnorm));
+  double h = tau / nsub;
+
+  std::vector<double> term(m), next(m);
+  for (int isub = 0; isub < nsub; isub++) {
+    /* v = sum_k (hH)^k/k! v, until the terms are below roundoff relative to v */
+    double vnorm = 0.0;
+    for (int i = 0; i < m; i++) vnorm += fabs(v[i]);
+    term = v;
+    for (int k = 1; k < 30; k++) {
+      double termnorm = 0.0;
+      for (int i = 0; i < m; i++) {
+        next[i] = 0.0;
+        for (int j = 0; j < m; j++) next[i] += H[i*ldh + j] * term[j];
+        next[i] *= h / k;
+        termnorm += fabs(next[i]);
+      }
+      for (int i = 0; i < m; i++) v[i] += next[i];
+      term.swap(next);
+      if (termnorm <= 1e-17 * vnorm) break;
+    }
+  }
+}
+
+
+void getGaussLegendre(const int q, std::vector<double>& nodes, std::vector<double>& weights){
+
+  nodes.resize(q);
+  weights.resize(q);
+  for (int i = 0; i < q; i++) {
+    /* Newton iteration for the i-th root of the Legendre polynomial P_q on [-1,1] */
+    double z = cos(M_PI * (i + 0.75) / (q + 0.5));
+    double dp = 1.0;
+    for (int iter = 0; iter < 100; iter++) {
+      double p0 = 1.0, p1 = z;
+      for (int k = 2; k <= q; k++) {
+        double p2 = ((2.0*k - 1.0) * z * p1 - (k - 1.0) * p0) / k;
+        p0 = p1;
+        p1 = p2;
+      }
+      dp = q * (z * p1 - p0) / (z*z - 1.0);
+      double dz = p1 / dp;
+      z -= dz;
+      if (fabs(dz) < 1e-15) break;
+    }
+    /* Map to [0,1] */
+    nodes[i]   = 0.5 * (1.0 - z);
+    weights[i] = 1.0 / ((1.0 - z*z) * dp * dp);
+  }
+}
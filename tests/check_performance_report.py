@@ -0,0 +1,47 @@
+import sys
+import json
+
+def check_performance_report(reportfile):
+
+    # Fails if the file is missing or not valid JSON
+    infile = open(reportfile, 'r')
+    report = json.load(infile)
+    infile.close()
+
+    stages = ["main", "forward", "adjoint"]
+    events = ["rhs_apply", "linear_solve", "control_eval", "gradient", "output_io", "mpi_reduction"]
+    fields = ["time", "count", "reductions"]
+
+    for key in ["processors", "runtime", "memory_MB", "stages", "linear_solver"]:
+        if key not in report:
+            print("-- Missing key ", key)
+            return sys.exit(1)
+    for stage in stages:
+        if stage not in report["stages"]:
+            print("-- Missing stage ", stage)
+            return sys.exit(1)
+        for event in events:
+            if event not in report["stages"][stage]:
+                print("-- Missing event ", event, " in stage ", stage)
+                return sys.exit(1)
+            for field in fields:
+                if field not in report["stages"][stage][event]:
+                    print("-- Missing field ", field, " of event ", event, " in stage ", stage)
+                    return sys.exit(1)
+
+    # Forward and adjoint stages integrate in time, and the histogram adds up to the number of linear solves
+    for stage in ["forward", "adjoint"]:
+        if report["stages"][stage]["rhs_apply"]["count"] <= 0:
+            print("-- No RHS applications logged in stage ", stage)
+            return sys.exit(1)
+    linsolver = report["linear_solver"]
+    if sum(linsolver["histogram"]) != linsolver["solves"]:
+        print("-- Iteration histogram does not add up to the number of linear solves")
+        return sys.exit(1)
+
+    print("-- Test passed! performance report is valid")
+    return sys.exit(0)
+
+
+if __name__ == '__main__':
+    check_performance_report(*sys.argv[1:])
@@ -0,0 +1,12 @@
+NUM_PARALLEL_PROCESSORS=0
+EXECUTABLE=main_blocked
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    make -C ${DIR}/.. main_blocked
+    cd ${DIR}/cnot_blocked
+    $QUANDARY cnot_blocked.cfg 
+    cd ${DIR}
+    ;;
+esac
@@ -0,0 +1,12 @@
+NUM_PARALLEL_PROCESSORS=0
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/cnot_compression_delta
+    $QUANDARY cnot_compression_delta.cfg | tee data_out/stdout.log
+    # The reported gradient error of the compressed storage must stay below the bound
+    awk '/Gradient error of compressed storage/ {found=1; if ($NF > 1e-7) exit 1} END {if (!found) exit 1}' data_out/stdout.log || exit 1
+    cd ${DIR}
+    ;;
+esac
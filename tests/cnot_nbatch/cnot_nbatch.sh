@@ -0,0 +1,10 @@
+NUM_PARALLEL_PROCESSORS=0
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/cnot_nbatch
+    $QUANDARY cnot_nbatch.cfg 
+    cd ${DIR}
+    ;;
+esac
@@ -0,0 +1,11 @@
+NUM_PARALLEL_PROCESSORS=0
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/cnot_perfreport
+    $QUANDARY cnot_perfreport.cfg 
+    python3 ${DIR}/check_performance_report.py data_out/performance.json || exit 1
+    cd ${DIR}
+    ;;
+esac
@@ -160,6 +160,7 @@ do
 			subTestNum=0
 			parallel=false
 			NUM_PARALLEL_PROCESSORS=0
+			EXECUTABLE=main
 
 			# Get test names
 			. "$script"
@@ -175,7 +176,7 @@ do
 					HEADER="$COMMAND -n $NUM_PARALLEL_PROCESSORS"
 					testName="${testNames[$subTestNum]}-parallel"
 				fi
-        QUANDARY="$HEADER ${DIR}/../main "
+        QUANDARY="$HEADER ${DIR}/../${EXECUTABLE} "
 
 				# Update subtest numbers
 				subTestNum=$((subTestNum+1))